@@ -0,0 +1,204 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#include <string.h>
+
+#include "base64.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define BASE64_X86
+#include <immintrin.h>
+#endif
+
+static const char alphabet[] = 
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*---------------------------------------------------------------------------*/
+/*                          PORTABLE C ENCODER                               */
+/*---------------------------------------------------------------------------*/
+
+static size_t
+encodeC(char* dst, const unsigned char* src, size_t n)
+{
+  char* d = dst;
+  size_t i;
+  unsigned int v;
+
+  for(i=0; i+3<=n; i+=3) {
+    v = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+    d[0] = alphabet[(v >> 18) & 0x3F];
+    d[1] = alphabet[(v >> 12) & 0x3F];
+    d[2] = alphabet[(v >> 6) & 0x3F];
+    d[3] = alphabet[v & 0x3F];
+    d += 4;
+  }
+
+  if(i < n) {			// one or two bytes left
+    v = src[i] << 16;
+    if(i+1 < n)
+      v |= src[i+1] << 8;
+    d[0] = alphabet[(v >> 18) & 0x3F];
+    d[1] = alphabet[(v >> 12) & 0x3F];
+    d[2] = (i+1 < n) ? alphabet[(v >> 6) & 0x3F] : '=';
+    d[3] = '=';
+    d += 4;
+  }
+
+  return(d - dst);
+}
+
+#ifdef BASE64_X86
+
+/*---------------------------------------------------------------------------*/
+/*                 SSSE3 ENCODER, 12 BYTES PER STEP                          */
+/*---------------------------------------------------------------------------*/
+
+// every 3 input bytes are spread over a 32 bit lane, the four 6 bit
+// fields are moved to their own byte with 16 bit multiplies and
+// translated to ASCII by adding an offset looked up by range:
+// A-Z, a-z, 0-9, '+' and '/'
+
+__attribute__((target("ssse3"))) static inline __m128i
+asciiSSSE3(__m128i in)
+{
+  const __m128i offsets = _mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52,
+					'0'-52, '0'-52, '0'-52, '0'-52, 
+					'0'-52, '0'-52, '0'-52, '+'-62, 
+					'/'-63, 'A', 0, 0);
+  __m128i t0, t1, t2, t3, idx, sel;
+
+  in = _mm_shuffle_epi8(in, _mm_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10));
+  t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  idx = _mm_or_si128(t1, t3);
+
+  // 0..25 -> 13, 26..51 -> 0, 52..63 -> 1..12
+
+  sel = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  sel = _mm_or_si128(sel, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+					_mm_set1_epi8(13)));
+  return(_mm_add_epi8(idx, _mm_shuffle_epi8(offsets, sel)));
+}
+
+__attribute__((target("ssse3"))) static size_t
+encodeSSSE3(char* dst, const unsigned char* src, size_t n)
+{
+  size_t i, len;
+
+  // loads 16 bytes for 12, so it stops 4 bytes before the end
+
+  for(i=0, len=0; i+16<=n; i+=12, len+=16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + len), asciiSSSE3(v));
+  }
+
+  return(len + encodeC(dst + len, src + i, n - i));
+}
+
+/*---------------------------------------------------------------------------*/
+/*                 AVX2 ENCODER, 24 BYTES PER STEP                           */
+/*---------------------------------------------------------------------------*/
+
+// same as above, 12 input bytes in each 128 bit lane
+
+__attribute__((target("avx2"))) static size_t
+encodeAVX2(char* dst, const unsigned char* src, size_t n)
+{
+  const __m256i offsets = _mm256_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52,
+					   '0'-52, '0'-52, '0'-52, '0'-52, 
+					   '0'-52, '0'-52, '0'-52, '+'-62, 
+					   '/'-63, 'A', 0, 0,
+					   'a'-26, '0'-52, '0'-52, '0'-52,
+					   '0'-52, '0'-52, '0'-52, '0'-52, 
+					   '0'-52, '0'-52, '0'-52, '+'-62, 
+					   '/'-63, 'A', 0, 0);
+  const __m256i spread = _mm256_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10,
+					  1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+  __m256i in, t0, t1, t2, t3, idx, sel;
+  size_t i, len;
+
+  for(i=0, len=0; i+28<=n; i+=24, len+=32) {
+    in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+	   _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))),
+	   _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 12)), 1);
+    in = _mm256_shuffle_epi8(in, spread);
+    t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    idx = _mm256_or_si256(t1, t3);
+    sel = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    sel = _mm256_or_si256(sel, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx),
+						_mm256_set1_epi8(13)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + len),
+			_mm256_add_epi8(idx, _mm256_shuffle_epi8(offsets, sel)));
+  }
+
+  _mm256_zeroupper();		// no AVX to SSE transition stall
+  return(len + encodeSSSE3(dst + len, src + i, n - i));
+}
+
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                           RUNTIME DISPATCH                                */
+/*---------------------------------------------------------------------------*/
+
+Base64Kernel Base64::encode = encodeC;
+const char*  Base64::impl   = "C";
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Base64::select(const char* which)
+{
+  // the portable encoder unless a better one runs on this CPU
+
+  encode = encodeC;
+  impl   = "C";
+  if(which && strcmp(which, impl) == 0)
+    return(true);
+
+#ifdef BASE64_X86
+
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2") && (which == 0 || strcmp(which, "AVX2") == 0)) {
+    encode = encodeAVX2;
+    impl   = "AVX2";
+    return(true);
+  }
+  if(__builtin_cpu_supports("ssse3") && (which == 0 || strcmp(which, "SSSE3") == 0)) {
+    encode = encodeSSSE3;
+    impl   = "SSSE3";
+    return(true);
+  }
+
+#endif
+
+  return(which == 0);
+}
+
+/*---------------------------------------------------------------------------*/
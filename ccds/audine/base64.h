@@ -0,0 +1,62 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#ifndef AUDINE_BASE64_H
+#define AUDINE_BASE64_H
+
+#include <stddef.h>
+
+/*
+ * Base64 encoders (RFC 4648, no line breaks) for BLOB payloads.
+ * As with the pixel kernels, the best implementation for the running
+ * CPU (AVX2, SSSE3 or portable C) is selected once at startup.
+ * Input split at multiples of 3 bytes can be encoded piecewise,
+ * only the last piece gets '=' padding.
+ */
+
+typedef size_t (*Base64Kernel)(char* dst, const unsigned char* src, size_t n);
+
+class Base64 {
+
+ public:
+
+  /* encoded size of 'n' bytes */
+  static size_t size(size_t n) { return(4 * ((n + 2) / 3)); }
+
+  /* selects the encoder for this CPU, or the one named ("AVX2", "SSSE3" */
+  /* or "C") to compare them. false if it does not run on this CPU. */
+  /* Call before any other thread starts */
+  static bool select(const char* which = 0);
+
+  /* name of the selected implementation, for logging */
+  static const char* name() { return(impl); }
+
+  /* encodes 'n' bytes into 'dst'. Returns the encoded length */
+  static Base64Kernel encode;
+
+ private:
+
+  static const char* impl;
+};
+
+#endif
@@ -0,0 +1,811 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audine.h"
+#include "base64.h"
+#include "checksum.h"
+#include "cosmic.h"
+#include "difference.h"
+#include "diskwriter.h"
+#include "pixkern.h"
+
+/*
+ * Off line throughput of the storage path, on synthetic KAF3200 full
+ * frames, against the code it replaced where there was one.
+ * Files are written to the current directory, then removed.
+ * Built along the driver, never installed.
+ */
+
+static const int WIDTH  = 2184;	/* KAF3200 full frame */
+static const int HEIGHT = 1472;
+
+/*---------------------------------------------------------------------------*/
+
+// monotonic clock, in seconds
+
+static double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// a frame of sky level noise, the same for every run
+
+static pixel_t*
+synthFrame()
+{
+  pixel_t* pix = new pixel_t[WIDTH * HEIGHT];
+
+  srand(1);
+  for(int i=0; i<WIDTH*HEIGHT; i++)
+    pix[i] = STATIC_CAST(pixel_t, 1000 + rand() % 64);
+  return(pix);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// gaussian deviate
+
+static double
+gauss()
+{
+  double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+  return(sqrt(-2 * log(u1)) * cos(2 * M_PI * u2));
+}
+
+// the stars of the synthetic fields, on the first one
+
+static const int STARS = 300;
+
+static void
+fieldStars(double* sx, double* sy, double* sf)
+{
+  srand(7);
+  for(int i=0; i<STARS; i++) {
+    sx[i] = 20 + rand() % (WIDTH - 40) + rand() / (RAND_MAX + 1.0);
+    sy[i] = 20 + rand() % (HEIGHT - 40) + rand() / (RAND_MAX + 1.0);
+    sf[i] = 2000 * exp(4 * rand() / (RAND_MAX + 1.0)); /* [ADU] */
+  }
+}
+
+static const double SIGMA = 1.5;	/* PSF, FWHM 3.5 pixels */
+static const double SKY = 200;		/* [ADU] */
+static const double GAIN = 2;		/* [e-/ADU] */
+static const double RDNOISE = 10;	/* [e-] */
+
+// adds a star of 'flux' [ADU] centered at (cx, cy), with its photon noise
+
+static void
+addStar(pixel_t* pix, double cx, double cy, double flux)
+{
+  double v;
+
+  for(int y = STATIC_CAST(int, cy) - 8; y <= STATIC_CAST(int, cy) + 8; y++)
+    for(int x = STATIC_CAST(int, cx) - 8; x <= STATIC_CAST(int, cx) + 8; x++) {
+      if(x < 0 || y < 0 || x >= WIDTH || y >= HEIGHT)
+	continue;
+      v = flux / (2 * M_PI * SIGMA * SIGMA) * 
+	exp(-((x-cx)*(x-cx) + (y-cy)*(y-cy)) / (2 * SIGMA * SIGMA));
+      v += sqrt(v / GAIN) * gauss();
+      v += pix[y*WIDTH + x];
+      pix[y*WIDTH + x] = STATIC_CAST(pixel_t, (v > 32767) ? 32767 : lrint(v));
+    }
+}
+
+// a star field, bias subtracted, shifted by (dx, dy). Stars are the
+// same in every field, noise depends on 'seed'
+
+static void
+synthField(pixel_t* pix, double dx, double dy, unsigned int seed)
+{
+  double sx[STARS], sy[STARS], sf[STARS];
+  double noise = sqrt(SKY / GAIN + RDNOISE * RDNOISE / (GAIN * GAIN)); /* [ADU] */
+
+  fieldStars(sx, sy, sf);
+  srand(seed);
+  for(int i=0; i<WIDTH*HEIGHT; i++)
+    pix[i] = STATIC_CAST(pixel_t, lrint(SKY + noise * gauss()));
+  for(int i=0; i<STARS; i++)
+    addStar(pix, sx[i] + dx, sy[i] + dy, sf[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                             ROW KERNELS                                   */
+/*---------------------------------------------------------------------------*/
+
+// the byte at a time loops the kernels replaced, in place as they were
+
+static void
+legacySwap(void* dst, const pixel_t* src, int n)
+{
+  unsigned char* px = STATIC_CAST(unsigned char*, dst);
+  unsigned char temp;
+
+  memcpy(dst, src, n * sizeof(pixel_t)); // as received into the message
+  for(int i=0; i<n; i++, px += sizeof(pixel_t)) {
+    temp  = px[0];
+    px[0] = px[1];
+    px[1] = temp;
+  }
+}
+
+static void
+legacySwapMirror(void* dst, const pixel_t* src, int n)
+{
+  unsigned char* first = STATIC_CAST(unsigned char*, dst);
+  unsigned char* last  = first + n * sizeof(pixel_t) - 1;
+  unsigned char temp;
+
+  memcpy(dst, src, n * sizeof(pixel_t));
+  for(int j=0; j<n; j++, first++, last--) {
+    temp   = *first;
+    *first = *last;
+    *last  = temp;
+  }
+}
+
+// one kernel over whole frames, in Mpixels/s. The writer converts
+// a chunk just received, so a few rows cached are taken over and over
+
+static double
+rowRate(RowKernel fn, const pixel_t* src, pixel_t* dst, int frames)
+{
+  static const int ROWS = 8;
+  double t = now();
+
+  for(int f=0; f<frames; f++)
+    for(int y=0; y<HEIGHT; y++)
+      fn(dst + (y % ROWS)*WIDTH, src + (y % ROWS)*WIDTH, WIDTH);
+  return(STATIC_CAST(double, frames) * WIDTH * HEIGHT / (now() - t) / 1e6);
+}
+
+static void
+benchKernels()
+{
+  static const char* impls[] = { "C", "SSSE3", "AVX2" };
+  static const int FRAMES = 20;
+  pixel_t* src = synthFrame();
+  pixel_t* dst = new pixel_t[WIDTH * HEIGHT];
+
+  printf("row kernels, %dx%d frames, Mpixels/s\n", WIDTH, HEIGHT);
+  printf("  %-8s %10s %10s %10s\n", "", "swap", "mirror", "swapMirror");
+  printf("  %-8s %10.0f %10s %10.0f\n", "legacy",
+	 rowRate(legacySwap, src, dst, FRAMES), "-",
+	 rowRate(legacySwapMirror, src, dst, FRAMES));
+
+  for(int i=0; i<3; i++) {
+    if(!PixKern::select(impls[i])) {
+      printf("  %-8s %10s\n", impls[i], "n/a");
+      continue;
+    }
+    printf("  %-8s %10.0f %10.0f %10.0f\n", impls[i],
+	   rowRate(PixKern::swap, src, dst, FRAMES),
+	   rowRate(PixKern::mirror, src, dst, FRAMES),
+	   rowRate(PixKern::swapMirror, src, dst, FRAMES));
+  }
+  PixKern::select();
+
+  delete [] src;
+  delete [] dst;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                              FITS WRITER                                  */
+/*---------------------------------------------------------------------------*/
+
+static const char* BENCH_FILE = "audine-bench.fit";
+
+// rows per COR packet, as Frame takes them
+
+static int
+chunkRows()
+{
+  int rows = MAX_IMG_LEN / (sizeof(pixel_t) * WIDTH);
+
+  return((rows == 0) ? 1 : rows);
+}
+
+// packs rows [y, y+n) as the COR packet of a chunk. Returns its length
+
+static int
+packChunk(void* data, const pixel_t* pix, int y, int n)
+{
+  Incoming_Message* msg = STATIC_CAST(Incoming_Message*, data);
+  ChunkHead* head;
+
+  head = STATIC_CAST(ChunkHead*, STATIC_CAST(void*, msg->body.imgData.data)) - 1;
+  head->seq  = y / chunkRows();
+  head->rows = n;
+  head->cols = WIDTH;
+  memcpy(msg->body.imgData.data, pix + y*WIDTH, n * WIDTH * sizeof(pixel_t));
+  return(IMG_HEAD + n * WIDTH * sizeof(pixel_t));
+}
+
+// a header like the ones saved, just smaller
+
+static void
+benchHeader(FITSHeader* h)
+{
+  h->set("NAXIS1", WIDTH, "length of data axis 1");
+  h->set("NAXIS2", HEIGHT, "length of data axis 2");
+  h->set("CCDBIN1", 1, "binning factor in axis 1");
+  h->set("CCDBIN2", 1, "binning factor in axis 2");
+  h->set("IMAGETYP", "OBJECT", "image type");
+  h->set("EXPTIME", 20.0, "exposure time in seconds");
+}
+
+// the stdio path the writer replaced, packet by packet as it was:
+// swapped & flipped in place in the receive buffer, written at the
+// file pointer, which goes backwards when flipped upside down
+
+static void
+legacyFile(const pixel_t* pix, bool flipLR, bool flipUD)
+{
+  Incoming_Message msg;
+  FITSHeader h;
+  FILE* fp;
+  u_char* first;
+  u_char* last;
+  u_char temp;
+  int rows = chunkRows();
+  int N = WIDTH * sizeof(pixel_t);
+  int imageSize = N * HEIGHT;
+  int rembytes = imageSize % FITSHeader::RECORDSZ;
+  int y, i, j, n;
+
+  benchHeader(&h);
+  fp = fopen(BENCH_FILE, "w");
+  h.save(fp);
+  if(flipUD)
+    fseek(fp, imageSize, SEEK_CUR);
+
+  for(y=0; y<HEIGHT; y += rows) {
+    n = (HEIGHT - y < rows) ? HEIGHT - y : rows;
+    memcpy(msg.body.imgData.data, pix + y*WIDTH, n * N);
+    if(flipUD)
+      fseek(fp, -(n * N), SEEK_CUR);
+    for(i=0; i<n; i++) {
+      first = msg.body.imgData.data + i*N;
+      last  = first + N - 1;
+      if(flipLR) {
+	for(j=0; j<WIDTH; j++, first++, last--) {
+	  temp   = *first;
+	  *first = *last;
+	  *last  = temp;
+	}
+      } else {
+	for(j=0; j<WIDTH; j++, first += sizeof(pixel_t)) {
+	  temp     = first[0];
+	  first[0] = first[1];
+	  first[1] = temp;
+	}
+      }
+    }
+    if(!flipUD)
+      fwrite(msg.body.imgData.data, sizeof(pixel_t), n * WIDTH, fp);
+    else {
+      for(i=n-1; i>-1; i--)
+	fwrite(msg.body.imgData.data + i*N, sizeof(pixel_t), WIDTH, fp);
+      fseek(fp, -(n * N), SEEK_CUR);
+    }
+  }
+
+  fseek(fp, 0L, SEEK_END);
+  if(rembytes)
+    while(rembytes++ < FITSHeader::RECORDSZ)
+      putc(0, fp);
+  fseek(fp, 0L, SEEK_SET);
+  h.save(fp);
+  fclose(fp);
+}
+
+// the driver delays the next exposure when the ring is congested,
+// here we just retry
+
+static WriterSlot*
+slotFor(DiskWriter* w, bool data)
+{
+  WriterSlot* slot;
+
+  while((slot = w->acquire(data)) == 0)
+    usleep(1000);
+  return(slot);
+}
+
+// the same image through the disk writer, as Storage queues it
+
+static void
+writerFile(DiskWriter* w, const pixel_t* pix, bool flipLR, bool flipUD)
+{
+  WriterSlot* slot;
+  FITSHeader h;
+  int rows = chunkRows();
+  int y, n;
+
+  benchHeader(&h);
+  slot = slotFor(w, false);
+  slot->op     = WR_OPEN;
+  slot->spec   = new WriterSpec();	// all analysis off
+  slot->header = new FITSHeader(h);
+  strcpy(slot->spec->path, BENCH_FILE);
+  slot->spec->width     = WIDTH;
+  slot->spec->height    = HEIGHT;
+  slot->spec->imageSize = WIDTH * HEIGHT * sizeof(pixel_t);
+  slot->spec->flipLR    = flipLR;
+  slot->spec->flipUD    = flipUD;
+  w->commit();
+
+  for(y=0; y<HEIGHT; y += rows) {
+    n = (HEIGHT - y < rows) ? HEIGHT - y : rows;
+    slot = slotFor(w, true);
+    slot->op  = WR_DATA;
+    slot->len = packChunk(slot->data, pix, y, n);
+    w->commit();
+  }
+
+  slot = slotFor(w, false);
+  slot->op     = WR_CLOSE;
+  slot->header = new FITSHeader(h);
+  slot->last   = true;
+  w->commit();
+}
+
+static void
+benchWrite()
+{
+  static const int FRAMES = 10;
+  static const char* combo[] = { "none", "LR", "UD", "LR+UD" };
+  pixel_t* pix = synthFrame();
+  WriterReport report;
+  DiskWriter w;
+  double t, q, legacy, writer, queued;
+
+  // legacy and writer are whole files, queued only the event loop share
+
+  w.start();
+  printf("FITS files, %dx%d frames, %d rows per packet, ms per file\n",
+	 WIDTH, HEIGHT, chunkRows());
+  printf("  %-8s %10s %10s %10s\n", "flip", "legacy", "writer", "queued");
+
+  for(int i=0; i<4; i++) {
+    t = now();
+    for(int f=0; f<FRAMES; f++)
+      legacyFile(pix, i & 1, i & 2);
+    legacy = (now() - t) / FRAMES * 1e3;
+
+    t = now();
+    queued = 0;
+    for(int f=0; f<FRAMES; f++) {
+      q = now();
+      writerFile(&w, pix, i & 1, i & 2);
+      queued += now() - q;
+      while(w.busy())
+	usleep(100);
+    }
+    writer = (now() - t) / FRAMES * 1e3;
+    queued = queued / FRAMES * 1e3;
+    while(w.popDone(&report))
+      ;
+
+    printf("  %-8s %10.1f %10.1f %10.1f\n", combo[i], legacy, writer, queued);
+  }
+
+  if(w.lastError() != 0)
+    printf("  writer failed\n");
+  w.stop();
+  unlink(BENCH_FILE);
+  delete [] pix;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                                DATASUM                                    */
+/*---------------------------------------------------------------------------*/
+
+// the word at a time ones' complement sum, as a separate pass does it
+
+static unsigned long long
+naiveSum(const void* buf, size_t len, unsigned long long sum)
+{
+  const unsigned char* p = STATIC_CAST(const unsigned char*, buf);
+
+  for(size_t i=0; i + 4 <= len; i += 4)
+    sum += (STATIC_CAST(unsigned int, p[i]) << 24) | (p[i+1] << 16) |
+      (p[i+2] << 8) | p[i+3];
+  return(sum);
+}
+
+static unsigned int
+naiveFold(unsigned long long sum)
+{
+  while(sum >> 32)
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  return(STATIC_CAST(unsigned int, sum));
+}
+
+// DATASUM is added as each converted chunk is written, while still
+// in cache. Its cost is weighed against the time a frame takes to
+// arrive over the 100 Mbit/s link to the camera
+
+static void
+benchDataSum()
+{
+  static const int ROWS = 8;
+  static const int FRAMES = 20;
+  pixel_t* src = synthFrame();
+  pixel_t* dst = new pixel_t[WIDTH * ROWS];
+  size_t rowBytes = WIDTH * sizeof(pixel_t);
+  double frameBytes = STATIC_CAST(double, rowBytes) * HEIGHT;
+  double link = frameBytes * 8 / 100e6;
+  double swap, summed, naive;
+  unsigned long long acc = 0;
+  DataSum sum;
+  double t;
+
+  t = now();
+  for(int f=0; f<FRAMES; f++)
+    for(int y=0; y<HEIGHT; y++)
+      PixKern::swap(dst + (y % ROWS)*WIDTH, src + y*WIDTH, WIDTH);
+  swap = (now() - t) / FRAMES;
+
+  t = now();
+  for(int f=0; f<FRAMES; f++) {
+    sum.reset();
+    for(int y=0; y<HEIGHT; y++) {
+      PixKern::swap(dst + (y % ROWS)*WIDTH, src + y*WIDTH, WIDTH);
+      sum.add(dst + (y % ROWS)*WIDTH, rowBytes, y*rowBytes);
+    }
+  }
+  summed = (now() - t) / FRAMES;
+
+  t = now();
+  for(int f=0; f<FRAMES; f++) {
+    acc = 0;
+    for(int y=0; y<HEIGHT; y++) {
+      PixKern::swap(dst + (y % ROWS)*WIDTH, src + y*WIDTH, WIDTH);
+      acc = naiveSum(dst + (y % ROWS)*WIDTH, rowBytes, acc);
+    }
+  }
+  naive = (now() - t) / FRAMES;
+
+  printf("DATASUM, %dx%d frames, ms per frame\n", WIDTH, HEIGHT);
+  printf("  %-14s %8.2f\n", "swap", swap * 1e3);
+  printf("  %-14s %8.2f  (+%.2f, %.2f%% of the link time)\n", "swap+DataSum",
+	 summed * 1e3, (summed - swap) * 1e3, (summed - swap) / link * 100);
+  printf("  %-14s %8.2f  (+%.2f)\n", "swap+naive",
+	 naive * 1e3, (naive - swap) * 1e3);
+  if(sum.value() != naiveFold(acc))
+    printf("  sums differ: %08x %08x\n", sum.value(), naiveFold(acc));
+
+  delete [] src;
+  delete [] dst;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                              FRAME BLOB                                   */
+/*---------------------------------------------------------------------------*/
+
+// encoder input rate in MB/s, over a FITS file sized buffer
+// taken in FrameBlob pieces
+
+static double
+encodeRate(const unsigned char* src, char* dst, size_t len, int times)
+{
+  double t = now();
+
+  for(int k=0; k<times; k++)
+    for(size_t pos=0; pos<len; pos += FrameBlob::CHUNK)
+      Base64::encode(dst + Base64::size(pos), src + pos,
+		     (len - pos < FrameBlob::CHUNK) ? len - pos : FrameBlob::CHUNK);
+  return(STATIC_CAST(double, times) * len / (now() - t) / 1e6);
+}
+
+// a complete frame as the writer reassembles it
+
+static void
+fillFrame(Frame* frame, const pixel_t* pix)
+{
+  Incoming_Message msg;
+  int rows = chunkRows();
+  int len, first, n;
+
+  frame->reset(WIDTH, HEIGHT);
+  for(int y=0; y<HEIGHT; y += rows) {
+    len = packChunk(&msg, pix, y, (HEIGHT - y < rows) ? HEIGHT - y : rows);
+    frame->place(&msg, len, &first, &n);
+  }
+}
+
+static void
+benchBlob()
+{
+  static const char* impls[] = { "C", "SSSE3", "AVX2" };
+  static const int FRAMES = 5;
+  pixel_t* pix = synthFrame();
+  size_t fileSize = FITSHeader::HEADERSZ + WIDTH * HEIGHT * sizeof(pixel_t);
+  unsigned char* file = new unsigned char[fileSize];
+  char* enc = new char[Base64::size(fileSize)];
+  FILE* sink = fopen("/dev/null", "w");
+  FITSHeader h;
+  FrameBlob blob;
+  WorkerPool pool;
+  Frame frame;
+  double t;
+
+  printf("base64 encoders, %d KB pieces, MB/s of input\n",
+	 FrameBlob::CHUNK / 1024);
+  memcpy(file, pix, WIDTH * HEIGHT * sizeof(pixel_t));
+  for(int i=0; i<3; i++) {
+    if(!Base64::select(impls[i]))
+      printf("  %-8s %10s\n", impls[i], "n/a");
+    else
+      printf("  %-8s %10.0f\n", impls[i], encodeRate(file, enc, fileSize, 10));
+  }
+  Base64::select();
+
+  // the copy into a file image, then encoded whole, is what a
+  // BLOB of the saved file costs the event loop
+
+  benchHeader(&h);
+  fillFrame(&frame, pix);
+  pool.start();
+
+  printf("full frame BLOB, %dx%d frames, %d threads, ms per frame\n",
+	 WIDTH, HEIGHT, pool.threads());
+  Base64::select("C");
+  t = now();
+  for(int f=0; f<FRAMES; f++) {
+    h.render(STATIC_CAST(char*, STATIC_CAST(void*, file)), 
+	     FITSHeader::HEADERSZ / FITSHeader::RECORDSZ);
+    for(int y=0; y<HEIGHT; y++)
+      PixKern::swap(file + FITSHeader::HEADERSZ + y*WIDTH*sizeof(pixel_t), 
+		    frame.row(y), WIDTH);
+    Base64::encode(enc, file, fileSize);
+  }
+  printf("  %-14s %8.1f %8d KB\n", "copy+C", (now() - t) / FRAMES * 1e3,
+	 STATIC_CAST(int, Base64::size(fileSize) / 1024));
+  Base64::select();
+
+  // as the writer sends it, the message written to the null device
+
+  blob.attach(sink, "BENCH", "FRAME");
+  for(int mode = BLOB_FITS; mode <= BLOB_FITSZ; mode++) {
+    t = now();
+    for(int f=0; f<FRAMES; f++) {
+      blob.build(&h, &frame, false, false, mode, &pool);
+      blob.wait();
+    }
+    printf("  %-14s %8.1f %8d KB\n", (mode == BLOB_FITS) ? "FrameBlob" : "FrameBlob+zlib",
+	   (now() - t) / FRAMES * 1e3, STATIC_CAST(int, blob.encoded() / 1024));
+  }
+
+  pool.stop();
+  fclose(sink);
+  delete [] pix;
+  delete [] file;
+  delete [] enc;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                              COSMIC RAYS                                  */
+/*---------------------------------------------------------------------------*/
+
+static void
+benchCosmic()
+{
+  static const int HITS = 200;
+  static const int RUNS = 3;
+  CosmicPars pars = { 4, 4.5, 0.3, 5.0, 2.0, 10.0 }; /* as synthField() */
+  pixel_t* pix = new pixel_t[WIDTH * HEIGHT];
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int x, y, hits = 0;
+  CosmicRays cosmics;
+  Frame frame;
+  double t;
+
+  // single pixel and two pixel hits, well above the sky
+
+  synthField(pix, 0, 0, 1);
+  for(int i=0; i<HITS; i++) {
+    x = 1 + rand() % (WIDTH - 2);
+    y = 1 + rand() % (HEIGHT - 2);
+    pix[y*WIDTH + x] += 500 + rand() % 2500;
+    if(i % 2)
+      pix[y*WIDTH + x + 1] += 500 + rand() % 2500;
+  }
+  fillFrame(&frame, pix);
+
+  printf("cosmic rays, %dx%d frame, %d hits in %d pixels, %d CPUs online\n",
+	 WIDTH, HEIGHT, HITS, HITS + HITS/2, cpus);
+  printf("  %-8s %10s %10s\n", "threads", "ms", "pixels");
+
+  for(int n=1; n <= ((cpus > 4) ? cpus : 4); n *= 2) {
+    WorkerPool pool;
+
+    pool.start(n);
+    t = now();
+    for(int r=0; r<RUNS; r++)
+      hits = cosmics.find(&frame, 0, &pars, false, &pool);
+    printf("  %-8d %10.0f %10d\n", n, (now() - t) / RUNS * 1e3, hits);
+    pool.stop();
+  }
+
+  delete [] pix;
+}
+
+/*---------------------------------------------------------------------------*/
+/*                             DIFFERENCING                                  */
+/*---------------------------------------------------------------------------*/
+
+// a reference of the first fields is made, then every later one,
+// drifting, with a nova, is filled in and differenced as the writer does
+
+static void
+benchDiff()
+{
+  static const int REF = 4;
+  static const int FRAMES = 10;
+  static const double NOVA_X = 700.3;	/* on the reference */
+  static const double NOVA_Y = 500.6;
+  DiffPars pars = { 5.0, 3, REF, 0.25, 2.0, GAIN };
+  pixel_t* pix = new pixel_t[WIDTH * HEIGHT];
+  double sx[STARS], sy[STARS], sf[STARS];
+  double x[STARS], y[STARS];
+  int order[STARS];
+  double dx, dy, t, fill = 0, add = 0, elapsed = 0;
+  const DiffEvent* e;
+  int events = 0, novae = 0, threads;
+  DiffField field;
+  Differencer differ;
+  WorkerPool pool;
+  float* row;
+
+  memset(&field, 0, sizeof(field));
+  strcpy(field.object, "BENCH");
+
+  // brightest first, as the extractor gives them
+
+  fieldStars(sx, sy, sf);
+  for(int i=0; i<STARS; i++) {
+    int j;
+
+    for(j=i; j>0 && sf[order[j-1]] < sf[i]; j--)
+      order[j] = order[j-1];
+    order[j] = i;
+  }
+
+  pool.start();
+  for(int f=0; f<REF+FRAMES; f++) {
+    dx = 0.37 * f;
+    dy = -0.21 * f;
+    synthField(pix, dx, dy, 10 + f);
+    if(f >= REF)
+      addStar(pix, NOVA_X + dx, NOVA_Y + dy, 20000);
+    for(int i=0; i<STARS; i++) {
+      x[i] = sx[order[i]] + dx;
+      y[i] = sy[order[i]] + dy;
+    }
+
+    t = now();
+    differ.select(&field, WIDTH, HEIGHT, &pars);
+    for(int j=0; j<HEIGHT; j++) {
+      row = differ.row(j);
+      for(int i=0; i<WIDTH; i++)
+	row[i] = pix[j*WIDTH + i];
+    }
+    if(f >= REF)
+      fill += now() - t;
+
+    t = now();
+    differ.add(x, y, STARS, 2.355 * SIGMA, &pool);
+    if(f < REF)
+      continue;
+    add += now() - t;
+    elapsed += differ.result()->elapsed;
+
+    events += differ.count();
+    for(int i=0; i<differ.count(); i++) {
+      e = differ.event(i);
+      if(fabs(e->x - NOVA_X) < 2 && fabs(e->y - NOVA_Y) < 2 && e->flux > 0) {
+	novae++;
+	break;
+      }
+    }
+  }
+  threads = pool.threads();
+  pool.stop();
+
+  printf("differencing, %dx%d frames, reference of %d, %d threads\n",
+	 WIDTH, HEIGHT, REF, threads);
+  printf("  %-20s %8.1f\n", "frames/s", FRAMES / (fill + add));
+  printf("  %-20s %8.1f\n", "ms to fill", fill / FRAMES * 1e3);
+  printf("  %-20s %8.1f  (%.1f reported)\n", "ms to difference",
+	 add / FRAMES * 1e3, elapsed / FRAMES);
+  printf("  %-20s %8.1f\n", "events per frame", STATIC_CAST(double, events) / FRAMES);
+  printf("  %-20s %5d/%d\n", "nova found", novae, FRAMES);
+
+  delete [] pix;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static const struct {
+  const char* name;
+  void (*run)();
+} benches[] = {
+  { "kernels", benchKernels },
+  { "write",   benchWrite },
+  { "datasum", benchDataSum },
+  { "blob",    benchBlob },
+  { "cosmic",  benchCosmic },
+  { "diff",    benchDiff },
+};
+
+static const int NBENCH = sizeof(benches) / sizeof(benches[0]);
+
+/*---------------------------------------------------------------------------*/
+
+// runs the benchmarks named, all of them if none
+
+int
+main(int argc, char** argv)
+{
+  bool found;
+
+  PixKern::select();
+  Base64::select();
+  if(argc == 1) {
+    for(int i=0; i<NBENCH; i++)
+      benches[i].run();
+    return(0);
+  }
+
+  for(int a=1; a<argc; a++) {
+    found = false;
+    for(int i=0; i<NBENCH; i++)
+      if(strcmp(argv[a], benches[i].name) == 0) {
+	benches[i].run();
+	found = true;
+      }
+    if(!found) {
+      fprintf(stderr, "usage: %s [benchmark ...]\n  benchmarks:", argv[0]);
+      for(int i=0; i<NBENCH; i++)
+	fprintf(stderr, " %s", benches[i].name);
+      fprintf(stderr, "\n");
+      return(2);
+    }
+  }
+  return(0);
+}
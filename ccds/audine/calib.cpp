@@ -0,0 +1,457 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "calib.h"
+#include "fitshead.h"
+#include "fitsread.h"
+
+/*---------------------------------------------------------------------------*/
+
+Calibrator::Calibrator() : masters(0), nmasters(0), dirTime(0), clock(0),
+    bias(0), dark(0), flat(0), darkScale(1), planeScale(0), off(0), gain(0), 
+    planeSize(0)
+{
+  dirname[0] = 0;
+  memset(&planeKey, 0, sizeof(planeKey));
+  memset(planeMasters, 0, sizeof(planeMasters));
+}
+
+/*---------------------------------------------------------------------------*/
+
+Calibrator::~Calibrator()
+{
+  for(int i=0; i<nmasters; i++)
+    free(masters[i].pix);
+  delete [] masters;
+  free(off);
+  free(gain);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Calibrator::readHeader(const char* path, Master* m)
+{
+  FITSImage img;
+  bool res;
+  int fd;
+
+  memset(m, 0, sizeof(*m));
+
+  fd = ::open(path, O_RDONLY);
+  if(fd == -1)
+    return(false);
+  res = FITSReader::read(fd, 0, &img);
+  ::close(fd);
+  if(!res || img.naxis != 2 || img.width <= 0 || img.height <= 0 ||
+     (img.bitpix != 16 && img.bitpix != -32))
+    return(false);
+
+  if(strcasestr(img.imagetyp, "zero") || strcasestr(img.imagetyp, "bias"))
+    m->type = BIAS;
+  else if(strcasestr(img.imagetyp, "dark"))
+    m->type = DARK;
+  else if(strcasestr(img.imagetyp, "flat"))
+    m->type = FLAT;
+  else
+    return(false);
+
+  strncpy(m->path, path, sizeof(m->path) - 1);
+  strcpy(m->model, img.model);
+  m->bin     = img.bin;
+  m->x       = img.x;
+  m->y       = img.y;
+  m->width   = img.width;
+  m->height  = img.height;
+  m->exptime = img.exptime;
+  m->bitpix  = img.bitpix;
+  m->bzero   = img.bzero;
+  m->bscale  = img.bscale;
+  m->flipLR  = img.flipLR;
+  m->flipUD  = img.flipUD;
+  m->data    = img.data;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Calibrator::scan(const char* dir)
+{
+  Master* found;
+  Master* m;
+  struct dirent* entry;
+  struct stat st;
+  char path[256];
+  const char* ext;
+  DIR* dp;
+  int n = 0, size = 16;
+
+  bias = dark = flat = 0;
+  memset(planeMasters, 0, sizeof(planeMasters)); // planes to be made again
+
+  found = new Master[size];
+  dp = opendir(dir);
+  while(dp && (entry = readdir(dp)) != NULL) {
+    ext = strrchr(entry->d_name, '.');
+    if(ext == NULL || (strcasecmp(ext, ".fit") && strcasecmp(ext, ".fits") &&
+		       strcasecmp(ext, ".fts")))
+      continue;
+    if(snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= 
+       STATIC_CAST(int, sizeof(path)))
+      continue;			// a path too long is never ours
+    if(stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+      continue;
+    if(n == size) {
+      m = new Master[2*size];
+      memcpy(m, found, n * sizeof(Master));
+      delete [] found;
+      found = m;
+      size *= 2;
+    }
+    if(!readHeader(path, &found[n]))
+      continue;
+    found[n].mtime = st.st_mtime;
+
+    // pixels already in memory are kept if the file is the same
+
+    for(int i=0; i<nmasters; i++) {
+      m = &masters[i];
+      if(m->pix && m->mtime == st.st_mtime && !strcmp(m->path, path)) {
+	found[n].pix  = m->pix;
+	found[n].mean = m->mean;
+	found[n].used = m->used;
+	m->pix = 0;
+	break;
+      }
+    }
+    n++;
+  }
+  if(dp)
+    closedir(dp);
+
+  for(int i=0; i<nmasters; i++)
+    free(masters[i].pix);
+  delete [] masters;
+  masters  = found;
+  nmasters = n;
+}
+
+/*---------------------------------------------------------------------------*/
+
+Calibrator::Master*
+Calibrator::best(int type, const CalibKey* key)
+{
+  Master* res = 0;
+  Master* m;
+
+  // darks: the closest exposure time, then the smallest area
+
+  for(int i=0; i<nmasters; i++) {
+    m = &masters[i];
+    if(m->type != type || m->bin != key->bin || strcmp(m->model, key->model) ||
+       m->x > key->x || m->y > key->y ||
+       m->x + m->width  < key->x + key->width ||
+       m->y + m->height < key->y + key->height)
+      continue;
+    if(res == 0)
+      res = m;
+    else if(type == DARK && 
+	    fabs(m->exptime - key->exptime) != fabs(res->exptime - key->exptime)) {
+      if(fabs(m->exptime - key->exptime) < fabs(res->exptime - key->exptime))
+	res = m;
+    } 
+    else if(m->width * m->height < res->width * res->height)
+      res = m;
+  }
+  return(res);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Calibrator::load(Master* m)
+{
+  size_t n = STATIC_CAST(size_t, m->width) * m->height;
+  size_t bytes = n * ((m->bitpix == 16) ? 2 : 4);
+  const unsigned char* p;
+  unsigned int u;
+  double sum = 0;
+  struct stat st;
+  void* map;
+  size_t x, y;
+  float f;
+  int fd;
+
+  fd = ::open(m->path, O_RDONLY);
+  if(fd == -1)
+    return(false);
+  if(fstat(fd, &st) == -1 || STATIC_CAST(size_t, st.st_size) < m->data + bytes) {
+    ::close(fd);
+    return(false);
+  }
+
+  map = mmap(0, m->data + bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(map == MAP_FAILED)
+    return(false);
+  madvise(map, m->data + bytes, MADV_SEQUENTIAL);
+
+  if(posix_memalign(STATIC_CAST(void**, STATIC_CAST(void*, &m->pix)), 64, 
+		    n * sizeof(float)) != 0) {
+    m->pix = 0;
+    munmap(map, m->data + bytes);
+    return(false);
+  }
+
+  // big endian, BSCALE & BZERO applied once and for all,
+  // in readout orientation
+
+  p = STATIC_CAST(const unsigned char*, map) + m->data;
+  for(size_t i=0; i<n; i++) {
+    if(m->bitpix == 16)
+      f = STATIC_CAST(short, (p[2*i] << 8) | p[2*i+1]);
+    else {
+      u = (p[4*i] << 24) | (p[4*i+1] << 16) | (p[4*i+2] << 8) | p[4*i+3];
+      memcpy(&f, &u, sizeof(f));
+    }
+    x = i % m->width;
+    y = i / m->width;
+    x = (m->flipLR) ? m->width-1 - x : x;
+    y = (m->flipUD) ? m->height-1 - y : y;
+    m->pix[y * m->width + x] = f * m->bscale + m->bzero;
+    sum += f * m->bscale + m->bzero;
+  }
+  m->mean = sum / n;
+
+  munmap(map, m->data + bytes);
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Calibrator::evict()
+{
+  Master* oldest;
+  int loaded;
+
+  for(;;) {
+    loaded = 0;
+    oldest = 0;
+    for(int i=0; i<nmasters; i++) {
+      if(masters[i].pix == 0)
+	continue;
+      loaded++;
+      if(oldest == 0 || masters[i].used < oldest->used)
+	oldest = &masters[i];
+    }
+    if(loaded <= MAXLOADED || oldest->used == clock) // all in use
+      return;
+    free(oldest->pix);
+    oldest->pix = 0;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Calibrator::prepare(const CalibKey* key)
+{
+  int w = key->width;
+  int h = key->height;
+  const float *b, *d, *f;
+  float* o;
+  float* g;
+  float scale, mean;
+
+  if(planeMasters[0] == bias && planeMasters[1] == dark && planeMasters[2] == flat &&
+     planeScale == darkScale && planeKey.x == key->x && planeKey.y == key->y &&
+     planeKey.width == w && planeKey.height == h)
+    return;			// same as the previous image
+
+  if(w * h > planeSize) {
+    free(off);
+    free(gain);
+    planeSize = w * h;
+    if(posix_memalign(STATIC_CAST(void**, STATIC_CAST(void*, &off)), 64, 
+		      planeSize * sizeof(float)) != 0)
+      off = 0;
+    if(posix_memalign(STATIC_CAST(void**, STATIC_CAST(void*, &gain)), 64,
+		      planeSize * sizeof(float)) != 0)
+      gain = 0;
+  }
+
+  scale = darkScale;
+  mean  = (flat) ? flat->mean : 1;
+
+  for(int y=0; y<h; y++) {
+    b = (bias) ? bias->pix + (key->y - bias->y + y) * bias->width + key->x - bias->x : 0;
+    d = (dark) ? dark->pix + (key->y - dark->y + y) * dark->width + key->x - dark->x : 0;
+    f = (flat) ? flat->pix + (key->y - flat->y + y) * flat->width + key->x - flat->x : 0;
+    o = off  + y * w;
+    g = gain + y * w;
+    for(int x=0; x<w; x++) {
+      o[x] = ((b) ? b[x] : 0) + ((d) ? scale * d[x] : 0);
+      g[x] = (!f) ? 1 : (f[x] > 0) ? mean / f[x] : 0; // dead pixels
+    }
+  }
+
+  planeKey = *key;
+  planeMasters[0] = bias;
+  planeMasters[1] = dark;
+  planeMasters[2] = flat;
+  planeScale = darkScale;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Calibrator::select(const char* dir, const CalibKey* key, int use)
+{
+  Master* sel[3];
+  struct stat st;
+
+  // the directory is read again only when its contents change
+
+  if(stat(dir, &st) == -1)
+    st.st_mtime = 0;
+  if(strcmp(dir, dirname) || st.st_mtime != dirTime) {
+    strncpy(dirname, dir, sizeof(dirname) - 1);
+    dirTime = st.st_mtime;
+    scan(dir);
+  }
+
+  clock++;
+  sel[BIAS] = (use & MASTER_BIAS) ? best(BIAS, key) : 0;
+  sel[DARK] = (use & MASTER_DARK) ? best(DARK, key) : 0;
+  sel[FLAT] = (use & MASTER_FLAT) ? best(FLAT, key) : 0;
+  for(int i=0; i<3; i++) {
+    if(sel[i] && sel[i]->pix == 0 && !load(sel[i]))
+      sel[i] = 0;
+    if(sel[i])
+      sel[i]->used = clock;
+  }
+  evict();
+
+  bias = sel[BIAS];
+  dark = sel[DARK];
+  flat = sel[FLAT];
+  darkScale = (dark && dark->exptime > 0) ? key->exptime / dark->exptime : 1;
+  if(!bias && !dark && !flat)
+    return(false);
+
+  prepare(key);
+  return(off != 0 && gain != 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Calibrator::stamp(FITSHeader* header, int mode) const
+{
+  char buf[FITSHeader::STRINGSZ+1];
+  char scale[24];
+  const char* name;
+  int n;
+
+  header->set("BITPIX", (mode == CALIB_FLOAT) ? -32 : 16, 
+	      "Number of bits per data pixel");
+
+  if(bias) {
+    name = strrchr(bias->path, '/');
+    header->set("ZEROCOR", (name) ? name+1 : bias->path, "bias master");
+  }
+  if(dark) {
+    name = strrchr(dark->path, '/');	// a long name is clipped, never the scale
+    n = snprintf(scale, sizeof(scale), " x%.4f", darkScale);
+    n = (n < FITSHeader::STRINGSZ) ? FITSHeader::STRINGSZ - n : 0;
+    snprintf(buf, sizeof(buf), "%.*s%s", n, (name) ? name+1 : dark->path, scale);
+    header->set("DARKCOR", buf, "dark master, scale");
+  }
+  if(flat) {
+    name = strrchr(flat->path, '/');
+    header->set("FLATCOR", (name) ? name+1 : flat->path, "flat master");
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Calibrator::row(void* dst, const pixel_t* src, int y, bool mirror, int mode) const
+{
+  int w = planeKey.width;
+  const float* o = off  + y * w;
+  const float* g = gain + y * w;
+  unsigned int* d32 = STATIC_CAST(unsigned int*, dst);
+  unsigned short* d16 = STATIC_CAST(unsigned short*, dst);
+  unsigned int u;
+  float v;
+  int i;
+
+  if(mode == CALIB_FLOAT) {
+    for(int x=0; x<w; x++) {
+      v = (src[x] - o[x]) * g[x];
+      memcpy(&u, &v, sizeof(u));
+      d32[(mirror) ? w-1-x : x] = __builtin_bswap32(u);
+    }
+    return;
+  }
+
+  for(int x=0; x<w; x++) {
+    v = (src[x] - o[x]) * g[x];
+    i = STATIC_CAST(int, lrintf(v));
+    i = (i < -32768) ? -32768 : (i > 32767) ? 32767 : i;
+    d16[(mirror) ? w-1-x : x] = __builtin_bswap16(STATIC_CAST(unsigned short, i));
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Calibrator::values(float* dst, const pixel_t* src, int y) const
+{
+  int w = planeKey.width;
+  const float* o = off  + y * w;
+  const float* g = gain + y * w;
+
+  for(int x=0; x<w; x++)
+    dst[x] = (src[x] - o[x]) * g[x];
+}
+
+/*---------------------------------------------------------------------------*/
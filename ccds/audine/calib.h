@@ -0,0 +1,164 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_CALIB_H
+#define AUDINE_CALIB_H
+
+#include <time.h>
+
+/* output of calibrated images */
+
+#define CALIB_NONE  0		/* raw images only */
+#define CALIB_FLOAT 1		/* BITPIX -32 */
+#define CALIB_INT16 2		/* BITPIX 16, rounded to the nearest ADU */
+
+/* master frames used, as a mask */
+
+#define MASTER_BIAS 1
+#define MASTER_DARK 2
+#define MASTER_FLAT 4
+#define MASTER_ALL  (MASTER_BIAS | MASTER_DARK | MASTER_FLAT)
+
+/* what an image must match in a master frame */
+
+struct CalibKey {
+  char model[32];		/* CCD model */
+  int bin;			/* binning factor */
+  int x;			/* area origin, binned pixels */
+  int y;
+  int width;			/* image size */
+  int height;
+  double exptime;		/* requested exposure time [s] */
+};
+
+class FITSHeader;
+
+/*
+ * Bias, dark and flat calibration fused into the row writing path.
+ * Master frames are FITS files in a directory, recognized by IMAGETYP
+ * (zero or bias, dark, flat) and matched by CCD model (INSTRUME),
+ * binning (CCDBIN1) and area: a master covering a larger area, such as
+ * a full frame, also serves any subframe inside it (XORGSUBF, YORGSUBF).
+ * Darks are expected bias subtracted and are scaled by exposure time,
+ * the closest one being used. Flats are normalized by their mean.
+ * Masters are converted once into aligned float arrays, in readout
+ * orientation as the rows calibrated even if saved flipped (FLIPLR,
+ * FLIPUD), and kept in memory while in use. Per image, bias and scaled dark are merged into 
+ * a single offset plane and the flat into a gain plane, so that 
+ * calibrating a pixel takes a subtraction and a multiplication.
+ */
+
+class Calibrator {
+
+ public:
+
+  static const int MAXLOADED = 6; /* masters kept in memory */
+
+  Calibrator();
+ ~Calibrator();
+
+  /* selects the masters in 'dir' matching an image. false if none */
+  /* only those given by 'use', a MASTER_xxx mask */
+  bool select(const char* dir, const CalibKey* key, int use = MASTER_ALL);
+
+  /* sets BITPIX and the IRAF ZEROCOR, DARKCOR & FLATCOR cards */
+  void stamp(FITSHeader* header, int mode) const;
+
+  /* calibrates row 'y' of the selected image into FITS layout */
+  /* big endian floats or 16 bit integers as given by 'mode' */
+  void row(void* dst, const pixel_t* src, int y, bool mirror, int mode) const;
+
+  /* same, host order floats, not mirrored */
+  void values(float* dst, const pixel_t* src, int y) const;
+
+  /* bias + scaled dark of row 'y' of the selected image */
+  const float* offset(int y) const { return(off + y * planeKey.width); }
+
+  /* bytes per calibrated pixel */
+  static int pixelSize(int mode) { return((mode == CALIB_FLOAT) ? 4 : 2); }
+
+ private:
+
+  enum { BIAS, DARK, FLAT };
+
+  struct Master {
+    char path[256];		/* FITS file */
+    time_t mtime;		/* file modification time */
+    int type;			/* BIAS, DARK or FLAT */
+    char model[32];		/* CCD model */
+    int bin;			/* binning factor */
+    int x;			/* area origin, binned pixels */
+    int y;
+    int width;			/* image size */
+    int height;
+    double exptime;		/* exposure time [s] */
+    int bitpix;			/* 16 or -32 */
+    double bzero;
+    double bscale;
+    bool flipLR;		/* saved right to left */
+    bool flipUD;		/* saved bottom to top */
+    long data;			/* data unit offset in the file */
+    float* pix;			/* pixels in memory, 0 if not loaded */
+    double mean;		/* mean pixel value */
+    unsigned long used;		/* last use, for eviction */
+  };
+
+  Master* masters;		/* masters found in the directory */
+  int nmasters;
+  char dirname[256];		/* directory scanned */
+  time_t dirTime;		/* its modification time when scanned */
+  unsigned long clock;		/* selections so far */
+
+  /* current selection */
+  Master* bias;
+  Master* dark;
+  Master* flat;
+  double darkScale;		/* image to dark exposure time ratio */
+
+  /* planes of the current selection */
+  CalibKey planeKey;		/* image they were made for */
+  Master* planeMasters[3];	/* masters they were made from */
+  double planeScale;		/* dark scale they were made with */
+  float* off;			/* bias + scaled dark */
+  float* gain;			/* normalized inverse flat */
+  int planeSize;		/* capacity of off[] & gain[] in pixels */
+
+  /* reads the directory again, keeping masters already loaded */
+  void scan(const char* dir);
+
+  /* reads the keywords of a master. false if not a master frame */
+  bool readHeader(const char* path, Master* m);
+
+  /* best master of a type for an image. NULL if none */
+  Master* best(int type, const CalibKey* key);
+
+  /* converts the master pixels into memory */
+  bool load(Master* m);
+
+  /* frees the least recently used masters above MAXLOADED */
+  void evict();
+
+  /* merges the selection into the offset and gain planes */
+  void prepare(const CalibKey* key);
+};
+
+#endif
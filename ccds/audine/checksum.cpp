@@ -0,0 +1,174 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "checksum.h"
+
+/*---------------------------------------------------------------------------*/
+
+void
+DataSum::reset()
+{
+  for(int i=0; i<4; i++)
+    lane[i] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DataSum::add(const void* buf, size_t len, off_t pos)
+{
+  const unsigned char* p = static_cast<const unsigned char*>(buf);
+  unsigned long long s[4] = {0, 0, 0, 0};
+  size_t i = 0;
+
+  // byte sums by position modulo 4 relative to 'buf' are enough,
+  // 16 bit word sums are rebuilt from them at the end
+
+#ifdef __SSE2__
+
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i m0 = _mm_set1_epi32(0x000000FF);
+  const __m128i m1 = _mm_set1_epi32(0x0000FF00);
+  const __m128i m2 = _mm_set1_epi32(0x00FF0000);
+  const __m128i m3 = _mm_set1_epi32(0xFF000000);
+  __m128i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+  __m128i v;
+
+  for(; i + 16 <= len; i += 16) {
+    v  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    a0 = _mm_add_epi64(a0, _mm_sad_epu8(_mm_and_si128(v, m0), zero));
+    a1 = _mm_add_epi64(a1, _mm_sad_epu8(_mm_and_si128(v, m1), zero));
+    a2 = _mm_add_epi64(a2, _mm_sad_epu8(_mm_and_si128(v, m2), zero));
+    a3 = _mm_add_epi64(a3, _mm_sad_epu8(_mm_and_si128(v, m3), zero));
+  }
+
+  {
+    unsigned long long t[2];
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(t), a0);
+    s[0] = t[0] + t[1];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(t), a1);
+    s[1] = t[0] + t[1];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(t), a2);
+    s[2] = t[0] + t[1];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(t), a3);
+    s[3] = t[0] + t[1];
+  }
+
+#endif
+
+  for(; i < len; i++)
+    s[i & 3] += p[i];
+
+  // relative positions to data unit word positions
+
+  for(i=0; i<4; i++)
+    if(s[i])
+      __sync_fetch_and_add(&lane[(pos + i) & 3], s[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+unsigned int
+DataSum::value() const
+{
+  unsigned long long hi, lo, hicarry, locarry;
+
+  hi = 256 * lane[0] + lane[1];
+  lo = 256 * lane[2] + lane[3];
+
+  // carries out of the high half wrap around to the low half
+
+  hicarry = hi >> 16;
+  locarry = lo >> 16;
+  while(hicarry || locarry) {
+    hi = (hi & 0xFFFF) + locarry;
+    lo = (lo & 0xFFFF) + hicarry;
+    hicarry = hi >> 16;
+    locarry = lo >> 16;
+  }
+
+  return(static_cast<unsigned int>((hi << 16) | lo));
+}
+
+/*---------------------------------------------------------------------------*/
+
+unsigned int
+DataSum::add(unsigned int a, unsigned int b)
+{
+  unsigned long long s = static_cast<unsigned long long>(a) + b;
+
+  return(static_cast<unsigned int>((s & 0xFFFFFFFF) + (s >> 32)));
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DataSum::encode(unsigned int sum, char* ascii)
+{
+  static const unsigned char exclude[13] = { 
+    0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 
+    0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60 
+  };
+  unsigned int value = ~sum;
+  char asc[16];
+  int ch[4], i, j, k, byte, check;
+
+  // each byte is spread over 4 printable chars keeping the sum.
+  // Punctuation chars are avoided by moving units between pairs
+
+  for(i=0; i<4; i++) {
+    byte = (value >> (24 - 8*i)) & 0xFF;
+    for(j=0; j<4; j++)
+      ch[j] = byte / 4 + '0';
+    ch[0] += byte % 4;
+
+    do {
+      check = 0;
+      for(k=0; k<13; k++) {
+	for(j=0; j<4; j+=2) {
+	  if(ch[j] == exclude[k] || ch[j+1] == exclude[k]) {
+	    ch[j]++;
+	    ch[j+1]--;
+	    check++;
+	  }
+	}
+      }
+    } while(check);
+
+    for(j=0; j<4; j++)
+      asc[4*j+i] = ch[j];
+  }
+
+  // rotated one char to the right, the FITS way
+
+  for(i=0; i<16; i++)
+    ascii[i] = asc[(i+15) % 16];
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,63 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_CHECKSUM_H
+#define AUDINE_CHECKSUM_H
+
+#include <sys/types.h>
+
+/*
+ * 32 bit ones' complement sum of a FITS data unit, as used by the
+ * DATASUM and CHECKSUM keywords. Since the sum is commutative, data can
+ * be added in any order, from any thread, as long as its position in
+ * the data unit is given. Zero bytes (missing rows, padding) can be
+ * skipped altogether.
+ */
+
+class DataSum {
+
+ public:
+
+  DataSum() { reset(); }
+
+  /* starts a new data unit */
+  void reset();
+
+  /* accounts 'len' bytes found at offset 'pos' of the data unit */
+  void add(const void* buf, size_t len, off_t pos);
+
+  /* the 32 bit ones' complement sum so far */
+  unsigned int value() const;
+
+  /* ones' complement addition of two sums */
+  static unsigned int add(unsigned int a, unsigned int b);
+
+  /* encodes the complement of a sum as the 16 chars of CHECKSUM */
+  static void encode(unsigned int sum, char* ascii);
+
+ private:
+
+  /* byte sums for each byte position in a 32 bit big endian word */
+  volatile unsigned long long lane[4];
+};
+
+#endif
@@ -25,6 +25,7 @@
 
 
 #include "audine.h"
+#include "overscan.h"
 
 
 /* Xilinx sequence for binning 1x1, slow ADC */
@@ -467,6 +468,8 @@ CCDChip::setAreaDimOverscan(int binning)
 
   audine->fits.set("NAXIS1", dimx, "columns");
   audine->fits.set("NAXIS2", dimy, "rows" );
+  audine->fits.set("XORGSUBF", 0, "[pixels] area origin");
+  audine->fits.set("YORGSUBF", 0, "[pixels] area origin");
 
   audine->req.body.imageReq.x1 = 0;
   audine->req.body.imageReq.y1 = 0;
@@ -548,6 +551,8 @@ CCDChip::setAreaDimFullFrame(int binning)
 
   audine->fits.set("NAXIS1",  dimx);
   audine->fits.set("NAXIS2",  dimy);
+  audine->fits.set("XORGSUBF", origx, "[pixels] area origin");
+  audine->fits.set("YORGSUBF", origy, "[pixels] area origin");
 
   audine->fits.erase("BIASSEC");
   audine->fits.erase("TRIMSEC");
@@ -613,6 +618,8 @@ CCDChip::setAreaDimRect(int xorig, int yorig, int width, int height, int binning
 
   audine->fits.set("NAXIS1", width, "columns");
   audine->fits.set("NAXIS2", height, "rows");
+  audine->fits.set("XORGSUBF", xorig, "[pixels] area origin");
+  audine->fits.set("YORGSUBF", yorig, "[pixels] area origin");
 
   audine->fits.erase("BIASSEC");
   audine->fits.erase("TRIMSEC");
@@ -663,6 +670,8 @@ CCDChip::setAreaDimCommon(int width, int binn, int x1, int y1, int x2, int y2)
 
   audine->fits.set("NAXIS1", width);
   audine->fits.set("NAXIS2", width);
+  audine->fits.set("XORGSUBF", origx, "[pixels] area origin");
+  audine->fits.set("YORGSUBF", origy, "[pixels] area origin");
 
   audine->fits.erase("BIASSEC");
   audine->fits.erase("TRIMSEC");
@@ -1363,6 +1372,34 @@ CCDChip::getDim(int* width, int* height)
 
 /*---------------------------------------------------------------------------*/
 
+bool
+CCDChip::getOverscan(OverscanGeom* geom)
+{
+  int x1, x2, y1, y2;
+
+  if(!areaSelection->getValue("FULL_FRAME_OV"))
+    return(false);
+
+  // as in computeTrimSection(), binned pixels straddling the active 
+  // area edges belong neither to the active area nor to the overscan
+
+  x1 = ccdData[model].over1.x;
+  x2 = ccdData[model].over1.x + ccdData[model].active.x;
+  y1 = ccdData[model].over1.y;
+  y2 = ccdData[model].over1.y + ccdData[model].active.y;
+
+  geom->pre    = x1 / bin;
+  geom->post   = (x2 + bin - 1) / bin;
+  geom->x      = (x1 + bin - 1) / bin;
+  geom->y      = (y1 + bin - 1) / bin;
+  geom->width  = x2 / bin - geom->x;
+  geom->height = y2 / bin - geom->y;
+  return(geom->pre > 0 || 
+	 geom->post < STATIC_CAST(int, areaDimRect->getValue("DIMX")));
+}
+
+/*---------------------------------------------------------------------------*/
+
 
 // THIS METHOD IS NO LONGER NEEDED
 // WE RETAIN IT HERE TO DOCUMENT HOW COR CALCULATES THESE PARAMETERS
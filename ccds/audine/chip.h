@@ -74,6 +74,7 @@ struct CCDData {
 #define OOB_XY  0x03		/* out of bounds in X and Y */
 
 class Audine;			/* forward reference */
+struct OverscanGeom;
 
 
 /* This class represents the chip topological features and 
@@ -133,6 +134,28 @@ class CCDChip {
   /* gets the selected CCD model's name */
   const char* getModel() { return(ccdModel->getLastOn()->getName()); }
 
+  /* gets the binning factor */
+  int getBinning() { return(bin); }
+
+  /* gets the binned pixel size [microns] */
+  double getPixelSize() { return(areaDim->getValue("PIXSZ")); }
+
+  /* gets the CCD gain [e-/ADU], 0 if unknown */
+  double getGain() { return(photPars->getValue("GAIN")); }
+
+  /* gets the binning-dependant readout noise [e-] */
+  double getReadNoise() { return(photPars->getValue("RDNOISE")*bin*bin); }
+
+  /* gets the selected area origin, in binned pixels */
+  void getOrigin(int* x, int* y) {
+    *x = STATIC_CAST(int, areaDimRect->getValue("ORIGX"));
+    *y = STATIC_CAST(int, areaDimRect->getValue("ORIGY"));
+  }
+
+  /* gets where the overscan is in binned pixels */
+  /* false if the area selected has no overscan */
+  bool getOverscan(OverscanGeom* geom);
+
  private:
 
   Log* log;
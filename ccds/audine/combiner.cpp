@@ -0,0 +1,602 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "combiner.h"
+#include "defects.h"
+
+#define SAMPLING 8		/* flat level taken every 8 rows & columns */
+
+/*---------------------------------------------------------------------------*/
+
+static double
+monotonic()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*---------------------------------------------------------------------------*/
+
+Combiner::Combiner() : running(false), state(IDLE), quit(false), 
+    useCalib(false), nmaps(0), nframes(0), fd(-1), dataOffset(0), error(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&wake, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+
+Combiner::~Combiner()
+{
+  stop();
+  pthread_cond_destroy(&wake);
+  pthread_mutex_destroy(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::start()
+{
+  int res;
+
+  if(running)
+    return;
+
+  quit = false;
+  pool.start();
+  res = pthread_create(&thread, NULL, Combiner::run, this);
+  assert(res == 0);
+  running = true;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::stop()
+{
+  if(!running)
+    return;
+
+  // a job being combined is completed first
+
+  pthread_mutex_lock(&lock);
+  quit = true;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+
+  pthread_join(thread, NULL);
+  pool.stop();
+  running = false;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Combiner::submit(const CombineJob* newJob)
+{
+  bool res = false;
+
+  pthread_mutex_lock(&lock);
+  if(state != QUEUED && state != RUNNING) {
+    job   = *newJob;
+    state = QUEUED;
+    pthread_cond_signal(&wake);
+    res = true;
+  }
+  pthread_mutex_unlock(&lock);
+  return(res);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Combiner::popDone(CombineReport* report)
+{
+  bool found;
+
+  pthread_mutex_lock(&lock);
+  found = (state == DONE);
+  if(found) {
+    *report = result;
+    state = IDLE;
+  }
+  pthread_mutex_unlock(&lock);
+  return(found);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void*
+Combiner::run(void* arg)
+{
+  STATIC_CAST(Combiner*, arg)->loop();
+  return(NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::loop()
+{
+  pthread_mutex_lock(&lock);
+  for(;;) {
+    while(!quit && state != QUEUED)
+      pthread_cond_wait(&wake, &lock);
+    if(quit)
+      break;
+    state = RUNNING;
+    pthread_mutex_unlock(&lock);
+
+    combine();
+
+    pthread_mutex_lock(&lock);
+    state = DONE;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Combiner::addFile(const char* path)
+{
+  FITSImage img;
+  struct stat st;
+  off_t pos = 0;
+  void* map;
+  int file, n = 0;
+
+  file = ::open(path, O_RDONLY);
+  if(file == -1)
+    return(false);
+  if(fstat(file, &st) == -1 || st.st_size == 0) {
+    ::close(file);
+    return(false);
+  }
+  map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, file, 0);
+  if(map == MAP_FAILED) {
+    ::close(file);
+    return(false);
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  // every image HDU, so that multi-extension files give all their frames
+
+  while(nframes < MAXFRAMES && pos < st.st_size && FITSReader::read(file, pos, &img)) {
+    pos = img.next;
+    if(img.naxis != 2 || (img.bitpix != 16 && img.bitpix != -32) ||
+       img.width <= 0 || img.height <= 0 ||
+       img.data + FITSReader::dataSize(&img) > st.st_size)
+      continue;
+    if(nframes == 0)
+      first = img;
+    else if(img.width != first.width || img.height != first.height)
+      continue;
+    frames[nframes].pix    = STATIC_CAST(const unsigned char*, map) + img.data;
+    frames[nframes].bitpix = img.bitpix;
+    frames[nframes].bzero  = img.bzero;
+    frames[nframes].bscale = img.bscale;
+    frames[nframes].scale  = 1;
+    frames[nframes].flipLR = img.flipLR;
+    frames[nframes].flipUD = img.flipUD;
+    nframes++;
+    n++;
+  }
+  ::close(file);
+
+  if(n == 0) {
+    munmap(map, st.st_size);
+    return(false);
+  }
+  maps[nmaps]    = map;
+  mapSize[nmaps] = st.st_size;
+  perFile[nmaps] = n;
+  nmaps++;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::release()
+{
+  for(int i=0; i<nmaps; i++)
+    munmap(maps[i], mapSize[i]);
+  nmaps   = 0;
+  nframes = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::load(const Input* in, int y, float* dst) const
+{
+  int w = first.width;
+  const unsigned char* p;
+  const float* off;
+  unsigned int u;
+  float f;
+  int fy;
+
+  // big endian, BSCALE & BZERO applied, then masters subtracted.
+  // Rows & columns saved flipped are read back in readout order
+
+  fy = (in->flipUD) ? first.height-1 - y : y;
+  p  = in->pix + STATIC_CAST(size_t, fy) * w * ((in->bitpix == 16) ? 2 : 4);
+  for(int x=0; x<w; x++) {
+    if(in->bitpix == 16)
+      f = STATIC_CAST(short, (p[2*x] << 8) | p[2*x+1]);
+    else {
+      u = (p[4*x] << 24) | (p[4*x+1] << 16) | (p[4*x+2] << 8) | p[4*x+3];
+      memcpy(&f, &u, sizeof(f));
+    }
+    dst[(in->flipLR) ? w-1-x : x] = f * in->bscale + in->bzero;
+  }
+
+  if(useCalib) {
+    off = calib.offset(y);
+    for(int x=0; x<w; x++)
+      dst[x] -= off[x];
+  }
+  if(in->scale != 1)
+    for(int x=0; x<w; x++)
+      dst[x] *= in->scale;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::normalize()
+{
+  float* row = new float[first.width];
+  double level[MAXFRAMES];
+  double sum, common = 0;
+  int n, used = 0;
+
+  // each flat is brought to the mean level of the sequence,
+  // as sky flats fade or brighten from one frame to the next
+
+  for(int i=0; i<nframes; i++) {
+    sum = 0;
+    n = 0;
+    for(int y=0; y<first.height; y+=SAMPLING) {
+      load(&frames[i], y, row);
+      for(int x=0; x<first.width; x+=SAMPLING, n++)
+	sum += row[x];
+    }
+    level[i] = sum / n;
+    if(level[i] > 0) {
+      common += level[i];
+      used++;
+    }
+  }
+  common = (used) ? common / used : 1;
+
+  for(int i=0; i<nframes; i++)
+    frames[i].scale = (level[i] > 0) ? common / level[i] : 1;
+  delete [] row;
+}
+
+/*---------------------------------------------------------------------------*/
+
+float
+Combiner::median(float* v, int n) const
+{
+  float lo;
+
+  std::nth_element(v, v + n/2, v + n);
+  if(n % 2)
+    return(v[n/2]);
+  lo = *std::max_element(v, v + n/2);
+  return((lo + v[n/2]) / 2);
+}
+
+/*---------------------------------------------------------------------------*/
+
+float
+Combiner::clipped(float* v, int n) const
+{
+  double sum, sum2, mean, sigma;
+  float center = median(v, n);
+  int k;
+
+  // values too far from the median (cosmic rays, satellites ...) 
+  // are rejected, the spread being measured again on those left
+
+  for(int it=0; ; it++) {
+    sum = sum2 = 0;
+    for(int i=0; i<n; i++) {
+      sum  += v[i];
+      sum2 += STATIC_CAST(double, v[i]) * v[i];
+    }
+    mean = sum / n;
+    if(it == MAXITER)
+      break;
+    sigma = sqrt(std::max(sum2 / n - mean * mean, 0.0));
+    k = 0;
+    for(int i=0; i<n; i++)
+      if(fabs(v[i] - center) <= job.kappa * sigma)
+	v[k++] = v[i];
+    if(k == n)
+      break;
+    n = k;			// never empty, the median itself is kept
+  }
+  return(mean);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::bandJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(Combiner*, ctx)->band(a, b);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::band(int y0, int n)
+{
+  int w = first.width;
+  float* rows = new float[nframes * w];
+  float* out  = new float[n * w];
+  float v[MAXFRAMES];
+  size_t len = n * w * sizeof(float);
+  off_t pos = STATIC_CAST(off_t, y0) * w * sizeof(float);
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t p, q;
+  unsigned int u;
+  int bytes;
+
+  for(int y=0; y<n; y++) {
+    for(int i=0; i<nframes; i++)
+      load(&frames[i], y0 + y, rows + i * w);
+    for(int x=0; x<w; x++) {
+      for(int i=0; i<nframes; i++)
+	v[i] = rows[i * w + x];
+      out[y * w + x] = (job.method == COMBINE_SIGCLIP) ?
+	clipped(v, nframes) : median(v, nframes);
+    }
+  }
+
+  // the input pages of this band are not needed any more.
+  // Pages shared with the neighbour bands are left alone
+
+  for(int i=0; i<nframes; i++) {
+    bytes = (frames[i].bitpix == 16) ? 2 : 4;
+    p = reinterpret_cast<uintptr_t>(frames[i].pix) + STATIC_CAST(size_t, 
+      (frames[i].flipUD) ? first.height - y0 - n : y0) * w * bytes;
+    q = p + STATIC_CAST(size_t, n) * w * bytes;
+    p = (p + page - 1) / page * page;
+    q = q / page * page;
+    if(q > p)
+      madvise(reinterpret_cast<void*>(p), q - p, MADV_DONTNEED);
+  }
+
+  for(int i=0; i<n*w; i++) {
+    memcpy(&u, &out[i], sizeof(u));
+    u = __builtin_bswap32(u);
+    memcpy(&out[i], &u, sizeof(u));
+  }
+  dataSum.add(out, len, pos);
+  if(pwrite(fd, out, len, dataOffset + pos) != STATIC_CAST(ssize_t, len))
+    __sync_lock_test_and_set(&error, (errno) ? errno : EIO);
+
+  delete [] out;
+  delete [] rows;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::masterPath(char* path, int size) const
+{
+  const char* type;
+  char model[32];
+  char date[32];
+  struct tm tm;
+  time_t t;
+
+  type = (job.type == MASTER_BIAS) ? "bias" : (job.type == MASTER_DARK) ? "dark" : "flat";
+  snprintf(model, sizeof(model), "%s", (first.model[0]) ? first.model : "ccd");
+  for(char* p=model; *p; p++)
+    if(*p == ' ' || *p == '/')
+      *p = '-';
+  time(&t);
+  gmtime_r(&t, &tm);
+  strftime(date, sizeof(date), "%Y%m%dT%H%M%S", &tm);
+
+  snprintf(path, size, "%s/master_%s_%s_b%d_%gs_%s.fit", 
+	   job.dir, type, model, first.bin, first.exptime, date);
+
+  // never replaces a master of the same second
+
+  for(int i=2; access(path, F_OK) == 0; i++)
+    snprintf(path, size, "%s/master_%s_%s_b%d_%gs_%s_%d.fit", 
+	     job.dir, type, model, first.bin, first.exptime, date, i);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::fillHeader(FITSHeader* header) const
+{
+  char text[FITSHeader::CARDSZ - FITSHeader::KEYSZ + 1]; // a HISTORY card
+  char date[32];
+  const char* name;
+  struct tm tm;
+  time_t t;
+
+  time(&t);
+  gmtime_r(&t, &tm);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  header->set("BITPIX", -32, "Number of bits per data pixel");
+  header->set("NAXIS1", first.width, "columns");
+  header->set("NAXIS2", first.height, "rows");
+  header->set("DATE", date, "file creation time");
+  header->set("IMAGETYP", (job.type == MASTER_BIAS) ? Audine::BIAS :
+	      (job.type == MASTER_DARK) ? Audine::DARK : Audine::FLAT,
+	      "IRAF image type");
+  header->set("INSTRUME", first.model);
+  header->set("CCDBIN1", first.bin, "binned columns");
+  header->set("CCDBIN2", first.bin, "binned rows");
+  header->set("XORGSUBF", first.x, "[pixels] area origin");
+  header->set("YORGSUBF", first.y, "[pixels] area origin");
+  header->set("EXPTIME", first.exptime, "[s] exposure time");
+  header->set("FLIPLR", false, "columns saved right to left");
+  header->set("FLIPUD", false, "rows saved bottom to top");
+  header->set("NCOMBINE", nframes, "frames combined");
+  header->set("COMBINE", (job.method == COMBINE_SIGCLIP) ? "sigclip" : "median",
+	      "combine method");
+  if(job.method == COMBINE_SIGCLIP)
+    header->set("KAPPA", job.kappa, "[sigma] clipping threshold");
+  if(useCalib)
+    calib.stamp(header, CALIB_FLOAT); // masters subtracted
+  if(job.type == MASTER_FLAT)
+    header->appendVoid("HISTORY", "flats scaled to their common mean level");
+
+  // the inputs, in the order they were taken
+
+  for(int i=0, f=0; i<job.nfiles && f<nmaps; i++) {
+    if(job.files[i][0] == 0)	// unreadable
+      continue;
+    name = strrchr(job.files[i], '/');
+    name = (name) ? name+1 : job.files[i];
+    if(perFile[f] > 1)
+      snprintf(text, sizeof(text), "%.50s, %d frames", name, perFile[f]);
+    else
+      snprintf(text, sizeof(text), "%.72s", name);
+    header->appendVoid("HISTORY", text);
+    f++;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Combiner::combine()
+{
+  FITSHeader header;
+  char tmp[sizeof(result.path) + 8];
+  char* buf;
+  double t0 = monotonic();
+  off_t size;
+  int nrec, use, n;
+
+  memset(&result, 0, sizeof(result));
+  nmaps = nframes = 0;
+  error = 0;
+  for(int i=0; i<job.nfiles; i++)
+    if(!addFile(job.files[i]))
+      job.files[i][0] = 0;	// not in the master history
+  if(nframes < COMBINE_MIN) {
+    result.error = ENOENT;
+    release();
+    return;
+  }
+
+  // masters of the same chip, binning & area are subtracted first
+
+  memset(&key, 0, sizeof(key));
+  strcpy(key.model, first.model);
+  key.bin     = first.bin;
+  key.x       = first.x;
+  key.y       = first.y;
+  key.width   = first.width;
+  key.height  = first.height;
+  key.exptime = first.exptime;
+  use = (job.type == MASTER_DARK) ? MASTER_BIAS :
+    (job.type == MASTER_FLAT) ? MASTER_BIAS | MASTER_DARK : 0;
+  useCalib = use && calib.select(job.dir, &key, use);
+  if(job.type == MASTER_FLAT)
+    normalize();
+
+  // written under a name the calibration stage ignores, renamed when done
+
+  masterPath(result.path, sizeof(result.path));
+  snprintf(tmp, sizeof(tmp), "%s.tmp", result.path);
+  fd = ::open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    result.error = errno;
+    release();
+    return;
+  }
+
+  fillHeader(&header);
+  nrec = header.records();
+  dataOffset = STATIC_CAST(off_t, nrec) * FITSHeader::RECORDSZ;
+  size = STATIC_CAST(off_t, first.width) * first.height * sizeof(float);
+  size = (size + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ * FITSHeader::RECORDSZ;
+  if(ftruncate(fd, dataOffset + size) == -1)
+    error = errno;
+
+  dataSum.reset();
+  for(int y=0; y<first.height && !error; y+=BAND)
+    pool.submit(Combiner::bandJob, this, y, std::min(BAND, first.height - y));
+  pool.wait();
+  n = nframes;
+  release();
+
+  buf = new char[nrec * FITSHeader::RECORDSZ];
+  header.render(buf, nrec, dataSum.value());
+  if(!error && pwrite(fd, buf, nrec * FITSHeader::RECORDSZ, 0) != 
+     nrec * FITSHeader::RECORDSZ)
+    error = (errno) ? errno : EIO;
+  if(!error && fsync(fd) == -1)
+    error = errno;
+  delete [] buf;
+  ::close(fd);
+  fd = -1;
+
+  if(!error && rename(tmp, result.path) == -1)
+    error = errno;
+  if(error)
+    unlink(tmp);
+  result.error   = error;
+  result.frames  = (error) ? 0 : n;
+  result.defects = (!error && job.type != MASTER_FLAT) ? 
+    DefectMap::build(job.dir, result.path) : -1;
+  result.elapsed = monotonic() - t0;
+}
+
+/*---------------------------------------------------------------------------*/
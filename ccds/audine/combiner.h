@@ -0,0 +1,185 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_COMBINER_H
+#define AUDINE_COMBINER_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "calib.h"
+#include "checksum.h"
+#include "fitshead.h"
+#include "fitsread.h"
+#include "workpool.h"
+
+/* combine methods */
+
+#define COMBINE_NONE    0	/* sequences are left alone */
+#define COMBINE_MEDIAN  1	/* median of each pixel */
+#define COMBINE_SIGCLIP 2	/* mean of the values within kappa sigma */
+
+#define COMBINE_FILES 128	/* max. files in a job */
+#define COMBINE_MIN   3		/* min. frames worth combining */
+
+/* a sequence to combine into a master frame */
+
+struct CombineJob {
+  int type;			/* MASTER_BIAS, MASTER_DARK or MASTER_FLAT */
+  int method;			/* one of COMBINE_xxx */
+  double kappa;			/* clipping threshold in sigmas */
+  char dir[256];		/* master frames directory */
+  int nfiles;
+  char files[COMBINE_FILES][256]; /* FITS files, single or multi-extension */
+};
+
+/* outcome of a job, sent back to the event loop */
+
+struct CombineReport {
+  char path[256];		/* master frame written */
+  int frames;			/* frames combined */
+  int error;			/* errno, 0 if written */
+  double elapsed;		/* [s] */
+  int defects;			/* defect runs in the chip map, -1 if not built */
+};
+
+/*
+ * Combines bias, dark and flat sequences into master frames, in a
+ * background thread so that the next sequence may start right away.
+ * Input images are mapped read only rather than loaded, and combined
+ * one band of rows at a time by a pool of worker threads, each band
+ * being released as soon as it is done: memory stays bounded whatever
+ * the number of frames. Darks get the bias master subtracted and flats
+ * the bias and scaled dark, if any, flats being also scaled to a common
+ * level before combining. The master is written as a float image with
+ * its provenance, under a temporary name and renamed when complete, so
+ * that the calibration stage finds it at the next image. Frames saved
+ * flipped are turned back, masters being always in readout orientation.
+ * Bias and dark masters also update the defect map of the chip.
+ */
+
+class Combiner {
+
+ public:
+
+  static const int BAND = 32;	/* rows per worker job */
+  static const int MAXFRAMES = 256; /* frames combined at most */
+  static const int MAXITER = 5;	/* sigma clipping iterations */
+
+  Combiner();
+ ~Combiner();
+
+  /* spawns the combiner thread */
+  void start();
+
+  /* waits for the current job and joins the thread */
+  void stop();
+
+  /* queues a job. false if one is still running */
+  bool submit(const CombineJob* job);
+
+  /* true while a job is queued or running */
+  bool busy() const { return(state != IDLE); }
+
+  /* gets the report of the last job if not yet taken */
+  bool popDone(CombineReport* report);
+
+ private:
+
+  enum { IDLE, QUEUED, RUNNING, DONE };
+
+  /* an input frame within a mapped file */
+
+  struct Input {
+    const unsigned char* pix;	/* data unit */
+    int bitpix;			/* 16 or -32 */
+    double bzero;
+    double bscale;
+    double scale;		/* flats: factor to the common level */
+    bool flipLR;		/* saved right to left */
+    bool flipUD;		/* saved bottom to top */
+  };
+
+  pthread_t thread;
+  bool running;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;		/* signals a new job or quit */
+  volatile int state;		/* IDLE, QUEUED, RUNNING or DONE */
+  bool quit;
+  CombineJob job;		/* current job */
+  CombineReport result;		/* its outcome */
+
+  WorkerPool pool;		/* band combiners */
+  Calibrator calib;		/* masters subtracted from darks & flats */
+  bool useCalib;		/* some master was found */
+
+  /* current job inputs */
+  void* maps[COMBINE_FILES];	/* mapped files */
+  size_t mapSize[COMBINE_FILES];
+  int nmaps;
+  int perFile[COMBINE_FILES];	/* frames found in each file */
+  Input frames[MAXFRAMES];
+  int nframes;
+  FITSImage first;		/* first frame header */
+  CalibKey key;			/* its calibration key */
+
+  /* output */
+  int fd;			/* temporary master file */
+  off_t dataOffset;		/* its data unit */
+  DataSum dataSum;
+  volatile int error;		/* errno of a failed write */
+
+  static void* run(void* arg);	/* thread entry point */
+  void loop();			/* thread main loop */
+
+  /* combines the current job into result */
+  void combine();
+
+  /* maps a file and adds its images. false if unreadable */
+  bool addFile(const char* path);
+
+  /* unmaps all input files */
+  void release();
+
+  /* scales flats to their common mean level */
+  void normalize();
+
+  /* converts row 'y' of a frame, in readout orientation, */
+  /* to floats, masters subtracted */
+  void load(const Input* in, int y, float* dst) const;
+
+  /* combines and writes rows [a, a+b). Runs in the worker pool */
+  static void bandJob(void* ctx, int a, int b);
+  void band(int first, int n);
+
+  /* combined value of 'n' samples, reordered */
+  float median(float* v, int n) const;
+  float clipped(float* v, int n) const;
+
+  /* fills the master header with its provenance */
+  void fillHeader(FITSHeader* header) const;
+
+  /* master file name in the job directory */
+  void masterPath(char* path, int size) const;
+};
+
+#endif
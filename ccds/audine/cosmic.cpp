@@ -0,0 +1,515 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "calib.h"
+#include "cosmic.h"
+#include "fitshead.h"
+#include "frame.h"
+#include "workpool.h"
+
+#define HIT      1		/* pixel hit by a cosmic ray */
+#define NEW      2		/* found in the current iteration */
+#define FINEMIN  0.01f		/* smallest fine structure contrast */
+#define QNOISE2  (1.0f/12)	/* quantization noise squared [ADU^2] */
+#define MADSIGMA 1.4826f	/* sigma of a normal distribution from its MAD */
+#define SAMPLES  65536		/* pixels sampled for the background noise */
+
+/*---------------------------------------------------------------------------*/
+
+static inline float
+positive(float x)
+{
+  return((x > 0) ? x : 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// the medians of 3x3 and 5x5 pixels, taken for every pixel, are
+// sorting networks (Paeth, Devillard) with no branch to mispredict
+
+static inline void
+order(float* a, float* b)
+{
+  float t = *a;
+
+  *a = (t < *b) ? t : *b;
+  *b = (t < *b) ? *b : t;
+}
+
+static float
+median9(float* p)
+{
+  static const unsigned char net[19][2] = {
+    {1,2}, {4,5}, {7,8}, {0,1}, {3,4}, {6,7}, {1,2}, {4,5}, {7,8}, {0,3},
+    {5,8}, {4,7}, {3,6}, {1,4}, {2,5}, {4,7}, {4,2}, {6,4}, {4,2}
+  };
+
+  for(int k=0; k<19; k++)
+    order(p + net[k][0], p + net[k][1]);
+  return(p[4]);
+}
+
+static float
+median25(float* p)
+{
+  static const unsigned char net[99][2] = {
+    {0,1}, {3,4}, {2,4}, {2,3}, {6,7}, {5,7}, {5,6}, {9,10}, {8,10}, {8,9},
+    {12,13}, {11,13}, {11,12}, {15,16}, {14,16}, {14,15}, {18,19}, {17,19},
+    {17,18}, {21,22}, {20,22}, {20,21}, {23,24}, {2,5}, {3,6}, {0,6}, {0,3},
+    {4,7}, {1,7}, {1,4}, {11,14}, {8,14}, {8,11}, {12,15}, {9,15}, {9,12},
+    {13,16}, {10,16}, {10,13}, {20,23}, {17,23}, {17,20}, {21,24}, {18,24},
+    {18,21}, {19,22}, {8,17}, {9,18}, {0,18}, {0,9}, {10,19}, {1,19}, {1,10},
+    {11,20}, {2,20}, {2,11}, {12,21}, {3,21}, {3,12}, {13,22}, {4,22}, {4,13},
+    {14,23}, {5,23}, {5,14}, {15,24}, {6,24}, {6,15}, {7,16}, {7,19}, {13,21},
+    {15,23}, {7,13}, {7,15}, {1,9}, {3,11}, {5,17}, {11,17}, {9,17}, {4,10},
+    {6,12}, {7,14}, {4,6}, {4,7}, {12,14}, {10,14}, {6,7}, {10,12}, {6,10},
+    {6,17}, {12,17}, {7,17}, {7,10}, {12,18}, {7,12}, {10,18}, {12,20},
+    {10,20}, {10,12}
+  };
+
+  for(int k=0; k<99; k++)
+    order(p + net[k][0], p + net[k][1]);
+  return(p[12]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+CosmicRays::CosmicRays() : frame(0), calib(0), gain(0), rn2(0), bkgNoise(0),
+    w(0), h(0), bandRows(0), hits(0), iter(0), img(0), s(0), sp(0), cand(0),
+    grown(0), hit(0), size(0)
+{
+  memset(&pars, 0, sizeof(pars));
+}
+
+/*---------------------------------------------------------------------------*/
+
+CosmicRays::~CosmicRays()
+{
+  delete [] img;
+  delete [] s;
+  delete [] sp;
+  delete [] cand;
+  delete [] grown;
+  delete [] hit;
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+CosmicRays::find(Frame* f, const Calibrator* c, const CosmicPars* p,
+		 bool clean, WorkerPool* pool)
+{
+  const float* off;
+  pixel_t* row;
+  long v;
+  int y, d, src, n;
+
+  frame = f;
+  calib = c;
+  pars  = *p;
+  w     = frame->width();
+  h     = frame->height();
+  hits  = 0;
+  iter  = 0;
+  bandRows = (h + BANDS - 1) / BANDS;
+
+  if(w * h > size) {
+    delete [] img;
+    delete [] s;
+    delete [] sp;
+    delete [] cand;
+    delete [] grown;
+    delete [] hit;
+    size  = w * h;
+    img   = new float[size];
+    s     = new float[size];
+    sp    = new float[size];
+    cand  = new unsigned char[size];
+    grown = new unsigned char[size];
+    hit   = new unsigned char[size];
+  }
+
+  run(pool, LOAD);
+
+  // rows never received take the nearest one received,
+  // so that their edges do not look like hits
+
+  for(y=0; y<h; y++) {
+    if(frame->hasRow(y))
+      continue;
+    for(d=1, src=-1; src == -1 && (y-d >= 0 || y+d < h); d++)
+      if(y-d >= 0 && frame->hasRow(y-d))
+	src = y-d;
+      else if(y+d < h && frame->hasRow(y+d))
+	src = y+d;
+    if(src == -1)		// nothing received at all
+      return(0);
+    memcpy(img + y*w, img + src*w, w * sizeof(float));
+  }
+
+  gain     = (pars.gain > 0) ? pars.gain : 0;
+  rn2      = (gain > 0) ? (pars.rdnoise / gain) * (pars.rdnoise / gain) : 0;
+  bkgNoise = (gain > 0) ? 0 : background();
+
+  // every iteration searches the image cleaned by the previous one
+
+  while(iter < pars.iterations) {
+    run(pool, LAPLACE);
+    run(pool, SHARP);
+    run(pool, CANDIDATES);
+    run(pool, GROW);
+    run(pool, NEIGHBOURS);
+    iter++;
+
+    for(n=0, d=0; d<BANDS; d++)
+      n += found[d];
+    if(n == 0)
+      break;
+    hits += n;
+    run(pool, CLEAN);
+  }
+
+  if(!clean || hits == 0)
+    return(hits);
+
+  // the offset plane added back, rounded to the nearest ADU
+
+  for(y=0; y<h; y++) {
+    if(!frame->hasRow(y))
+      continue;
+    row = frame->row(y);
+    off = (calib) ? calib->offset(y) : 0;
+    for(int x=0; x<w; x++) {
+      if(!hit[y*w + x])
+	continue;
+      v = lrintf(img[y*w + x] + ((off) ? off[x] : 0));
+      row[x] = STATIC_CAST(pixel_t, (v < -32768) ? -32768 : (v > 32767) ? 32767 : v);
+    }
+  }
+  return(hits);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+CosmicRays::stamp(FITSHeader* header, int mode) const
+{
+  header->set("COSMIC", (mode == COSMIC_CLEAN) ? "cleaned" : "flagged in CRMASK",
+	      "cosmic ray hits, L.A.Cosmic");
+  header->set("CRPIXELS", hits, "pixels hit by cosmic rays");
+  header->set("CRITER", iter, "cosmic ray search iterations");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+CosmicRays::output(SavedImage* image, FITSHeader* header)
+{
+  const SavedGeom* g = image->geometry();
+  const unsigned char* m;
+  unsigned char* buf;
+  unsigned char* dst;
+  off_t size;
+  FITSHeader ext;
+  int ox;
+
+  // flipped, cropped and binned, a binned pixel being hit 
+  // if any of its pixels is
+
+  size = STATIC_CAST(off_t, g->width) * g->height;
+  size = ((size + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ)
+    * FITSHeader::RECORDSZ;
+  buf = new unsigned char[size];
+  memset(buf, 0, size);
+
+  for(int oy=0; oy<g->height; oy++) {
+    dst = buf + ((g->flipUD) ? g->height-1-oy : oy) * g->width;
+    for(int j=0; j<g->binY; j++) {
+      m = mask(g->y + oy*g->binY + j) + g->x;
+      for(int x=0; x<g->width*g->binX; x++) {
+	if(!m[x])
+	  continue;
+	ox = x / g->binX;
+	dst[(g->flipLR) ? g->width-1-ox : ox] = 1;
+      }
+    }
+  }
+
+  ext.set("BITPIX", 8, "1 if hit by a cosmic ray, else 0");
+  ext.set("NAXIS1", g->width, "columns");
+  ext.set("NAXIS2", g->height, "rows");
+  ext.toExtension();
+  ext.set("EXTNAME", "CRMASK", "cosmic ray hits");
+  image->append(header, &ext, buf, size);
+  delete [] buf;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+CosmicRays::run(WorkerPool* pool, int which)
+{
+  for(int b=0; b<BANDS; b++)
+    pool->submit(CosmicRays::passJob, this, which, b);
+  pool->wait();
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+CosmicRays::passJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(CosmicRays*, ctx)->pass(a, b);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+CosmicRays::pass(int which, int band)
+{
+  float low = pars.sigfrac * pars.sigclip;
+  const float *up, *p, *down, *off;
+  const pixel_t* src;
+  float v2, l;
+  int y0, y1, i, xl, xr, n = 0;
+
+  y0 = band * bandRows;
+  y1 = (y0 + bandRows < h) ? y0 + bandRows : h;
+
+  for(int y=y0; y<y1; y++) {
+    i = y * w;
+
+    switch(which) {
+
+    case LOAD:
+      memset(hit + i, 0, w);
+      if(!frame->hasRow(y))
+	break;
+      src = frame->row(y);
+      off = (calib) ? calib->offset(y) : 0;
+      for(int x=0; x<w; x++)
+	img[i+x] = src[x] - ((off) ? off[x] : 0);
+      break;
+
+    case LAPLACE:
+
+      // each pixel is four subpixels in the 2x subsampled image,
+      // whose Laplacian is clipped to positive and binned back
+
+      up   = img + ((y > 0) ? y-1 : 0) * w;
+      p    = img + i;
+      down = img + ((y < h-1) ? y+1 : h-1) * w;
+      for(int x=0; x<w; x++) {
+	hit[i+x] &= ~NEW;
+	xl = (x > 0) ? x-1 : 0;
+	xr = (x < w-1) ? x+1 : w-1;
+	v2 = 2 * p[x];
+	l  = positive(v2 - up[x] - p[xl]) + positive(v2 - up[x] - p[xr]) +
+	  positive(v2 - down[x] - p[xl]) + positive(v2 - down[x] - p[xr]);
+	s[i+x] = (l > 0) ? (l / 4) / (2 * noise(median(img, x, y, 2))) : 0;
+      }
+      break;
+
+    case SHARP:
+
+      // the median is never negative, so nothing below 'low' 
+      // can come above it
+
+      for(int x=0; x<w; x++)
+	sp[i+x] = (s[i+x] > low) ? s[i+x] - median(s, x, y, 2) : 0;
+      break;
+
+    case CANDIDATES:
+      for(int x=0; x<w; x++)
+	cand[i+x] = sp[i+x] > pars.sigclip && sp[i+x] / fine(x, y) > pars.objlim;
+      break;
+
+    case GROW:
+      for(int x=0; x<w; x++)
+	grown[i+x] = sp[i+x] > pars.sigclip && near(cand, x, y);
+      break;
+
+    case NEIGHBOURS:
+      if(!frame->hasRow(y))
+	break;
+      for(int x=0; x<w; x++)
+	if(!hit[i+x] && sp[i+x] > low && near(grown, x, y)) {
+	  hit[i+x] = HIT | NEW;
+	  n++;
+	}
+      break;
+
+    case CLEAN:
+
+      // only unflagged pixels are read, and only new hits written,
+      // so bands do not step on each other
+
+      for(int x=0; x<w; x++)
+	if(hit[i+x] & NEW)
+	  replace(x, y);
+      break;
+    }
+  }
+
+  if(which == NEIGHBOURS)
+    found[band] = n;
+}
+
+/*---------------------------------------------------------------------------*/
+
+float
+CosmicRays::noise(float m) const
+{
+  float n2;
+
+  // never below the quantization noise
+
+  if(gain == 0)
+    return(bkgNoise);
+  n2 = positive(m) / gain + rn2;
+  return(sqrtf((n2 > QNOISE2) ? n2 : QNOISE2));
+}
+
+/*---------------------------------------------------------------------------*/
+
+float
+CosmicRays::median(const float* plane, int x, int y, int r) const
+{
+  float buf[81];
+  const float* p;
+  int n = 0;
+
+  // edges replicated
+
+  for(int j=y-r; j<=y+r; j++) {
+    p = plane + ((j < 0) ? 0 : (j >= h) ? h-1 : j) * w;
+    for(int i=x-r; i<=x+r; i++)
+      buf[n++] = p[(i < 0) ? 0 : (i >= w) ? w-1 : i];
+  }
+  if(n == 9)
+    return(median9(buf));
+  if(n == 25)
+    return(median25(buf));
+  std::nth_element(buf, buf + n/2, buf + n);
+  return(buf[n/2]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+float
+CosmicRays::fine(int x, int y) const
+{
+  float m3[49];
+  float f, m37;
+  int n = 0;
+
+  // 3x3 median less the 7x7 median of the 3x3 medians
+
+  for(int j=-3; j<=3; j++)
+    for(int i=-3; i<=3; i++)
+      m3[n++] = median(img, x+i, y+j, 1);
+  std::nth_element(m3, m3 + n/2, m3 + n);
+  m37 = m3[n/2];
+
+  f = (median(img, x, y, 1) - m37) / noise(median(img, x, y, 2));
+  return((f > FINEMIN) ? f : FINEMIN);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+CosmicRays::near(const unsigned char* plane, int x, int y) const
+{
+  int x0 = (x > 0) ? x-1 : 0;
+  int x1 = (x < w-1) ? x+1 : w-1;
+  int y0 = (y > 0) ? y-1 : 0;
+  int y1 = (y < h-1) ? y+1 : h-1;
+
+  for(int j=y0; j<=y1; j++)
+    for(int i=x0; i<=x1; i++)
+      if(plane[j*w + i])
+	return(true);
+  return(false);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+CosmicRays::replace(int x, int y)
+{
+  float buf[81];
+  int n;
+
+  // widened up to 9x9 if the 5x5 box is all hits
+
+  for(int r=2; r<=4; r++) {
+    n = 0;
+    for(int j=y-r; j<=y+r; j++) {
+      if(j < 0 || j >= h)
+	continue;
+      for(int i=x-r; i<=x+r; i++)
+	if(i >= 0 && i < w && !hit[j*w + i])
+	  buf[n++] = img[j*w + i];
+    }
+    if(n > 0) {
+      std::nth_element(buf, buf + n/2, buf + n);
+      img[y*w + x] = buf[n/2];
+      return;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+float
+CosmicRays::background() const
+{
+  int step = (w * h) / SAMPLES + 1;
+  float* v = new float[(w * h) / step + 1];
+  float med, mad, n2;
+  int n = 0;
+
+  // median absolute deviation of a sample of the image
+
+  for(int i=0; i<w*h; i+=step)
+    v[n++] = img[i];
+  std::nth_element(v, v + n/2, v + n);
+  med = v[n/2];
+  for(int i=0; i<n; i++)
+    v[i] = fabsf(v[i] - med);
+  std::nth_element(v, v + n/2, v + n);
+  mad = v[n/2];
+  delete [] v;
+
+  n2 = (MADSIGMA * mad) * (MADSIGMA * mad);
+  return(sqrtf((n2 > QNOISE2) ? n2 : QNOISE2));
+}
+
+/*---------------------------------------------------------------------------*/
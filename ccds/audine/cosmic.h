@@ -0,0 +1,148 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_COSMIC_H
+#define AUDINE_COSMIC_H
+
+#include "sidefile.h"
+
+/* cosmic ray rejection of object images */
+
+#define COSMIC_NONE  0		/* saved as read */
+#define COSMIC_CLEAN 1		/* hits replaced by their neighbourhood */
+#define COSMIC_MASK  2		/* hits flagged in a CRMASK extension */
+
+/* detection parameters, as in L.A.Cosmic */
+
+struct CosmicPars {
+  int iterations;		/* detection & cleaning passes at most */
+  double sigclip;		/* detection limit [sigma] */
+  double sigfrac;		/* neighbours limit, fraction of sigclip */
+  double objlim;		/* contrast limit against stars */
+  double gain;			/* [e-/ADU], 0 if unknown */
+  double rdnoise;		/* readout noise [e-] */
+};
+
+class Calibrator;
+class FITSHeader;
+class Frame;
+class WorkerPool;
+
+/*
+ * Cosmic ray hits detection by Laplacian edge detection 
+ * (van Dokkum 2001, L.A.Cosmic) on complete frames.
+ * Hits have sharper edges than anything the optics can deliver:
+ * the Laplacian of the 2x subsampled image, over the expected noise,
+ * singles them out, and a fine structure image (median filters of
+ * 3 and 7 pixels) tells them apart from the cores of undersampled 
+ * stars. Hits are grown to their 8 neighbours above a lower limit,
+ * replaced by the median of their 5x5 unflagged neighbours and the 
+ * search is run again on the cleaned image, until no new hit is found.
+ * Noise is the Poisson noise of the median filtered image plus the
+ * readout noise, so images should be bias subtracted (calibrated or
+ * overscan subtracted). If the gain is unknown, a constant background
+ * noise is measured instead.
+ * Every pass goes through the image in horizontal bands run in
+ * parallel by the worker pool, each band reading only what the 
+ * previous passes have left.
+ * The hits may be saved as a mask extension of the image.
+ */
+
+class CosmicRays : public SideOutput {
+
+ public:
+
+  static const int BANDS = 32;	/* parallel jobs per pass */
+
+  CosmicRays();
+ ~CosmicRays();
+
+  /* finds the hits of a complete frame, less the 'calib' offset plane */
+  /* (bias + dark) if not NULL. Hits are replaced in the frame if 'clean' */
+  /* Rows never received are left alone. Returns the pixels hit */
+  int find(Frame* frame, const Calibrator* calib, const CosmicPars* pars,
+	   bool clean, WorkerPool* pool);
+
+  /* hits of row 'y' of the last frame, non zero if hit */
+  const unsigned char* mask(int y) const { return(hit + y*w); }
+
+  /* adds the hits found and how, mode being one of COSMIC_xxx */
+  void stamp(FITSHeader* header, int mode) const;
+
+  /* appends the hits of the last frame to the image saved from it */
+  /* as a CRMASK IMAGE extension, laid out as the image */
+  void output(SavedImage* image, FITSHeader* header);
+
+ private:
+
+  /* passes through the image */
+  enum { LOAD, LAPLACE, SHARP, CANDIDATES, GROW, NEIGHBOURS, CLEAN };
+
+  Frame* frame;			/* frame being cleaned */
+  const Calibrator* calib;	/* its offset plane, NULL if none */
+  CosmicPars pars;		/* parameters in use */
+  float gain;			/* [e-/ADU] */
+  float rn2;			/* readout noise squared [ADU^2] */
+  float bkgNoise;		/* constant noise if the gain is unknown [ADU] */
+  int w;			/* frame size */
+  int h;
+  int bandRows;			/* rows per band */
+  int hits;			/* pixels hit so far */
+  int iter;			/* iterations run */
+  int found[BANDS];		/* new hits per band */
+
+  /* work planes */
+  float* img;			/* frame less offset, cleaned as hits are found */
+  float* s;			/* Laplacian over noise */
+  float* sp;			/* same less its large scale structure */
+  unsigned char* cand;		/* hits above sigclip */
+  unsigned char* grown;		/* their neighbours above sigclip */
+  unsigned char* hit;		/* all hits, NEW if found in this iteration */
+  int size;			/* capacity of the planes in pixels */
+
+  /* runs a pass over the whole image with the worker pool */
+  void run(WorkerPool* pool, int pass);
+
+  /* runs a pass over a band. Runs in the worker pool */
+  static void passJob(void* ctx, int a, int b);
+  void pass(int which, int band);
+
+  /* noise of a pixel whose median filtered value is 'm' [ADU] */
+  float noise(float m) const;
+
+  /* median of the (2r+1)x(2r+1) pixels of 'plane' around (x,y) */
+  float median(const float* plane, int x, int y, int r) const;
+
+  /* fine structure contrast at (x,y) */
+  float fine(int x, int y) const;
+
+  /* true if any of the 3x3 flags of 'plane' around (x,y) is set */
+  bool near(const unsigned char* plane, int x, int y) const;
+
+  /* replaces a hit at (x,y) by its unflagged neighbourhood */
+  void replace(int x, int y);
+
+  /* background noise of the whole image [ADU] */
+  float background() const;
+};
+
+#endif
@@ -0,0 +1,593 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "defects.h"
+#include "fitshead.h"
+#include "fitsread.h"
+
+#define KAPPA_PIXEL  10.0f	/* pixel defect threshold in sigmas */
+#define KAPPA_COLUMN  5.0f	/* column defect threshold in sigmas */
+#define HALFWIN  8		/* columns at each side a column is compared to */
+#define BAND     32		/* rows of a column compared at once */
+#define MAXBAD   100		/* more than 1/MAXBAD of the pixels: not a master */
+#define SAMPLES  65536		/* pixels sampled for the master noise */
+
+/*---------------------------------------------------------------------------*/
+
+static float
+median(float* v, int n)
+{
+  std::nth_element(v, v + n/2, v + n);
+  return(v[n/2]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// median of a few neighbours, the mean of the middle two if even
+
+static float
+middle(float* v, int n)
+{
+  std::sort(v, v + n);
+  return((n & 1) ? v[n/2] : 0.5f * (v[n/2 - 1] + v[n/2]));
+}
+
+/*---------------------------------------------------------------------------*/
+
+// median and sigma of a sample. Integer masters have a quantized
+// median absolute deviation, so sigma is the standard deviation of
+// the values within five of them
+
+static void
+robust(const float* pix, int n, float* med, float* sigma)
+{
+  int step = (n > SAMPLES) ? n / SAMPLES : 1;
+  float* v = new float[n / step + 1];
+  float* d = new float[n / step + 1];
+  double sum = 0, sum2 = 0;
+  float lim;
+  int m = 0, k = 0;
+
+  for(int i=0; i<n; i+=step)
+    v[m++] = pix[i];
+  *med = median(v, m);
+  for(int i=0; i<m; i++)
+    d[i] = fabsf(v[i] - *med);
+  lim = 5 * std::max(1.4826f * median(d, m), 0.5f);
+
+  for(int i=0; i<m; i++)
+    if(fabsf(v[i] - *med) <= lim) {
+      sum  += v[i];
+      sum2 += v[i] * v[i];
+      k++;
+    }
+  *sigma = STATIC_CAST(float, sqrt(std::max(sum2/k - (sum/k)*(sum/k), 0.0)));
+  delete [] v;
+  delete [] d;
+}
+
+/*---------------------------------------------------------------------------*/
+
+// marks the defects of a master in 'bad', which may have some already.
+// Columns are compared band by band, by their median to that of the
+// columns around, so that those going bad from some row on are found.
+// Pixels are compared to the median of three good neighbours at each
+// side along the row, enough for small clusters not to hide themselves.
+// Returns the defects marked, -1 if too many
+
+static int
+find(const float* pix, int w, int h, unsigned char* bad)
+{
+  float* colmed = new float[w];
+  float* resid  = new float[w];
+  float* tmp    = new float[std::max(BAND, 2*HALFWIN)];
+  const float* p;
+  float level, sigma, clevel, csigma, v[6];
+  int k, n, total = 0;
+
+  robust(pix, w*h, &level, &sigma);
+  if(sigma <= 0)		// a synthetic master, maybe
+    sigma = 0.5f;
+
+  for(int y0=0; y0<h; y0+=BAND) {
+    n = std::min(BAND, h - y0);
+    for(int x=0; x<w; x++) {
+      for(int y=0; y<n; y++)
+	tmp[y] = pix[(y0+y)*w + x];
+      colmed[x] = median(tmp, n);
+    }
+    for(int x=0; x<w; x++) {
+      k = 0;
+      for(int i=x-HALFWIN; i<=x+HALFWIN; i++)
+	if(i != x && i >= 0 && i < w)
+	  tmp[k++] = colmed[i];
+      resid[x] = (k) ? colmed[x] - median(tmp, k) : 0;
+    }
+
+    // the median of a band is far less noisy than a pixel
+
+    robust(resid, w, &clevel, &csigma);
+    csigma = std::max(csigma, sigma / sqrtf(n));
+    for(int x=0; x<w; x++)
+      if(fabsf(resid[x] - clevel) > KAPPA_COLUMN * csigma)
+	for(int y=y0; y<y0+n; y++)
+	  bad[y*w + x] = 1;
+  }
+
+  for(int y=0; y<h; y++) {
+    p = pix + y*w;
+    for(int x=0; x<w; x++) {
+      if(bad[y*w + x])
+	continue;
+      k = 0;
+      for(int i=x-3; i<=x+3; i++)
+	if(i != x && i >= 0 && i < w && !bad[y*w + i])
+	  v[k++] = p[i];
+      if(k && fabsf(p[x] - middle(v, k)) > KAPPA_PIXEL * sigma)
+	bad[y*w + x] = 1;
+    }
+  }
+
+  for(int i=0; i<w*h; i++)
+    total += bad[i];
+
+  delete [] colmed;
+  delete [] resid;
+  delete [] tmp;
+  return((total > w*h / MAXBAD) ? -1 : total);
+}
+
+/*---------------------------------------------------------------------------*/
+
+DefectMap::DefectMap() : mtime(0), bin(0), x(0), y(0), width(0), height(0),
+    runs(0), nruns(0), maxRuns(0), indexed(false), w(0), h(0),
+    rowStart(0), rowEnd(0), maxRows(0), segs(0), maxSegs(0)
+{
+  path[0]  = 0;
+  model[0] = 0;
+  memset(&imageKey, 0, sizeof(imageKey));
+}
+
+/*---------------------------------------------------------------------------*/
+
+DefectMap::~DefectMap()
+{
+  delete [] runs;
+  delete [] rowStart;
+  delete [] rowEnd;
+  delete [] segs;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DefectMap::add(int rx, int ry, int n, bool column)
+{
+  Run* bigger;
+
+  if(nruns == maxRuns) {
+    maxRuns = (maxRuns) ? 2*maxRuns : 256;
+    bigger  = new Run[maxRuns];
+    if(nruns)
+      memcpy(bigger, runs, nruns * sizeof(Run));
+    delete [] runs;
+    runs = bigger;
+  }
+  runs[nruns].x = rx;
+  runs[nruns].y = ry;
+  runs[nruns].n = n;
+  runs[nruns].column = column;
+  nruns++;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+DefectMap::load(const char* file)
+{
+  char line[128];
+  char kind;
+  int rx, ry, n, flipLR = 0, flipUD = 0;
+  bool area = false;
+  Run* r;
+  FILE* f;
+
+  f = fopen(file, "r");
+  if(f == NULL)
+    return(false);
+
+  nruns    = 0;
+  model[0] = 0;
+  bin      = 0;
+  while(fgets(line, sizeof(line), f)) {
+    if(sscanf(line, "MODEL %31s", model) == 1 || sscanf(line, "BINNING %d", &bin) == 1)
+      continue;
+    if(sscanf(line, "AREA %d %d %d %d", &x, &y, &width, &height) == 4) {
+      area = true;
+      continue;
+    }
+    if(sscanf(line, "FLIP %d %d", &flipLR, &flipUD) == 2)
+      continue;
+    if(sscanf(line, " %c %d %d %d", &kind, &rx, &ry, &n) != 4 || n <= 0)
+      continue;		// comments & blank lines
+    if(kind == 'C' || kind == 'R')
+      add(rx, ry, n, kind == 'C');
+  }
+  fclose(f);
+
+  // in readout orientation, whatever the map was written in
+
+  for(int i=0; i<nruns; i++) {
+    r = &runs[i];
+    if(flipLR)
+      r->x = (r->column) ? width-1 - r->x : width - r->x - r->n;
+    if(flipUD)
+      r->y = (r->column) ? height - r->y - r->n : height-1 - r->y;
+  }
+  return(area && width > 0 && height > 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+DefectMap::save(const char* file) const
+{
+  char tmp[sizeof(path) + 8];
+  bool ok;
+  FILE* f;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  f = fopen(tmp, "w");
+  if(f == NULL)
+    return(false);
+
+  fprintf(f, "# defect map: C x y n = column x from row y, "
+	  "R x y n = row y from column x\n");
+  fprintf(f, "MODEL %s\nBINNING %d\nAREA %d %d %d %d\nFLIP 0 0\n", 
+	  model, bin, x, y, width, height);
+  for(int i=0; i<nruns; i++)
+    fprintf(f, "%c %d %d %d\n", (runs[i].column) ? 'C' : 'R', 
+	    runs[i].x, runs[i].y, runs[i].n);
+
+  ok = !ferror(f);
+  ok = (fclose(f) == 0) && ok;
+  if(ok && rename(tmp, file) == -1)
+    ok = false;
+  if(!ok)
+    unlink(tmp);
+  return(ok);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DefectMap::paint(unsigned char* bad) const
+{
+  const Run* r;
+
+  for(int i=0; i<nruns; i++) {
+    r = &runs[i];
+    for(int k=0; k<r->n; k++) {
+      int px = (r->column) ? r->x : r->x + k;
+      int py = (r->column) ? r->y + k : r->y;
+      if(px >= 0 && px < width && py >= 0 && py < height)
+	bad[py*width + px] = 1;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DefectMap::encode(unsigned char* bad)
+{
+  int n;
+
+  nruns = 0;
+  for(int px=0; px<width; px++)
+    for(int py=0; py<height; py+=n) {
+      for(n=0; py+n<height && bad[(py+n)*width + px]; n++)
+	;
+      if(n >= MINCOLUMN) {
+	add(px, py, n, true);
+	for(int k=0; k<n; k++)
+	  bad[(py+k)*width + px] = 0;
+      }
+      n = (n) ? n : 1;
+    }
+
+  for(int py=0; py<height; py++)
+    for(int px=0; px<width; px+=n) {
+      for(n=0; px+n<width && bad[py*width + px+n]; n++)
+	bad[py*width + px+n] = 0;
+      if(n)
+	add(px, py, n, false);
+      n = (n) ? n : 1;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DefectMap::index(const CalibKey* key)
+{
+  const Run* r;
+  int dx, dy, x1, x2, y1, y2, total, m;
+
+  // map pixels in image coordinates
+
+  dx = x - key->x;
+  dy = y - key->y;
+  w  = key->width;
+  h  = key->height;
+  if(h > maxRows) {
+    delete [] rowStart;
+    delete [] rowEnd;
+    maxRows  = h;
+    rowStart = new int[maxRows];
+    rowEnd   = new int[maxRows];
+  }
+
+  // segments counted per row first, then filled
+
+  memset(rowEnd, 0, h * sizeof(int));
+  for(int pass=0; pass<2; pass++) {
+    for(int i=0; i<nruns; i++) {
+      r = &runs[i];
+      if(r->column) {
+	x1 = r->x + dx;
+	x2 = x1 + 1;
+	y1 = std::max(r->y + dy, 0);
+	y2 = std::min(r->y + dy + r->n, h);
+      } else {
+	x1 = std::max(r->x + dx, 0);
+	x2 = std::min(r->x + dx + r->n, w);
+	y1 = r->y + dy;
+	y2 = y1 + 1;
+      }
+      if(x1 < 0 || x2 > w || x1 >= x2 || y1 < 0 || y2 > h)
+	continue;
+      for(int py=y1; py<y2; py++) {
+	if(pass) {
+	  segs[rowEnd[py]].x1 = x1;
+	  segs[rowEnd[py]].x2 = x2;
+	}
+	rowEnd[py]++;
+      }
+    }
+    if(pass)
+      break;
+
+    total = 0;
+    for(int py=0; py<h; py++) {
+      rowStart[py] = total;
+      total += rowEnd[py];
+      rowEnd[py] = rowStart[py];
+    }
+    if(total > maxSegs) {
+      delete [] segs;
+      maxSegs = total;
+      segs    = new Segment[maxSegs];
+    }
+  }
+
+  // sorted along each row, overlapping & adjacent ones merged
+
+  for(int py=0; py<h; py++) {
+    if(rowEnd[py] == rowStart[py])
+      continue;
+    std::sort(segs + rowStart[py], segs + rowEnd[py]);
+    m = rowStart[py];
+    for(int i=rowStart[py]+1; i<rowEnd[py]; i++) {
+      if(segs[i].x1 <= segs[m].x2)
+	segs[m].x2 = std::max(segs[m].x2, segs[i].x2);
+      else
+	segs[++m] = segs[i];
+    }
+    rowEnd[py] = m + 1;
+  }
+
+  imageKey = *key;
+  indexed  = true;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+DefectMap::select(const char* dir, const CalibKey* key)
+{
+  char file[sizeof(path)];
+  struct stat st;
+
+  snprintf(file, sizeof(file), "%s/defects_%s_b%d.map", dir, key->model, key->bin);
+  if(stat(file, &st) == -1) {
+    path[0] = 0;
+    return(false);
+  }
+
+  if(strcmp(file, path) || st.st_mtime != mtime) {
+    indexed = false;
+    if(!load(file) || strcmp(model, key->model) || bin != key->bin) {
+      path[0] = 0;
+      return(false);
+    }
+    strcpy(path, file);
+    mtime = st.st_mtime;
+  }
+
+  // as a master frame, a map serves any image inside its area
+
+  if(key->x < x || key->y < y || key->x + key->width > x + width ||
+     key->y + key->height > y + height)
+    return(false);
+
+  if(!indexed || key->x != imageKey.x || key->y != imageKey.y || 
+     key->width != imageKey.width || key->height != imageKey.height)
+    index(key);
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+DefectMap::repair(pixel_t* row, int py, const float* offset) const
+{
+  const Segment* s;
+  float v[4], med;
+  int left, right, k, val, n = 0;
+
+  if(py < 0 || py >= h)
+    return(0);
+
+  for(int i=rowStart[py]; i<rowEnd[py]; i++) {
+    s = &segs[i];
+
+    // good pixels lie between the previous and next segments
+
+    left  = (i > rowStart[py]) ? segs[i-1].x2 : 0;
+    right = (i+1 < rowEnd[py]) ? segs[i+1].x1 : w;
+    k = 0;
+    for(int px=s->x1-1; px>=left && px>=s->x1-2; px--)
+      v[k++] = row[px] - ((offset) ? offset[px] : 0);
+    for(int px=s->x2; px<right && px<s->x2+2; px++)
+      v[k++] = row[px] - ((offset) ? offset[px] : 0);
+    if(k == 0)			// nothing to take from
+      continue;
+
+    med = middle(v, k);
+    for(int px=s->x1; px<s->x2; px++) {
+      val = STATIC_CAST(int, lrintf(med + ((offset) ? offset[px] : 0)));
+      row[px] = STATIC_CAST(pixel_t, (val < -32768) ? -32768 : (val > 32767) ? 32767 : val);
+    }
+    n += s->x2 - s->x1;
+  }
+  return(n);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DefectMap::stamp(FITSHeader* header, int repaired) const
+{
+  char buf[FITSHeader::STRINGSZ+1];
+  const char* name = strrchr(path, '/');
+
+  name = (name) ? name + 1 : path;
+  if(snprintf(buf, sizeof(buf), "Bad pixels fixed with %s", name) >= 
+     STATIC_CAST(int, sizeof(buf)))
+    header->set("FIXPIX", name, "cosmetic correction, map"); // a long name goes alone
+  else
+    header->set("FIXPIX", buf, "cosmetic correction");
+  header->set("NFIXPIX", repaired, "pixels repaired");
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+DefectMap::build(const char* dir, const char* master)
+{
+  DefectMap map;
+  FITSImage img;
+  char file[sizeof(map.path)];
+  unsigned char* raw;
+  unsigned char* bad;
+  float* pix;
+  size_t n, bytes, x, y;
+  unsigned int u;
+  float f;
+  int fd, runs = -1;
+
+  fd = ::open(master, O_RDONLY);
+  if(fd == -1)
+    return(-1);
+  if(!FITSReader::read(fd, 0, &img) || img.naxis != 2 || !img.model[0] ||
+     (img.bitpix != 16 && img.bitpix != -32)) {
+    ::close(fd);
+    return(-1);
+  }
+
+  n     = STATIC_CAST(size_t, img.width) * img.height;
+  bytes = FITSReader::dataSize(&img);
+  raw   = new unsigned char[bytes];
+  if(pread(fd, raw, bytes, img.data) != STATIC_CAST(ssize_t, bytes)) {
+    delete [] raw;
+    ::close(fd);
+    return(-1);
+  }
+  ::close(fd);
+
+  // big endian, BSCALE & BZERO applied and in readout 
+  // orientation as in Calibrator::load()
+
+  pix = new float[n];
+  for(size_t i=0; i<n; i++) {
+    if(img.bitpix == 16)
+      f = STATIC_CAST(short, (raw[2*i] << 8) | raw[2*i+1]);
+    else {
+      u = (raw[4*i] << 24) | (raw[4*i+1] << 16) | (raw[4*i+2] << 8) | raw[4*i+3];
+      memcpy(&f, &u, sizeof(f));
+    }
+    x = i % img.width;
+    y = i / img.width;
+    x = (img.flipLR) ? img.width-1 - x : x;
+    y = (img.flipUD) ? img.height-1 - y : y;
+    pix[y * img.width + x] = f * img.bscale + img.bzero;
+  }
+  delete [] raw;
+
+  // defects already known are kept, unless the area changed
+
+  bad = new unsigned char[n];
+  memset(bad, 0, n);
+  snprintf(file, sizeof(file), "%s/defects_%s_b%d.map", dir, img.model, img.bin);
+  if(map.load(file) && map.x == img.x && map.y == img.y && 
+     map.width == img.width && map.height == img.height)
+    map.paint(bad);
+
+  if(find(pix, img.width, img.height, bad) >= 0) {
+    snprintf(map.model, sizeof(map.model), "%s", img.model);
+    map.bin    = img.bin;
+    map.x      = img.x;
+    map.y      = img.y;
+    map.width  = img.width;
+    map.height = img.height;
+    map.encode(bad);
+    if(map.save(file))
+      runs = map.nruns;
+  }
+
+  delete [] pix;
+  delete [] bad;
+  return(runs);
+}
@@ -0,0 +1,138 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_DEFECTS_H
+#define AUDINE_DEFECTS_H
+
+#include <time.h>
+
+#include "calib.h"
+
+class FITSHeader;
+
+/*
+ * Cosmetic correction of the known defects of a chip: hot or dead
+ * pixels and bad columns. There is one defect map per CCD model and
+ * binning, found in the master frames directory as
+ * defects_<model>_b<binning>.map. It is a text file of runs in the
+ * master area, so that it can be read and edited by hand:
+ *
+ *   MODEL KAF0400
+ *   BINNING 1
+ *   AREA 0 0 768 512        origin & size, binned pixels
+ *   FLIP 0 0                runs given left to right, top to bottom
+ *   C 123 40 472            column 123, 472 rows from row 40
+ *   R 45 67 2               row 67, 2 columns from column 45
+ *
+ * Runs are in readout orientation, as the rows repaired. A map given
+ * flipped (FLIP 1 1 for columns right to left, rows bottom to top),
+ * as an image saved with STORAGE_FLIP, is turned back when loaded.
+ * Maps are built from every bias or dark master combined, read back
+ * in readout orientation (FLIPLR, FLIPUD), merged with the defects 
+ * already known. Images are repaired row by row as they
+ * arrive: every defect takes the median of the two nearest good pixels
+ * at each side along its row, the only neighbours sure to be there.
+ */
+
+class DefectMap {
+
+ public:
+
+  static const int MINCOLUMN = 8; /* shortest run coded along a column */
+
+  DefectMap();
+ ~DefectMap();
+
+  /* selects the map in 'dir' covering an image. false if none */
+  bool select(const char* dir, const CalibKey* key);
+
+  /* repairs the defects of row 'y' of the selected image in place */
+  /* neighbours compared less 'offset' (bias + dark) if not NULL */
+  /* returns the pixels repaired */
+  int repair(pixel_t* row, int y, const float* offset) const;
+
+  /* adds the IRAF FIXPIX card and the pixels repaired */
+  void stamp(FITSHeader* header, int repaired) const;
+
+  /* finds the defects of a bias or dark master and merges them */
+  /* into the map of its chip in 'dir'. Returns its runs, -1 on error */
+  static int build(const char* dir, const char* master);
+
+ private:
+
+  struct Run {
+    int x;			/* first pixel */
+    int y;
+    int n;			/* length */
+    bool column;		/* along a column, else along a row */
+  };
+
+  struct Segment {		/* defects of an image row */
+    int x1;			/* [x1, x2) */
+    int x2;
+    bool operator<(const Segment& s) const { return(x1 < s.x1); }
+  };
+
+  /* the map file */
+  char path[256];		/* map loaded, empty if none */
+  time_t mtime;			/* its modification time */
+  char model[32];		/* CCD model */
+  int bin;			/* binning factor */
+  int x;			/* area origin, binned pixels */
+  int y;
+  int width;			/* area size */
+  int height;
+  Run* runs;
+  int nruns;
+  int maxRuns;			/* capacity of runs[] */
+
+  /* the map as seen by the selected image */
+  CalibKey imageKey;		/* image the index was made for */
+  bool indexed;			/* index valid */
+  int w;			/* image size */
+  int h;
+  int* rowStart;		/* segments of row y: [rowStart[y], rowEnd[y]) */
+  int* rowEnd;
+  int maxRows;			/* capacity of rowStart[] & rowEnd[] */
+  Segment* segs;
+  int maxSegs;			/* capacity of segs[] */
+
+  /* reads a map file. false if unreadable */
+  bool load(const char* file);
+
+  /* writes the map under a temporary name, then renames it */
+  bool save(const char* file) const;
+
+  /* appends a run, growing runs[] */
+  void add(int x, int y, int n, bool column);
+
+  /* marks the defects in a 'bad' pixel mask of the map area */
+  void paint(unsigned char* bad) const;
+
+  /* codes a 'bad' pixel mask as runs, columns first. Clears the mask */
+  void encode(unsigned char* bad);
+
+  /* sorts the runs into image rows segments */
+  void index(const CalibKey* key);
+};
+
+#endif
@@ -0,0 +1,464 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "difference.h"
+#include "fitshead.h"
+#include "pixkern.h"
+#include "workpool.h"
+
+#define DEG       (M_PI / 180)
+#define REFKAPPA  3		/* pixel clipping of the reference stack [sigma] */
+#define SAMPLE    20000		/* pixels sampled for levels & noise */
+#define MADSIGMA  1.4826	/* sigma of a normal distribution from its MAD */
+#define BRIGHT    20		/* reference pixels giving the flux scale [sigma] */
+#define MINBRIGHT 50		/* fewest of them, else the scale is 1 */
+#define MISMATCH  0.5		/* fraction of a reference star left by seeing */
+#define SHARPNESS 1.5		/* peak to 3x3 flux allowed over a centred star */
+
+/*---------------------------------------------------------------------------*/
+
+// median of 'n' values, reordered
+
+static float
+median(float* v, int n)
+{
+  std::nth_element(v, v + n/2, v + n);
+  return(v[n/2]);
+}
+
+// strongest events first
+
+static bool
+stronger(const DiffEvent& a, const DiffEvent& b)
+{
+  return(fabs(a.snr) > fabs(b.snr));
+}
+
+/*---------------------------------------------------------------------------*/
+
+Differencer::Differencer() : cur(fields), clock(0), w(0), h(0), size(0),
+    img(0), ref(0), var(0), diff(0), skyImg(0), skyRef(0), sharp(1), bandRows(0), nevents(0)
+{
+  for(int i=0; i<MAXFIELDS; i++) {
+    memset(&fields[i].key, 0, sizeof(fields[i].key));
+    fields[i].used = 0;
+  }
+  memset(&pars, 0, sizeof(pars));
+  memset(&res, 0, sizeof(res));
+  memset(nfound, 0, sizeof(nfound));
+}
+
+/*---------------------------------------------------------------------------*/
+
+Differencer::~Differencer()
+{
+  delete [] img;
+  delete [] ref;
+  delete [] var;
+  delete [] diff;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Differencer::select(const DiffField* field, int width, int height, const DiffPars* p)
+{
+  StackPars sp;
+  Field* f = 0;
+
+  pars = *p;
+  for(int i=0; i<MAXFIELDS && !f; i++)
+    if(fields[i].used && same(&fields[i], field, width, height))
+      f = &fields[i];
+
+  // a new reference, in place of the one unused for the longest time
+
+  if(!f) {
+    f = fields;
+    for(int i=1; i<MAXFIELDS; i++)
+      if(fields[i].used < f->used)
+	f = &fields[i];
+    f->key = *field;
+    sp.kappa     = REFKAPPA;
+    sp.matchTol  = pars.matchTol;
+    sp.saveEvery = 0;
+    f->stack.reset(width, height, &sp);
+  }
+  f->used = ++clock;
+  cur = f;
+
+  w = width;
+  h = height;
+  bandRows = (h + BANDS - 1) / BANDS;
+  if(w * h > size) {
+    delete [] img;
+    delete [] ref;
+    delete [] var;
+    delete [] diff;
+    size = w * h;
+    img  = new float[size];
+    ref  = new float[size];
+    var  = new float[size];
+    diff = new float[size];
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Differencer::add(const double* x, const double* y, int n, double fwhm, WorkerPool* pool)
+{
+  const StackResult* sr = cur->stack.result();
+  DiffEvent* all = &found[0][0];
+  struct timespec t0, t1;
+  double f1, f3;
+  bool ok;
+  int total;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  // a gaussian star centred on a pixel has f1^2 of its flux there
+  // and f3^2 in the 3x3 around. Anything much sharper is no star
+
+  sharp = 1;
+  if(fwhm > 0) {
+    f1 = erf(0.5 / (fwhm / 2.3548 * M_SQRT2));
+    f3 = erf(1.5 / (fwhm / 2.3548 * M_SQRT2));
+    sharp = SHARPNESS * (f1*f1) / (f3*f3);
+  }
+
+  nevents = 0;
+  res.events = 0;
+  res.scale  = 1;
+  res.noise  = 0;
+
+  // the first images of the field make its reference, the next ones
+  // are differenced against it
+
+  if(sr->frames < pars.refFrames) {
+    ok = cur->stack.add(x, y, n, pool);
+    res.ready = false;
+  } else if((ok = cur->stack.resample(x, y, n, pool, img))) {
+    run(pool, 0);
+    levels();
+    run(pool, 1);
+    res.noise = noise(diff);
+    run(pool, 2);
+
+    // the strongest of all bands, packed in place
+
+    for(int j=total=0; j<BANDS; j++)
+      for(int k=0; k<nfound[j]; k++)
+	all[total++] = found[j][k];
+    std::sort(all, all + total, stronger);
+    nevents = (total < MAXEVENTS) ? total : MAXEVENTS;
+    memcpy(events, all, nevents * sizeof(DiffEvent));
+    res.ready  = true;
+    res.events = nevents;
+  } else
+    res.ready = false;
+
+  res.refFrames = sr->frames;
+  res.matched   = (ok) ? sr->matched : 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  res.elapsed = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  return(ok);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Differencer::same(const Field* f, const DiffField* key, int width, int height) const
+{
+  double c;
+
+  if(f->stack.width() != width || f->stack.height() != height ||
+     strcmp(f->key.object, key->object))
+    return(false);
+  if(!f->key.pointed || !key->pointed)
+    return(true);		// by name only
+
+  c = sin(f->key.dec*DEG) * sin(key->dec*DEG) + cos(f->key.dec*DEG) * 
+    cos(key->dec*DEG) * cos((f->key.ra - key->ra)*DEG);
+  return(acos((c < 1) ? c : 1) / DEG <= pars.radius);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Differencer::levels()
+{
+  float* si = new float[SAMPLE];
+  float* sr = new float[SAMPLE];
+  int step = (w * h + SAMPLE - 1) / SAMPLE;
+  float noiseRef, cut, scale;
+  int n = 0, m = 0;
+
+  // sky levels from a sample of the pixels both have
+
+  for(int i=0; i<w*h && n<SAMPLE; i+=step)
+    if(!isnan(img[i]) && !isnan(ref[i])) {
+      si[n] = img[i];
+      sr[n] = ref[i];
+      n++;
+    }
+  skyImg = skyRef = 0;
+  if(n < 2) {
+    delete [] si;
+    delete [] sr;
+    return;
+  }
+  skyImg = median(si, n);
+  skyRef = median(sr, n);
+  noiseRef = noise(ref);
+
+  // flux scale from the bright reference pixels, on stars mostly.
+  // The difference image is not made yet and holds the ratios
+
+  cut = skyRef + BRIGHT * noiseRef;
+  for(int i=0; i<w*h; i++)
+    if(ref[i] > cut && !isnan(img[i]))
+      diff[m++] = (img[i] - skyImg) / (ref[i] - skyRef);
+  if(m >= MINBRIGHT && (scale = median(diff, m)) > 0)
+    res.scale = scale;
+  delete [] si;
+  delete [] sr;
+}
+
+/*---------------------------------------------------------------------------*/
+
+double
+Differencer::noise(const float* v) const
+{
+  float* buf = new float[SAMPLE];
+  int step = (w * h + SAMPLE - 1) / SAMPLE;
+  double sigma = 0;
+  float med;
+  int n = 0;
+
+  // from neighbours along rows, so that sky gradients do not count
+
+  for(int i=0; i<w*h-1 && n<SAMPLE; i+=step)
+    if(!isnan(v[i]) && !isnan(v[i+1]))
+      buf[n++] = v[i+1] - v[i];
+
+  if(n > 1) {
+    med = median(buf, n);
+    for(int i=0; i<n; i++)
+      buf[i] = fabsf(buf[i] - med);
+    sigma = MADSIGMA * median(buf, n) / M_SQRT2;
+  }
+  delete [] buf;
+  return(sigma);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Differencer::run(WorkerPool* pool, int step)
+{
+  for(int j=0; j<BANDS; j++)
+    pool->submit(Differencer::bandJob, this, j, step);
+  pool->wait();
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Differencer::bandJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(Differencer*, ctx)->band(a, b);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Differencer::band(int job, int step)
+{
+  int y1 = job * bandRows;
+  int y2 = (y1 + bandRows < h) ? y1 + bandRows : h;
+  int least = (pars.refFrames > 1) ? (pars.refFrames + 1) / 2 : 1;
+  float b = skyImg - res.scale * skyRef;
+  float cut = pars.kappa * res.noise;
+
+  switch(step) {
+
+  case 0:			// reference pixels stacked often enough
+    for(int y=y1; y<y2; y++) {
+      cur->stack.stackRow(y, ref + y*w, NAN, least);
+      cur->stack.varianceRow(y, var + y*w);
+    }
+    break;
+
+  case 1:			// matched to the image and subtracted
+    for(int y=y1; y<y2; y++)
+      PixKern::subtract(diff + y*w, img + y*w, ref + y*w, res.scale, b, w);
+    break;
+
+  case 2:			// residuals above the noise of the difference
+    nfound[job] = 0;
+    for(int y=(y1 > 1) ? y1 : 1; y<y2 && y<h-1; y++)
+      for(int x=1; x<w-1; x++)
+	if(fabsf(diff[y*w + x]) > cut) // false for NaN
+	  candidate(job, y*w + x);
+    break;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Differencer::candidate(int job, int i)
+{
+  const int around[8] = { -w-1, -w, -w+1, -1, 1, w-1, w, w+1 };
+  float cut = pars.kappa * res.noise;
+  float sgn = (diff[i] > 0) ? 1 : -1;
+  float v = sgn * diff[i];
+  float u, rexc;
+  double s, d, sum = 0, sx = 0, sy = 0, wsum = 0;
+  DiffEvent e;
+  int npix = 1, k, j;
+
+  // the extreme of its neighbourhood, ties going to the first one,
+  // and not a single pixel
+
+  for(k=0; k<8; k++) {
+    u = sgn * diff[i + around[k]];
+    if(isnan(u))
+      continue;
+    if(u > v || (u == v && around[k] < 0))
+      return;
+    if(u > cut / 2)
+      npix++;
+  }
+  if(npix < pars.minPix)
+    return;
+
+  // seeing changes leave a small fraction of the reference stars
+
+  rexc = ref[i] - skyRef;
+  if(rexc > cut && v < MISMATCH * res.scale * rexc)
+    return;
+
+  // with the photon noise of the reference source
+  // and the uncertainty of the reference itself
+
+  s = res.noise * res.noise + res.scale * res.scale * var[i];
+  if(pars.gain > 0 && rexc > 0)
+    s += res.scale * rexc / pars.gain;
+  s = sqrt(s);
+  if(v <= pars.kappa * s)
+    return;
+
+  for(int dy=-1; dy<=1; dy++)
+    for(int dx=-1; dx<=1; dx++) {
+      d = diff[i + dy*w + dx];
+      if(isnan(d))
+	continue;
+      sum += d;
+      if(sgn * d > 0) {
+	sx   += sgn * d * dx;
+	sy   += sgn * d * dy;
+	wsum += sgn * d;
+      }
+    }
+  if(sum * sgn <= 0 || diff[i] / sum > sharp)
+    return;			// a cosmic ray or noise
+  e.x    = i % w + sx / wsum;
+  e.y    = i / w + sy / wsum;
+  e.flux = sum;
+  e.peak = diff[i];
+  e.snr  = diff[i] / s;
+  e.npix = npix;
+
+  // the strongest ones of the band
+
+  if(nfound[job] < MAXEVENTS) {
+    found[job][nfound[job]++] = e;
+    return;
+  }
+  for(j=0, k=1; k<MAXEVENTS; k++)
+    if(fabs(found[job][k].snr) < fabs(found[job][j].snr))
+      j = k;
+  if(fabs(e.snr) > fabs(found[job][j].snr))
+    found[job][j] = e;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Differencer::output(SavedImage* image, FITSHeader* header)
+{
+  static const char* COLUMNS = "date_obs,jd_mid,file,object,x,y,ra,dec,"
+    "flux,peak,snr,npix\n";
+  const DiffEvent* e;
+  const char *name, *date;
+  const char* saved = image->path();
+  char evPath[256], file[300];
+  double x, y, ra, dec, exptime, jd;
+
+  // 'dir/name.fit' goes to 'dir/events.csv', along with every field
+
+  name = strrchr(saved, '/');
+  name = (name) ? name+1 : saved;
+  snprintf(evPath, sizeof(evPath), "%.*sevents.csv", STATIC_CAST(int, name - saved),
+	   saved);
+  if(image->extension() > 0)	// the extension of the image
+    snprintf(file, sizeof(file), "%s[%d]", name, image->extension());
+  else
+    snprintf(file, sizeof(file), "%s", name);
+
+  date = header->get("DATE-OBS");
+  if(!header->get("EXPTIME", &exptime))
+    exptime = 0;
+  jd = julianDay(date);
+  if(jd > 0)
+    jd += exptime / 2 / 86400;	// mid exposure
+
+  // positions in pixels of the image as saved, 1 based,
+  // RA & DEC by its plate solution if any
+
+  lines.begin(COLUMNS);
+  for(int i=0; i<nevents; i++) {
+    e = &events[i];
+    toImage(e->x, e->y, &x, &y);
+    if(!image->world(x, y, &ra, &dec))
+      ra = dec = -99;
+    lines.line("%s,%.6f,%s,\"%s\",%.3f,%.3f,%.6f,%.6f,%.2f,%.2f,%.2f,%d\n",
+	       (date) ? date : "", jd, file, cur->key.object, x + 1, y + 1,
+	       ra, dec, e->flux, e->peak, e->snr, e->npix);
+  }
+  if(!lines.append(evPath))
+    image->warn(errno, evPath);	// the image is still saved
+}
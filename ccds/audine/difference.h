@@ -0,0 +1,187 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_DIFFERENCE_H
+#define AUDINE_DIFFERENCE_H
+
+#include "livestack.h"
+
+/* differencing of object images */
+
+#define DIFF_NONE   0		/* no differencing */
+#define DIFF_EVENTS 1		/* residuals reported as candidate events */
+
+/* the field an image belongs to */
+
+struct DiffField {
+  char object[72];		/* OBJECT name, may be empty */
+  bool pointed;			/* telescope position below is known */
+  double ra;			/* J2000 [deg] */
+  double dec;
+};
+
+/* differencing parameters */
+
+struct DiffPars {
+  double kappa;			/* event threshold [sigma] */
+  int minPix;			/* fewest pixels above half the threshold */
+  int refFrames;		/* images stacked into a new reference */
+  double radius;		/* largest pointing offset of the same field [deg] */
+  double matchTol;		/* star match tolerance [pixels] */
+  double gain;			/* [e-/ADU], 0 if unknown */
+};
+
+/* a candidate event, brightening if 'flux' > 0, else fading */
+
+struct DiffEvent {
+  double x;			/* 0 based pixel of the reference */
+  double y;
+  double flux;			/* over the 3x3 pixels around the peak [ADU] */
+  double peak;			/* residual at the peak [ADU] */
+  double snr;			/* peak significance [sigma], signed */
+  int npix;			/* of the 3x3 above half the threshold */
+};
+
+/* state after the last image */
+
+struct DiffResult {
+  int refFrames;		/* images in the reference of the field */
+  bool ready;			/* reference complete, image differenced */
+  int matched;			/* stars matched by the image */
+  int events;			/* candidate events found */
+  double scale;			/* reference flux scale to the image */
+  double noise;			/* of the difference image [ADU] */
+  double elapsed;		/* registration & differencing time [ms] */
+};
+
+class WorkerPool;
+
+/*
+ * Reference image differencing of object images, as saved, for
+ * transients to be reported as they happen. A reference is kept in
+ * memory per field, a field being the OBJECT name and the telescope
+ * position within a radius. It is the live stack of the first images
+ * of the field. Every later image is registered to it by its stars,
+ * resampled onto its grid, and the reference subtracted once matched
+ * in sky level and flux scale, in parallel bands. Local extremes of
+ * the residual above the threshold are candidates, unless they are
+ * single pixels, sharper than the stars of the image as cosmic rays
+ * are, or a small fraction of a reference star, as seeing changes
+ * leave. The sigma of each pixel adds the photon noise of the
+ * reference sources and the variance of the reference stack, which
+ * also hides what its clipping missed, to the noise of the difference.
+ */
+
+class Differencer : public SideOutput {
+
+ public:
+
+  static const int MAXFIELDS = 4;  /* references kept */
+  static const int MAXEVENTS = 64; /* strongest events kept per image */
+  static const int BANDS     = 32; /* parallel jobs per image */
+
+  Differencer();
+ ~Differencer();
+
+  /* selects the reference of 'field' for images of 'w' x 'h' pixels, */
+  /* a new one replacing the least recently used if not kept */
+  void select(const DiffField* field, int w, int h, const DiffPars* pars);
+
+  /* row 'y' of the next image to fill before add(), NaN if not valid */
+  float* row(int y) { return(cur->stack.row(y)); }
+
+  /* registers the image just filled from its stars, brightest first, */
+  /* whose typical 'fwhm' is given [pixels]. It is stacked while the */
+  /* reference is being made, else the reference is subtracted and */
+  /* events looked for. false if not registered */
+  bool add(const double* x, const double* y, int n, double fwhm, WorkerPool* pool);
+
+  /* events of the last image, strongest first */
+  int count() const { return(nevents); }
+  const DiffEvent* event(int i) const { return(&events[i]); }
+
+  /* pixel of the last image of reference pixel (rx, ry) */
+  void toImage(double rx, double ry, double* x, double* y) const
+    { cur->stack.toImage(rx, ry, x, y); }
+
+  /* state after the last image */
+  const DiffResult* result() const { return(&res); }
+
+  /* appends the events of the last image to the event file next to */
+  /* 'image', in its pixels & by its plate solution if any */
+  void output(SavedImage* image, FITSHeader* header);
+
+ private:
+
+  struct Field {
+    DiffField key;
+    LiveStack stack;		/* its reference */
+    unsigned long used;		/* last selected, 0 if free */
+  };
+
+  Field fields[MAXFIELDS];
+  Field* cur;			/* selected */
+  unsigned long clock;		/* selections so far */
+  DiffPars pars;
+  DiffResult res;
+  int w;
+  int h;
+  int size;			/* capacity of the pixel arrays */
+
+  /* per pixel */
+  float* img;			/* image registered onto the reference */
+  float* ref;			/* reference, NaN where too few stacked */
+  float* var;			/* its variance */
+  float* diff;			/* image - scale * reference - offset */
+
+  double skyImg;		/* sky levels */
+  double skyRef;
+  double sharp;			/* largest peak to 3x3 flux of a star */
+  int bandRows;			/* rows per band */
+  DiffEvent found[BANDS][MAXEVENTS]; /* per band */
+  int nfound[BANDS];
+  DiffEvent events[MAXEVENTS];
+  int nevents;
+  CSVLines lines;		/* for the event file */
+
+  /* true if 'f' is the field of 'key' for images of w x h */
+  bool same(const Field* f, const DiffField* key, int width, int height) const;
+
+  /* sky levels & flux scale of the image against the reference */
+  void levels();
+
+  /* noise of 'v' from the differences of a sample of neighbour pixels */
+  double noise(const float* v) const;
+
+  /* candidate at pixel 'i' of 'job' if it is one */
+  void candidate(int job, int i);
+
+  /* runs a step over all bands */
+  void run(WorkerPool* pool, int step);
+
+  /* steps per band: 0 reference, 1 subtraction, 2 detection. */
+  /* Runs in the worker pool */
+  static void bandJob(void* ctx, int a, int b);
+  void band(int job, int step);
+};
+
+#endif
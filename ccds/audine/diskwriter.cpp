@@ -0,0 +1,1804 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "diskwriter.h"
+#include "pixkern.h"
+#include "rice.h"
+
+/*---------------------------------------------------------------------------*/
+
+DiskWriter::DiskWriter() : ring(0), head(0), tail(0), count(0), hwm(0),
+    ndrops(0), running(false), error(0), ndone(0), focusReady(false), fd(-1),
+    hdrOffset(0), dataOffset(0), hdrRecords(2), hdrBuf(0),
+    maxRecords(0), calibMode(CALIB_NONE), calibSkipped(false), rawFd(-1),
+    warning(0), repair(false),
+    repaired(0), overscanMode(OVERSCAN_NONE),
+    rebin(false), cosmicMode(COSMIC_NONE), catalogMode(CATALOG_NONE),
+    solving(false), starX(0), starY(0), maxStars(0), photMode(PHOT_NONE),
+    photStar(-1), stacking(false), stackLate(false),
+    diffMode(DIFF_NONE),
+    fileEnd(0), outWidth(0), outHeight(0), noutputs(0), toRing(false), stage(0), stageLen(0),
+    stageOff(0), extSize(0),
+    extCount(0), tiles(0), maxTiles(0), heapStart(0), heapSize(0), maxLen(0),
+    analyzing(0), postHead(0), nextSpec(0), nextHead(0)
+{
+  ring = new WriterSlot[SLOTS];
+  stage = new unsigned char[STAGESZ];
+  sem_init(&freeSlots, 0, SLOTS);
+  sem_init(&usedSlots, 0, 0);
+  pthread_mutex_init(&lock, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+
+DiskWriter::~DiskWriter()
+{
+  stop();
+  sem_destroy(&freeSlots);
+  sem_destroy(&usedSlots);
+  pthread_mutex_destroy(&lock);
+  delete [] ring;
+  delete [] stage;
+  delete [] tiles;
+  delete [] hdrBuf;
+  delete [] starX;
+  delete [] starY;
+  delete nextSpec;
+  delete nextHead;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::start()
+{
+  int res;
+
+  if(running)
+    return;
+
+  pool.start();
+  post.start(1);
+  res = pthread_create(&thread, NULL, DiskWriter::run, this);
+  assert(res == 0);
+  running = true;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::stop()
+{
+  WriterSlot* slot;
+
+  if(!running)
+    return;
+
+  // the only place where the event loop waits for the writer,
+  // as it is going to join it anyway
+
+  while(sem_wait(&freeSlots) == -1 && errno == EINTR)
+    ;
+  slot = &ring[head];
+  slot->op     = WR_QUIT;
+  slot->header = 0;
+  slot->spec   = 0;
+  commit();
+
+  pthread_join(thread, NULL);
+  post.stop();
+  pool.stop();
+  running = false;
+}
+
+/*---------------------------------------------------------------------------*/
+
+WriterSlot*
+DiskWriter::acquire(bool data)
+{
+  int nfree;
+
+  // the ring is sized to hold a whole frame in most cases.
+  // If the disk is so slow that it fills up anyway, the event loop
+  // must not wait for it: data is dropped and the caller reports it.
+  // We are the only producer, so free slots cannot vanish meanwhile
+
+  sem_getvalue(&freeSlots, &nfree);
+  if(nfree <= (data ? RESERVE : 0) || sem_trywait(&freeSlots) == -1) {
+    ndrops++;
+    return(0);
+  }
+
+  ring[head].header = 0;
+  ring[head].spec   = 0;
+  ring[head].len    = 0;
+  return(&ring[head]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::commit()
+{
+  int n;
+
+  head = (head + 1) % SLOTS;
+  n = __sync_add_and_fetch(&count, 1);
+  if(n > hwm)
+    hwm = n;
+  sem_post(&usedSlots);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+DiskWriter::lastError()
+{
+  return(__sync_lock_test_and_set(&error, 0));
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+DiskWriter::popDone(WriterReport* report)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&lock);
+  if(ndone > 0) {
+    *report = done[0];
+    ndone--;
+    memmove(&done[0], &done[1], ndone * sizeof(done[0]));
+    found = true;
+  }
+  pthread_mutex_unlock(&lock);
+  return(found);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+DiskWriter::popFocus(FocusMetrics* metrics)
+{
+  bool found;
+
+  pthread_mutex_lock(&lock);
+  found = focusReady;
+  if(found)
+    *metrics = focusResult;
+  focusReady = false;
+  pthread_mutex_unlock(&lock);
+  return(found);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::setError(int err)
+{
+  __sync_lock_test_and_set(&error, err);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::warn(int err, const char* path)
+{
+  // the first one is kept, it is likely the cause of the others
+
+  if(warning)
+    return;
+  warning = err;
+  strncpy(warnPath, path, sizeof(warnPath)-1);
+  warnPath[sizeof(warnPath)-1] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::append(FITSHeader* header, FITSHeader* ext, const void* data, off_t size)
+{
+  int nrec = ext->records();
+  char* hdr = new char[nrec * FITSHeader::RECORDSZ];
+  DataSum sum;
+
+  // after the padded image data unit or the heap of its tiles,
+  // or the extensions already appended
+
+  sum.add(data, size, 0);
+  ext->render(hdr, nrec, sum.value());
+  writeAt(hdr, nrec * FITSHeader::RECORDSZ, fileEnd);
+  writeAt(data, size, fileEnd + nrec * FITSHeader::RECORDSZ);
+  fileEnd += STATIC_CAST(off_t, nrec) * FITSHeader::RECORDSZ + size;
+  delete [] hdr;
+
+  if(!spec.rice)		// else in the empty primary HDU already
+    header->set("EXTEND", true, "FITS dataset may contain extensions");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void*
+DiskWriter::run(void* arg)
+{
+  STATIC_CAST(DiskWriter*, arg)->loop();
+  return(NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::loop()
+{
+  WriterSlot* slot;
+  bool quit = false;
+  bool held, busy;
+  int first, n;
+
+  while(!quit) {
+
+    while(sem_wait(&usedSlots) == -1 && errno == EINTR)
+      ;
+
+    slot = &ring[tail];
+
+    // while the last image is analyzed the next one is held back,
+    // anything else waits for the analysis to finish
+
+    busy = __sync_fetch_and_add(&analyzing, 0);
+    held = busy && holdBack(slot);
+    if(!held && (busy || nextSpec)) {
+      post.wait();
+      if(nextSpec)		// an aborted image is not even created
+	resume(slot->op != WR_CANCEL && slot->op != WR_QUIT);
+    }
+
+    if(!held) {
+      switch(slot->op) {
+
+      case WR_OPEN:
+	open(slot->spec, slot->header);
+	break;
+
+      case WR_DATA:
+	if(fd == -1 && !toRing)	// file could not be created
+	  break;
+	if(frame.place(slot->data, slot->len, &first, &n) != CHUNK_OK)
+	  break;
+	do			// rows received before are left out
+	  takeRows(first, n);
+	while(frame.nextRun(&first, &n));
+	break;
+
+      case WR_CLOSE:
+	close(slot);
+	break;
+
+      case WR_CANCEL:
+	cancel();
+	break;
+
+      case WR_PERSIST:
+	persist(slot);
+	break;
+
+      case WR_QUIT:
+	cancel();
+	focus.close();
+	quit = true;
+	break;
+      }
+    }
+
+    delete slot->header;	// header copies are owned by the writer
+    slot->header = 0;
+    delete slot->spec;		// and so are parameters
+    slot->spec = 0;
+
+    tail = (tail + 1) % SLOTS;
+    __sync_sub_and_fetch(&count, 1);
+    sem_post(&freeSlots);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::takeRows(int first, int n)
+{
+  addRows(first, n);
+  preview.add(&frame, first, n);
+  if(toRing)			// copied to the ring when complete
+    return;
+  if(spec.rice)
+    pool.submit(DiskWriter::compressJob, this, first, n);
+  else if(rebin)
+    writeRebinned(first, n);
+  else if(calibMode == CALIB_NONE)
+    stageRows(first, n);
+  else {
+    writeCalibrated(first, n);
+    if(rawFd != -1)
+      writeRows(first, n);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::open(const WriterSpec* s, FITSHeader* header)
+{
+  off_t dataSize;
+  int res;
+
+  spec = *s;
+  spec.rice = spec.rice && !spec.mef; // extensions are never compressed
+
+  // single plain images only, as read. Masters never match an image
+  // binned, cropped or overscan corrected by software, which is reported
+
+  calibSkipped = spec.calib != CALIB_NONE && 
+    (spec.overscan != OVERSCAN_NONE || spec.rebin);
+  if(spec.rice || spec.mef || spec.ringSlots > 0 || spec.overscan != OVERSCAN_NONE ||
+     spec.rebin)
+    spec.calib = CALIB_NONE;
+  calibMode = CALIB_NONE;
+  overscanMode = spec.overscan;
+  if(overscanMode != OVERSCAN_NONE)
+    overscan.reset(&spec.overscanGeom, spec.width, spec.height);
+
+  // Rice tiles and focus frames always keep the whole frame
+
+  rebin = spec.rebin && !spec.rice && spec.ringSlots == 0;
+  if(rebin) {
+    rebinner.reset(&spec.rebinGeom, spec.width, spec.height);
+    rebinner.stamp(header);
+  }
+
+  // hits are only looked for in single plain images, as calibrated ones
+
+  cosmicMode = (spec.rice || spec.mef || spec.ringSlots > 0) ? COSMIC_NONE : spec.cosmic;
+  catalogMode = (spec.mef || spec.ringSlots > 0) ? CATALOG_NONE : spec.catalog;
+  extractor.setCatalog(catalogMode);
+  solving     = spec.solve && !spec.mef && spec.ringSlots == 0;
+  photMode    = (spec.photometry == PHOT_NONE || spec.ringSlots > 0 ||
+		 !photometer.load(spec.photTargets)) ? PHOT_NONE : spec.photometry;
+  stacking    = spec.liveStack && spec.ringSlots == 0;
+  diffMode    = (spec.ringSlots > 0) ? DIFF_NONE : spec.difference;
+  outWidth  = (rebin) ? rebinner.width()  : spec.width;
+  outHeight = (rebin) ? rebinner.height() : spec.height;
+  geom.x      = (rebin) ? spec.rebinGeom.x : 0;
+  geom.y      = (rebin) ? spec.rebinGeom.y : 0;
+  geom.binX   = (rebin) ? spec.rebinGeom.binX : 1;
+  geom.binY   = (rebin) ? spec.rebinGeom.binY : 1;
+  geom.width  = outWidth;
+  geom.height = outHeight;
+  geom.flipLR = spec.flipLR;
+  geom.flipUD = spec.flipUD;
+  repair   = spec.defects && defects.select(spec.calibDir, &spec.calibKey);
+  repaired = 0;
+  frame.reset(spec.width, spec.height);
+  stats.reset();
+  calStats.reset();
+  dataSum.reset();
+  preview.reset(spec.width, spec.height, (stacking) ? 0 : spec.preview, // the stack is
+		spec.flipLR, spec.flipUD);			      // previewed instead
+
+  if(spec.ringSlots > 0) {	// no file at all, one spare record for close
+    toRing = focus.open(spec.path, spec.ringSlots, spec.width, spec.height,
+			header->records() + 1);
+    if(!toRing)
+      setError(errno);
+    return;
+  }
+
+  if(spec.mef && extCount > 0) { // the file is already there
+    if(fd != -1)
+      openExtension(header);
+    return;
+  }
+
+  // read back only if the final header outgrows its reserve
+  fd = ::open(spec.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    setError(errno);
+    return;
+  }
+
+  if(spec.mef) {
+    startMEF(header);
+    return;
+  }
+
+  if(spec.rice) {		// final size is not known in advance
+    startTiles(header);
+    return;
+  }
+
+  // an image is saved raw if no master frame matches it
+
+  FITSHeader raw(*header);
+  if(spec.calib != CALIB_NONE && calib.select(spec.calibDir, &spec.calibKey)) {
+    calibMode = spec.calib;
+    calib.stamp(header, calibMode);
+  }
+  if(cosmicMode == COSMIC_MASK || catalogMode == CATALOG_EXTENSION)
+    header->set("EXTEND", true, "FITS dataset may contain extensions");
+
+  // the header is given room to spare, so that the final one 
+  // with more keywords never moves the data unit
+
+  reserve(header);
+  hdrOffset  = 0;
+  dataOffset = hdrRecords * FITSHeader::RECORDSZ;
+  dataSize   = STATIC_CAST(off_t, outWidth) * outHeight * 
+    ((calibMode) ? Calibrator::pixelSize(calibMode) : sizeof(pixel_t));
+  dataSize   = ((dataSize + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ)
+    * FITSHeader::RECORDSZ;
+  fileEnd    = dataOffset + dataSize;
+
+  if(calibMode && spec.calibRaw)
+    openRaw(&raw);
+
+  // reserves all disk blocks now. The unwritten parts read as zeros,
+  // which gives missing rows and the final padding for free
+
+  res = posix_fallocate(fd, 0, dataOffset + dataSize);
+  if(res != 0 && ftruncate(fd, dataOffset + dataSize) == -1) {
+    setError(errno);
+    cancel();
+    return;
+  }
+
+  /* writes a temporary header, complete except for exposure dates & times */
+
+  header->render(hdrBuf, hdrRecords);
+  writeAt(hdrBuf, hdrRecords * FITSHeader::RECORDSZ, hdrOffset);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::close(WriterSlot* slot)
+{
+  preview.finish();		// even if rows were lost
+
+  if(overscanMode != OVERSCAN_NONE) {
+    overscan.finish(&bias);
+    overscan.stamp(slot->header, &bias);
+  }
+  if(repair)
+    defects.stamp(slot->header, repaired);
+
+  if(toRing) {
+    slot->header->set("LOSTROWS", frame.lostRows(), "rows lost in transmission");
+    finishStats(slot->header);
+    measureFocus();
+    sendBlob(slot->header);
+    publish(slot->header);
+    toRing = false;
+    report(false, true);
+    return;
+  }
+
+  if(fd == -1)
+    return;
+  flushRows();			// before anything reads or rewrites them
+
+  // the analysis takes far longer than the rows did, the next
+  // image does not wait for it. Its header goes along
+
+  if(cosmicMode != COSMIC_NONE || catalogMode != CATALOG_NONE || solving ||
+     photMode != PHOT_NONE || stacking || diffMode != DIFF_NONE) {
+    postHead = slot->header;
+    slot->header = 0;
+    __sync_lock_test_and_set(&analyzing, 1);
+    post.submit(DiskWriter::analyzeJob, this, slot->last, 0);
+    return;
+  }
+
+  finish(slot->header, slot->last);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::finish(FITSHeader* header, bool last)
+{
+  noutputs = 0;
+  if(cosmicMode != COSMIC_NONE)
+    rejectCosmics();
+
+  // a lossy transmission is reported, not fatal.
+  // missing rows are zeros in the file or coded as zero tiles,
+  // binned rows missing some of theirs are made of those received
+
+  if(rebin)
+    for(int oy=rebinner.incomplete(0); oy != -1; oy=rebinner.incomplete(oy+1))
+      putRebinned(oy, oy+1);
+
+  if(catalogMode != CATALOG_NONE || solving || stacking || diffMode != DIFF_NONE)
+    extractSources();		// as saved, cleaned and calibrated
+  if(solving)
+    solveField(header);
+  if(photMode != PHOT_NONE)
+    measureTargets(header);	// placed by the plate solution if any
+  if(stacking)
+    stackFrame(header, last);
+  if(diffMode != DIFF_NONE)
+    differenceFrame(header);
+
+  header->set("LOSTROWS", frame.lostRows(), "rows lost in transmission");
+  finishStats(header);
+  measureFocus();		// published right now, not with the report
+  sendBlob(header);		// before any extension or tile conversion
+
+  if(rebin)
+    rebinner.stamp(header);	// the blob keeps the whole frame
+
+  if(calibMode) {
+    if(rawFd != -1)
+      closeRaw(header);
+    calib.stamp(header, calibMode);
+    finishCalibrated(header);	// the raw ones went to the raw copy
+  }
+
+  if(cosmicMode != COSMIC_NONE) // the raw image is left as read
+    cosmics.stamp(header, cosmicMode);
+
+  if(spec.rice) {
+    pool.wait();
+    endTiles(header);
+  }
+
+  // what the analysis found, after the image data or its tiles,
+  // the catalog after any other extension
+
+  if(catalogMode != CATALOG_NONE)
+    outputs[noutputs++] = &extractor;
+  for(int i=0; i<noutputs; i++)
+    outputs[i]->output(this, header);
+
+
+  if(spec.mef)
+    header->toExtension();
+
+  // the reserve is a worst case, but the header is never truncated
+
+  if(header->records() > hdrRecords) {
+    pool.wait();
+    errno = 0;
+    if(!growHeader(header->records())) {
+      setError(errno);
+      cancel();
+      return;
+    }
+  }
+
+  header->render(hdrBuf, hdrRecords, dataSum.value()); // final date & time
+  writeAt(hdrBuf, hdrRecords * FITSHeader::RECORDSZ, hdrOffset);
+
+  // a multi-extension file is only closed after the last image
+  // but lost rows are reported for every one
+
+  if(spec.mef) {
+    extCount++;
+    report(false, true);
+    if(!last)
+      return;
+    endMEF();
+  }
+
+  if(::close(fd) == -1)
+    setError(errno);
+  fd = -1;
+
+  report(true, !spec.mef);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::analyzeJob(void* ctx, int a, int b)
+{
+  DiskWriter* w = STATIC_CAST(DiskWriter*, ctx);
+
+  w->finish(w->postHead, a != 0);
+  delete w->postHead;
+  w->postHead = 0;
+  __sync_fetch_and_and(&w->analyzing, 0);	// full barrier, results first
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+DiskWriter::holdBack(WriterSlot* slot)
+{
+  int first, n;
+
+  if(slot->op == WR_OPEN && nextSpec == 0) {
+    nextSpec = slot->spec;	// now owned until resumed
+    nextHead = slot->header;
+    slot->spec   = 0;
+    slot->header = 0;
+    early.reset(nextSpec->width, nextSpec->height);
+    return(true);
+  }
+
+  // just placed, corrected and written when resumed
+
+  if(slot->op == WR_DATA && nextSpec != 0) {
+    if(early.place(slot->data, slot->len, &first, &n) == CHUNK_OK)
+      while(early.nextRun(&first, &n))
+	;
+    return(true);
+  }
+  return(false);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::resume(bool keep)
+{
+  int batch, y, n;
+
+  if(keep) {
+    open(nextSpec, nextHead);
+    frame.swap(&early);		// as if the rows had just arrived
+
+    // in runs of received rows, as many as a chunk holds
+
+    batch = sizeof(out) / (frame.width() * sizeof(pixel_t));
+    if(batch == 0)
+      batch = 1;
+    for(y=0; (fd != -1 || toRing) && y<frame.height(); y+=n) {
+      for(n=0; n<batch && y+n<frame.height() && frame.hasRow(y+n); n++)
+	;
+      if(n == 0) {
+	n = 1;
+	continue;
+      }
+      takeRows(y, n);
+    }
+  }
+
+  delete nextSpec;
+  delete nextHead;
+  nextSpec = 0;
+  nextHead = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::report(bool file, bool stats)
+{
+  WriterReport* rep;
+
+  // queues the report for the event loop to notify XEphem
+
+  pthread_mutex_lock(&lock);
+  if(ndone == 8) {		// nobody is draining, forget the oldest
+    ndone--;
+    memmove(&done[0], &done[1], ndone * sizeof(done[0]));
+  }
+  rep = &done[ndone++];
+  strcpy(rep->path, spec.path);
+  rep->file    = file;
+  rep->lost    = (stats) ? frame.lostRows()   : 0;
+  rep->dups    = (stats) ? frame.duplicates() : 0;
+  rep->invalid = (stats) ? frame.invalids()   : 0;
+  rep->hasStats = stats;
+  rep->uncalibrated = file && spec.calib != CALIB_NONE && calibMode == CALIB_NONE;
+  rep->calibSkipped = file && calibSkipped;
+  rep->stats    = result;
+  rep->hasBias  = stats && overscanMode != OVERSCAN_NONE;
+  rep->bias     = bias;
+  rep->hasWCS   = file && stats && solving && solver.fit()->matched > 0;
+  rep->unsolved = file && stats && solving && solver.fit()->matched == 0;
+  rep->wcs      = *solver.fit();
+  rep->hasPhot  = stats && photMode != PHOT_NONE && photStar != -1;
+  rep->unmeasured = stats && spec.photometry != PHOT_NONE && photMode == PHOT_NONE &&
+    spec.ringSlots == 0;
+  if(rep->hasPhot)
+    rep->phot   = *photometer.result(photStar);
+  rep->hasStack  = stats && stacking;
+  rep->stackLate = stats && stacking && stackLate;
+  rep->stack     = *stacker.result();
+  rep->hasDiff   = stats && diffMode != DIFF_NONE;
+  rep->warning   = warning;
+  strcpy(rep->warnPath, (warning) ? warnPath : "");
+  warning = 0;
+  rep->diff      = *differ.result();
+  memset(&rep->event, 0, sizeof(rep->event));
+  if(rep->hasDiff && differ.count() > 0) {
+    rep->event = *differ.event(0);
+    differ.toImage(rep->event.x, rep->event.y, &rep->event.x, &rep->event.y);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::cancel()
+{
+  toRing = false;		// the ring slot is only taken when complete
+  stageLen = 0;			// rows of an incomplete image
+
+  if(fd != -1) {
+    pool.wait();		// nobody writes to the file any more
+
+    if(spec.mef && extCount > 0) { // keeps the images already complete
+      endMEF();
+      if(::close(fd) == -1)
+	setError(errno);
+      fd = -1;
+      report(true, false);
+      return;
+    }
+
+    ::close(fd);
+    unlink(spec.path);		// borra el fichero
+  }
+  fd = -1;
+
+  if(rawFd != -1) {
+    ::close(rawFd);
+    unlink(rawPath);
+  }
+  rawFd = -1;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::measureFocus()
+{
+  FocusMetrics res;
+
+  if(!spec.focus)
+    return;
+
+  analyzer.analyze(&frame, spec.roiX, spec.roiY, spec.roiWidth, spec.roiHeight,
+		   &pool, &res);
+
+  pthread_mutex_lock(&lock);
+  focusResult = res;		// older metrics are simply replaced
+  focusReady  = true;
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::sendBlob(const FITSHeader* header)
+{
+  // a plain single image FITS file, as if neither Rice nor MEF
+
+  if(spec.blob != BLOB_NONE)
+    blob.build(header, &frame, spec.flipLR, spec.flipUD, spec.blob, &pool);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::finishStats(FITSHeader* header)
+{
+
+  // lost rows are not accounted
+
+  stats.finish(&result);
+  header->set("DATAMIN", result.min, "minimum pixel value [ADU]");
+  header->set("DATAMAX", result.max, "maximum pixel value [ADU]");
+  header->set("DATAMEAN", result.mean, "mean pixel value [ADU]");
+  header->set("DATASTD", result.sigma, "pixel standard deviation [ADU]");
+  header->set("DATAMED", result.median, "median pixel value [ADU]");
+  header->set("NSATUR", result.saturated, "saturated pixels");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::finishCalibrated(FITSHeader* header)
+{
+  FrameStatistics cal;
+
+  // the pixels saved, to the nearest ADU if floats. NSATUR is
+  // left as read, saturation is lost once calibrated
+
+  calStats.finish(&cal);
+  header->set("DATAMIN", cal.min, "minimum pixel value [ADU]");
+  header->set("DATAMAX", cal.max, "maximum pixel value [ADU]");
+  header->set("DATAMEAN", cal.mean, "mean pixel value [ADU]");
+  header->set("DATASTD", cal.sigma, "pixel standard deviation [ADU]");
+  header->set("DATAMED", cal.median, "median pixel value [ADU]");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::addCalibrated(const unsigned char* src, int w)
+{
+  pixel_t* dst = STATIC_CAST(pixel_t*, STATIC_CAST(void*, out));
+  unsigned short s;
+  unsigned int u;
+  float v;
+  int i;
+
+  if(calibMode == CALIB_FLOAT)
+    for(int x=0; x<w; x++) {
+      memcpy(&u, src + 4*x, sizeof(u));
+      u = __builtin_bswap32(u);
+      memcpy(&v, &u, sizeof(v));
+      i = STATIC_CAST(int, lrintf(v));
+      dst[x] = (i < -32768) ? -32768 : (i > 32767) ? 32767 : i;
+    }
+  else
+    for(int x=0; x<w; x++) {
+      memcpy(&s, src + 2*x, sizeof(s));
+      dst[x] = STATIC_CAST(pixel_t, __builtin_bswap16(s));
+    }
+  calStats.add(dst, w);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::publish(FITSHeader* header)
+{
+  int w = frame.width();
+  int h = frame.height();
+  int records = header->records();
+  FocusSlotHead* slot;
+  pixel_t* dst;
+  int i, y;
+
+  // a header grown beyond the slots takes a larger ring, never
+  // a truncated header. Readers are told to open it again
+
+  if(!focus.fits(records) && 
+     !focus.open(spec.path, spec.ringSlots, w, h, records + 1)) {
+    toRing = false;
+    setError(errno);
+    return;
+  }
+
+  slot = focus.begin();
+  slot->width   = w;
+  slot->height  = h;
+  slot->lost    = frame.lostRows();
+  slot->records = records;
+  header->render(FocusRing::header(slot), records);
+
+  // host order pixels, flipped as they would be saved
+
+  dst = focus.pixels(slot);
+  for(i=0; i<h; i++, dst += w) {
+    y = (spec.flipUD) ? h-1-i : i;
+    if(!frame.hasRow(y))
+      memset(dst, 0, w * sizeof(pixel_t));
+    else if(spec.flipLR)
+      PixKern::mirror(dst, frame.row(y), w);
+    else
+      memcpy(dst, frame.row(y), w * sizeof(pixel_t));
+  }
+
+  focus.commit(slot);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::persist(WriterSlot* cmd)
+{
+  FocusSlotHead* slot;
+  const pixel_t* src;
+  pixel_t* buf;
+  size_t rowBytes;
+  off_t hdrBytes, end;
+  int y;
+
+  slot = focus.slot(cmd->spec->slot);
+  if(slot == NULL)		// empty slot, nothing to save
+    return;
+
+  spec = *cmd->spec;
+  fd = ::open(spec.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    setError(errno);
+    return;
+  }
+
+  // this thread is the only ring writer, so the slot is stable here.
+  // Pixels are already flipped, only the byte swap is left
+
+  hdrBytes = STATIC_CAST(off_t, slot->records) * FITSHeader::RECORDSZ;
+  writeAt(FocusRing::header(slot), hdrBytes, 0);
+
+  rowBytes = slot->width * sizeof(pixel_t);
+  buf = new pixel_t[slot->width];
+  src = focus.pixels(slot);
+  for(y=0; y<slot->height; y++, src += slot->width) {
+    PixKern::swap(buf, src, slot->width);
+    writeAt(buf, rowBytes, hdrBytes + y * rowBytes);
+  }
+  delete [] buf;
+
+  end = hdrBytes + STATIC_CAST(off_t, slot->height) * rowBytes;
+  end = ((end + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ) 
+    * FITSHeader::RECORDSZ;
+  if(ftruncate(fd, end) == -1)
+    setError(errno);
+
+  if(::close(fd) == -1)
+    setError(errno);
+  fd = -1;
+
+  report(true, false);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::reserve(FITSHeader* header)
+{
+  // room for every keyword added on close (statistics, checksums,
+  // extension keywords ...), so that the data unit never moves.
+  // Never less than the traditional two records
+
+  hdrRecords = header->records(closeCards());
+  if(hdrRecords < FITSHeader::HEADERSZ / FITSHeader::RECORDSZ)
+    hdrRecords = FITSHeader::HEADERSZ / FITSHeader::RECORDSZ;
+
+  if(hdrRecords > maxRecords) {
+    delete [] hdrBuf;
+    maxRecords = hdrRecords;
+    hdrBuf = new char[maxRecords * FITSHeader::RECORDSZ];
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+DiskWriter::closeCards() const
+{
+  int n;
+
+  // keywords the event loop updates at readout are given one
+  // spare record, those of the writer are counted
+
+  n = FITSHeader::NUMCARDS;
+  n += 9;			// LOSTROWS, 6 statistics, DATASUM & CHECKSUM
+  if(overscanMode != OVERSCAN_NONE)
+    n += 4;
+  if(repair)
+    n += 2;
+  if(cosmicMode != COSMIC_NONE)
+    n += 4;			// with EXTEND
+  if(catalogMode != CATALOG_NONE)
+    n += 5;			// extractor, CATALOG & EXTEND
+  if(solving)
+    n += 18;			// world coordinates
+  if(spec.mef)			// PCOUNT & GCOUNT, and one more record 
+    n += 2 + FITSHeader::NUMCARDS; // as all extensions take the same size
+  return(n);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+DiskWriter::growHeader(int nrec)
+{
+  off_t shift = STATIC_CAST(off_t, nrec - hdrRecords) * FITSHeader::RECORDSZ;
+  off_t pos;
+  ssize_t len;
+  char* buf;
+
+  if(spec.mef) {		// extensions are spaced by a fixed size
+    errno = EOVERFLOW;
+    return(false);
+  }
+
+  // the data unit and any extension after it, last bytes first
+
+  buf = new char[SHIFT_CHUNK];
+  for(pos = fileEnd; pos > dataOffset; pos -= len) {
+    len = (pos - dataOffset < SHIFT_CHUNK) ? pos - dataOffset : SHIFT_CHUNK;
+    if(pread(fd, buf, len, pos - len) != len) {
+      delete [] buf;
+      if(errno == 0)
+	errno = EIO;
+      return(false);
+    }
+    writeAt(buf, len, pos - len + shift);
+  }
+  delete [] buf;
+
+  dataOffset += shift;
+  fileEnd    += shift;
+  hdrRecords  = nrec;
+  if(hdrRecords > maxRecords) {
+    delete [] hdrBuf;
+    maxRecords = hdrRecords;
+    hdrBuf = new char[maxRecords * FITSHeader::RECORDSZ];
+  }
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::addRows(int first, int n)
+{
+  if(overscanMode != OVERSCAN_NONE)
+    for(int y=first; y<first+n; y++)
+      overscan.subtract(frame.row(y), y);
+
+  // repaired as they will be calibrated, if they are
+
+  if(repair)
+    for(int y=first; y<first+n; y++)
+      repaired += defects.repair(frame.row(y), y, (calibMode) ? calib.offset(y) : 0);
+
+  if(!rebin)			// else accounted as saved
+    stats.add(frame.row(first), n * frame.width());
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::fitsRows(unsigned char* buf, int first, int n)
+{
+  int w = frame.width();
+  pixel_t* dst = STATIC_CAST(pixel_t*, STATIC_CAST(void*, buf));
+  int i, y;
+
+  // the chunk rows stay contiguous in the file when flipped
+  // upside down, only in reverse order. So one pwrite() suffices.
+
+  for(i=0; i<n; i++) {
+
+    y = (spec.flipUD) ? first+n-1-i : first+i;
+
+    // FITS needs a byte swap for x86
+
+    if(spec.flipLR)
+      PixKern::swapMirror(dst + i*w, frame.row(y), w);
+    else
+      PixKern::swap(dst + i*w, frame.row(y), w);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::writeRows(int first, int n)
+{
+  int h = frame.height();
+  size_t rowBytes = frame.width() * sizeof(pixel_t);
+  int top;
+
+  fitsRows(out, first, n);
+
+  top = (spec.flipUD) ? h-first-n : first;
+  if(rawFd != -1) {		// raw copy of a calibrated image
+    if(!pwriteAll(rawFd, out, n*rowBytes, dataOffset + STATIC_CAST(off_t, top)*rowBytes))
+      dropRaw(errno);		// the calibrated image is still saved
+    rawSum.add(out, n*rowBytes, STATIC_CAST(off_t, top)*rowBytes);
+    return;
+  }
+  writeAt(out, n*rowBytes, dataOffset + STATIC_CAST(off_t, top)*rowBytes);
+  dataSum.add(out, n*rowBytes, STATIC_CAST(off_t, top)*rowBytes);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::stageRows(int first, int n)
+{
+  int h = frame.height();
+  size_t rowBytes = frame.width() * sizeof(pixel_t);
+  int len = n * rowBytes;
+  off_t off = STATIC_CAST(off_t, (spec.flipUD) ? h-first-n : first) * rowBytes;
+  unsigned char* dst;
+
+  // a packet holds a row or two of a big CCD, one pwrite() each
+  // costs as much as the rest of the writer. Rows arrive in order,
+  // so they are gathered forwards, or backwards when upside down
+
+  if(len > STAGESZ) {
+    flushRows();
+    writeRows(first, n);
+    return;
+  }
+
+  if(stageLen > 0 && (stageLen + len > STAGESZ ||
+		      ((spec.flipUD) ? off + len != stageOff : off != stageOff + stageLen)))
+    flushRows();
+
+  if(spec.flipUD) {
+    dst = stage + STAGESZ - stageLen - len;
+    stageOff = off;
+  } else {
+    dst = stage + stageLen;
+    if(stageLen == 0)
+      stageOff = off;
+  }
+  stageLen += len;
+
+  fitsRows(dst, first, n);
+  dataSum.add(dst, len, off);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::flushRows()
+{
+  unsigned char* src = (spec.flipUD) ? stage + STAGESZ - stageLen : stage;
+
+  if(stageLen == 0)
+    return;
+  writeAt(src, stageLen, dataOffset + stageOff);
+  stageLen = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::writeRebinned(int first, int n)
+{
+  int o1, o2;
+
+  if(rebinner.add(first, n, &o1, &o2))
+    putRebinned(o1, o2);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::putRebinned(int o1, int o2)
+{
+  int w = outWidth;
+  size_t rowBytes = w * sizeof(pixel_t);
+  int batch = sizeof(out) / rowBytes;
+  pixel_t* dst = STATIC_CAST(pixel_t*, STATIC_CAST(void*, out));
+  const pixel_t* src;
+  int i, n, oy, top;
+
+  // as many rows per pwrite() as fit in out[], laid out as in writeRows()
+
+  for(; o1<o2; o1+=n) {
+    n = (o2-o1 < batch) ? o2-o1 : batch;
+    for(i=0; i<n; i++) {
+      oy  = (spec.flipUD) ? o1+n-1-i : o1+i;
+      src = rebinner.row(&frame, oy);
+      stats.add(src, w);
+      if(spec.flipLR)
+	PixKern::swapMirror(dst + i*w, src, w);
+      else
+	PixKern::swap(dst + i*w, src, w);
+    }
+    top = (spec.flipUD) ? outHeight-o1-n : o1;
+    writeAt(out, n*rowBytes, dataOffset + STATIC_CAST(off_t, top)*rowBytes);
+    dataSum.add(out, n*rowBytes, STATIC_CAST(off_t, top)*rowBytes);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::rejectCosmics()
+{
+  int w = frame.width();
+  int h = frame.height();
+  int batch = sizeof(out) / (w * sizeof(pixel_t));
+  int hits, y, n, o1, o2;
+
+  hits = cosmics.find(&frame, (calibMode) ? &calib : 0, &spec.cosmicPars,
+		      cosmicMode == COSMIC_CLEAN, &pool);
+
+  if(cosmicMode == COSMIC_MASK) {
+    outputs[noutputs++] = &cosmics;
+    return;
+  }
+  if(hits == 0)
+    return;
+
+  // rows were saved as they arrived, so they are all saved again
+  // cleaned, statistics and checksum starting over. Binned rows left
+  // incomplete are saved on close
+
+  stats.reset();
+  calStats.reset();
+  dataSum.reset();
+
+  if(rebin) {
+    for(o1=0; o1<outHeight; o1=o2) {
+      while(o1 < outHeight && !rebinner.complete(o1))
+	o1++;
+      for(o2=o1; o2<outHeight && rebinner.complete(o2); o2++)
+	;
+      if(o2 > o1)
+	putRebinned(o1, o2);
+    }
+    return;
+  }
+
+  // in runs of received rows, as many as a chunk holds
+
+  for(y=0; y<h; y+=n) {
+    for(n=0; n<batch && y+n<h && frame.hasRow(y+n); n++)
+      ;
+    if(n == 0) {
+      n = 1;
+      continue;
+    }
+    stats.add(frame.row(y), n * w);
+    if(calibMode)
+      writeCalibrated(y, n);	// the raw copy is left as read
+    else
+      writeRows(y, n);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::extractSources()
+{
+  const RebinGeom* g = &spec.rebinGeom;
+  const OverscanGeom* o = &spec.overscanGeom;
+
+  // only what is saved, never the overscan
+
+  if(rebin)
+    extractor.extract(&frame, 0, g->x, g->y, g->width, g->height,
+		      &spec.extractPars, &pool);
+  else if(overscanMode != OVERSCAN_NONE)
+    extractor.extract(&frame, 0, o->x, o->y, o->width, o->height,
+		      &spec.extractPars, &pool);
+  else
+    extractor.extract(&frame, (calibMode) ? &calib : 0, 0, 0, 0, 0,
+		      &spec.extractPars, &pool);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+DiskWriter::savedStars()
+{
+  const Source* src;
+  int n = 0;
+
+  if(extractor.count() > maxStars) {
+    delete [] starX;
+    delete [] starY;
+    maxStars = extractor.count();
+    starX = new double[maxStars];
+    starY = new double[maxStars];
+  }
+
+  // well measured stars only, still brightest first
+
+  for(int i=0; i<extractor.count(); i++) {
+    src = extractor.source(i);
+    if(!(src->flags & (SOURCE_EDGE | SOURCE_SATURATED)) &&
+       geom.toSaved(src->x, src->y, &starX[n], &starY[n]))
+      n++;
+  }
+  return(n);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::savedRow(int oy, float* dst)
+{
+  int y = (spec.flipUD) ? outHeight-1 - oy : oy;
+  int w = outWidth;
+  const pixel_t* src;
+  float v;
+
+  // rows lost in transmission, or binned from some lost, are blank
+
+  if((rebin) ? !rebinner.complete(y) : !frame.hasRow(y)) {
+    for(int x=0; x<w; x++)
+      dst[x] = NAN;
+    return;
+  }
+
+  if(calibMode)
+    calib.values(dst, frame.row(y), y);
+  else {
+    src = (rebin) ? rebinner.row(&frame, y) : frame.row(y);
+    for(int x=0; x<w; x++)
+      dst[x] = src[x];
+  }
+  if(spec.flipLR)
+    for(int x=0; x<w/2; x++) {
+      v = dst[x];
+      dst[x] = dst[w-1 - x];
+      dst[w-1 - x] = v;
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::solveField(FITSHeader* header)
+{
+  int n = savedStars();
+
+  solver.solve(&spec.solvePars, starX, starY, n, outWidth, outHeight);
+  solver.stamp(header);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::measureTargets(const FITSHeader* header)
+{
+  const RebinGeom* g = &spec.rebinGeom;
+  const OverscanGeom* o = &spec.overscanGeom;
+  double bin = (rebin) ? (g->binX + g->binY) / 2.0 : 1;
+  const PhotTarget* t;
+  PhotPars pars;
+  double x, y, fx, fy, exptime;
+
+  // sizes are given in pixels of the image as saved
+
+  pars = spec.photPars;
+  pars.radius *= bin;
+  pars.inner  *= bin;
+  pars.outer  *= bin;
+  pars.search *= bin;
+  if(!header->get("EXPTIME", &exptime))
+    exptime = 0;
+
+  // stars by RA & DEC go where every plate solution puts them,
+  // stars by pixel start there. Then they are tracked
+
+  for(int i=0; i<photometer.count(); i++) {
+    t = photometer.target(i);
+    if(t->world && solving && solver.pixel(t->a, t->b, &x, &y) &&
+       geom.toFrame(x, y, &fx, &fy))
+      photometer.place(i, fx, fy);
+    else if(!t->world && !t->placed && geom.toFrame(t->a - 1, t->b - 1, &fx, &fy))
+      photometer.place(i, fx, fy);
+  }
+
+  // only what is saved, never the overscan
+
+  if(rebin)
+    photometer.measure(&frame, 0, g->x, g->y, g->width, g->height, &pars, exptime);
+  else if(overscanMode != OVERSCAN_NONE)
+    photometer.measure(&frame, 0, o->x, o->y, o->width, o->height, &pars, exptime);
+  else
+    photometer.measure(&frame, (calibMode) ? &calib : 0, 0, 0, 0, 0, &pars, exptime);
+
+  photStar = -1;
+  for(int i=0; i<photometer.count() && photStar == -1; i++)
+    if(!photometer.target(i)->comparison)
+      photStar = i;
+  outputs[noutputs++] = &photometer;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::stackFrame(const FITSHeader* header, bool last)
+{
+  const StackResult* res = stacker.result();
+  float* row;
+  double exptime;
+
+  // a new stack at the start of every sequence, named after its
+  // first image, in the geometry saved
+
+  if(spec.stackStart || stacker.width() != outWidth || stacker.height() != outHeight) {
+    stacker.reset(outWidth, outHeight, &spec.stackPars);
+    stacker.nameAfter(spec.path);
+  }
+
+  for(int oy=0; oy<outHeight; oy++)
+    savedRow(oy, stacker.row(oy));
+  if(stacker.add(starX, starY, savedStars(), &pool))
+    stacker.describe(header);
+
+  // the stack should keep up with the sequence
+
+  if(!header->get("EXPTIME", &exptime))
+    exptime = 0;
+  stackLate = res->elapsed / 1000 > exptime;
+
+  // previewed as the image would have been, blank where empty
+
+  if(res->frames == 0)
+    return;
+  preview.reset(outWidth, outHeight, spec.preview, false, false);
+  row = new float[outWidth];
+  for(int oy=0; oy<outHeight; oy++) {
+    stacker.stackRow(oy, row, 0);
+    preview.add(row, oy);
+  }
+  delete [] row;
+  preview.finish();
+
+  if(last || (spec.stackPars.saveEvery > 0 && res->frames % spec.stackPars.saveEvery == 0))
+    outputs[noutputs++] = &stacker;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::differenceFrame(const FITSHeader* header)
+{
+  const RebinGeom* g = &spec.rebinGeom;
+  double bin = (rebin) ? sqrt(STATIC_CAST(double, g->binX * g->binY)) : 1;
+  float* fwhm = new float[extractor.count() + 1];
+  const Source* src;
+  int n = 0;
+
+  // the typical star size in pixels of the image as saved
+
+  for(int i=0; i<extractor.count(); i++) {
+    src = extractor.source(i);
+    if(!(src->flags & (SOURCE_EDGE | SOURCE_SATURATED)))
+      fwhm[n++] = src->fwhm / bin;
+  }
+  if(n > 0)
+    std::nth_element(fwhm, fwhm + n/2, fwhm + n);
+
+  differ.select(&spec.diffField, outWidth, outHeight, &spec.diffPars);
+  for(int oy=0; oy<outHeight; oy++)
+    savedRow(oy, differ.row(oy));
+  if(differ.add(starX, starY, savedStars(), (n > 0) ? fwhm[n/2] : 0, &pool) &&
+     differ.count() > 0)
+    outputs[noutputs++] = &differ;
+  delete [] fwhm;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::writeCalibrated(int first, int n)
+{
+  int h = frame.height();
+  size_t rowBytes = frame.width() * Calibrator::pixelSize(calibMode);
+  int i, y, top;
+
+  // the same layout as writeRows(), only wider pixels
+
+  for(i=0; i<n; i++) {
+    y = (spec.flipUD) ? first+n-1-i : first+i;
+    calib.row(calOut + i*rowBytes, frame.row(y), y, spec.flipLR, calibMode);
+    addCalibrated(calOut + i*rowBytes, frame.width());
+  }
+
+  top = (spec.flipUD) ? h-first-n : first;
+  writeAt(calOut, n*rowBytes, dataOffset + STATIC_CAST(off_t, top)*rowBytes);
+  dataSum.add(calOut, n*rowBytes, STATIC_CAST(off_t, top)*rowBytes);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::openRaw(FITSHeader* header)
+{
+  const char* ext;
+  off_t dataSize;
+  int n;
+
+  // 'name.fit' goes along with 'name_raw.fit'
+
+  ext = strrchr(spec.path, '.');
+  n   = (ext && !strchr(ext, '/')) ? ext - spec.path : strlen(spec.path);
+  snprintf(rawPath, sizeof(rawPath), "%.*s_raw%s", n, spec.path, spec.path + n);
+
+  rawFd = ::open(rawPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(rawFd == -1) {
+    warn(errno, rawPath);	// the calibrated image is still saved
+    return;
+  }
+  rawSum.reset();
+
+  // same header size as the calibrated image. The raw header is shorter
+
+  dataSize = STATIC_CAST(off_t, spec.width) * spec.height * sizeof(pixel_t);
+  dataSize = ((dataSize + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ)
+    * FITSHeader::RECORDSZ;
+  if(posix_fallocate(rawFd, 0, dataOffset + dataSize) != 0 &&
+     ftruncate(rawFd, dataOffset + dataSize) == -1) {
+    dropRaw(errno);
+    return;
+  }
+
+  header->render(hdrBuf, hdrRecords);
+  if(!pwriteAll(rawFd, hdrBuf, hdrRecords * FITSHeader::RECORDSZ, 0))
+    dropRaw(errno);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::closeRaw(FITSHeader* header)
+{
+  header->render(hdrBuf, hdrRecords, rawSum.value());
+  if(!pwriteAll(rawFd, hdrBuf, hdrRecords * FITSHeader::RECORDSZ, 0)) {
+    dropRaw(errno);
+    return;
+  }
+  if(::close(rawFd) == -1)
+    warn(errno, rawPath);
+  rawFd = -1;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::dropRaw(int err)
+{
+  // a partial raw file is worse than none
+
+  warn(err, rawPath);
+  ::close(rawFd);
+  unlink(rawPath);
+  rawFd = -1;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::writePrimary(int nextend)
+{
+  char buf[FITSHeader::RECORDSZ];
+  FITSHeader primary;
+
+  primary.set("NAXIS", 0, "no primary data, see extensions");
+  primary.erase("NAXIS1");
+  primary.erase("NAXIS2");
+  primary.set("EXTEND", true, "FITS dataset may contain extensions");
+  if(nextend >= 0)
+    primary.set("NEXTEND", nextend, "number of image extensions");
+  primary.render(buf, 1, 0);
+  writeAt(buf, sizeof(buf), 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::startMEF(FITSHeader* header)
+{
+  off_t dataSize;
+
+  dataSize = STATIC_CAST(off_t, outWidth) * outHeight * sizeof(pixel_t);
+  dataSize = ((dataSize + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ)
+    * FITSHeader::RECORDSZ;
+  reserve(header);
+  extSize  = hdrRecords * FITSHeader::RECORDSZ + dataSize;
+  extCount = 0;
+
+  // one allocation for the whole sequence, the file is trimmed 
+  // at the end if the sequence is cut short. Not fatal if it fails, 
+  // pwrite() extends the file anyway
+
+  posix_fallocate(fd, 0, FITSHeader::RECORDSZ + spec.frames * extSize);
+
+  writePrimary(0);
+  openExtension(header);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::openExtension(FITSHeader* header)
+{
+  hdrOffset  = FITSHeader::RECORDSZ + extCount * extSize;
+  dataOffset = hdrOffset + hdrRecords * FITSHeader::RECORDSZ;
+  dataSum.reset();
+
+  /* writes a temporary header, complete except for exposure dates & times */
+
+  header->toExtension();
+  header->render(hdrBuf, hdrRecords);
+  writeAt(hdrBuf, hdrRecords * FITSHeader::RECORDSZ, hdrOffset);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::endMEF()
+{
+  writePrimary(extCount);
+  if(ftruncate(fd, FITSHeader::RECORDSZ + extCount * extSize) == -1)
+    setError(errno);
+  extCount = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::startTiles(FITSHeader* header)
+{
+  int h = spec.height;
+
+  if(h > maxTiles) {
+    delete [] tiles;
+    maxTiles = h;
+    tiles = new int[2*maxTiles];
+  }
+  memset(tiles, 0, 2 * h * sizeof(int));
+  heapSize = 0;			// no worker runs yet
+  maxLen   = 0;
+
+  // an empty primary HDU, then the binary table extension:
+  // header, one (length, offset) descriptor per tile and the heap 
+
+  writePrimary(-1);
+
+  header->toZImage(spec.width, h, 0, 0);
+  reserve(header);
+
+  hdrOffset  = FITSHeader::RECORDSZ;
+  dataOffset = hdrOffset + hdrRecords * FITSHeader::RECORDSZ;
+  heapStart  = dataOffset + 2 * sizeof(int) * h;
+
+  header->render(hdrBuf, hdrRecords);
+  writeAt(hdrBuf, hdrRecords * FITSHeader::RECORDSZ, hdrOffset);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::endTiles(FITSHeader* header)
+{
+  int w = frame.width();
+  int h = frame.height();
+  unsigned char* buf = 0;
+  pixel_t* zeros;
+  int* table;
+  int y, len = 0, offset = 0;
+  off_t end;
+
+  // rows never received are coded as zeros.
+  // They all share a single tile in the heap.
+  // Workers are done, so the heap counters are ours again
+
+  for(y=0; y<h; y++) {
+    if(tiles[2*y] != 0)
+      continue;
+    if(buf == 0) {
+      buf   = new unsigned char[Rice::bound(w)];
+      zeros = new pixel_t[w];
+      memset(zeros, 0, w * sizeof(pixel_t));
+      len    = Rice::compress(zeros, w, buf);
+      offset = heapSize;
+      writeAt(buf, len, heapStart + offset);
+      dataSum.add(buf, len, heapStart + offset - dataOffset);
+      heapSize += len;
+      if(len > maxLen)
+	maxLen = len;
+      delete [] zeros;
+    }
+    tiles[2*y]   = len;
+    tiles[2*y+1] = offset;
+  }
+  delete [] buf;
+
+  // descriptors are big endian 32 bit integers
+
+  table = new int[2*h];
+  for(y=0; y<2*h; y++)
+    table[y] = htonl(tiles[y]);
+  writeAt(table, 2 * h * sizeof(int), dataOffset);
+  dataSum.add(table, 2 * h * sizeof(int), 0);
+  delete [] table;
+
+  // zero padding up to the end of the last record
+
+  end = heapStart + heapSize;
+  end = ((end + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ) 
+    * FITSHeader::RECORDSZ;
+  if(ftruncate(fd, end) == -1)
+    setError(errno);
+  fileEnd = end;
+
+  header->toZImage(w, h, heapSize, maxLen);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::compressJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(DiskWriter*, ctx)->compressRows(a, b);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::compressRows(int first, int n)
+{
+  int w = frame.width();
+  int h = frame.height();
+  unsigned char* buf;
+  pixel_t* tmp = 0;
+  const pixel_t* src;
+  int y, len;
+
+  buf = new unsigned char[Rice::bound(w)];
+  if(spec.flipLR)
+    tmp = new pixel_t[w];
+
+  // the Rice coder takes host order pixels, no byte swap needed
+
+  for(y=first; y<first+n; y++) {
+    src = frame.row(y);
+    if(spec.flipLR) {
+      PixKern::mirror(tmp, src, w);
+      src = tmp;
+    }
+    len = Rice::compress(src, w, buf);
+    storeTile((spec.flipUD) ? h-1-y : y, buf, len);
+  }
+
+  delete [] tmp;
+  delete [] buf;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+DiskWriter::storeTile(int tile, const unsigned char* buf, int len)
+{
+  int offset, m;
+
+  // the heap space is reserved atomically, 
+  // so that workers write their tiles concurrently
+
+  offset = __sync_fetch_and_add(&heapSize, len);
+  writeAt(buf, len, heapStart + offset);
+  dataSum.add(buf, len, heapStart + offset - dataOffset);
+  tiles[2*tile]   = len;
+  tiles[2*tile+1] = offset;
+
+  m = __sync_fetch_and_add(&maxLen, 0);
+  while(len > m && !__sync_bool_compare_and_swap(&maxLen, m, len))
+    m = __sync_fetch_and_add(&maxLen, 0);
+}
+
+/*---------------------------------------------------------------------------*/
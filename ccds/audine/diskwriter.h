@@ -0,0 +1,532 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_DISKWRITER_H
+#define AUDINE_DISKWRITER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "calib.h"
+#include "checksum.h"
+#include "cosmic.h"
+#include "defects.h"
+#include "difference.h"
+#include "fitshead.h"
+#include "focusmetrics.h"
+#include "focusring.h"
+#include "frame.h"
+#include "frameblob.h"
+#include "livestack.h"
+#include "overscan.h"
+#include "photometry.h"
+#include "platesolve.h"
+#include "preview.h"
+#include "rebin.h"
+#include "sidefile.h"
+#include "sources.h"
+#include "stats.h"
+#include "workpool.h"
+
+/*
+ * Commands carried by a writer slot.
+ * They are executed by the writer thread in the same order
+ * they were queued by the event loop.
+ */
+
+#define WR_OPEN   0		/* creates a new FITS file */
+#define WR_DATA   1		/* an image chunk as received from COR */
+#define WR_CLOSE  2		/* patches header and closes current image */
+#define WR_CANCEL 3		/* closes and deletes current FITS file */
+#define WR_QUIT   4		/* terminates the writer thread */
+#define WR_PERSIST 5		/* saves a focus ring slot as a FITS file */
+
+
+/* per-file parameters sent along with the WR_OPEN & WR_PERSIST commands */
+
+struct WriterSpec {
+  char path[256];		/* FITS file path or focus ring name */
+  int width;			/* image width in pixels */
+  int height;			/* image height in pixels */
+  int imageSize;		/* predicted image size in bytes */
+  bool flipLR;			/* save image flipped Left to Right */
+  bool flipUD;			/* save image flipped upside down */
+  bool rice;			/* save as Rice tile compressed image */
+  int ringSlots;		/* focus ring size, 0 to save a FITS file */
+  int slot;			/* focus ring slot for WR_PERSIST */
+  bool mef;			/* one IMAGE extension per image of a sequence */
+  int frames;			/* images expected in a multi-extension file */
+  int preview;			/* preview size in pixels, 0 for none */
+  int blob;			/* full frame BLOB, one of BLOB_xxx */
+  bool focus;			/* measure focus metrics */
+  int roiX;			/* focus region origin */
+  int roiY;
+  int roiWidth;			/* focus region size, 0 for the whole frame */
+  int roiHeight;
+  int calib;			/* calibrated output, one of CALIB_xxx */
+  bool calibRaw;		/* raw image also saved, as *_raw.fit */
+  char calibDir[256];		/* master frames directory */
+  CalibKey calibKey;		/* what master frames must match */
+  bool defects;			/* defects repaired with the chip map */
+  int overscan;			/* overscan correction, one of OVERSCAN_xxx */
+  OverscanGeom overscanGeom;	/* where the overscan is */
+  bool rebin;			/* saved cropped and/or software binned */
+  RebinGeom rebinGeom;		/* how */
+  int cosmic;			/* cosmic ray rejection, one of COSMIC_xxx */
+  CosmicPars cosmicPars;	/* how */
+  int catalog;			/* source catalog, one of CATALOG_xxx */
+  ExtractPars extractPars;	/* how */
+  bool solve;			/* plate solve from the sources found */
+  SolvePars solvePars;		/* how */
+  int photometry;		/* target photometry, one of PHOT_xxx */
+  char photTargets[256];	/* target list file, see Photometer */
+  PhotPars photPars;		/* how, in pixels of the image as saved */
+  bool liveStack;		/* stacked live along the sequence */
+  bool stackStart;		/* first image of a new stack */
+  StackPars stackPars;		/* how */
+  int difference;		/* reference differencing, one of DIFF_xxx */
+  DiffField diffField;		/* field of the image */
+  DiffPars diffPars;		/* how */
+};
+
+/* per-file results sent back to the event loop */
+
+struct WriterReport {
+  char path[256];		/* FITS file path or focus ring name */
+  bool file;			/* a new FITS file, else a focus ring frame */
+  int lost;			/* rows never received */
+  int dups;			/* duplicated chunks discarded */
+  int invalid;			/* chunks out of image bounds */
+  bool hasStats;		/* frame statistics below are valid */
+  bool uncalibrated;		/* saved raw, no master frame found */
+  bool calibSkipped;		/* saved raw, binned, cropped or overscan */
+				/* corrected unlike the master frames */
+  FrameStatistics stats;	/* frame statistics */
+  bool hasBias;			/* overscan level below is valid */
+  BiasLevel bias;		/* overscan level */
+  bool hasWCS;			/* plate solution below is valid */
+  bool unsolved;		/* plate solving failed */
+  WCSFit wcs;			/* plate solution */
+  bool hasPhot;			/* photometry below is valid */
+  bool unmeasured;		/* no target list to measure */
+  PhotMeasure phot;		/* photometry of the first target */
+  bool hasStack;		/* live stack state below is valid */
+  bool stackLate;		/* stacking took longer than the frame cadence */
+  StackResult stack;		/* live stack state */
+  bool hasDiff;			/* differencing state below is valid */
+  DiffResult diff;		/* differencing state */
+  DiffEvent event;		/* strongest event, in 0 based image pixels */
+  int warning;			/* errno of a side file not saved, 0 if none */
+  char warnPath[256];		/* that file, the image is saved anyway */
+};
+
+/* a pooled packet buffer. Most carry image data, so the few */
+/* per-file parameters go apart, owned by the writer once queued */
+
+struct WriterSlot {
+  int op;			/* one of WR_xxx commands */
+  int len;			/* bytes used in data[] */
+  FITSHeader* header;		/* header copy for WR_OPEN & WR_CLOSE */
+  WriterSpec* spec;		/* parameters for WR_OPEN & WR_PERSIST */
+  bool last;			/* WR_CLOSE of the last image of a sequence */
+  unsigned char data[sizeof(Incoming_Message)]; /* raw UDP message */
+};
+
+
+/*
+ * The disk writer decouples UDP image reception from FITS file I/O.
+ * The event loop (single producer) copies every packet into a
+ * preallocated ring of slots and returns immediately.
+ * A background thread (single consumer) drains the ring and performs
+ * all the file I/O.
+ * FITS files are preallocated to their final size when opened, and every
+ * chunk is written with pwrite() at its final position in the data unit,
+ * already flipped, as soon as it arrives. Only the header block is
+ * rewritten when the file is closed.
+ * Rice compressed images are written as fpack compatible binary tables
+ * with one tile per image row. Tiles are compressed by a pool of worker
+ * threads and appended to the heap in completion order.
+ * A whole sequence may also be saved as a single multi-extension file,
+ * preallocated for all its images, with one IMAGE extension per image.
+ * Focus frames may go to a shared memory ring instead, without any disk
+ * I/O. Ring slots can be saved later as FITS files on demand.
+ * A downsampled preview is binned along, for the event loop to publish.
+ * Complete frames may also be encoded as a FITS BLOB on request.
+ * Focus frames are measured (HFD, FWHM) as soon as they are complete.
+ * Single images may be calibrated row by row as they are written, 
+ * the raw image going optionally to a second file.
+ * Full frames with overscan may have it subtracted row by row, and 
+ * known chip defects be repaired from a map, also row by row.
+ * Images may be saved cropped (to the active area, say) and binned
+ * further by software, every output row being written once complete.
+ * Single images may have cosmic ray hits found once complete, either
+ * cleaned (the whole image is written again) or flagged in a mask
+ * extension appended to the file. They may also have their sources
+ * extracted, the catalog going to a binary table extension or to a
+ * file of its own, and be plate solved from them. Object images may
+ * have a list of stars measured, appended to a light curve file,
+ * and be stacked live as they come, the running stack being previewed
+ * instead of each image and saved now and then. They may also be
+ * differenced against a reference of their field, candidate events
+ * being appended to an event file.
+ * What the analysis finds is saved by the modules themselves, through
+ * the SavedImage view of the file, once the image is saved.
+ * This analysis of a complete image runs apart, in a thread of its own,
+ * and finishes its file. Meanwhile the writer keeps draining the ring,
+ * the rows of the next image being held back in a spare frame, which
+ * is written once the analysis is over.
+ */
+
+class DiskWriter : private SavedImage {
+
+ public:
+
+  static const int SLOTS = 2048; /* ring capacity in packets */
+  static const int STAGESZ = 256*1024; /* largest run of rows per pwrite() */
+  static const int RESERVE = 16; /* slots kept free for commands */
+  static const int OUTPUTS = 5;	/* analysis modules saving side outputs */
+
+  DiskWriter();
+ ~DiskWriter();
+
+  /* spawns the writer thread */
+  void start();
+
+  /* queues a WR_QUIT command and joins the writer thread */
+  void stop();
+
+  /****************************/
+  /* producer (event loop) API */
+  /****************************/
+
+  /* gets next free slot. Never blocks: NULL when the ring is full. */
+  /* Image data is refused earlier, leaving RESERVE slots for commands */
+  WriterSlot* acquire(bool data = false);
+
+  /* hands the acquired slot to the writer thread */
+  void commit();
+
+  /* current number of queued slots */
+  int depth() { return(__sync_fetch_and_add(&count, 0)); }
+
+  /* true while slots are queued or an image is still analyzed */
+  bool busy() { return(depth() > 0 || __sync_fetch_and_add(&analyzing, 0)); }
+
+  /* maximun number of queued slots since last reset */
+  int highWater() const { return(hwm); }
+
+  /* number of slots refused to the producer because the ring was full */
+  int drops() const { return(ndrops); }
+
+  /* resets high water mark & drop counters */
+  void resetStats() { hwm = depth(); ndrops = 0; }
+
+  /* returns errno of a failed file operation, 0 otherwise. Clears it */
+  int lastError();
+
+  /* pops the report of the oldest file already closed. false if none */
+  bool popDone(WriterReport* report);
+
+  /* gets the metrics of the last focus frame if not yet taken */
+  bool popFocus(FocusMetrics* metrics);
+
+  /* preview of the image being written */
+  Preview* getPreview() { return(&preview); }
+
+  /* last complete frame, encoded for the event loop to publish */
+  FrameBlob* getBlob() { return(&blob); }
+
+ private:
+
+  /* ring buffer and its indexes. */
+  /* Shared counters are only accessed through __sync builtins */
+  WriterSlot* ring;
+  int head;			/* next slot to fill (producer only) */
+  int tail;			/* next slot to drain (consumer only) */
+  int count;			/* queued slots (shared) */
+  int hwm;			/* high water mark (producer only) */
+  int ndrops;			/* slots refused to the producer (idem) */
+
+  sem_t freeSlots;		/* counts free slots */
+  sem_t usedSlots;		/* counts queued slots */
+
+  pthread_t thread;
+  bool running;
+
+  /* completion & error reporting back to the event loop */
+  pthread_mutex_t lock;
+  int error;			/* errno of last failed operation (shared) */
+  WriterReport done[8];		/* reports of recently closed files */
+  int ndone;
+  FocusMetrics focusResult;	/* metrics of the last focus frame */
+  bool focusReady;		/* not yet taken */
+
+  /********************************/
+  /* consumer (writer thread) side */
+  /********************************/
+
+  static const int SHIFT_CHUNK = 64 * FITSHeader::RECORDSZ; /* growHeader() moves */
+
+  int fd;			/* current FITS file, -1 if none */
+  off_t hdrOffset;		/* start of the image header */
+  off_t dataOffset;		/* start of data unit */
+  int hdrRecords;		/* header size reserved in the file */
+  char* hdrBuf;			/* rendered header */
+  int maxRecords;		/* capacity of hdrBuf[] in records */
+  DataSum dataSum;		/* DATASUM of current data unit */
+  WriterSpec spec;		/* current file parameters */
+  Frame frame;			/* reassembly buffer for current image */
+  FrameStats stats;		/* statistics accumulator */
+  FrameStats calStats;		/* same, of the calibrated image saved */
+  FrameStatistics result;	/* statistics of the last complete frame */
+  Preview preview;		/* binned as rows arrive */
+  FrameBlob blob;		/* full frame BLOB */
+  FocusAnalyzer analyzer;	/* focus metrics */
+  Calibrator calib;		/* master frames */
+  int calibMode;		/* CALIB_xxx of the current file */
+  bool calibSkipped;		/* calibration requested but not possible */
+  int rawFd;			/* raw image file, -1 if none */
+  char rawPath[256];		/* its name */
+  DataSum rawSum;		/* its DATASUM */
+  int warning;			/* side file not saved, for the next report */
+  char warnPath[256];		/* its name */
+  unsigned char calOut[2*sizeof(Incoming_Message)]; /* calibrated chunk rows */
+  DefectMap defects;		/* chip defects */
+  bool repair;			/* current image repaired */
+  int repaired;			/* its pixels repaired so far */
+  Overscan overscan;		/* row overscan levels */
+  int overscanMode;		/* OVERSCAN_xxx of the current image */
+  bool rebin;			/* current file cropped and/or binned */
+  Rebinner rebinner;		/* its rows */
+  CosmicRays cosmics;		/* cosmic ray hits */
+  int cosmicMode;		/* COSMIC_xxx of the current image */
+  SourceExtractor extractor;	/* sources */
+  int catalogMode;		/* CATALOG_xxx of the current image */
+  PlateSolver solver;		/* world coordinates */
+  bool solving;			/* current image plate solved */
+  double* starX;		/* its sources in the file pixels */
+  double* starY;
+  int maxStars;			/* capacity of starX[] & starY[] */
+  Photometer photometer;	/* target photometry */
+  int photMode;			/* PHOT_xxx of the current image */
+  int photStar;			/* star reported, -1 if none */
+  LiveStack stacker;		/* running stack of the sequence */
+  bool stacking;		/* current image stacked */
+  bool stackLate;		/* and it took longer than the frame cadence */
+  Differencer differ;		/* per field reference differencing */
+  int diffMode;			/* DIFF_xxx of the current image */
+  off_t fileEnd;		/* end of the last HDU written */
+  int outWidth;			/* image size in the file */
+  int outHeight;
+  SavedGeom geom;		/* where the frame pixels go in it */
+  SideOutput* outputs[OUTPUTS];	/* modules with something to save, in order */
+  int noutputs;
+  BiasLevel bias;		/* overscan level of the last complete frame */
+  FocusRing focus;		/* last focus frames */
+  bool toRing;			/* current image goes to the focus ring */
+  unsigned char out[sizeof(Incoming_Message)]; /* chunk rows in FITS layout */
+  unsigned char* stage;		/* run of rows adjacent in the file */
+  int stageLen;			/* its bytes, at the end if upside down */
+  off_t stageOff;		/* its data unit offset */
+
+  /* multi-extension output */
+  off_t extSize;		/* bytes per IMAGE extension */
+  int extCount;			/* extensions complete */
+
+  /* Rice compressed output */
+  WorkerPool pool;		/* tile compressors */
+  int* tiles;			/* (length, heap offset) per tile */
+  int maxTiles;			/* capacity of tiles[] */
+  off_t heapStart;		/* start of compressed tiles heap */
+  int heapSize;			/* bytes used in heap (shared by workers) */
+  int maxLen;			/* largest compressed tile (idem) */
+
+  /* analysis of a complete image */
+  WorkerPool post;		/* runs it, one image at a time */
+  int analyzing;		/* an image is being analyzed (shared) */
+  FITSHeader* postHead;		/* its header, owned by the analysis */
+  WriterSpec* nextSpec;		/* next image, held back meanwhile */
+  FITSHeader* nextHead;		/* its header */
+  Frame early;			/* its rows received meanwhile */
+
+  static void* run(void* arg);	/* thread entry point */
+  void loop();			/* thread main loop */
+
+  void open(const WriterSpec* s, FITSHeader* header);
+  void close(WriterSlot* slot);
+
+  /* analyzes the complete image if requested, then writes */
+  /* the final header and reports. Closes the file if 'last' */
+  void finish(FITSHeader* header, bool last);
+
+  /* finish() of the image handed to the analysis thread */
+  static void analyzeJob(void* ctx, int a, int b);
+
+  /* keeps the next image aside while the last one is analyzed */
+  /* false if the slot has to wait for the analysis instead */
+  bool holdBack(WriterSlot* slot);
+
+  /* opens the image held back and writes the rows received, */
+  /* or just forgets it if not 'keep' */
+  void resume(bool keep);
+  void cancel();
+  void persist(WriterSlot* slot);
+  void setError(int err);
+
+  /* SavedImage view of the current file for side outputs. */
+  /* Warnings go to the next report */
+  const char* path() const { return(spec.path); }
+  int extension() const { return((spec.mef) ? extCount + 1 : 0); }
+  const SavedGeom* geometry() const { return(&geom); }
+  bool world(double x, double y, double* ra, double* dec) const
+    { return(solving && solver.world(x, y, ra, dec)); }
+  void append(FITSHeader* header, FITSHeader* ext, const void* data, off_t size);
+  void warn(int err, const char* path);
+
+  /* queues a report for the event loop, with frame statistics or not */
+  void report(bool file, bool stats);
+
+  /* computes frame statistics and adds them to the header */
+  void finishStats(FITSHeader* header);
+
+  /* same for the calibrated pixels saved, saturation as read */
+  void finishCalibrated(FITSHeader* header);
+
+  /* accounts a calibrated row in FITS layout */
+  void addCalibrated(const unsigned char* src, int w);
+
+  /* measures focus metrics if requested */
+  void measureFocus();
+
+  /* encodes the complete frame as a BLOB if requested */
+  void sendBlob(const FITSHeader* header);
+
+  /* copies the complete frame into the focus ring */
+  void publish(FITSHeader* header);
+
+  /* corrects, previews and writes 'n' just placed rows from 'first' */
+  void takeRows(int first, int n);
+
+  /* reserves header records for 'header' plus the keywords added later */
+  void reserve(FITSHeader* header);
+
+  /* worst case number of keywords close() adds to the image header */
+  int closeCards() const;
+
+  /* moves the data unit down so that the header takes 'nrec' records */
+  /* false if it can not (errno) */
+  bool growHeader(int nrec);
+
+  /* corrects 'n' just placed rows from 'first' and accounts them */
+  void addRows(int first, int n);
+
+  /* writes 'n' just placed rows from 'first' at their final offset */
+  void writeRows(int first, int n);
+
+  /* same, but rows adjacent in the file are gathered into a single */
+  /* pwrite(), delayed until the run is broken, full or flushed */
+  void stageRows(int first, int n);
+
+  /* writes the staged run, if any */
+  void flushRows();
+
+  /* lays out 'n' rows from 'first' in FITS order into 'dst' */
+  void fitsRows(unsigned char* dst, int first, int n);
+
+  /* same for a cropped and/or binned image, the output rows they complete */
+  void writeRebinned(int first, int n);
+
+  /* writes output rows [o1, o2) of a cropped and/or binned image */
+  void putRebinned(int o1, int o2);
+
+  /* finds the cosmic ray hits of the complete image, then cleans */
+  /* and writes it again or has the mask of the hits appended */
+  void rejectCosmics();
+
+  /* extracts the sources of the complete image */
+  void extractSources();
+
+  /* well measured sources in the pixels of the file, brightest first */
+  /* into starX[] & starY[]. Returns how many */
+  int savedStars();
+
+  /* row 'oy' of the file as decimal pixels, NaN if lost */
+  void savedRow(int oy, float* dst);
+
+  /* plate solves the image from its sources and adds the WCS */
+  void solveField(FITSHeader* header);
+
+  /* measures the target list stars of the complete image */
+  void measureTargets(const FITSHeader* header);
+
+  /* adds the complete image to the live stack, previews the stack */
+  /* and has it saved if due or after the last image */
+  void stackFrame(const FITSHeader* header, bool last);
+
+  /* differences the complete image against the reference of its field */
+  void differenceFrame(const FITSHeader* header);
+
+  /* same for a calibrated image */
+  void writeCalibrated(int first, int n);
+
+  /* creates the raw image file of a calibrated image */
+  void openRaw(FITSHeader* header);
+
+  /* rewrites its header and closes it */
+  void closeRaw(FITSHeader* header);
+
+  /* gives it up on a write error, reported as a warning */
+  void dropRaw(int err);
+
+  /* writes an empty primary HDU. No NEXTEND keyword if 'nextend' < 0 */
+  void writePrimary(int nextend);
+
+  /* preallocates a multi-extension file for the whole sequence */
+  void startMEF(FITSHeader* header);
+
+  /* writes the temporary header of the next extension */
+  void openExtension(FITSHeader* header);
+
+  /* writes final primary header and trims unused extensions */
+  void endMEF();
+
+  /* writes the primary HDU and reserves the tile table */
+  void startTiles(FITSHeader* header);
+
+  /* codes missing rows and writes the tile table. Pool must be idle */
+  void endTiles(FITSHeader* header);
+
+  /* compresses rows [a, a+b) into tiles. Runs in the worker pool */
+  static void compressJob(void* ctx, int a, int b);
+  void compressRows(int first, int n);
+
+  /* appends a compressed tile to the heap */
+  void storeTile(int tile, const unsigned char* buf, int len);
+
+  /* writes a whole buffer at a given file offset */
+  void writeAt(const void* buf, size_t len, off_t offset) {
+    if(!pwriteAll(fd, buf, len, offset))
+      setError(errno);
+  }
+};
+
+#endif
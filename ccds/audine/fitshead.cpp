@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include "fitshead.h"
+#include "checksum.h"
 
 
 #define MAX(a,b) ((a > b) ? (a) : (b))
@@ -29,191 +30,427 @@
 
 /*---------------------------------------------------------------------------*/
 
-const char*
-FITSHeader::formatKey(const char* key)
+static unsigned int
+hashKey(const char* key)
 {
-  static char _key[KEYSZ+1];		/* keyword scratch pad buffer */
+  unsigned int h = 2166136261u;	// FNV-1a
 
-  strncpy(_key, key, KEYSZ);
-  _key[KEYSZ] = 0;		// make sure string is null terminated
-  return(_key);
+  for(int i=0; i<FITSHeader::KEYSZ && key[i]; i++)
+    h = (h ^ static_cast<unsigned char>(key[i])) * 16777619u;
+  return(h);
 }
 
 /*---------------------------------------------------------------------------*/
 
-void 
-FITSHeader::format(const char* key, bool val, const char* comment)
+int
+FITSHeader::probe(const char* key) const
 {
-  int len;
-  char c = (val) ? 'T' : 'F';
+  unsigned int mask = indexSize - 1;
+  unsigned int pos  = hashKey(key) & mask;
 
-  if(comment)
-    snprintf(pad, sizeof pad, "%-8s= %20c / %s",formatKey(key), c, comment);
-  else
-    snprintf(pad, sizeof pad, "%-8s= %20c", formatKey(key), c);
+  // linear probing. The table is never more than half full
 
-  len = strlen(pad);
-  if(len < CARDSZ) {
-    memset(&pad[len], BLANK, CARDSZ - len);
-    pad[CARDSZ] = 0;
-  }
+  while(index[pos] != -1 && strncmp(at(index[pos]).key, key, KEYSZ))
+    pos = (pos + 1) & mask;
+  return(pos);
+}
+
+/*---------------------------------------------------------------------------*/
 
+int
+FITSHeader::find(const char* key) const
+{
+  return(index[probe(key)]);
 }
 
 /*---------------------------------------------------------------------------*/
 
-void 
-FITSHeader::format(const char* key, int val, const char* comment)
+bool
+FITSHeader::owned(int id) const
 {
-  int len;
+  // only this header could add a new reference to the page
 
-  if(comment)
-    snprintf(pad, sizeof pad, "%-8s= %20d / %s", formatKey(key), val, comment);
-  else
-    snprintf(pad, sizeof pad, "%-8s= %20d", formatKey(key), val);
+  return(__sync_add_and_fetch(&pages[id / NUMCARDS]->refs, 0) == 1);
+}
 
-  len = strlen(pad);
-  if(len < CARDSZ) {
-    memset(&pad[len], BLANK, CARDSZ - len);
-    pad[CARDSZ] = 0;
+/*---------------------------------------------------------------------------*/
+
+FITSHeader::Card&
+FITSHeader::edit(int id)
+{
+  CardPage* page;
+  int p = id / NUMCARDS;
+
+  // a shared page is copied before its first change,
+  // the other headers keep on using the original
+
+  if(!owned(id)) {
+    page = new CardPage;
+    page->refs = 1;
+    for(int i=0; i<NUMCARDS; i++)
+      page->card[i] = pages[p]->card[i];
+    if(__sync_sub_and_fetch(&pages[p]->refs, 1) == 0)
+      delete pages[p];
+    pages[p] = page;
   }
+  return(pages[p]->card[id % NUMCARDS]);
 }
 
 /*---------------------------------------------------------------------------*/
 
-void 
-FITSHeader::format(const char* key, double val, const char* comment)
+void
+FITSHeader::indexAdd(int id)
 {
+  int pos = probe(at(id).key);
 
-  int len;
+  // repeated keywords are chained, the newest one is indexed
 
-  if(comment)
-    snprintf(pad, sizeof pad, "%-8s= %20g / %s", formatKey(key), val, comment);
-  else
-    snprintf(pad, sizeof pad, "%-8s= %20g", formatKey(key), val);
+  edit(id).same = index[pos];
+  index[pos] = id;
+}
 
-  len = strlen(pad);
-  if(len < CARDSZ) {
-    memset(&pad[len], BLANK, CARDSZ - len);
-    pad[CARDSZ] = 0;
-  }  
+/*---------------------------------------------------------------------------*/
+
+void
+FITSHeader::indexRemove(int id)
+{
+  unsigned int mask = indexSize - 1;
+  unsigned int hole, pos, home;
+  int link;
+
+  hole = probe(at(id).key);
+  if(index[hole] != id) {	// an older card with a repeated keyword
+    for(link = index[hole]; at(link).same != -1; link = at(link).same)
+      if(at(link).same == id) {
+	edit(link).same = at(id).same;
+	break;
+      }
+    return;
+  }
+
+  if(at(id).same != -1) {	// the older one takes its place
+    index[hole] = at(id).same;
+    return;
+  }
+
+  // backward shift deletion, so that no tombstones are left behind:
+  // following entries of the cluster move back into the hole
+  // unless their home position lies cyclically after the hole
+
+  index[hole] = -1;
+  for(pos = (hole + 1) & mask; index[pos] != -1; pos = (pos + 1) & mask) {
+    home = hashKey(at(index[pos]).key) & mask;
+    if(((pos - home) & mask) >= ((pos - hole) & mask)) {
+      index[hole] = index[pos];
+      index[pos]  = -1;
+      hole = pos;
+    }
+  }
 }
 
 /*---------------------------------------------------------------------------*/
 
-void 
-FITSHeader::format(const char* key, const char* val, const char* comment)
+void
+FITSHeader::grow()
 {
-  int len;
-  char strbuf[68+1];
+  CardPage** table;
+  int* old;
+  int oldSize, i, base;
+
+  // the pool grows a whole record at a time
+
+  table = new CardPage*[npages + 1];
+  for(i=0; i<npages; i++)
+    table[i] = pages[i];
+  table[npages] = new CardPage;
+  table[npages]->refs = 1;
+  delete [] pages;
+  pages = table;
+
+  base = npages * NUMCARDS;
+  for(i=0; i<NUMCARDS; i++)
+    pages[npages]->card[i].next = (i+1 < NUMCARDS) ? base+i+1 : freeList;
+  freeList = base;
+  npages++;
+
+  if(2*npages*NUMCARDS <= indexSize)
+    return;
 
-  strncpy(strbuf, val, 68);	// make sure val string can be held between ' '
+  // only chain heads are in the table, so they are simply rehashed
+
+  old = index;
+  oldSize = indexSize;
+  for(indexSize = 64; indexSize < 2*npages*NUMCARDS; indexSize <<= 1)
+    ;
+  index = new int[indexSize];
+  for(i=0; i<indexSize; i++)
+    index[i] = -1;
+  for(i=0; i<oldSize; i++)
+    if(old[i] != -1)
+      index[probe(at(old[i]).key)] = old[i];
+  delete [] old;
+}
 
-  if(comment) {
+/*---------------------------------------------------------------------------*/
 
-    len = strlen(val);
-    len = MAX(len, 8);
+int
+FITSHeader::place(const char* key, int after)
+{
+  int id, next;
+
+  if(freeList == -1)
+    grow();
+
+  id = freeList;
+  freeList = at(id).next;
+
+  Card& card = edit(id);
+  strncpy(card.key, key, KEYSZ);
+  card.key[KEYSZ] = 0;		// make sure string is null terminated
+  card.type = CARD_VOID;
+  card.text[0] = 0;
+  card.comment[0] = 0;
+  card.dirty = true;
+  indexAdd(id);
+
+  // links the card in header order
+
+  next = (after == -1) ? first : at(after).next;
+  edit(id).prev = after;
+  edit(id).next = next;
+  if(next == -1)
+    last = id;
+  else
+    edit(next).prev = id;
+  if(after == -1)
+    first = id;
+  else
+    edit(after).next = id;
 
-    if(len <19) {		// comment is justified
-      snprintf(pad, sizeof pad, "%-8s= '%-8s'%*c / %s",
-	       formatKey(key), strbuf, 18-len, BLANK, comment);
-    } else {			// comment just follows string
-      snprintf(pad, sizeof pad, "%-8s= '%-8s' / %s",
-	       formatKey(key), strbuf, comment);
-    }
-  }
+  ncards++;
+  return(id);
+}
 
-  else				// no comment
-    snprintf(pad, sizeof pad, "%-8s= '%-8s'", formatKey(key), strbuf);
+/*---------------------------------------------------------------------------*/
 
-  len = strlen(pad);
-  if(len < CARDSZ) {
-    memset(&pad[len], BLANK, CARDSZ - len);
-    pad[CARDSZ] = 0;
-  }
+void
+FITSHeader::release()
+{
+  for(int i=0; i<npages; i++)
+    if(__sync_sub_and_fetch(&pages[i]->refs, 1) == 0)
+      delete pages[i];
+  delete [] pages;
+  pages  = 0;
+  npages = 0;
 }
 
 /*---------------------------------------------------------------------------*/
 
-void 
-FITSHeader::formatVoid(const char* key, const char* comment)
+void
+FITSHeader::copy(const FITSHeader& other)
 {
-  int len;
+  int i;
 
-  snprintf(pad, sizeof pad, "%-8s%s", formatKey(key), comment);
+  // pages are shared, only the page table and the index are copied
 
-  len = strlen(pad);
-  if(len < CARDSZ) {
-    memset(&pad[len], BLANK, CARDSZ - len);
-    pad[CARDSZ] = 0;
+  for(i=0; i<other.npages; i++)
+    __sync_add_and_fetch(&other.pages[i]->refs, 1);
+  release();
+  pages = new CardPage*[other.npages];
+  for(i=0; i<other.npages; i++)
+    pages[i] = other.pages[i];
+  npages = other.npages;
+
+  if(indexSize != other.indexSize) {
+    delete [] index;
+    index = new int[other.indexSize];
+    indexSize = other.indexSize;
   }
+  memcpy(index, other.index, indexSize * sizeof(int));
+
+  ncards   = other.ncards;
+  first    = other.first;
+  last     = other.last;
+  freeList = other.freeList;
 }
 
 /*---------------------------------------------------------------------------*/
 
 void 
-FITSHeader::end()
+FITSHeader::assign(int id, bool val, const char* comment)
 {
-  sprintf(pad, "%-80s","END");
-  memcpy(header, pad, CARDSZ);
-  lastCard = 0;
+  Card& card = edit(id);
+
+  card.type = CARD_BOOL;
+  card.val.b = val;
+  strncpy(card.comment, (comment) ? comment : "", CARDSZ);
+  card.comment[CARDSZ] = 0;
+  card.dirty = true;
 }
 
 /*---------------------------------------------------------------------------*/
 
 void 
-FITSHeader::append()
+FITSHeader::assign(int id, int val, const char* comment)
 {
-  if(lastCard == 2*NUMCARDS -1)
-    return;			// siently ignores appending to a full header
+  Card& card = edit(id);
 
-  // move the END card to a higher location
-  memcpy(&header[CARDSZ*(lastCard+1)], &header[CARDSZ*lastCard], CARDSZ);
+  card.type = CARD_INT;
+  card.val.i = val;
+  strncpy(card.comment, (comment) ? comment : "", CARDSZ);
+  card.comment[CARDSZ] = 0;
+  card.dirty = true;
+}
 
-  // move the new card to the last used location
-  memcpy(&header[CARDSZ*lastCard], pad, CARDSZ);
+/*---------------------------------------------------------------------------*/
 
-  lastCard++;
+void 
+FITSHeader::assign(int id, double val, const char* comment)
+{
+  Card& card = edit(id);
+
+  card.type = CARD_DOUBLE;
+  card.val.d = val;
+  strncpy(card.comment, (comment) ? comment : "", CARDSZ);
+  card.comment[CARDSZ] = 0;
+  card.dirty = true;
 }
 
 /*---------------------------------------------------------------------------*/
 
 void 
-FITSHeader::init()
+FITSHeader::assign(int id, const char* val, const char* comment)
 {
-  end();			// generates the END keyword
-  set("SIMPLE", true, "File does conform to FITS standard");
-  set("BITPIX", 16, "Number of bits per data pixel");
-  set("NAXIS", 2, "Number of data axes");
-  set("NAXIS1", 1, "columns");	// fake value to make room
-  set("NAXIS2", 1, "rows");	// fake value to make room
-  appendVoid("COMMENT", "Written by INDI driver 'PACORRO'");
-  appendVoid("COMMENT", "Programa de Adquisicion del COR de Rafael gOnzalez");
+  Card& card = edit(id);
 
-  for(int i=lastCard+1; i<2*NUMCARDS; i++)
-    memset(&header[i*CARDSZ],BLANK, CARDSZ);
+  // make sure val string can be held between ' '
+
+  card.type = CARD_STRING;
+  strncpy(card.text, val, STRINGSZ);
+  card.text[STRINGSZ] = 0;
+  strncpy(card.comment, (comment) ? comment : "", CARDSZ);
+  card.comment[CARDSZ] = 0;
+  card.dirty = true;
 }
 
 /*---------------------------------------------------------------------------*/
 
-int
-FITSHeader::find(const char* key)
+void 
+FITSHeader::assignVoid(int id, const char* text)
 {
-  int i;
-  char buf[KEYSZ+1];
+  Card& card = edit(id);
 
-  snprintf(buf, sizeof(buf), "%-8s", key);
-  
-  // starting from the end of header.
-  // convenient to edit the last COMMENT or HISTORY card
+  card.type = CARD_VOID;
+  strncpy(card.text, text, CARDSZ);
+  card.text[CARDSZ] = 0;
+  card.comment[0] = 0;
+  card.dirty = true;
+}
 
-  for(i=lastCard; i > -1; i--) {
-    if(!strncmp(&header[CARDSZ*i], buf, KEYSZ)) {
-      break;
+/*---------------------------------------------------------------------------*/
+
+void 
+FITSHeader::format(const Card* card, char* image) const
+{
+  char pad[3*CARDSZ];		// scratchpad buffer, room for any card
+  const char* comment = (card->comment[0]) ? card->comment : 0;
+  int len;
+
+  switch(card->type) {
+
+  case CARD_BOOL:
+    if(comment)
+      snprintf(pad, sizeof pad, "%-8s= %20c / %s", card->key, 
+	       (card->val.b) ? 'T' : 'F', comment);
+    else
+      snprintf(pad, sizeof pad, "%-8s= %20c", card->key, 
+	       (card->val.b) ? 'T' : 'F');
+    break;
+
+  case CARD_INT:
+    if(comment)
+      snprintf(pad, sizeof pad, "%-8s= %20d / %s", card->key, card->val.i, comment);
+    else
+      snprintf(pad, sizeof pad, "%-8s= %20d", card->key, card->val.i);
+    break;
+
+  case CARD_DOUBLE:
+    if(comment)
+      snprintf(pad, sizeof pad, "%-8s= %20.12G / %s", card->key, card->val.d, comment);
+    else
+      snprintf(pad, sizeof pad, "%-8s= %20.12G", card->key, card->val.d);
+    break;
+
+  case CARD_STRING:
+    if(comment) {
+
+      len = strlen(card->text);
+      len = MAX(len, 8);
+
+      if(len <19) {		// comment is justified
+	snprintf(pad, sizeof pad, "%-8s= '%-8s'%*c / %s",
+		 card->key, card->text, 18-len, BLANK, comment);
+      } else {			// comment just follows string
+	snprintf(pad, sizeof pad, "%-8s= '%-8s' / %s",
+		 card->key, card->text, comment);
+      }
     }
+
+    else			// no comment
+      snprintf(pad, sizeof pad, "%-8s= '%-8s'", card->key, card->text);
+    break;
+
+  default:
+    snprintf(pad, sizeof pad, "%-8s%s", card->key, card->text);
+    break;
   }
 
-  return(i);
+  // long strings & comments are clipped to a single card
+
+  len = strlen(pad);
+  if(len > CARDSZ)
+    len = CARDSZ;
+  memcpy(image, pad, len);
+  memset(image + len, BLANK, CARDSZ - len);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void 
+FITSHeader::rename(const char* key, const char* newKey)
+{
+  int card;
+
+  card = find(key);
+  if(card == -1)
+    return;
+
+  indexRemove(card);
+  strncpy(edit(card).key, newKey, KEYSZ);
+  edit(card).key[KEYSZ] = 0;
+  edit(card).dirty = true;
+  indexAdd(card);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void 
+FITSHeader::init()
+{
+  ncards   = 0;
+  first    = -1;
+  last     = -1;
+  freeList = -1;
+  grow();			// the usual header never grows
+  grow();
+
+  set("SIMPLE", true, "File does conform to FITS standard");
+  set("BITPIX", 16, "Number of bits per data pixel");
+  set("NAXIS", 2, "Number of data axes");
+  set("NAXIS1", 1, "columns");	// fake value to make room
+  set("NAXIS2", 1, "rows");	// fake value to make room
+  appendVoid("COMMENT", "Written by INDI driver 'PACORRO'");
+  appendVoid("COMMENT", "Programa de Adquisicion del COR de Rafael gOnzalez");
 }
 
 /*---------------------------------------------------------------------------*/
@@ -223,13 +460,10 @@ FITSHeader::set(const char* key, bool val, const char* comment)
 {
   int card;
 
-  format(key, val, comment);
   card = find(key);
   if(card == -1)
-    append();
-  else {
-    memcpy(&header[card*CARDSZ], pad, CARDSZ);
-  }
+    card = place(key, last);
+  assign(card, val, comment);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -239,13 +473,10 @@ FITSHeader::set(const char* key, int val, const char* comment)
 {
   int card;
 
-  format(key, val, comment);
   card = find(key);
   if(card == -1)
-    append();
-  else {
-    memcpy(&header[card*CARDSZ], pad, CARDSZ);
-  }
+    card = place(key, last);
+  assign(card, val, comment);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -255,13 +486,10 @@ FITSHeader::set(const char* key, double val, const char* comment)
 {
   int card;
 
-  format(key, val, comment);
   card = find(key);
   if(card == -1)
-    append();
-  else {
-    memcpy(&header[card*CARDSZ], pad, CARDSZ);
-  }
+    card = place(key, last);
+  assign(card, val, comment);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -271,13 +499,10 @@ FITSHeader::set(const char* key, const char* val, const char* comment)
 {
   int card;
 
-  format(key, val, comment);
   card = find(key);
   if(card == -1)
-    append();
-  else {
-    memcpy(&header[card*CARDSZ], pad, CARDSZ);
-  }
+    card = place(key, last);
+  assign(card, val, comment);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -287,13 +512,10 @@ FITSHeader::setVoid(const char* key, const char* comment)
 {
   int card;
 
-  formatVoid(key, comment);
   card = find(key);
   if(card == -1)
-    append();
-  else {
-    memcpy(&header[card*CARDSZ], pad, CARDSZ);
-  }
+    card = place(key, last);
+  assignVoid(card, comment);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -301,8 +523,7 @@ FITSHeader::setVoid(const char* key, const char* comment)
 void 
 FITSHeader::appendVoid(const char* key, const char* comm)
 {  
-  formatVoid(key, comm);
-  append();
+  assignVoid(place(key, last), comm);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -310,22 +531,74 @@ FITSHeader::appendVoid(const char* key, const char* comm)
 void 
 FITSHeader::erase(const char* key)
 {
-  int card;
-
-  if(lastCard < 0)		// empty header
-    return;
+  int card, prev, next;
 
   card = find(key);		// not found
   if(card == -1)
     return;
 
-  // shift down cards
-  for(int i=card+1; i<= lastCard; i++)
-    memcpy(&header[(i-1)*CARDSZ], &header[i*CARDSZ], CARDSZ);
+  indexRemove(card);
+
+  // unlinks the card, nothing else moves
+
+  prev = at(card).prev;
+  next = at(card).next;
+  if(prev == -1)
+    first = next;
+  else
+    edit(prev).next = next;
+  if(next == -1)
+    last = prev;
+  else
+    edit(next).prev = prev;
 
-  // clears old top keyword
-  memset(&header[lastCard*CARDSZ], BLANK, CARDSZ);
-  lastCard--;
+  edit(card).next = freeList;
+  freeList = card;
+  ncards--;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+FITSHeader::get(const char* key, double* val) const
+{
+  int card;
+
+  card = find(key);
+  if(card == -1)
+    return(false);
+
+  switch(at(card).type) {
+  case CARD_INT:
+    *val = at(card).val.i;
+    return(true);
+  case CARD_DOUBLE:
+    *val = at(card).val.d;
+    return(true);
+  default:
+    return(false);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+const char*
+FITSHeader::get(const char* key) const
+{
+  int card;
+
+  card = find(key);
+  if(card == -1 || at(card).type != CARD_STRING)
+    return(0);
+  return(at(card).text);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+FITSHeader::records(int extra) const
+{
+  return((ncards + extra + 1 + NUMCARDS - 1) / NUMCARDS);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -333,13 +606,197 @@ FITSHeader::erase(const char* key)
 void 
 FITSHeader::save(FILE* fp)
 {
-  int n;
+  int nrec = records();
+  char* buf = new char[nrec * RECORDSZ];
 
-  n = (lastCard < NUMCARDS) ? NUMCARDS : 2*NUMCARDS;
-  fwrite(header, CARDSZ, n, fp);
- 
+  render(buf, nrec);
+  fwrite(buf, RECORDSZ, nrec, fp);
+  delete [] buf;
 }
 
 /*---------------------------------------------------------------------------*/
 
+void 
+FITSHeader::render(char* buf, int nrec) const
+{
+  int ncards = nrec * NUMCARDS;
+  int n, id;
+
+  // cards are formatted here, only if changed since last time.
+  // Cards in shared pages are left as they are for the other headers
+
+  for(n = 0, id = first; id != -1 && n < ncards - 1; id = at(id).next, n++) {
+    const Card& card = at(id);
+    if(!card.dirty)
+      memcpy(buf + n*CARDSZ, card.image, CARDSZ);
+    else if(owned(id)) {
+      format(&card, card.image);
+      card.dirty = false;
+      memcpy(buf + n*CARDSZ, card.image, CARDSZ);
+    } else
+      format(&card, buf + n*CARDSZ);
+  }
+
+  // blank cards are legal anywhere in the header
+  // so they fill the gap up to the final END card
+
+  memset(buf + n*CARDSZ, BLANK, (ncards - n) * CARDSZ);
+  memcpy(buf + (ncards-1)*CARDSZ, "END", 3);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void 
+FITSHeader::render(char* buf, int nrec, unsigned int datasum)
+{
+  char str[24];
+  DataSum sum;
+  int card, id, n;
+
+  snprintf(str, sizeof(str), "%u", datasum);
+  set("DATASUM", str, "data unit checksum");
+  set("CHECKSUM", "0000000000000000", "HDU checksum");
+
+  // the zeros in CHECKSUM are already accounted by the encoding
+
+  render(buf, nrec);
+  sum.add(buf, nrec * RECORDSZ, 0);
+  DataSum::encode(DataSum::add(sum.value(), datasum), str);
+
+  // value starts after "CHECKSUM= '"
+
+  card = find("CHECKSUM");
+  memcpy(edit(card).text, str, 16);
+  memcpy(&edit(card).image[11], str, 16);
+
+  for(n = 0, id = first; id != card; id = at(id).next)
+    n++;
+  if(n < nrec*NUMCARDS - 1)
+    memcpy(&buf[n*CARDSZ + 11], str, 16);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void 
+FITSHeader::toExtension()
+{
+  int pos;
 
+  rename("SIMPLE", "XTENSION");
+  set("XTENSION", "IMAGE", "image extension");
+
+  // PCOUNT & GCOUNT must follow the last NAXISn keyword
+
+  pos = place("PCOUNT", find("NAXIS2"));
+  assign(pos, 0, "no parameters");
+  pos = place("GCOUNT", pos);
+  assign(pos, 1, "one data group");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void 
+FITSHeader::toTable(int rowBytes, int rows, int fields)
+{
+  int pos;
+
+  rename("SIMPLE", "XTENSION");
+  set("XTENSION", "BINTABLE", "binary table extension");
+  set("BITPIX", 8, "8-bit bytes");
+  set("NAXIS", 2, "2-dimensional binary table");
+  set("NAXIS1", rowBytes, "width of table in bytes");
+  set("NAXIS2", rows, "number of rows in table");
+
+  // PCOUNT, GCOUNT & TFIELDS must follow NAXIS2 in this order
+
+  pos = place("PCOUNT", find("NAXIS2"));
+  assign(pos, 0, "size of special data area");
+  pos = place("GCOUNT", pos);
+  assign(pos, 1, "one data group");
+  pos = place("TFIELDS", pos);
+  assign(pos, fields, "number of fields in each row");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void 
+FITSHeader::setColumn(int n, const char* type, const char* form, const char* unit)
+{
+  char key[KEYSZ+1];
+  char comment[CARDSZ+1];
+
+  snprintf(comment, sizeof(comment), "label for field %d", n);
+  snprintf(key, sizeof(key), "TTYPE%d", n);
+  set(key, type, comment);
+  snprintf(comment, sizeof(comment), "data format of field %d", n);
+  snprintf(key, sizeof(key), "TFORM%d", n);
+  set(key, form, comment);
+  if(unit) {
+    snprintf(comment, sizeof(comment), "physical unit of field %d", n);
+    snprintf(key, sizeof(key), "TUNIT%d", n);
+    set(key, unit, comment);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void 
+FITSHeader::toZImage(int width, int height, int heapSize, int maxLen)
+{
+  char tform[24];
+  int pos;
+
+  // the image mandatory keywords are preserved under their Z names,
+  // the rest of the cards (BZERO, DATE-OBS ...) apply to the image as is
+
+  rename("SIMPLE", "ZSIMPLE");
+  rename("BITPIX", "ZBITPIX");
+  rename("NAXIS",  "ZNAXIS");
+  rename("NAXIS1", "ZNAXIS1");
+  rename("NAXIS2", "ZNAXIS2");
+  set("ZNAXIS1", width);
+  set("ZNAXIS2", height);
+
+  // the binary table mandatory keywords go first and in this order
+
+  snprintf(tform, sizeof(tform), "1PB(%d)", maxLen);
+
+  pos = place("XTENSION", -1);
+  assign(pos, "BINTABLE", "binary table extension");
+  pos = place("BITPIX", pos);
+  assign(pos, 8, "8-bit bytes");
+  pos = place("NAXIS", pos);
+  assign(pos, 2, "2-dimensional binary table");
+  pos = place("NAXIS1", pos);
+  assign(pos, 8, "width of table in bytes");
+  pos = place("NAXIS2", pos);
+  assign(pos, height, "number of rows in table");
+  pos = place("PCOUNT", pos);
+  assign(pos, heapSize, "size of special data area");
+  pos = place("GCOUNT", pos);
+  assign(pos, 1, "one data group");
+  pos = place("TFIELDS", pos);
+  assign(pos, 1, "number of fields in each row");
+  pos = place("TTYPE1", pos);
+  assign(pos, "COMPRESSED_DATA", "label for field 1");
+  pos = place("TFORM1", pos);
+  assign(pos, tform, "data format of field: variable length array");
+  pos = place("ZIMAGE", pos);
+  assign(pos, true, "extension contains compressed image");
+  pos = place("ZTILE1", pos);
+  assign(pos, width, "size of tiles to be compressed");
+  pos = place("ZTILE2", pos);
+  assign(pos, 1, "size of tiles to be compressed");
+  pos = place("ZCMPTYPE", pos);
+  assign(pos, "RICE_1", "compression algorithm");
+  pos = place("ZNAME1", pos);
+  assign(pos, "BLOCKSIZE", "compression block size");
+  pos = place("ZVAL1", pos);
+  assign(pos, 32, "pixels per block");
+  pos = place("ZNAME2", pos);
+  assign(pos, "BYTEPIX", "bytes per pixel (1, 2, 4, or 8)");
+  pos = place("ZVAL2", pos);
+  assign(pos, 2, "bytes per pixel (1, 2, 4, or 8)");
+}
+
+/*---------------------------------------------------------------------------*/
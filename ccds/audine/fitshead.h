@@ -25,6 +25,19 @@
 
 #include <stdio.h>
 
+/*
+ * A FITS header is kept as a pool of typed cards, chained in header
+ * order and indexed by keyword in an open addressing hash table.
+ * Keyword lookup is O(1), cards are unlinked without leaving holes
+ * and the pool grows one record (36 cards) at a time.
+ * Cards are only formatted into their 80 character image when rendered,
+ * so that keywords rewritten for every frame cost no formatting at all.
+ * Copies are cheap snapshots: cards live in reference counted pages
+ * of one record each, shared between copies until a card in the page
+ * is modified (copy on write). Distinct copies may be used by distinct
+ * threads without any locking.
+ */
+
 class FITSHeader {
  
  public:
@@ -37,19 +50,48 @@ class FITSHeader {
   static const int RECORDSZ = 2880; /* single block header size in bytes */
   static const char BLANK   = ' ';
   static const int KEYSZ    = 8; /* max size of keyword in bytes */
-  static const int HEADERSZ = 2*RECORDSZ; /* total header size */
+  static const int HEADERSZ = 2*RECORDSZ; /* default header size */
   static const int STRINGSZ = 68; /* max size of string valued cards */
 
   /* constructors and destructor */
 
   FITSHeader();
+  FITSHeader(const FITSHeader& other);
   ~FITSHeader();
 
+  FITSHeader& operator=(const FITSHeader& other);
  
   /* saves header into a FILE */
 
   void save(FILE* fp);
 
+  /* number of records needed to hold all the cards plus END */
+  /* and 'extra' cards still to be added */
+  int records(int extra = 0) const;
+
+  /* renders header into 'nrec' records, END being the very last card */
+  /* so that a header can be rewritten in place with a fixed size */
+  /* cards not fitting in 'nrec' records are left out */
+  void render(char* buf, int nrec) const;
+
+  /* same as render() but sets DATASUM from the data unit sum */
+  /* and CHECKSUM of the whole HDU, in the header and in 'buf' */
+  void render(char* buf, int nrec, unsigned int datasum);
+
+  /* turns a primary image header into an IMAGE extension header */
+  void toExtension();
+
+  /* turns an image header into the header of a Rice tile compressed */
+  /* image (ZIMAGE binary table convention), one tile per image row */
+  void toZImage(int width, int height, int heapSize, int maxLen);
+
+  /* turns a header as built by default into the header of a binary */
+  /* table of 'rows' rows of 'rowBytes' bytes and 'fields' columns */
+  void toTable(int rowBytes, int rows, int fields);
+
+  /* describes column 'n' (1 based) of a binary table */
+  void setColumn(int n, const char* type, const char* form, const char* unit = 0);
+
   /* ********************* */
   /* header management API */
   /* ********************* */
@@ -75,11 +117,49 @@ class FITSHeader {
   /* deletes card given by key */
   void erase(const char* key);
 
+  /* value of a numeric FITS card given by 'key'. false if none */
+  bool get(const char* key, double* val) const;
+
+  /* value of a string FITS card given by 'key'. NULL if none */
+  const char* get(const char* key) const;
+
  private:
 
-  char header[HEADERSZ];	/* FITS header data */
-  char pad[CARDSZ+1];		/* scratchpad buffer  */
-  int  lastCard;	      /* index for last used card. -1=empty */
+  /* card value types */
+
+  enum { CARD_BOOL, CARD_INT, CARD_DOUBLE, CARD_STRING, CARD_VOID };
+
+  struct Card {
+    char key[KEYSZ+1];		/* keyword, null terminated */
+    int  type;			/* one of CARD_xxx */
+    union {
+      bool b;
+      int  i;
+      double d;
+    } val;			/* numeric & boolean values */
+    char text[CARDSZ+1];	/* string value or commentary text */
+    char comment[CARDSZ+1];	/* comment, empty if none */
+    int  prev;			/* previous card in header order */
+    int  next;			/* next card in header order, or free list */
+    int  same;			/* previous card with the same keyword */
+    mutable bool dirty;		/* image[] must be formatted again */
+    mutable char image[CARDSZ]; /* formatted card */
+  };
+
+  struct CardPage {
+    volatile int refs;		/* headers sharing this page */
+    Card card[NUMCARDS];
+  };
+
+  CardPage** pages;		/* card pool, NUMCARDS cards per page */
+  int npages;			/* pages in pool */
+  int ncards;			/* cards in use, END excluded */
+  int first;			/* first card in header order, -1 if empty */
+  int last;			/* last card in header order, -1 if empty */
+  int freeList;			/* unused cards chained by 'next' */
+
+  int* index;			/* keyword hash table of card ids, -1=empty */
+  int indexSize;		/* hash table size, a power of 2 */
 
 
   /******************/
@@ -87,34 +167,61 @@ class FITSHeader {
   /******************/
 
 
-  /* fints card with a given keyword name. -1 if not found else the index */
-  int find(const char* key);
+  /* finds card with a given keyword name. -1 if not found else the id */
+  /* the last one added when there are several (COMMENT, HISTORY) */
+  int find(const char* key) const;
 
-  /* formats a boolean FITS card given by 'key' */
-  void format(const char* key, bool val, const char* comment = 0);
+  /* hash table position of a keyword, its own or the empty one */
+  int probe(const char* key) const;
 
-  /* formats an integer FITS card given by 'key' */
-  void format(const char* key, int val, const char* comment = 0);
+  /* indexes & unindexes a card by its keyword */
+  void indexAdd(int id);
+  void indexRemove(int id);
 
-  /* formats a decimal FITS card given by 'key' */
-  void format(const char* key, double val, const char* comment = 0);
+  /* read only access to a card */
+  const Card& at(int id) const 
+    { return(pages[id / NUMCARDS]->card[id % NUMCARDS]); }
 
-  /* formats a string FITS card given by 'key' */
-  void format(const char* key, const char* val, const char* comment = 0);
+  /* write access to a card. Its page is copied first if shared */
+  Card& edit(int id);
 
-  /* formats a void FITS card */
-  void formatVoid(const char* key, const char* comment);
+  /* true if a card page is not shared with other headers */
+  bool owned(int id) const;
 
-  /* formats the keyword part in to the key buffer */
-  const char* formatKey(const char* key);
+  /* adds a page with room for NUMCARDS more cards */
+  void grow();
 
-  /* appends recently formatted FITS card to the header */
-  void append();
-  
-  /* generates the first END keyword */
-  void end();
+  /* drops this header's references to its pages */
+  void release();
+
+  /* creates a new card with 'key' after card 'after' (-1=first) */
+  int place(const char* key, int after);
+
+  /* assigns a boolean value to a card */
+  void assign(int id, bool val, const char* comment);
+
+  /* assigns an integer value to a card */
+  void assign(int id, int val, const char* comment);
+
+  /* assigns a decimal value to a card */
+  void assign(int id, double val, const char* comment);
 
-  /* generates the 5 mandatory keyw. SIMPLE,BITPIX,NAXES,NAXIS1,NAXIS2,END */
+  /* assigns a string value to a card */
+  void assign(int id, const char* val, const char* comment);
+
+  /* assigns the text of a commentary card */
+  void assignVoid(int id, const char* text);
+
+  /* formats a card into 'image' */
+  void format(const Card* card, char* image) const;
+
+  /* changes the keyword of a card, keeping its value and comment */
+  void rename(const char* key, const char* newKey);
+
+  /* shares the whole card store of another header */
+  void copy(const FITSHeader& other);
+
+  /* generates the 5 mandatory keyw. SIMPLE,BITPIX,NAXES,NAXIS1,NAXIS2 */
   void init();
   
 };
@@ -122,16 +229,37 @@ class FITSHeader {
 /*---------------------------------------------------------------------------*/
 
 inline
-FITSHeader::FITSHeader()
+FITSHeader::FITSHeader() : pages(0), npages(0), index(0), indexSize(0)
 {
   init();
 }
 
 /*---------------------------------------------------------------------------*/
 
+inline
+FITSHeader::FITSHeader(const FITSHeader& other) : 
+  pages(0), npages(0), index(0), indexSize(0)
+{
+  copy(other);
+}
+
+/*---------------------------------------------------------------------------*/
+
 inline
 FITSHeader::~FITSHeader()
 {
+  release();
+  delete [] index;
+}
+
+/*---------------------------------------------------------------------------*/
+
+inline FITSHeader&
+FITSHeader::operator=(const FITSHeader& other)
+{
+  if(this != &other)
+    copy(other);
+  return(*this);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -0,0 +1,153 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "fitshead.h"
+#include "fitsread.h"
+
+#define MAXHDR 16		/* header records searched for END */
+
+/*---------------------------------------------------------------------------*/
+
+bool
+FITSReader::value(const char* card, char* val, int size)
+{
+  const char* p = card + 10;
+  const char* end = card + FITSHeader::CARDSZ;
+  int n = 0;
+
+  // 'KEYWORD = value / comment', the value may be a quoted string
+
+  if(card[8] != '=')
+    return(false);
+
+  while(p < end && *p == ' ')
+    p++;
+
+  if(p < end && *p == '\'') {
+    for(p++; p < end && n < size-1; p++) {
+      if(*p == '\'') {
+	if(p+1 < end && p[1] == '\'')	// escaped quote
+	  p++;
+	else
+	  break;
+      }
+      val[n++] = *p;
+    }
+  } else {
+    for(; p < end && *p != '/' && n < size-1; p++)
+      val[n++] = *p;
+  }
+
+  while(n > 0 && val[n-1] == ' ')
+    n--;
+  val[n] = 0;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FITSReader::copy(char* dst, size_t size, const char* src, size_t len)
+{
+  if(len > size - 1)		// clipped, but always terminated
+    len = size - 1;
+  memcpy(dst, src, len);
+  dst[len] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+off_t
+FITSReader::dataSize(const FITSImage* img)
+{
+  off_t n = (img->naxis == 0) ? 0 : STATIC_CAST(off_t, img->width) * img->height;
+
+  return(n * ((img->bitpix < 0) ? -img->bitpix : img->bitpix) / 8);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+FITSReader::read(int fd, off_t pos, FITSImage* img)
+{
+  char rec[FITSHeader::RECORDSZ];
+  char val[FITSHeader::CARDSZ];
+  const char* card;
+  const char* p;
+  bool end = false;
+  off_t size, pcount = 0;
+
+  memset(img, 0, sizeof(*img));
+  img->bscale = 1;
+
+  for(int r=0; r<MAXHDR && !end; r++) {
+    if(pread(fd, rec, sizeof(rec), pos) != sizeof(rec))
+      return(false);
+    pos += sizeof(rec);
+
+    for(int i=0; i<FITSHeader::NUMCARDS && !end; i++) {
+      card = rec + i * FITSHeader::CARDSZ;
+      end  = !strncmp(card, "END     ", 8);
+      if(!value(card, val, sizeof(val)))
+	continue;
+
+      if(!strncmp(card, "IMAGETYP", 8))
+	copy(img->imagetyp, sizeof(img->imagetyp), val, strlen(val));
+      else if(!strncmp(card, "INSTRUME", 8)) {
+	p = strstr(val, " CG3 ");	// as written by CCDChip
+	p = (p) ? p + 5 : val;
+	copy(img->model, sizeof(img->model), p, strcspn(p, " "));
+      } 
+      else if(!strncmp(card, "NAXIS   ", 8)) img->naxis   = atoi(val);
+      else if(!strncmp(card, "NAXIS1  ", 8)) img->width   = atoi(val);
+      else if(!strncmp(card, "NAXIS2  ", 8)) img->height  = atoi(val);
+      else if(!strncmp(card, "BITPIX  ", 8)) img->bitpix  = atoi(val);
+      else if(!strncmp(card, "BZERO   ", 8)) img->bzero   = atof(val);
+      else if(!strncmp(card, "BSCALE  ", 8)) img->bscale  = atof(val);
+      else if(!strncmp(card, "CCDBIN1 ", 8)) img->bin     = atoi(val);
+      else if(!strncmp(card, "XORGSUBF", 8)) img->x       = atoi(val);
+      else if(!strncmp(card, "YORGSUBF", 8)) img->y       = atoi(val);
+      else if(!strncmp(card, "EXPTIME ", 8)) img->exptime = atof(val);
+      else if(!strncmp(card, "FLIPLR  ", 8)) img->flipLR  = val[0] == 'T';
+      else if(!strncmp(card, "FLIPUD  ", 8)) img->flipUD  = val[0] == 'T';
+      else if(!strncmp(card, "PCOUNT  ", 8)) pcount       = atol(val);
+    }
+  }
+
+  if(!end)
+    return(false);
+
+  size = (dataSize(img) + pcount + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ;
+  img->data = pos;
+  img->next = pos + size * FITSHeader::RECORDSZ;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,73 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_FITSREAD_H
+#define AUDINE_FITSREAD_H
+
+#include <sys/types.h>
+
+/* an image HDU read back from a FITS file, with the keywords we use */
+
+struct FITSImage {
+  off_t data;			/* data unit offset in the file */
+  off_t next;			/* next HDU offset in the file */
+  int bitpix;
+  int naxis;
+  int width;			/* NAXIS1 */
+  int height;			/* NAXIS2 */
+  double bzero;
+  double bscale;
+  char imagetyp[72];		/* IRAF image type */
+  char model[32];		/* CCD model, from INSTRUME */
+  int bin;			/* CCDBIN1 */
+  int x;			/* area origin, XORGSUBF & YORGSUBF */
+  int y;
+  double exptime;		/* EXPTIME */
+  bool flipLR;			/* FLIPLR, columns saved right to left */
+  bool flipUD;			/* FLIPUD, rows saved bottom to top */
+};
+
+/*
+ * Reads back the headers of the FITS files written by this driver, or
+ * any FITS file using the same keywords, to find their image data.
+ */
+
+class FITSReader {
+
+ public:
+
+  /* reads the HDU header at 'pos' of an open file. false if none */
+  static bool read(int fd, off_t pos, FITSImage* img);
+
+  /* value of a 'KEYWORD = value' card, quotes removed. false if not one */
+  static bool value(const char* card, char* val, int size);
+
+  /* data unit size in bytes, padding excluded */
+  static off_t dataSize(const FITSImage* img);
+
+ private:
+
+  /* copies 'len' bytes of 'src' as a string into 'dst' of 'size' bytes */
+  static void copy(char* dst, size_t size, const char* src, size_t len);
+};
+
+#endif
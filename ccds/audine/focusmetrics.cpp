@@ -0,0 +1,351 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "focusmetrics.h"
+#include "frame.h"
+#include "stats.h"
+#include "workpool.h"
+
+#define OFFSET 32768		/* pixel value of bin 0 */
+#define DETECT 5.0		/* detection level in noise units */
+#define MADSIGMA 1.4826		/* gaussian sigma per MAD */
+
+/* histogram bin of a pixel */
+#define BIN(p) (STATIC_CAST(unsigned short, p) ^ 0x8000)
+
+/*---------------------------------------------------------------------------*/
+
+static double
+elapsed(const struct timespec* t0)
+{
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return((t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static int
+byDouble(const void* a, const void* b)
+{
+  double x = *STATIC_CAST(const double*, a);
+  double y = *STATIC_CAST(const double*, b);
+
+  return((x > y) - (x < y));
+}
+
+/*---------------------------------------------------------------------------*/
+
+static double
+median(double* v, int n)
+{
+  qsort(v, n, sizeof(double), byDouble);
+  return((n % 2) ? v[n/2] : (v[n/2-1] + v[n/2]) / 2);
+}
+
+/*---------------------------------------------------------------------------*/
+
+FocusAnalyzer::FocusAnalyzer() : frame(0), x0(0), y0(0), x1(0), y1(0),
+    threshold(0), bandRows(0)
+{
+  hist  = new unsigned int[FrameStats::BINS];
+  peaks = new Peak[BANDS * MAXPEAKS];
+}
+
+/*---------------------------------------------------------------------------*/
+
+FocusAnalyzer::~FocusAnalyzer()
+{
+  delete [] hist;
+  delete [] peaks;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FocusAnalyzer::background(double* bkg, double* noise)
+{
+  unsigned int n = 0, half, acc;
+  const pixel_t* p;
+  int v, med, d;
+
+  memset(hist, 0, FrameStats::BINS * sizeof(unsigned int));
+
+  for(int y=y0; y<y1; y++) {
+    if(!frame->hasRow(y))
+      continue;
+    p = frame->row(y);
+    for(int x=x0; x<x1; x++)
+      hist[BIN(p[x])]++;
+    n += x1 - x0;
+  }
+
+  *bkg = *noise = 0;
+  if(n == 0)
+    return;
+
+  half = n / 2;
+  for(v=0, acc=0; acc + hist[v] <= half; v++)
+    acc += hist[v];
+  med = v;
+
+  // MAD: widens a window around the median until it holds half the pixels
+
+  acc = hist[med];
+  for(d=0; acc <= half; ) {
+    d++;
+    if(med - d >= 0)
+      acc += hist[med - d];
+    if(med + d < FrameStats::BINS)
+      acc += hist[med + d];
+  }
+
+  *bkg   = med - OFFSET;
+  *noise = (d > 0) ? MADSIGMA * d : 1; // quantized flat background
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+FocusAnalyzer::byValue(const void* a, const void* b)
+{
+  // brightest first
+
+  return(STATIC_CAST(const Peak*, b)->value - STATIC_CAST(const Peak*, a)->value);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FocusAnalyzer::detectJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(FocusAnalyzer*, ctx)->detect(a);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FocusAnalyzer::detect(int band)
+{
+  Peak* out = peaks + band * MAXPEAKS;
+  const pixel_t *up, *p, *down;
+  int first, last, n = 0;
+  int v, above;
+
+  // stars must fit whole in the region
+
+  first = y0 + RADIUS + band * bandRows;
+  last  = first + bandRows;
+  last  = (last < y1 - RADIUS) ? last : y1 - RADIUS;
+
+  for(int y=first; y<last && n<MAXPEAKS; y++) {
+    if(!frame->hasRow(y-1) || !frame->hasRow(y) || !frame->hasRow(y+1))
+      continue;
+    up   = frame->row(y-1);
+    p    = frame->row(y);
+    down = frame->row(y+1);
+
+    for(int x=x0+RADIUS; x<x1-RADIUS && n<MAXPEAKS; x++) {
+      v = p[x];
+      if(v <= threshold)
+	continue;
+
+      // a single maximum even on flat tops
+
+      if(v <= up[x-1] || v <= up[x] || v <= up[x+1] || v <= p[x-1] ||
+	 v < p[x+1] || v < down[x-1] || v < down[x] || v < down[x+1])
+	continue;
+
+      above = (up[x] > threshold) + (down[x] > threshold) +
+	(p[x-1] > threshold) + (p[x+1] > threshold);
+      if(above < 2)		// hot pixel or cosmic ray
+	continue;
+
+      out[n].x     = x;
+      out[n].y     = y;
+      out[n].value = v;
+      n++;
+    }
+  }
+
+  npeaks[band] = n;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+FocusAnalyzer::measure(const Peak* pk, double bkg, double* cx, double* cy,
+		       double* hfd, double* fwhm)
+{
+  double sum, sx, sy, sr, f, r, top;
+  const pixel_t* p;
+  int xa, xb, ya, yb, area;
+
+  // flux weighted centroid, iterated as the window recenters
+
+  *cx = pk->x;
+  *cy = pk->y;
+  sum = 0;
+
+  for(int i=0; i<3; i++) {
+    xa = STATIC_CAST(int, floor(*cx + 0.5)) - RADIUS;
+    ya = STATIC_CAST(int, floor(*cy + 0.5)) - RADIUS;
+    xa = (xa < x0) ? x0 : (xa + 2*RADIUS >= x1) ? x1 - 2*RADIUS - 1 : xa;
+    ya = (ya < y0) ? y0 : (ya + 2*RADIUS >= y1) ? y1 - 2*RADIUS - 1 : ya;
+    xb = xa + 2*RADIUS;
+    yb = ya + 2*RADIUS;
+
+    sum = sx = sy = 0;
+    for(int y=ya; y<=yb; y++) {
+      if(!frame->hasRow(y))
+	return(false);
+      p = frame->row(y);
+      for(int x=xa; x<=xb; x++) {
+	f = p[x] - bkg;
+	if(f <= 0 || (x - *cx)*(x - *cx) + (y - *cy)*(y - *cy) > RADIUS*RADIUS)
+	  continue;
+	sum += f;
+	sx  += f * x;
+	sy  += f * y;
+      }
+    }
+    if(sum <= 0)
+      return(false);
+    *cx = sx / sum;
+    *cy = sy / sum;
+  }
+
+  if(fabs(*cx - pk->x) > RADIUS/2 || fabs(*cy - pk->y) > RADIUS/2)
+    return(false);		// a blend or a gradient, not a star
+
+  // half flux diameter and half maximum area around the centroid
+
+  top  = pk->value - bkg;
+  sum  = sr = 0;
+  area = 0;
+  for(int y=ya; y<=yb; y++) {
+    p = frame->row(y);
+    for(int x=xa; x<=xb; x++) {
+      f = p[x] - bkg;
+      r = sqrt((x - *cx)*(x - *cx) + (y - *cy)*(y - *cy));
+      if(f <= 0 || r > RADIUS)
+	continue;
+      sum += f;
+      sr  += f * r;
+      area += (f >= top / 2);
+    }
+  }
+
+  *hfd  = 2 * sr / sum;
+  *fwhm = 2 * sqrt(area / M_PI);
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FocusAnalyzer::analyze(const Frame* frame, int x, int y, int w, int h, 
+		       WorkerPool* pool, FocusMetrics* res)
+{
+  double hfds[MAXSTARS], fwhms[MAXSTARS];
+  double bkg, noise, sx, sy, hfd, fwhm;
+  struct timespec t0;
+  Peak* cand;
+  bool near;
+  int n, k;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  memset(res, 0, sizeof(*res));
+
+  this->frame = frame;
+  if(w <= 0 || h <= 0) {
+    x = y = 0;
+    w = frame->width();
+    h = frame->height();
+  }
+  x0 = (x < 0) ? 0 : x;
+  y0 = (y < 0) ? 0 : y;
+  x1 = (x + w > frame->width())  ? frame->width()  : x + w;
+  y1 = (y + h > frame->height()) ? frame->height() : y + h;
+  if(x1 - x0 <= 2*RADIUS || y1 - y0 <= 2*RADIUS)
+    return;			// no room for a single star
+
+  background(&bkg, &noise);
+  res->background = bkg;
+  res->noise      = noise;
+  threshold = STATIC_CAST(int, bkg + DETECT * noise);
+
+  bandRows = (y1 - y0 - 2*RADIUS + BANDS - 1) / BANDS;
+  for(int b=0; b<BANDS; b++)
+    pool->submit(FocusAnalyzer::detectJob, this, b, 0);
+  pool->wait();
+
+  // gathers all candidates, brightest first
+
+  n = 0;
+  for(int b=0; b<BANDS; b++) {
+    memmove(peaks + n, peaks + b * MAXPEAKS, npeaks[b] * sizeof(Peak));
+    n += npeaks[b];
+  }
+  qsort(peaks, n, sizeof(Peak), byValue);
+  cand = peaks;
+
+  // skips saturated stars and those too close to a brighter one
+
+  for(int i=k=0; i<n && k<MAXSTARS; i++) {
+    if(cand[i].value >= FrameStats::SATURATION)
+      continue;
+    near = false;
+    for(int j=0; j<i && !near; j++)
+      near = abs(cand[j].x - cand[i].x) < RADIUS && abs(cand[j].y - cand[i].y) < RADIUS;
+    if(near || !measure(&cand[i], bkg, &sx, &sy, &hfd, &fwhm))
+      continue;
+    if(k == 0) {
+      res->x    = sx;
+      res->y    = sy;
+      res->peak = cand[i].value - bkg;
+    }
+    hfds[k]  = hfd;
+    fwhms[k] = fwhm;
+    k++;
+  }
+
+  res->stars = k;
+  if(k) {
+    res->hfd  = median(hfds, k);
+    res->fwhm = median(fwhms, k);
+  }
+  res->elapsed = elapsed(&t0);
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,103 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#ifndef AUDINE_FOCUSMETRICS_H
+#define AUDINE_FOCUSMETRICS_H
+
+/* focus quality of a frame. Coordinates are frame pixels, not flipped */
+
+struct FocusMetrics {
+  int stars;			/* stars measured */
+  double hfd;			/* median half flux diameter [pixels] */
+  double fwhm;			/* median full width at half maximum [pixels] */
+  double background;		/* sky background [ADU] */
+  double noise;			/* background noise [ADU] */
+  double x;			/* centroid of the brightest star */
+  double y;
+  double peak;			/* brightest star peak over background [ADU] */
+  double elapsed;		/* analysis time [ms] */
+};
+
+class Frame;
+class WorkerPool;
+
+/*
+ * Measures the focus of a complete frame, or of a region of it.
+ * The background level and noise are the median and the scaled median
+ * absolute deviation of the region histogram, so stars do not bias them.
+ * Horizontal bands are searched in parallel by the worker pool for 
+ * local maxima well above the noise and not isolated (hot pixels).
+ * The brightest unsaturated candidates, apart from each other, are then 
+ * measured around their flux weighted centroid: HFD is twice the flux 
+ * weighted mean radius and FWHM is the diameter of the circle having 
+ * the area of the pixels above half the peak.
+ */
+
+class FocusAnalyzer {
+
+ public:
+
+  static const int RADIUS   = 12;   /* star window radius [pixels] */
+  static const int MAXSTARS = 64;   /* brightest stars measured */
+  static const int BANDS    = 16;   /* parallel search jobs */
+  static const int MAXPEAKS = 256;  /* candidates kept per band */
+
+  FocusAnalyzer();
+ ~FocusAnalyzer();
+
+  /* analyzes a region of a complete frame, the whole frame if 'w' is 0 */
+  void analyze(const Frame* frame, int x, int y, int w, int h, 
+	       WorkerPool* pool, FocusMetrics* res);
+
+ private:
+
+  struct Peak {
+    int x;
+    int y;
+    int value;
+  };
+
+  const Frame* frame;
+  int x0, y0, x1, y1;		/* region, [x0,x1) x [y0,y1) */
+  int threshold;		/* detection level [ADU] */
+  int bandRows;			/* rows searched per job */
+  unsigned int* hist;		/* region histogram */
+  Peak* peaks;			/* MAXPEAKS candidates per band */
+  int npeaks[BANDS];
+
+  /* median and noise of the region */
+  void background(double* bkg, double* noise);
+
+  /* qsort() order of candidates */
+  static int byValue(const void* a, const void* b);
+
+  /* searches one band. Runs in the worker pool */
+  static void detectJob(void* ctx, int a, int b);
+  void detect(int band);
+
+  /* measures a star. false if unusable */
+  bool measure(const Peak* p, double bkg, double* x, double* y,
+	       double* hfd, double* fwhm);
+};
+
+#endif
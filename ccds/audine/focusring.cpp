@@ -0,0 +1,168 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "focusring.h"
+
+/*---------------------------------------------------------------------------*/
+
+FocusRing::FocusRing() : head(0), mapSize(0), current(0), frames(0)
+{
+  name[0] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+FocusRing::open(const char* shmName, int slots, int width, int height, 
+		int records)
+{
+  int fd, pixels, slotSize;
+  void* p;
+
+  pixels = width * height;
+
+  if(head != 0 && head->slots == slots && head->maxPixels >= pixels &&
+     head->maxRecords >= records && !strcmp(name, shmName))
+    return(true);		// current ring is good enough
+
+  close();
+
+  // slots are 64 byte aligned for the copy loops
+
+  slotSize = sizeof(FocusSlotHead) + records * FITSHeader::RECORDSZ +
+    pixels * sizeof(pixel_t);
+  slotSize = (slotSize + 63) & ~63;
+
+  strncpy(name, shmName, sizeof(name)-1);
+  name[sizeof(name)-1] = 0;
+  mapSize = sizeof(FocusRingHead) + STATIC_CAST(size_t, slots) * slotSize;
+
+  fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1)
+    return(false);
+
+  if(ftruncate(fd, mapSize) == -1) {
+    ::close(fd);
+    shm_unlink(name);
+    return(false);
+  }
+
+  p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);			// the mapping keeps the object alive
+  if(p == MAP_FAILED) {
+    shm_unlink(name);
+    return(false);
+  }
+
+  // a fresh object is all zeros: every slot is even and empty
+
+  head = STATIC_CAST(FocusRingHead*, p);
+  head->magic      = FOCUS_RING_MAGIC;
+  head->version    = FOCUS_RING_VERSION;
+  head->slots      = slots;
+  head->slotSize   = slotSize;
+  head->maxPixels  = pixels;
+  head->maxRecords = records;
+  head->newestSlot = 0;
+  head->newest     = 0;
+  current = 0;
+  frames  = 0;
+  __sync_synchronize();
+  head->valid      = 1;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FocusRing::close()
+{
+  if(head == 0)
+    return;
+
+  head->valid = 0;		// tells readers to reopen
+  __sync_synchronize();
+  munmap(head, mapSize);
+  shm_unlink(name);
+  head = 0;
+  mapSize = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+FocusSlotHead*
+FocusRing::begin()
+{
+  FocusSlotHead* slot;
+
+  // never the newest one, so that readers always find a complete frame
+
+  current = (frames == 0) ? 0 : (head->newestSlot + 1) % head->slots;
+  slot = STATIC_CAST(FocusSlotHead*, STATIC_CAST(void*, 
+         STATIC_CAST(char*, STATIC_CAST(void*, head)) + offset(current)));
+
+  slot->seq++;			// odd: being written
+  __sync_synchronize();
+  return(slot);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FocusRing::commit(FocusSlotHead* slot)
+{
+  slot->frame = ++frames;
+  __sync_synchronize();
+  slot->seq++;			// even: complete
+  __sync_synchronize();
+  head->newestSlot = current;
+  head->newest     = frames;
+}
+
+/*---------------------------------------------------------------------------*/
+
+FocusSlotHead*
+FocusRing::slot(int i)
+{
+  FocusSlotHead* slot;
+
+  if(head == 0 || i < 0 || i >= head->slots)
+    return(NULL);
+
+  slot = STATIC_CAST(FocusSlotHead*, STATIC_CAST(void*, 
+	 STATIC_CAST(char*, STATIC_CAST(void*, head)) + offset(i)));
+
+  return((slot->frame == 0) ? NULL : slot);
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,140 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_FOCUSRING_H
+#define AUDINE_FOCUSRING_H
+
+#include <stddef.h>
+
+#include "fitshead.h"
+
+/*
+ * Layout of the POSIX shared memory object holding the last focus frames.
+ *
+ *  FocusRingHead | slot 0 | slot 1 | ... | slot N-1
+ *
+ * Each slot is a FocusSlotHead, room for 'maxRecords' FITS header
+ * records and width*height pixels in host order, already flipped as 
+ * requested in STORAGE_FLIP. The header of a frame takes 'records' 
+ * of those records, END being its last card.
+ *
+ * A slot is guarded by a sequence lock. Readers do:
+ *
+ *   1. s1 = slot->seq. If odd, the slot is being written, retry.
+ *   2. copy header and pixels.
+ *   3. if slot->seq != s1 the copy is torn, retry.
+ *
+ * 'newestSlot' is the slot holding the last complete frame, whose
+ * number is 'newest' (0 = no frame yet). When the driver resizes the 
+ * ring it clears 'valid' before unlinking it; readers must then 
+ * unmap and open the object again.
+ */
+
+#define FOCUS_RING_MAGIC   0x46445541 /* "AUDF" in little endian */
+#define FOCUS_RING_VERSION 2
+
+struct FocusRingHead {
+  int magic;			/* FOCUS_RING_MAGIC */
+  int version;			/* FOCUS_RING_VERSION */
+  volatile int valid;		/* 0 when readers must reopen */
+  int slots;			/* number of frame slots */
+  int slotSize;			/* bytes per slot, head included */
+  int maxPixels;		/* pixel capacity of a slot */
+  int maxRecords;		/* header capacity of a slot, in records */
+  volatile int newestSlot;	/* slot of the newest complete frame */
+  volatile unsigned int newest;	/* number of the newest complete frame */
+};
+
+struct FocusSlotHead {
+  volatile unsigned int seq;	/* sequence lock, odd while writing */
+  unsigned int frame;		/* frame number, counting from 1 */
+  int width;			/* image width in pixels */
+  int height;			/* image height in pixels */
+  int lost;			/* rows lost in transmission */
+  int records;			/* FITS header records, as if saved */
+};
+
+
+/*
+ * The writer side of the focus ring. Only one thread may use it.
+ */
+
+class FocusRing {
+
+ public:
+
+  FocusRing();
+ ~FocusRing() { close(); }
+
+  /* maps the ring, creating it again if 'slots' differs or the */
+  /* pixel or header capacity is short. false on error (errno) */
+  bool open(const char* name, int slots, int width, int height, int records);
+
+  /* true if a header of 'records' records fits in a slot */
+  bool fits(int records) const { 
+    return(head != 0 && records <= head->maxRecords); 
+  }
+
+  /* invalidates, unmaps and removes the current ring */
+  void close();
+
+  /* true if a ring is mapped */
+  bool isOpen() const { return(head != 0); }
+
+  /* number of slots in the ring */
+  int slots() const { return((head) ? head->slots : 0); }
+
+  /* marks the next slot as being written and returns it */
+  FocusSlotHead* begin();
+
+  /* marks the slot as complete and publishes it as the newest frame */
+  void commit(FocusSlotHead* slot);
+
+  /* returns slot 'i' or NULL if not in range or empty */
+  FocusSlotHead* slot(int i);
+
+  /* header records following a slot head */
+  static char* header(FocusSlotHead* slot) {
+    return(STATIC_CAST(char*, STATIC_CAST(void*, slot + 1)));
+  }
+
+  /* pixel array following the header records of a slot */
+  pixel_t* pixels(FocusSlotHead* slot) const {
+    return(STATIC_CAST(pixel_t*, STATIC_CAST(void*, header(slot) + 
+	   STATIC_CAST(size_t, head->maxRecords) * FITSHeader::RECORDSZ)));
+  }
+
+ private:
+
+  char name[64];		/* shared memory object name */
+  FocusRingHead* head;		/* mapped ring */
+  size_t mapSize;		/* mapped bytes */
+  int current;			/* slot being written */
+  unsigned int frames;		/* frames published */
+
+  /* byte offset of slot 'i' */
+  size_t offset(int i) const { 
+    return(sizeof(FocusRingHead) + STATIC_CAST(size_t, i) * head->slotSize);
+  }
+};
+
+#endif
@@ -0,0 +1,180 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <string.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "frame.h"
+
+/*---------------------------------------------------------------------------*/
+
+Frame::Frame() : pixels(0), size(0), w(0), h(0),
+    rowsPerChunk(1), received(0), ndups(0), ninvalid(0),
+    chunk(0), chunkY(0), chunkEnd(0), chunkNext(0)
+{
+}
+
+/*---------------------------------------------------------------------------*/
+
+Frame::~Frame()
+{
+  delete [] pixels;
+}
+
+/*---------------------------------------------------------------------------*/
+
+// swaps two counts
+
+static void
+exchange(int* a, int* b)
+{
+  int v = *a;
+
+  *a = *b;
+  *b = v;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Frame::reset(int width, int height)
+{
+  assert(width > 0 && height > 0 && height <= MAXROWS);
+
+  // the buffer only grows, so that a sequence of images
+  // with the same geometry does not allocate anything
+
+  if(width*height > size) {
+    delete [] pixels;
+    size   = width*height;
+    pixels = new pixel_t[size];
+  }
+
+  w = width;
+  h = height;
+  received = 0;
+  ndups = 0;
+  ninvalid = 0;
+  memset(bitmap, 0, (h + 7) >> 3);
+
+  // the COR packs as many whole rows as fit in a UDP message
+
+  rowsPerChunk = MAX_IMG_LEN / (sizeof(pixel_t) * w);
+  if(rowsPerChunk == 0)
+    rowsPerChunk = 1;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Frame::swap(Frame* other)
+{
+  unsigned char bits[MAXROWS/8];
+  pixel_t* p;
+
+  // buffers are exchanged, never copied. Only the bitmap bytes in use
+
+  p = pixels;
+  pixels = other->pixels;
+  other->pixels = p;
+  memcpy(bits, bitmap, (h + 7) >> 3);
+  memcpy(bitmap, other->bitmap, (other->h + 7) >> 3);
+  memcpy(other->bitmap, bits, (h + 7) >> 3);
+
+  exchange(&size, &other->size);
+  exchange(&w, &other->w);
+  exchange(&h, &other->h);
+  exchange(&rowsPerChunk, &other->rowsPerChunk);
+  exchange(&received, &other->received);
+  exchange(&ndups, &other->ndups);
+  exchange(&ninvalid, &other->ninvalid);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+Frame::place(const void* data, int len, int* first, int* n)
+{
+  const Incoming_Message* msg = STATIC_CAST(const Incoming_Message*, data);
+  const ChunkHead* head;
+  const u_char* src;
+  int y0, nrows, pixelCount;
+
+  src = msg->body.imgData.data;
+  head = STATIC_CAST(const ChunkHead*, STATIC_CAST(const void*, src)) - 1;
+
+  pixelCount = (len - IMG_HEAD) / sizeof(pixel_t);
+  nrows = pixelCount / w;
+  y0    = head->seq * rowsPerChunk;
+
+  *first = y0;
+  *n     = nrows;
+
+  // rejects what does not fit exactly into the image,
+  // or whose header does not agree with its length
+
+  if(nrows == 0 || pixelCount % w || head->seq < 0 || y0 + nrows > h ||
+     head->cols != w || head->rows != nrows) {
+    ninvalid++;
+    return(CHUNK_INVALID);
+  }
+
+  // rows seen before are left as they are, as they may be
+  // corrected and accounted already. Only new ones are placed
+
+  chunk     = src;
+  chunkY    = y0;
+  chunkEnd  = y0 + nrows;
+  chunkNext = y0;
+  if(!nextRun(first, n)) {
+    ndups++;
+    return(CHUNK_DUPLICATE);
+  }
+  return(CHUNK_OK);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Frame::nextRun(int* first, int* n)
+{
+  int y;
+
+  for(y = chunkNext; y < chunkEnd && hasRow(y); y++)
+    ;
+  for(*first = y; y < chunkEnd && !hasRow(y); y++)
+    bitmap[y>>3] |= (1 << (y & 7));
+  *n = y - *first;
+  chunkNext = y;
+  if(*n == 0)
+    return(false);
+
+  memcpy(row(*first), chunk + (*first - chunkY) * w * sizeof(pixel_t),
+	 *n * w * sizeof(pixel_t));
+  received += *n;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
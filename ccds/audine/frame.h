@@ -0,0 +1,115 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_FRAME_H
+#define AUDINE_FRAME_H
+
+#pragma pack(1)			/* byte alignment */
+
+/*
+ * The three 16 bit words the COR places in front of the pixel data
+ * of every image chunk. The chunk sequence number and the fixed
+ * number of rows per chunk (see CCDChip::computeUDPPackets)
+ * give the chunk position inside the image.
+ */
+
+struct ChunkHead {
+  int16 seq;			/* chunk number within image, 0 based */
+  int16 rows;			/* rows in this chunk */
+  int16 cols;			/* pixels per row */
+};
+
+#pragma pack(0)			/* alignment by default */
+
+/* results of Frame::place() */
+
+#define CHUNK_OK        0
+#define CHUNK_DUPLICATE 1	/* all its rows were already received */
+#define CHUNK_INVALID   2	/* does not fit into the image */
+
+
+/*
+ * A frame buffer where image chunks are placed at their row offset
+ * regardless of arrival order. A bitmap keeps track of received rows
+ * so that gaps and duplicates can be detected and reported.
+ * Pixels are kept in host order as sent by the COR.
+ */
+
+class Frame {
+
+ public:
+
+  static const int MAXROWS = 32768; /* rows are int16 in the COR protocol */
+
+  Frame();
+ ~Frame();
+
+  /* prepares an empty frame of the given dimensions */
+  void reset(int width, int height);
+
+  /* exchanges pixels, received rows and counts with another frame */
+  void swap(Frame* other);
+
+  /* places a raw UDP image message. Returns a CHUNK_xxx code */
+  /* only rows not received before are placed. On return, 'first' */
+  /* and 'n' are the first run of them */
+  int place(const void* msg, int len, int* first, int* n);
+
+  /* places the next run of new rows of the same message, if it */
+  /* overlaps others more than once. false if none */
+  bool nextRun(int* first, int* n);
+
+  /* row accessors */
+  pixel_t* row(int y) { return(pixels + y*w); }
+  const pixel_t* row(int y) const { return(pixels + y*w); }
+
+  /* true if row y has been received */
+  bool hasRow(int y) const { return(bitmap[y>>3] & (1 << (y & 7))); }
+
+  int width()  const { return(w); }
+  int height() const { return(h); }
+
+  /* per-frame loss report */
+  int lostRows()   const { return(h - received); }
+  int duplicates() const { return(ndups); }
+  int invalids()   const { return(ninvalid); }
+
+ private:
+
+  pixel_t* pixels;		/* the image itself */
+  unsigned char bitmap[MAXROWS/8]; /* one bit per received row */
+  int size;			/* allocated pixels */
+  int w;			/* image width */
+  int h;			/* image height */
+  int rowsPerChunk;		/* as computed by the COR */
+  int received;			/* rows received so far */
+  int ndups;			/* duplicated chunks */
+  int ninvalid;			/* chunks out of image bounds or malformed */
+
+  /* message being placed */
+  const unsigned char* chunk;	/* its pixels */
+  int chunkY;			/* its first row */
+  int chunkEnd;			/* past its last row */
+  int chunkNext;		/* first row not looked at yet */
+};
+
+#endif
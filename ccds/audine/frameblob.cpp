@@ -0,0 +1,307 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#include <string.h>
+#include <zlib.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "base64.h"
+#include "fitshead.h"
+#include "frame.h"
+#include "frameblob.h"
+#include "pixkern.h"
+#include "workpool.h"
+
+#define PIECES_PER_JOB 8
+
+/*---------------------------------------------------------------------------*/
+
+FrameBlob::FrameBlob() : state(EMPTY), out(0), frame(0), flipLR(false), flipUD(false),
+    hdr(0), hdrSize(0), maxHdr(0), total(0), zbuf(0), zlen(0), maxZ(0),
+    enc(0), encLen(0), maxEnc(0), size(0), format(".fits")
+{
+  device[0] = name[0] = 0;
+  pthread_mutex_init(&lock, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+
+FrameBlob::~FrameBlob()
+{
+  sender.stop();		// before the payload goes away
+  pthread_mutex_destroy(&lock);
+  delete [] hdr;
+  delete [] zbuf;
+  delete [] enc;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameBlob::gather(size_t pos, size_t len, unsigned char* dst, 
+		  unsigned char* row) const
+{
+  int w = frame->width();
+  int h = frame->height();
+  size_t rowBytes = w * sizeof(pixel_t);
+  size_t dataEnd  = hdrSize + rowBytes * h;
+  size_t n, off;
+  int y, t;
+
+  while(len > 0) {
+
+    if(pos < STATIC_CAST(size_t, hdrSize)) {
+      n = hdrSize - pos;
+      n = (len < n) ? len : n;
+      memcpy(dst, hdr + pos, n);
+
+    } else if(pos >= dataEnd) {	// FITS padding
+      n = len;
+      memset(dst, 0, n);
+
+    } else {
+
+      // file row 't' is frame row 'y', as in DiskWriter::writeRows()
+      // rows never received are zeros, as in the file
+
+      off = pos - hdrSize;
+      t   = off / rowBytes;
+      off = off % rowBytes;
+      y   = (flipUD) ? h-1-t : t;
+      n   = rowBytes - off;
+      n   = (len < n) ? len : n;
+
+      if(!frame->hasRow(y))
+	memset(dst, 0, n);
+      else if(off == 0 && n == rowBytes)
+	((flipLR) ? PixKern::swapMirror : PixKern::swap)(dst, frame->row(y), w);
+      else {
+	((flipLR) ? PixKern::swapMirror : PixKern::swap)(row, frame->row(y), w);
+	memcpy(dst, row + off, n);
+      }
+    }
+
+    pos += n;
+    dst += n;
+    len -= n;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+FrameBlob::deflateStream()
+{
+  unsigned char* piece;
+  unsigned char* row;
+  z_stream zs;
+  size_t pos, n;
+  int res;
+
+  memset(&zs, 0, sizeof(zs));
+  if(deflateInit(&zs, Z_BEST_SPEED) != Z_OK)
+    return(false);
+
+  n = deflateBound(&zs, total);
+  if(n > maxZ) {
+    delete [] zbuf;
+    maxZ = n;
+    zbuf = new unsigned char[maxZ];
+  }
+
+  // the stream is deflated piece by piece, never built whole
+
+  piece = new unsigned char[CHUNK];
+  row   = new unsigned char[frame->width() * sizeof(pixel_t)];
+  zs.next_out  = zbuf;
+  zs.avail_out = maxZ;
+
+  for(pos = 0, res = Z_OK; pos < total && res == Z_OK; pos += n) {
+    n = (total - pos < STATIC_CAST(size_t, CHUNK)) ? total - pos : CHUNK;
+    gather(pos, n, piece, row);
+    zs.next_in  = piece;
+    zs.avail_in = n;
+    res = deflate(&zs, (pos + n == total) ? Z_FINISH : Z_NO_FLUSH);
+  }
+
+  zlen = zs.total_out;
+  deflateEnd(&zs);
+  delete [] piece;
+  delete [] row;
+  return(res == Z_STREAM_END);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameBlob::encodeJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(FrameBlob*, ctx)->encodePieces(a, b);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameBlob::encodePieces(int first, int n)
+{
+  size_t src  = (zlen) ? zlen : total;
+  unsigned char* piece = 0;
+  unsigned char* row = 0;
+  size_t pos, len;
+
+  // pieces are a multiple of 3 bytes, so they encode independently
+
+  if(zlen == 0) {
+    piece = new unsigned char[CHUNK];
+    row   = new unsigned char[frame->width() * sizeof(pixel_t)];
+  }
+
+  for(int i=first; i<first+n; i++) {
+    pos = STATIC_CAST(size_t, i) * CHUNK;
+    len = (src - pos < STATIC_CAST(size_t, CHUNK)) ? src - pos : CHUNK;
+    if(zlen)
+      Base64::encode(enc + pos/3*4, zbuf + pos, len);
+    else {
+      gather(pos, len, piece, row);
+      Base64::encode(enc + pos/3*4, piece, len);
+    }
+  }
+
+  delete [] piece;
+  delete [] row;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameBlob::build(const FITSHeader* header, const Frame* frame, 
+		 bool flipLR, bool flipUD, int mode, WorkerPool* pool)
+{
+  size_t dataSize, src;
+  int pieces, k;
+
+  pthread_mutex_lock(&lock);
+  k = state;
+  pthread_mutex_unlock(&lock);
+  if(k != EMPTY || out == 0)	// still sending, the client is slower
+    return;
+
+  this->frame  = frame;
+  this->flipLR = flipLR;
+  this->flipUD = flipUD;
+
+  k = header->records();
+  hdrSize = k * FITSHeader::RECORDSZ;
+  if(hdrSize > maxHdr) {
+    delete [] hdr;
+    maxHdr = hdrSize;
+    hdr = new char[maxHdr];
+  }
+  header->render(hdr, k);
+
+  dataSize = STATIC_CAST(size_t, frame->width()) * frame->height() * sizeof(pixel_t);
+  dataSize = ((dataSize + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ)
+    * FITSHeader::RECORDSZ;
+  total  = hdrSize + dataSize;
+  size   = total;
+  zlen   = 0;
+  format = ".fits";
+
+  if(mode == BLOB_FITSZ && deflateStream())
+    format = ".fits.z";
+  else
+    zlen = 0;			// sent uncompressed if zlib fails
+
+  src = (zlen) ? zlen : total;
+  if(Base64::size(src) > maxEnc) {
+    delete [] enc;
+    maxEnc = Base64::size(src);
+    enc = new char[maxEnc];
+  }
+  encLen = Base64::size(src);
+
+  // the writer thread only waits for the pool
+
+  pieces = (src + CHUNK - 1) / CHUNK;
+  for(k=0; k<pieces; k+=PIECES_PER_JOB)
+    pool->submit(FrameBlob::encodeJob, this, k, 
+		 (pieces - k < PIECES_PER_JOB) ? pieces - k : PIECES_PER_JOB);
+  pool->wait();
+
+  pthread_mutex_lock(&lock);
+  state = SENDING;
+  pthread_mutex_unlock(&lock);
+  sender.submit(FrameBlob::sendJob, this, 0, 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameBlob::attach(FILE* fp, const char* device, const char* name)
+{
+  snprintf(this->device, sizeof(this->device), "%s", device);
+  snprintf(this->name, sizeof(this->name), "%s", name);
+  out = fp;
+  sender.start(1);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameBlob::sendJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(FrameBlob*, ctx)->send();
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameBlob::send()
+{
+  static const size_t LINE = CHUNK/3*4; /* encoded bytes per fwrite() */
+  size_t pos, n;
+
+  // stdio locks the stream for every call made by the event loop,
+  // so the whole message goes out before any other one does.
+  // A slow client only delays the event loop if it has to write too
+
+  flockfile(out);
+  fprintf(out, "<setBLOBVector device='%s' name='%s' state='Ok'>\n", device, name);
+  fprintf(out, "  <oneBLOB name='IMAGE' size='%d' format='%s'>\n", size, format);
+  for(pos=0; pos<encLen; pos+=n) {
+    n = (encLen - pos < LINE) ? encLen - pos : LINE;
+    fwrite(enc + pos, 1, n, out);
+  }
+  fprintf(out, "\n  </oneBLOB>\n</setBLOBVector>\n");
+  fflush(out);
+  funlockfile(out);
+
+  pthread_mutex_lock(&lock);
+  state = EMPTY;		// the writer may encode the next frame
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
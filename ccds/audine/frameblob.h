@@ -0,0 +1,131 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#ifndef AUDINE_FRAMEBLOB_H
+#define AUDINE_FRAMEBLOB_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "workpool.h"
+
+/*
+ * Full frame BLOB modes
+ */
+
+#define BLOB_NONE  0		/* no full frame BLOB */
+#define BLOB_FITS  1		/* FITS file */
+#define BLOB_FITSZ 2		/* zlib compressed FITS file */
+
+class FITSHeader;
+class Frame;
+
+/*
+ * A complete frame encoded as a base64 FITS file and sent as an INDI BLOB.
+ * The writer thread builds it straight from the frame buffer: the FITS
+ * byte stream is produced piecewise, rows endian swapped and flipped on 
+ * the fly, and either deflated or base64 encoded in parallel pieces
+ * by the worker pool. Nothing but the final payload is ever stored whole.
+ * The event loop never sees the payload: a thread of its own writes
+ * the setBLOBVector message to the driver's output stream, locked so
+ * that other messages do not get into it.
+ * A single payload is kept. Frames completed while the previous one
+ * is still being sent are not encoded at all.
+ */
+
+class FrameBlob {
+
+ public:
+
+  static const int CHUNK = 3*16384; /* bytes encoded per piece */
+
+  FrameBlob();
+ ~FrameBlob();
+
+  /* event loop. Payloads go to 'fp' as element IMAGE of BLOB property */
+  /* 'name' of 'device'. Before the first build() */
+  void attach(FILE* fp, const char* device, const char* name);
+
+  /* writer thread. Encodes a complete frame with its final header */
+  /* and queues it to be sent */
+  void build(const FITSHeader* header, const Frame* frame, 
+	     bool flipLR, bool flipUD, int mode, WorkerPool* pool);
+
+  /* blocks until the last payload has been sent */
+  void wait() { sender.wait(); }
+
+  /* encoded size of the last payload */
+  size_t encoded() const { return(encLen); }
+
+ private:
+
+  enum { EMPTY, SENDING };
+
+  pthread_mutex_t lock;
+  int state;			/* payload handover between threads */
+
+  /* destination */
+  FILE* out;
+  char device[64];
+  char name[64];
+  WorkerPool sender;		/* a single thread writing the payload */
+
+  /* FITS stream being encoded */
+  const Frame* frame;
+  bool flipLR;
+  bool flipUD;
+  char* hdr;			/* rendered header */
+  int hdrSize;			/* bytes in hdr[] */
+  int maxHdr;			/* capacity of hdr[] */
+  size_t total;			/* FITS file size */
+
+  /* compressed stream */
+  unsigned char* zbuf;
+  size_t zlen;			/* bytes used in zbuf[] */
+  size_t maxZ;			/* capacity of zbuf[] */
+
+  /* encoded payload */
+  char* enc;
+  size_t encLen;		/* bytes used in enc[] */
+  size_t maxEnc;		/* capacity of enc[] */
+  int size;			/* decoded payload size */
+  const char* format;		/* ".fits" or ".fits.z" */
+
+  /* copies bytes [pos, pos+len) of the FITS stream into 'dst' */
+  /* 'row' is scratch space for a whole image row */
+  void gather(size_t pos, size_t len, unsigned char* dst, unsigned char* row) const;
+
+  /* deflates the whole FITS stream into zbuf[] */
+  bool deflateStream();
+
+  /* encodes pieces [a, a+b) into enc[]. Runs in the worker pool */
+  static void encodeJob(void* ctx, int a, int b);
+  void encodePieces(int first, int n);
+
+  /* writes the setBLOBVector message. Runs in the sender thread */
+  static void sendJob(void* ctx, int a, int b);
+  void send();
+};
+
+#endif
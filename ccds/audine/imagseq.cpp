@@ -183,6 +183,22 @@ ImageSequencer::restartFromWait()
 
 /*---------------------------------------------------------------------------*/
 
+void
+ImageSequencer::holdOff()
+{
+  // no user delay to count down, just retry later
+
+  expCounters->setValue("DELAY", 0);
+  expCounters->indiSetProperty();
+
+  timer->start();
+  alarm->start(HOLDOFF);
+
+  log->verbose(IFUN,"storage congested, next exposure delayed\n");
+}
+
+/*---------------------------------------------------------------------------*/
+
 void
 ImageSequencer::startFromWait()
 {
@@ -270,6 +286,8 @@ ImageSequencer::decDelay()
 {
   double delay = expCounters->getValue("DELAY");
   delay -=  TICK/1000.0;
+  if(delay < 0)			// storage hold-off has no delay to count
+    delay = 0;
   expCounters->setValue("DELAY", delay);
   expCounters->indiSetProperty();
 }
@@ -333,6 +351,7 @@ ImageSequencer::handleFinal(const void* data, int len)
   static char ts[32];
   time_t t;
   double duration, exptime, readtime;
+  FITSHeader* header;
   
   time (&t);			// takes 'end of exposure' timestamp
   
@@ -354,10 +373,16 @@ ImageSequencer::handleFinal(const void* data, int len)
   t -= STATIC_CAST(time_t,duration/1000); // PC's timestamp at exposure start
   strftime (ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
 
-  audine->fits.set("DATE-OBS", ts, "start date & time");
-  audine->fits.set("EXPTIME",  exptime/1000,  "[s] exposure time");
-  audine->fits.set("READTIME", readtime/1000, "[s] readout time");
-  audine->fits.set("DARKTIME", duration/1000, "[s] dark current time");
+  // they belong to the image just read, not to the camera header
+
+  header = audine->storage.frameHeader();
+  if(header == 0)		// storage error
+    return;
+
+  header->set("DATE-OBS", ts, "start date & time");
+  header->set("EXPTIME",  exptime/1000,  "[s] exposure time");
+  header->set("READTIME", readtime/1000, "[s] readout time");
+  header->set("DARKTIME", duration/1000, "[s] dark current time");
 }
 
 /*---------------------------------------------------------------------------*/
@@ -50,6 +50,7 @@ class ImageSequencer  {
  public:
 
   static const unsigned int TICK = 500;	/* ticks period in milliseconds */
+  static const unsigned int HOLDOFF = 1000; /* storage backpressure retry */
 
   ImageSequencer(Audine* aud);
   ~ImageSequencer();
@@ -86,6 +87,12 @@ class ImageSequencer  {
   /* another round when the number of counts is > 0 */
   void restartFromWait();
 
+  /* delays next exposure while the storage writer catches up */
+  void holdOff();
+
+  /* keeps ticking in Ok state while storage has pending work */
+  void startPolling() { timer->start(); }
+
   /* starts the image sequencer from the Audine exposure state */
   void startFromExp();
 
@@ -118,6 +125,9 @@ class ImageSequencer  {
   /* used by the storage manager */
   int getSequenceSize()  {return (STATIC_CAST(int,expLimits->getValue("COUNT"))); }
 
+  /* used by the storage manager */
+  double getExposure()  {return (expLimits->getValue("EXPTIME")); }
+
   /* updates Audine image start message */
   void updateMessage();
 
@@ -0,0 +1,530 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "checksum.h"
+#include "fitshead.h"
+#include "livestack.h"
+#include "workpool.h"
+
+#define DEG      (M_PI / 180)
+#define VOTE     20		/* brightest stars voting for a shift */
+#define MINMATCH 4		/* fewest stars registering an image */
+#define AFFINE   6		/* fewest stars fitting more than a shift */
+#define REFINE   3		/* least squares iterations */
+#define MINCLIP  5		/* values a pixel needs to clip new ones */
+#define SAMPLE   20000		/* pixels sampled for the image noise */
+#define MADSIGMA 1.4826		/* sigma of a normal distribution from its MAD */
+
+/*---------------------------------------------------------------------------*/
+
+// least squares fit of coordinate 'c' of 'n' pairs 'to' from 'from',
+// both (x, y) interleaved: to.c = t0 from.x + t1 from.y + t2
+
+static bool
+fit(const double* from, const double* to, int n, int c, double t[3])
+{
+  double sxx = 0, sxy = 0, syy = 0, su = 0, sxu = 0, syu = 0;
+  double x, y, u, det, mx = 0, my = 0;
+
+  // about the centroid, where the offset decouples from the matrix
+
+  for(int i=0; i<n; i++) {
+    mx += from[2*i];
+    my += from[2*i+1];
+  }
+  mx /= n;
+  my /= n;
+  for(int i=0; i<n; i++) {
+    x = from[2*i] - mx;
+    y = from[2*i+1] - my;
+    u = to[2*i+c];
+    sxx += x*x;
+    sxy += x*y;
+    syy += y*y;
+    su  += u;
+    sxu += x*u;
+    syu += y*u;
+  }
+
+  det = sxx * syy - sxy * sxy;
+  if(fabs(det) < 1e-9)
+    return(false);
+  t[0] = (sxu * syy - syu * sxy) / det;
+  t[1] = (syu * sxx - sxu * sxy) / det;
+  t[2] = su / n - t[0] * mx - t[1] * my;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+LiveStack::LiveStack() : head(0), w(0), h(0), size(0), plane(0), mean(0),
+    m2(0), count(0), nref(0), noise(0), out(0), bandRows(0)
+{
+  path[0] = 0;
+  memset(&pars, 0, sizeof(pars));
+  memset(&res, 0, sizeof(res));
+  memset(rejected, 0, sizeof(rejected));
+}
+
+/*---------------------------------------------------------------------------*/
+
+LiveStack::~LiveStack()
+{
+  delete [] plane;
+  delete [] mean;
+  delete [] m2;
+  delete [] count;
+  delete head;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::reset(int width, int height, const StackPars* p)
+{
+  w = width;
+  h = height;
+  pars = *p;
+  bandRows = (h + BANDS - 1) / BANDS;
+  nref = 0;
+  memset(&res, 0, sizeof(res));
+  delete head;
+  head = 0;
+
+  if(w * h > size) {
+    delete [] plane;
+    delete [] mean;
+    delete [] m2;
+    delete [] count;
+    size  = w * h;
+    plane = new float[size];
+    mean  = new float[size];
+    m2    = new float[size];
+    count = new unsigned short[size];
+  }
+  memset(mean, 0, w * h * sizeof(float));
+  memset(m2, 0, w * h * sizeof(float));
+  memset(count, 0, w * h * sizeof(unsigned short));
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::nameAfter(const char* image)
+{
+  const char* ext = strrchr(image, '.');
+  int n = (ext && !strchr(ext, '/')) ? ext - image : strlen(image);
+
+  snprintf(path, sizeof(path), "%.*s_stack%s", n, image, image + n);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::describe(const FITSHeader* header)
+{
+  if(head == 0)
+    head = new FITSHeader(*header);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+LiveStack::add(const double* x, const double* y, int n, WorkerPool* pool)
+{
+  struct timespec t0, t1;
+  int total;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  n = (n < MAXSTARS) ? n : MAXSTARS;
+  if(w < 2 || h < 2 || n < MINMATCH) {
+    res.skipped++;
+    return(false);
+  }
+
+  // the first image registered is the reference
+
+  if(nref == 0) {
+    nref = n;
+    memcpy(refX, x, n * sizeof(double));
+    memcpy(refY, y, n * sizeof(double));
+    t[0] = t[4] = 1;
+    t[1] = t[2] = t[3] = t[5] = 0;
+    res.matched = n;
+  } else if(!align(x, y, n)) {
+    res.skipped++;
+    return(false);
+  }
+
+  estimateNoise();
+  for(int j=0; j<BANDS; j++)
+    pool->submit(LiveStack::bandJob, this, j, 0);
+  pool->wait();
+
+  for(int j=total=0; j<BANDS; j++)
+    total += rejected[j];
+  res.frames++;
+  motion();
+  res.rejected = 100.0 * total / (STATIC_CAST(double, w) * h);
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  res.elapsed = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+LiveStack::resample(const double* x, const double* y, int n, WorkerPool* pool,
+		    float* dst)
+{
+  struct timespec t0, t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  n = (n < MAXSTARS) ? n : MAXSTARS;
+  if(nref == 0 || n < MINMATCH || !align(x, y, n))
+    return(false);
+
+  out = dst;
+  for(int j=0; j<BANDS; j++)
+    pool->submit(LiveStack::bandJob, this, j, 0);
+  pool->wait();
+  out = 0;
+  motion();
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  res.elapsed = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::stackRow(int y, float* dst, float blank, int least) const
+{
+  int i = y * w;
+
+  for(int x=0; x<w; x++, i++)
+    dst[x] = (count[i] >= least) ? mean[i] : blank;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::varianceRow(int y, float* dst) const
+{
+  int i = y * w;
+
+  for(int x=0; x<w; x++, i++)
+    dst[x] = (count[i] >= 2) ? m2[i] / (count[i] - 1) / count[i] : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::toImage(double rx, double ry, double* x, double* y) const
+{
+  *x = t[0] * rx + t[1] * ry + t[2];
+  *y = t[3] * rx + t[4] * ry + t[5];
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::output(SavedImage* image, FITSHeader* header)
+{
+  FITSHeader stack(*head);
+  char tmp[sizeof(path) + 8];
+  char hist[FITSHeader::STRINGSZ+1];
+  size_t rowBytes = w * sizeof(float);
+  float* buf = new float[SAVEROWS * w];
+  unsigned int u;
+  DataSum sum;
+  char* hdr;
+  off_t size;
+  int fd, nrec, n, err = 0;
+
+  // the reference image header, described as a mean of the sequence
+
+  stack.set("BITPIX", -32, "Number of bits per data pixel");
+  stack.set("NAXIS1", w, "columns");
+  stack.set("NAXIS2", h, "rows");
+  stack.erase("BZERO");
+  stack.erase("BSCALE");
+  stack.erase("CATALOG");
+  stack.set("NCOMBINE", res.frames, "images stacked");
+  stack.set("COMBINE", "sigclip", "running mean, clipped");
+  stack.set("KAPPA", pars.kappa, "[sigma] clipping threshold");
+  stack.set("STACKSKP", res.skipped, "images not registered");
+  snprintf(hist, sizeof(hist), "live stack of %d images, blank pixels are NaN",
+	   res.frames);
+  stack.setVoid("HISTORY", hist);
+
+  // written under a temporary name, renamed when done,
+  // so that the last stack saved is always readable
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    image->warn(errno, path);	// the image is still saved
+    delete [] buf;
+    return;
+  }
+  nrec = stack.records();
+  size = STATIC_CAST(off_t, w) * h * sizeof(float);
+  size = (size + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ * FITSHeader::RECORDSZ;
+  if(ftruncate(fd, STATIC_CAST(off_t, nrec) * FITSHeader::RECORDSZ + size) == -1)
+    err = errno;
+
+  // big endian floats, SAVEROWS rows per pwrite()
+
+  for(int y=0; y<h && !err; y+=n) {
+    n = (h-y < SAVEROWS) ? h-y : SAVEROWS;
+    for(int i=0; i<n; i++)
+      stackRow(y+i, buf + i*w, NAN);
+    for(int i=0; i<n*w; i++) {
+      memcpy(&u, &buf[i], sizeof(u));
+      u = __builtin_bswap32(u);
+      memcpy(&buf[i], &u, sizeof(u));
+    }
+    sum.add(buf, n*rowBytes, STATIC_CAST(off_t, y)*rowBytes);
+    if(!pwriteAll(fd, buf, n*rowBytes, STATIC_CAST(off_t, nrec) * FITSHeader::RECORDSZ
+		  + STATIC_CAST(off_t, y)*rowBytes))
+      err = (errno) ? errno : EIO;
+  }
+  delete [] buf;
+
+  hdr = new char[nrec * FITSHeader::RECORDSZ];
+  stack.render(hdr, nrec, sum.value());
+  if(!err && !pwriteAll(fd, hdr, nrec * FITSHeader::RECORDSZ, 0))
+    err = (errno) ? errno : EIO;
+  delete [] hdr;
+  if(close(fd) == -1 && !err)
+    err = errno;
+
+  if(!err && rename(tmp, path) == -1)
+    err = errno;
+  if(err) {
+    unlink(tmp);
+    image->warn(err, path);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::motion()
+{
+  // of the image centre
+
+  res.dx   = t[0] * w/2 + t[1] * h/2 + t[2] - w/2;
+  res.dy   = t[3] * w/2 + t[4] * h/2 + t[5] - h/2;
+  res.rota = atan2(t[3] - t[1], t[0] + t[4]) / DEG;
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+LiveStack::match(const double* x, const double* y, int n, double tol,
+		 double* from, double* to) const
+{
+  double px, py, d, best;
+  int m = 0, k;
+
+  for(int i=0; i<nref; i++) {
+    px = t[0] * refX[i] + t[1] * refY[i] + t[2];
+    py = t[3] * refX[i] + t[4] * refY[i] + t[5];
+    best = tol * tol;
+    k = -1;
+    for(int j=0; j<n; j++) {
+      d = (x[j] - px) * (x[j] - px) + (y[j] - py) * (y[j] - py);
+      if(d <= best) {
+	best = d;
+	k = j;
+      }
+    }
+    if(k == -1)
+      continue;
+    if(from) {
+      from[2*m]   = refX[i];
+      from[2*m+1] = refY[i];
+      to[2*m]     = x[k];
+      to[2*m+1]   = y[k];
+    }
+    m++;
+  }
+  return(m);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+LiveStack::align(const double* x, const double* y, int n)
+{
+  double from[2*MAXSTARS], to[2*MAXSTARS], shift[2];
+  int most = 0, m;
+
+  // the shift most pairs of bright stars agree on
+
+  t[0] = t[4] = 1;
+  t[1] = t[3] = 0;
+  for(int i=0; i<nref && i<VOTE; i++)
+    for(int j=0; j<n && j<VOTE; j++) {
+      t[2] = x[j] - refX[i];
+      t[5] = y[j] - refY[i];
+      m = match(x, y, n, pars.matchTol, 0, 0);
+      if(m > most) {
+	most = m;
+	shift[0] = t[2];
+	shift[1] = t[5];
+      }
+    }
+  if(most < MINMATCH)
+    return(false);
+  t[2] = shift[0];
+  t[5] = shift[1];
+
+  // then refined by least squares, stars matched again each time
+
+  for(int it=0; it<REFINE; it++) {
+    m = match(x, y, n, pars.matchTol, from, to);
+    if(m < MINMATCH)
+      return(false);
+    if(m >= AFFINE && fit(from, to, m, 0, t) && fit(from, to, m, 1, t+3))
+      continue;
+    t[0] = t[4] = 1;		// a shift only
+    t[1] = t[3] = t[2] = t[5] = 0;
+    for(int i=0; i<m; i++) {
+      t[2] += (to[2*i] - from[2*i]) / m;
+      t[5] += (to[2*i+1] - from[2*i+1]) / m;
+    }
+  }
+  res.matched = match(x, y, n, pars.matchTol, 0, 0);
+  return(res.matched >= MINMATCH);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::estimateNoise()
+{
+  float* buf = new float[SAMPLE];
+  int step = (w * h + SAMPLE - 1) / SAMPLE;
+  float med;
+  int n = 0;
+
+  for(int i=0; i<w*h && n<SAMPLE; i+=step)
+    if(!isnan(plane[i]))
+      buf[n++] = plane[i];
+
+  noise = 0;
+  if(n > 1) {
+    std::nth_element(buf, buf + n/2, buf + n);
+    med = buf[n/2];
+    for(int i=0; i<n; i++)
+      buf[i] = fabsf(buf[i] - med);
+    std::nth_element(buf, buf + n/2, buf + n);
+    noise = MADSIGMA * buf[n/2];
+  }
+  delete [] buf;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::bandJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(LiveStack*, ctx)->band(a);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+LiveStack::band(int job)
+{
+  int y1 = job * bandRows;
+  int y2 = (y1 + bandRows < h) ? y1 + bandRows : h;
+  const float* p;
+  double sx, sy, fx, fy, v, d, s;
+  int ix, iy, i, n;
+
+  rejected[job] = 0;
+  for(int y=y1; y<y2; y++)
+    for(int x=0; x<w; x++) {
+
+      // bilinear resampling of the image onto the reference grid
+
+      i = y*w + x;
+      if(out)
+	out[i] = NAN;
+      sx = t[0] * x + t[1] * y + t[2];
+      sy = t[3] * x + t[4] * y + t[5];
+      if(sx < 0 || sy < 0 || sx > w-1 || sy > h-1)
+	continue;
+      ix = (STATIC_CAST(int, sx) < w-1) ? STATIC_CAST(int, sx) : w-2;
+      iy = (STATIC_CAST(int, sy) < h-1) ? STATIC_CAST(int, sy) : h-2;
+      fx = sx - ix;
+      fy = sy - iy;
+      p  = plane + iy*w + ix;
+      if(isnan(p[0]) || isnan(p[1]) || isnan(p[w]) || isnan(p[w+1]))
+	continue;		// rows lost
+      v = (1-fy) * ((1-fx) * p[0] + fx * p[1]) + fy * ((1-fx) * p[w] + fx * p[w+1]);
+      if(out) {
+	out[i] = v;
+	continue;
+      }
+
+      // clipped against the values stacked so far, then added
+
+      n = count[i];
+      if(n >= MINCLIP) {
+	s = sqrt(m2[i] / (n-1));
+	s = (s > noise) ? s : noise;
+	if(fabs(v - mean[i]) > pars.kappa * s) {
+	  rejected[job]++;
+	  continue;
+	}
+      }
+      if(n == 65535)
+	continue;
+      n++;
+      d = v - mean[i];
+      mean[i] += d / n;
+      m2[i]   += d * (v - mean[i]);
+      count[i] = n;
+    }
+}
@@ -0,0 +1,169 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_LIVESTACK_H
+#define AUDINE_LIVESTACK_H
+
+#include "sidefile.h"
+
+/* live stacking parameters */
+
+struct StackPars {
+  double kappa;			/* pixel clipping threshold [sigma] */
+  double matchTol;		/* star match tolerance [pixels] */
+  int saveEvery;		/* frames between saves of the stack, 0=last only */
+};
+
+/* state of the stack after the last frame */
+
+struct StackResult {
+  int frames;			/* frames stacked */
+  int skipped;			/* frames not registered */
+  int matched;			/* stars matched by the last frame */
+  double dx;			/* its shift from the reference [pixels] */
+  double dy;
+  double rota;			/* its rotation from the reference [deg] */
+  double rejected;		/* its pixels clipped [%] */
+  double elapsed;		/* its registration & resampling time [ms] */
+};
+
+class FITSHeader;
+class WorkerPool;
+
+/*
+ * Running shift-and-add stack of the images of a sequence, as saved.
+ * The first image with enough stars is the reference. Every other one
+ * is registered to it by its star pattern: the offsets between their
+ * brightest stars vote for a shift, then an affine transform is fitted
+ * by least squares to the stars matched, a few times over. The image
+ * is resampled bilinearly onto the reference grid in parallel bands
+ * and added to a running mean and variance per pixel (Welford), each
+ * new value being clipped at some sigmas once the pixel has a few.
+ * The noise of the image is the floor of the per pixel sigma, so that 
+ * pixels stacked alike a few times do not reject everything after.
+ * The stack may be saved as a decimal FITS image now and then, under
+ * the header of its reference image.
+ */
+
+class LiveStack : public SideOutput {
+
+ public:
+
+  static const int BANDS    = 32;  /* parallel jobs per image */
+  static const int MAXSTARS = 100; /* brightest stars registered */
+  static const int SAVEROWS = 64;  /* rows per pwrite() when saved */
+
+  LiveStack();
+ ~LiveStack();
+
+  /* starts a new empty stack of images of 'w' x 'h' pixels, */
+  /* without a header */
+  void reset(int w, int h, const StackPars* pars);
+
+  /* names the file output() saves the stack to after the first image */
+  /* of the sequence: 'dir/name1.fit' goes to 'dir/name1_stack.fit' */
+  void nameAfter(const char* image);
+
+  /* keeps a copy of the 'header' of the image just added if the */
+  /* stack has none yet, that is, the header of its reference image */
+  void describe(const FITSHeader* header);
+
+  /* stack size */
+  int width() const { return(w); }
+  int height() const { return(h); }
+
+  /* row 'y' of the next image to fill before add(), NaN if not valid */
+  float* row(int y) { return(plane + y*w); }
+
+  /* registers the image just filled from its stars, brightest first, */
+  /* and adds it to the stack. false if not registered */
+  bool add(const double* x, const double* y, int n, WorkerPool* pool);
+
+  /* registers the image just filled like add() and resamples it onto */
+  /* the reference grid into 'dst', NaN where not covered, leaving the */
+  /* stack as is. false if not registered */
+  bool resample(const double* x, const double* y, int n, WorkerPool* pool,
+		float* dst);
+
+  /* row 'y' of the stack, 'blank' where fewer than 'least' were stacked */
+  void stackRow(int y, float* dst, float blank, int least = 1) const;
+
+  /* variance of the mean of row 'y', 0 where fewer than 2 were stacked */
+  void varianceRow(int y, float* dst) const;
+
+  /* pixel of the last image registered of reference pixel (rx, ry) */
+  void toImage(double rx, double ry, double* x, double* y) const;
+
+  /* state after the last image */
+  const StackResult* result() const { return(&res); }
+
+  /* saves the stack as a decimal FITS image, blank where empty, */
+  /* described as a mean of the sequence. Nothing goes to 'header' */
+  void output(SavedImage* image, FITSHeader* header);
+
+ private:
+
+  StackPars pars;
+  StackResult res;
+  char path[256];		/* where output() saves the stack */
+  FITSHeader* head;		/* header of the reference image, 0 if none */
+  int w;
+  int h;
+  int size;			/* capacity of the pixel arrays */
+
+  /* per pixel */
+  float* plane;			/* image being added */
+  float* mean;			/* running mean */
+  float* m2;			/* running sum of squared deviations */
+  unsigned short* count;	/* values stacked */
+
+  /* reference stars & the transform of the image being added, */
+  /* x = t0 rx + t1 ry + t2 and y = t3 rx + t4 ry + t5 */
+  double refX[MAXSTARS];
+  double refY[MAXSTARS];
+  int nref;
+  double t[6];
+  double noise;			/* of the image being added */
+  float* out;			/* where it is resampled to, 0 if stacked */
+  int rejected[BANDS];		/* pixels clipped per band */
+  int bandRows;			/* rows per band */
+
+  /* matches the reference stars through the transform within 'tol'. */
+  /* The pairs go to 'from' & 'to' if not NULL. Returns the matches */
+  int match(const double* x, const double* y, int n, double tol,
+	    double* from, double* to) const;
+
+  /* transform of the image from its stars. false if not registered */
+  bool align(const double* x, const double* y, int n);
+
+  /* noise of the image being added from a sample of its pixels */
+  void estimateNoise();
+
+  /* shift & rotation of the image registered into 'res' */
+  void motion();
+
+  /* resamples & stacks a band. Runs in the worker pool */
+  static void bandJob(void* ctx, int a, int b);
+  void band(int job);
+};
+
+#endif
@@ -0,0 +1,52 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "starindex.h"
+
+/*---------------------------------------------------------------------------*/
+
+// builds the plate solver star index from a text catalog, once and
+// off line, as it takes longer than a driver should
+
+int
+main(int argc, char** argv)
+{
+  int stars, quads, levels, res;
+
+  if(argc != 3) {
+    fprintf(stderr, "usage: %s catalog index\n"
+	    "  catalog: text file, one 'ra dec mag' star per line, in degrees\n"
+	    "  index:   index file for the SOLVER_INDEX property\n", argv[0]);
+    return(2);
+  }
+
+  res = StarIndex::build(argv[1], argv[2], &stars, &quads, &levels);
+  if(res != 0) {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(res));
+    return(1);
+  }
+  printf("%s: %d stars, %d quads in %d levels\n", argv[2], stars, quads, levels);
+  return(0);
+}
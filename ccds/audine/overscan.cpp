@@ -0,0 +1,169 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "fitshead.h"
+#include "overscan.h"
+
+#define KAPPA 3.0		/* clipping threshold in sigmas */
+
+/*---------------------------------------------------------------------------*/
+
+Overscan::Overscan() : w(0), h(0), level(0), size(0)
+{
+}
+
+/*---------------------------------------------------------------------------*/
+
+Overscan::~Overscan()
+{
+  delete [] level;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Overscan::reset(const OverscanGeom* g, int width, int height)
+{
+  geom = *g;
+  w = width;
+  h = height;
+  if(h > size) {
+    delete [] level;
+    size  = h;
+    level = new float[size];
+  }
+  for(int y=0; y<h; y++)
+    level[y] = NAN;
+}
+
+/*---------------------------------------------------------------------------*/
+
+float
+Overscan::measure(const pixel_t* row) const
+{
+  float v[MAXCOLS];
+  float dev[MAXCOLS];
+  float med, sigma, sum;
+  int n = 0, k = 0;
+
+  for(int x=0; x<geom.pre && n<MAXCOLS; x++)
+    v[n++] = row[x];
+  for(int x=geom.post; x<w && n<MAXCOLS; x++)
+    v[n++] = row[x];
+  if(n == 0)
+    return(0);
+
+  // median & MAD on copies, a few dozen values at most
+
+  std::nth_element(v, v + n/2, v + n);
+  med = v[n/2];
+  for(int i=0; i<n; i++)
+    dev[i] = fabsf(v[i] - med);
+  std::nth_element(dev, dev + n/2, dev + n);
+  sigma = 1.4826f * dev[n/2];
+
+  sum = 0;
+  for(int i=0; i<n; i++)
+    if(fabsf(v[i] - med) <= KAPPA * sigma) {
+      sum += v[i];
+      k++;
+    }
+  return((k) ? sum / k : med);	// the median at least is kept
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Overscan::subtract(pixel_t* row, int y)
+{
+  int bias;
+
+  level[y] = measure(row);
+  bias = STATIC_CAST(int, lrintf(level[y]));
+  for(int x=0; x<w; x++)
+    row[x] = STATIC_CAST(pixel_t, row[x] - bias);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Overscan::finish(BiasLevel* res) const
+{
+  double sy = 0, syy = 0, sl = 0, sly = 0, sll = 0;
+  double a, b, det, r;
+  int n = 0;
+
+  // least squares line through the row levels
+
+  for(int y=0; y<h; y++) {
+    if(isnan(level[y]))
+      continue;
+    sy  += y;
+    syy += STATIC_CAST(double, y) * y;
+    sl  += level[y];
+    sly += level[y] * STATIC_CAST(double, y);
+    sll += STATIC_CAST(double, level[y]) * level[y];
+    n++;
+  }
+
+  res->rows  = n;
+  res->level = (n) ? sl / n : 0;
+  res->drift = 0;
+  res->noise = 0;
+  if(n < 2)
+    return;
+
+  det = n * syy - sy * sy;
+  b = (n * sly - sy * sl) / det;
+  a = (sl - b * sy) / n;
+  r = sll - 2 * a * sl - 2 * b * sly + n * a * a + 2 * a * b * sy + b * b * syy;
+  res->drift = b * (h - 1);
+  res->noise = sqrt(std::max(r / n, 0.0));
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Overscan::stamp(FITSHeader* header, const BiasLevel* res) const
+{
+  char buf[FITSHeader::STRINGSZ+1];
+
+  // IRAF sections are one based
+
+  snprintf(buf, sizeof(buf), "[1:%d,*] [%d:%d,*] row clipped mean", 
+	   geom.pre, geom.post + 1, w);
+  header->set("OVERSCAN", buf, "overscan subtracted");
+  header->set("BIASLEVL", res->level, "[ADU] mean overscan level");
+  header->set("BIASDRFT", res->drift, "[ADU] level drift, first to last row");
+  header->set("BIASNOIS", res->noise, "[ADU] row level scatter");
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,99 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_OVERSCAN_H
+#define AUDINE_OVERSCAN_H
+
+/* overscan processing of full frames with overscan */
+
+#define OVERSCAN_NONE     0	/* images saved as read */
+#define OVERSCAN_SUBTRACT 1	/* row overscan level subtracted */
+#define OVERSCAN_TRIM     2	/* same, and only the active area saved */
+
+/* where the overscan is in an image, in binned pixels */
+
+struct OverscanGeom {
+  int pre;			/* overscan columns [0, pre) */
+  int post;			/* and [post, image width) */
+  int x;			/* active area origin */
+  int y;
+  int width;			/* active area size */
+  int height;
+};
+
+/* bias level of a frame, as measured in the overscan */
+
+struct BiasLevel {
+  int rows;			/* rows measured */
+  double level;			/* mean level [ADU] */
+  double drift;			/* fitted change from first to last row [ADU] */
+  double noise;			/* row levels scatter around the fit [ADU] */
+};
+
+class FITSHeader;
+
+/*
+ * Streaming overscan correction. The bias level of every row is
+ * measured as soon as the row arrives, as a clipped mean of its 
+ * overscan pixels: those further than 3 sigma (estimated from the 
+ * median absolute deviation) from the median are left out, which
+ * takes care of hot columns and cosmic rays. The rounded level is
+ * subtracted from the whole row in place, so that everything
+ * downstream (statistics, preview, file) sees corrected pixels.
+ * Row levels are kept to fit the bias level and its drift along
+ * the frame once it is complete.
+ */
+
+class Overscan {
+
+ public:
+
+  static const int MAXCOLS = 128; /* overscan pixels per row used */
+
+  Overscan();
+ ~Overscan();
+
+  /* prepares for a new frame of the given dimensions */
+  void reset(const OverscanGeom* geom, int width, int height);
+
+  /* measures and subtracts the overscan level of row 'y' */
+  void subtract(pixel_t* row, int y);
+
+  /* fits the level and drift of the rows measured so far */
+  void finish(BiasLevel* res) const;
+
+  /* adds the IRAF OVERSCAN card and the measured level */
+  void stamp(FITSHeader* header, const BiasLevel* res) const;
+
+ private:
+
+  OverscanGeom geom;		/* current frame geometry */
+  int w;			/* image width */
+  int h;			/* image height */
+  float* level;			/* level per row, NAN if not received */
+  int size;			/* capacity of level[] */
+
+  /* clipped mean of the overscan pixels of a row */
+  float measure(const pixel_t* row) const;
+};
+
+#endif
@@ -0,0 +1,537 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "calib.h"
+#include "fitshead.h"
+#include "frame.h"
+#include "photometry.h"
+#include "stats.h"
+
+#define CLIP      3.0		/* sky clipping [sigma] */
+#define CLIPS     3		/* sky clipping iterations */
+#define MADSIGMA  1.4826	/* sigma of a normal distribution from its MAD */
+#define MINSKY    10		/* fewest sky pixels trusted */
+#define DETECT    5.0		/* star detection limit [sigma] */
+#define MOMENTS   10		/* centroid iterations */
+#define SUBPIX    5		/* aperture border pixels subsampling */
+#define LOST      1		/* bad[]: off the region or row never received */
+#define SATURATED 2		/* bad[]: pixel at full scale */
+#define NOMAG     99.0		/* magnitude of a null flux */
+
+/*---------------------------------------------------------------------------*/
+
+static float
+median(float* v, int n)
+{
+  std::nth_element(v, v + n/2, v + n);
+  return(v[n/2]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+Photometer::Photometer() : mtime(0), ntargets(0), frame(0), calib(0), x0(0),
+    y0(0), w(0), h(0), box(0), bad(0), row(0), annulus(0), half(0), size(0),
+    rowSize(0), bx(0), by(0)
+{
+  path[0] = 0;
+  memset(&pars, 0, sizeof(pars));
+}
+
+/*---------------------------------------------------------------------------*/
+
+Photometer::~Photometer()
+{
+  delete [] box;
+  delete [] bad;
+  delete [] row;
+  delete [] annulus;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Photometer::load(const char* file)
+{
+  char line[256], kind[2], units[4];
+  PhotTarget* t;
+  struct stat st;
+  FILE* f;
+
+  if(stat(file, &st) == -1) {
+    path[0]  = 0;
+    ntargets = 0;
+    return(false);
+  }
+  if(!strcmp(file, path) && st.st_mtime == mtime)
+    return(ntargets > 0);
+
+  f = fopen(file, "r");
+  if(f == NULL) {
+    path[0]  = 0;
+    ntargets = 0;
+    return(false);
+  }
+
+  ntargets = 0;
+  while(fgets(line, sizeof(line), f) && ntargets < MAXTARGETS) {
+    t = &targets[ntargets];
+    if(sscanf(line, " %1[TC] %31s %lf %lf %3s", kind, t->name, &t->a, &t->b,
+	      units) != 5)
+      continue;			// comments & blank lines
+    if(strcmp(units, "deg") && strcmp(units, "pix"))
+      continue;
+    t->comparison = kind[0] == 'C';
+    t->world  = !strcmp(units, "deg");
+    t->placed = false;
+    t->x = t->y = 0;
+    ntargets++;
+  }
+  fclose(f);
+
+  snprintf(path, sizeof(path), "%s", file);
+  mtime = st.st_mtime;
+  return(ntargets > 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Photometer::place(int i, double x, double y)
+{
+  targets[i].placed = true;
+  targets[i].x = x;
+  targets[i].y = y;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Photometer::measure(const Frame* f, const Calibrator* c, int x, int y,
+		    int rw, int rh, const PhotPars* p, double exptime)
+{
+  double sx[MAXTARGETS], sy[MAXTARGETS];
+  double cx, cy, dx, dy;
+  bool found[MAXTARGETS];
+  int n;
+
+  frame = f;
+  calib = c;
+  pars  = *p;
+  pars.gain = (pars.gain > 0) ? pars.gain : 1;
+  x0 = (rw > 0) ? x : 0;
+  y0 = (rw > 0) ? y : 0;
+  w  = (rw > 0) ? rw : frame->width();
+  h  = (rw > 0) ? rh : frame->height();
+
+  // the box holds the annulus of a star found anywhere in the search radius
+
+  half = STATIC_CAST(int, ceil(pars.outer + pars.search)) + 2;
+  if((2*half + 1) * (2*half + 1) > size) {
+    delete [] box;
+    delete [] bad;
+    delete [] annulus;
+    size    = (2*half + 1) * (2*half + 1);
+    box     = new float[size];
+    bad     = new unsigned char[size];
+    annulus = new float[2 * size];
+  }
+  if(calib && frame->width() > rowSize) {
+    delete [] row;
+    rowSize = frame->width();
+    row     = new float[rowSize];
+  }
+
+  // stars not found follow the median shift of those found
+
+  for(int i=n=0; i<ntargets; i++) {
+    found[i] = false;
+    if(!targets[i].placed)
+      continue;
+    cx = targets[i].x;
+    cy = targets[i].y;
+    found[i] = centroid(&cx, &cy);
+    if(!found[i])
+      continue;
+    sx[n]   = cx - targets[i].x;
+    sy[n++] = cy - targets[i].y;
+    targets[i].x = cx;
+    targets[i].y = cy;
+  }
+  dx = dy = 0;
+  if(n > 0) {
+    std::nth_element(sx, sx + n/2, sx + n);
+    std::nth_element(sy, sy + n/2, sy + n);
+    dx = sx[n/2];
+    dy = sy[n/2];
+  }
+
+  for(int i=0; i<ntargets; i++) {
+    if(targets[i].placed && !found[i]) {
+      targets[i].x += dx;
+      targets[i].y += dy;
+    }
+    measureStar(i);
+    if(targets[i].placed && !found[i])
+      results[i].flags |= PHOT_CENTROID;
+  }
+
+  exptime = (exptime > 0) ? exptime : 1;
+  for(int i=0; i<ntargets; i++) {
+    PhotMeasure* r = &results[i];
+    if(r->flags & PHOT_LOST)
+      continue;
+    r->mag    = (r->flux > 0) ? 25 - 2.5 * log10(r->flux / exptime) : NOMAG;
+    r->magErr = (r->flux > 0) ? 2.5 / M_LN10 * r->fluxErr / r->flux : NOMAG;
+  }
+  for(int i=0; i<ntargets; i++)
+    differential(i);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Photometer::output(SavedImage* image, FITSHeader* header)
+{
+  static const char* COLUMNS = "date_obs,jd_mid,exptime,file,name,kind,x,y,"
+    "flux,flux_err,sky,sky_noise,mag,mag_err,dmag,dmag_err,flags\n";
+  const SavedGeom* g = image->geometry();
+  const PhotTarget* t;
+  const PhotMeasure* r;
+  const char *list, *name, *date;
+  const char* saved = image->path();
+  char lcPath[256], file[300];
+  double x, y, exptime, jd;
+  int n;
+
+  // 'dir/name.fit' measured from 'list.txt' goes to 'dir/list.csv'
+
+  list = strrchr(path, '/');
+  list = (list) ? list+1 : path;
+  name = strrchr(saved, '/');
+  name = (name) ? name+1 : saved;
+  n = strlen(list);
+  if(strrchr(list, '.'))
+    n = strrchr(list, '.') - list;
+  snprintf(lcPath, sizeof(lcPath), "%.*s%.*s.csv", STATIC_CAST(int, name - saved),
+	   saved, n, list);
+  if(image->extension() > 0)	// the extension of the image
+    snprintf(file, sizeof(file), "%s[%d]", name, image->extension());
+  else
+    snprintf(file, sizeof(file), "%s", name);
+
+  date = header->get("DATE-OBS");
+  if(!header->get("EXPTIME", &exptime))
+    exptime = 0;
+  jd = julianDay(date);
+  if(jd > 0)
+    jd += exptime / 2 / 86400;	// mid exposure
+
+  // one line per star, positions in pixels of the image as saved, 1 based
+
+  lines.begin(COLUMNS);
+  for(int i=0; i<ntargets; i++) {
+    t = &targets[i];
+    r = &results[i];
+    if(r->flags & PHOT_LOST || !g->toSaved(r->x, r->y, &x, &y))
+      x = y = -1;
+    lines.line("%s,%.6f,%.3f,%s,%s,%c,%.3f,%.3f,%.2f,%.2f,%.2f,%.2f,%.4f,%.4f,"
+	       "%.4f,%.4f,%d\n", (date) ? date : "", jd, exptime, file, t->name,
+	       (t->comparison) ? 'C' : 'T', x + 1, y + 1, r->flux, r->fluxErr,
+	       r->sky, r->skyNoise, r->mag, r->magErr, r->dmag, r->dmagErr, r->flags);
+  }
+  if(!lines.append(lcPath))
+    image->warn(errno, lcPath);	// the image is still saved
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Photometer::fetch(double x, double y)
+{
+  const pixel_t* src;
+  int fx, fy, i;
+
+  bx = STATIC_CAST(int, lrint(x)) - half;
+  by = STATIC_CAST(int, lrint(y)) - half;
+
+  for(int j=0; j<2*half+1; j++) {
+    fy = by + j;
+    i  = j * (2*half + 1);
+    if(fy < y0 || fy >= y0 + h || !frame->hasRow(fy)) {
+      memset(bad + i, LOST, 2*half + 1);
+      continue;
+    }
+    src = frame->row(fy);
+    if(calib)
+      calib->values(row, src, fy);
+    for(int k=0; k<2*half+1; k++, i++) {
+      fx = bx + k;
+      if(fx < x0 || fx >= x0 + w) {
+	bad[i] = LOST;
+	continue;
+      }
+      bad[i] = (src[fx] >= FrameStats::SATURATION) ? SATURATED : 0;
+      box[i] = (calib) ? row[fx] : src[fx];
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+Photometer::sky(double x, double y, double* level, double* noise)
+{
+  float* dev = annulus + size;
+  double r2, sum, sum2, med, mean, s;
+  int n = 0, m, i;
+
+  for(int j=0; j<2*half+1; j++)
+    for(int k=0; k<2*half+1; k++) {
+      i  = j * (2*half + 1) + k;
+      r2 = (bx + k - x) * (bx + k - x) + (by + j - y) * (by + j - y);
+      if(!bad[i] && r2 >= pars.inner * pars.inner && r2 <= pars.outer * pars.outer)
+	annulus[n++] = box[i];
+    }
+
+  *level = *noise = 0;
+  if(n == 0)
+    return(0);
+
+  // median & MAD first, then clipped mean & standard deviation, stars
+  // in the annulus being left out. The mean does not suffer from
+  // integer pixels as the median does
+
+  med  = median(annulus, n);
+  mean = med;
+  for(i=0; i<n; i++)
+    dev[i] = fabs(annulus[i] - med);
+  s = MADSIGMA * median(dev, n);
+
+  for(int it=0; it<CLIPS && n > 2; it++) {
+    sum = sum2 = 0;
+    for(i=m=0; i<n; i++) {
+      if(s > 0 && fabs(annulus[i] - med) > CLIP * s)
+	continue;
+      annulus[m++] = annulus[i];
+      sum  += annulus[i];
+      sum2 += annulus[i] * annulus[i];
+    }
+    if(m < 2)
+      break;
+    n    = m;
+    med  = median(annulus, n);
+    mean = sum / n;
+    s    = sqrt(fmax(sum2 - sum * sum / n, 0) / (n - 1));
+  }
+
+  *level = mean;
+  *noise = s;
+  return(n);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Photometer::centroid(double* x, double* y)
+{
+  double level, noise, peak, v, sum, sx, sy, cx, cy, r2;
+  int px = 0, py = 0, i;
+
+  fetch(*x, *y);
+  if(sky(*x, *y, &level, &noise) < MINSKY)
+    return(false);
+
+  // brightest 3x3 sum within the search radius
+
+  peak = -1e30;
+  for(int j=1; j<2*half; j++)
+    for(int k=1; k<2*half; k++) {
+      if((bx + k - *x) * (bx + k - *x) + (by + j - *y) * (by + j - *y) >
+	 pars.search * pars.search)
+	continue;
+      sum = 0;
+      for(int dj=-1; dj<=1; dj++)
+	for(int dk=-1; dk<=1; dk++) {
+	  i = (j + dj) * (2*half + 1) + k + dk;
+	  sum += (bad[i] & LOST) ? level : box[i];
+	}
+      if(sum > peak) {
+	peak = sum;
+	px = k;
+	py = j;
+      }
+    }
+  if(peak - 9 * level < DETECT * 3 * noise)
+    return(false);		// nothing there
+
+  // intensity weighted moments over the sky, within the aperture
+
+  cx = bx + px;
+  cy = by + py;
+  for(int it=0; it<MOMENTS; it++) {
+    sum = sx = sy = 0;
+    for(int j=0; j<2*half+1; j++)
+      for(int k=0; k<2*half+1; k++) {
+	i  = j * (2*half + 1) + k;
+	r2 = (bx + k - cx) * (bx + k - cx) + (by + j - cy) * (by + j - cy);
+	if(bad[i] & LOST || r2 > pars.radius * pars.radius)
+	  continue;
+	v = box[i] - level;
+	if(v <= 0)
+	  continue;
+	sum += v;
+	sx  += v * (bx + k);
+	sy  += v * (by + j);
+      }
+    if(sum <= 0)
+      return(false);
+    v  = hypot(sx / sum - cx, sy / sum - cy);
+    cx = sx / sum;
+    cy = sy / sum;
+    if(v < 0.01)
+      break;
+  }
+
+  if(hypot(cx - *x, cy - *y) > pars.search + 1)
+    return(false);
+  *x = cx;
+  *y = cy;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+double
+Photometer::aperture(double x, double y, double level, double* area, int* flags)
+{
+  double r2, d, f, sum = 0;
+  int i, in;
+
+  // border pixels count by the fraction of their subpixels inside
+
+  *area = 0;
+  for(int j=0; j<2*half+1; j++)
+    for(int k=0; k<2*half+1; k++) {
+      i = j * (2*half + 1) + k;
+      d = hypot(bx + k - x, by + j - y);
+      if(d > pars.radius + M_SQRT1_2)
+	continue;
+      if(d < pars.radius - M_SQRT1_2)
+	f = 1;
+      else {
+	in = 0;
+	for(int sj=0; sj<SUBPIX; sj++)
+	  for(int sk=0; sk<SUBPIX; sk++) {
+	    r2 = (bx + k + (sk + 0.5) / SUBPIX - 0.5 - x) * 
+	      (bx + k + (sk + 0.5) / SUBPIX - 0.5 - x) +
+	      (by + j + (sj + 0.5) / SUBPIX - 0.5 - y) * 
+	      (by + j + (sj + 0.5) / SUBPIX - 0.5 - y);
+	    in += r2 <= pars.radius * pars.radius;
+	  }
+	f = STATIC_CAST(double, in) / (SUBPIX * SUBPIX);
+      }
+      if(f == 0)
+	continue;
+      if(bad[i] & LOST) {
+	*flags |= PHOT_EDGE;
+	continue;
+      }
+      if(bad[i] & SATURATED)
+	*flags |= PHOT_SATURATED;
+      sum   += f * (box[i] - level);
+      *area += f;
+    }
+  return(sum);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Photometer::measureStar(int i)
+{
+  PhotMeasure* r = &results[i];
+  double area;
+  int nsky;
+
+  memset(r, 0, sizeof(*r));
+  if(!targets[i].placed) {
+    r->flags = PHOT_LOST;
+    return;
+  }
+
+  r->x = targets[i].x;
+  r->y = targets[i].y;
+  fetch(r->x, r->y);
+  nsky = sky(r->x, r->y, &r->sky, &r->skyNoise);
+  if(nsky < MINSKY)
+    r->flags |= PHOT_NOSKY;
+  r->flux = aperture(r->x, r->y, r->sky, &area, &r->flags);
+
+  // photon noise of the star, sky noise over the aperture
+  // and the error of the sky level itself
+
+  r->fluxErr = sqrt(fmax(r->flux, 0) / pars.gain + 
+		    area * r->skyNoise * r->skyNoise +
+		    ((nsky) ? area * area * r->skyNoise * r->skyNoise / nsky : 0));
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Photometer::differential(int i)
+{
+  static const int BAD = PHOT_EDGE | PHOT_SATURATED | PHOT_NOSKY | PHOT_LOST;
+  PhotMeasure* r = &results[i];
+  double flux = 0, var = 0;
+
+  if(r->flags & PHOT_LOST)
+    return;
+
+  for(int j=0; j<ntargets; j++)
+    if(j != i && targets[j].comparison && !(results[j].flags & BAD) &&
+       results[j].flux > 0) {
+      flux += results[j].flux;
+      var  += results[j].fluxErr * results[j].fluxErr;
+    }
+
+  if(flux <= 0)
+    r->flags |= PHOT_NOREF;
+  if(flux <= 0 || r->flux <= 0) {
+    r->dmag    = NOMAG;
+    r->dmagErr = NOMAG;
+    return;
+  }
+  r->dmag    = -2.5 * log10(r->flux / flux);
+  r->dmagErr = 2.5 / M_LN10 * sqrt(r->fluxErr * r->fluxErr / (r->flux * r->flux) +
+				   var / (flux * flux));
+}
@@ -0,0 +1,187 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_PHOTOMETRY_H
+#define AUDINE_PHOTOMETRY_H
+
+#include <time.h>
+
+#include "sidefile.h"
+
+/* photometry of object images */
+
+#define PHOT_NONE       0	/* no photometry */
+#define PHOT_LIGHTCURVE 1	/* targets measured into a light curve file */
+
+/* measure flags, as a mask */
+
+#define PHOT_EDGE      1	/* aperture off the region or on lost rows */
+#define PHOT_SATURATED 2	/* aperture has pixels at full scale */
+#define PHOT_CENTROID  4	/* centroid not refined, position kept */
+#define PHOT_NOSKY     8	/* too few sky pixels in the annulus */
+#define PHOT_LOST      16	/* position unknown, not measured */
+#define PHOT_NOREF     32	/* no comparison star to refer to */
+
+/* aperture parameters, in frame pixels */
+
+struct PhotPars {
+  double radius;		/* aperture radius */
+  double inner;			/* sky annulus radii */
+  double outer;
+  double search;		/* largest centroid shift between frames */
+  double gain;			/* [e-/ADU] */
+};
+
+/* a star of the target list */
+
+struct PhotTarget {
+  char name[32];
+  bool comparison;		/* comparison star, else a target */
+  bool world;			/* given by RA & DEC, else by pixel */
+  double a;			/* RA & DEC [deg] or 1 based pixel */
+  double b;			/* of the image as saved */
+  bool placed;			/* tracked position below is valid */
+  double x;			/* tracked position, 0 based frame pixels */
+  double y;
+};
+
+/* a star measured */
+
+struct PhotMeasure {
+  double x;			/* centroid, 0 based frame pixels */
+  double y;
+  double flux;			/* over the sky [ADU] */
+  double fluxErr;
+  double sky;			/* sky level per pixel [ADU] */
+  double skyNoise;		/* sky noise per pixel [ADU] */
+  double mag;			/* instrumental, 25 - 2.5 log(flux/s) */
+  double magErr;
+  double dmag;			/* against the other comparison stars */
+  double dmagErr;
+  int flags;			/* PHOT_xxx mask */
+};
+
+class Calibrator;
+class FITSHeader;
+class Frame;
+
+/*
+ * Aperture photometry of a short list of target and comparison stars,
+ * read from a text file with one star per line:
+ *
+ *   T|C  name  ra dec deg        (decimal degrees, J2000)
+ *   T|C  name  x y pix           (1 based pixels of the image as saved)
+ *
+ * and '#' comments. Stars are tracked from frame to frame: each one
+ * is looked for from its last position, at the brightest pixel within
+ * the search radius, and centred by intensity weighted moments over
+ * the local sky. Stars not found follow the median shift of the others.
+ * The sky is the clipped median of an annulus, its noise giving the
+ * flux error along with the photon noise. Every star gets a
+ * differential magnitude against the summed flux of the comparison 
+ * stars other than itself.
+ * The stars measured are appended to a light curve file, one line
+ * per star and image.
+ */
+
+class Photometer : public SideOutput {
+
+ public:
+
+  static const int MAXTARGETS = 64; /* stars in a list */
+
+  Photometer();
+ ~Photometer();
+
+  /* reads the target list, again only if its file changed, */
+  /* every star being unplaced then. false if none could be read */
+  bool load(const char* path);
+
+  /* stars of the list, in file order */
+  int count() const { return(ntargets); }
+  const PhotTarget* target(int i) const { return(&targets[i]); }
+
+  /* places a star at a frame pixel, 0 based */
+  void place(int i, double x, double y);
+
+  /* measures the stars placed in a region of a complete frame, */
+  /* the whole frame if 'w' is 0. Calibrated pixels if 'calib' */
+  /* is not NULL. Tracked positions move to the centroids found */
+  void measure(const Frame* frame, const Calibrator* calib, int x, int y,
+	       int w, int h, const PhotPars* pars, double exptime);
+
+  /* last measure of a star */
+  const PhotMeasure* result(int i) const { return(&results[i]); }
+
+  /* appends the stars measured in the frame of 'image' to the light */
+  /* curve file of the list, next to the image, in its pixels */
+  void output(SavedImage* image, FITSHeader* header);
+
+ private:
+
+  char path[256];		/* target list loaded */
+  time_t mtime;		/* its modification time */
+  PhotTarget targets[MAXTARGETS];
+  PhotMeasure results[MAXTARGETS];
+  int ntargets;
+  CSVLines lines;		/* of the light curve file */
+
+  /* frame being measured */
+  const Frame* frame;
+  const Calibrator* calib;
+  PhotPars pars;
+  int x0;			/* region in the frame */
+  int y0;
+  int w;
+  int h;
+
+  /* pixels about the star being measured */
+  float* box;
+  unsigned char* bad;		/* out of region, lost or saturated */
+  float* row;			/* a calibrated frame row */
+  float* annulus;		/* sky pixels */
+  int half;			/* box is 2 half + 1 pixels wide */
+  int size;			/* capacity of box[], bad[] & annulus[] */
+  int rowSize;			/* capacity of row[] */
+  int bx;			/* box origin in the frame */
+  int by;
+
+  /* loads the box about frame pixel (x, y) */
+  void fetch(double x, double y);
+
+  /* clipped sky level & noise about (x, y). Returns the pixels used */
+  int sky(double x, double y, double* level, double* noise);
+
+  /* finds the star about (x, y) and its centroid. false if not found */
+  bool centroid(double* x, double* y);
+
+  /* aperture flux about (x, y), the area and flags through pointers */
+  double aperture(double x, double y, double level, double* area, int* flags);
+
+  /* measures star 'i' at its tracked position */
+  void measureStar(int i);
+
+  /* differential magnitude of star 'i' */
+  void differential(int i);
+};
+
+#endif
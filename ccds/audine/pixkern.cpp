@@ -0,0 +1,408 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <string.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "pixkern.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define PIXKERN_X86
+#include <immintrin.h>
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                         PORTABLE C KERNELS                                */
+/*---------------------------------------------------------------------------*/
+
+static inline unsigned short
+bswap16(unsigned short v)
+{
+  return(STATIC_CAST(unsigned short, (v >> 8) | (v << 8)));
+}
+
+static void
+swapC(void* dst, const pixel_t* src, int n)
+{
+  const unsigned short* s = STATIC_CAST(const unsigned short*, STATIC_CAST(const void*, src));
+  unsigned short* d = STATIC_CAST(unsigned short*, dst);
+
+  for(int i=0; i<n; i++)
+    d[i] = bswap16(s[i]);
+}
+
+static void
+mirrorC(void* dst, const pixel_t* src, int n)
+{
+  pixel_t* d = STATIC_CAST(pixel_t*, dst);
+
+  for(int i=0; i<n; i++)
+    d[i] = src[n-1-i];
+}
+
+static void
+swapMirrorC(void* dst, const pixel_t* src, int n)
+{
+  const unsigned short* s = STATIC_CAST(const unsigned short*, STATIC_CAST(const void*, src));
+  unsigned short* d = STATIC_CAST(unsigned short*, dst);
+
+  for(int i=0; i<n; i++)
+    d[i] = bswap16(s[n-1-i]);
+}
+
+static void
+binAddC(int* acc, const pixel_t* src, int n, int f)
+{
+  int sum;
+
+  for(int i=0; i<n; i++, src += f) {
+    sum = 0;
+    for(int k=0; k<f; k++)
+      sum += src[k];
+    acc[i] += sum;
+  }
+}
+
+static void
+packC(pixel_t* dst, const int* acc, int n)
+{
+  for(int i=0; i<n; i++)
+    dst[i] = STATIC_CAST(pixel_t, (acc[i] > 32767) ? 32767 : 
+			 (acc[i] < -32768) ? -32768 : acc[i]);
+}
+
+static void
+subtractC(float* dst, const float* img, const float* ref, float a, float b, int n)
+{
+  for(int i=0; i<n; i++)
+    dst[i] = img[i] - a*ref[i] - b;
+}
+
+#ifdef PIXKERN_X86
+
+/*---------------------------------------------------------------------------*/
+/*                   SSSE3 KERNELS, 8 PIXELS PER STEP                        */
+/*---------------------------------------------------------------------------*/
+
+__attribute__((target("ssse3"))) static void
+swapSSSE3(void* dst, const pixel_t* src, int n)
+{
+  const __m128i mask = _mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+  const __m128i* s = STATIC_CAST(const __m128i*, STATIC_CAST(const void*, src));
+  __m128i* d = STATIC_CAST(__m128i*, dst);
+  int i, blocks = n / 8;
+
+  for(i=0; i<blocks; i++)
+    _mm_storeu_si128(d+i, _mm_shuffle_epi8(_mm_loadu_si128(s+i), mask));
+
+  swapC(STATIC_CAST(pixel_t*, dst) + 8*blocks, src + 8*blocks, n - 8*blocks);
+}
+
+__attribute__((target("ssse3"))) static void
+mirrorSSSE3(void* dst, const pixel_t* src, int n)
+{
+  const __m128i mask = _mm_setr_epi8(14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1);
+  pixel_t* d = STATIC_CAST(pixel_t*, dst);
+  int i, blocks = n / 8;
+
+  // destination block i comes reversed from the i-th block
+  // counted from the end of the source row
+
+  for(i=0; i<blocks; i++) {
+    __m128i v = _mm_loadu_si128(STATIC_CAST(const __m128i*, STATIC_CAST(const void*, src + n - 8*(i+1))));
+    _mm_storeu_si128(STATIC_CAST(__m128i*, STATIC_CAST(void*, d + 8*i)), _mm_shuffle_epi8(v, mask));
+  }
+
+  for(i=8*blocks; i<n; i++)
+    d[i] = src[n-1-i];
+}
+
+__attribute__((target("ssse3"))) static void
+swapMirrorSSSE3(void* dst, const pixel_t* src, int n)
+{
+  const __m128i mask = _mm_setr_epi8(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0);
+  pixel_t* d = STATIC_CAST(pixel_t*, dst);
+  int i, blocks = n / 8;
+
+  for(i=0; i<blocks; i++) {
+    __m128i v = _mm_loadu_si128(STATIC_CAST(const __m128i*, STATIC_CAST(const void*, src + n - 8*(i+1))));
+    _mm_storeu_si128(STATIC_CAST(__m128i*, STATIC_CAST(void*, d + 8*i)), _mm_shuffle_epi8(v, mask));
+  }
+
+  for(i=8*blocks; i<n; i++)
+    d[i] = bswap16(src[n-1-i]);
+}
+
+// binning by 1, 2 or 4 columns: pmaddwd against ones adds pixel 
+// pairs straight into 32 bits, phaddd adds those pairs again.
+// Other factors are not worth it and go to the C kernel
+
+__attribute__((target("ssse3"))) static void
+binAddSSSE3(int* acc, const pixel_t* src, int n, int f)
+{
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i* a = STATIC_CAST(__m128i*, STATIC_CAST(void*, acc));
+  __m128i v, w;
+  int i = 0;
+
+  if(f == 1) {
+    for(; i+8<=n; i+=8) {
+      v = _mm_loadu_si128(STATIC_CAST(const __m128i*, STATIC_CAST(const void*, src + i)));
+      w = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16); // sign extension
+      _mm_storeu_si128(a + i/4, _mm_add_epi32(_mm_loadu_si128(a + i/4), w));
+      w = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+      _mm_storeu_si128(a + i/4 + 1, _mm_add_epi32(_mm_loadu_si128(a + i/4 + 1), w));
+    }
+  } else if(f == 2) {
+    for(; i+4<=n; i+=4) {
+      v = _mm_loadu_si128(STATIC_CAST(const __m128i*, STATIC_CAST(const void*, src + 2*i)));
+      w = _mm_madd_epi16(v, ones);
+      _mm_storeu_si128(a + i/4, _mm_add_epi32(_mm_loadu_si128(a + i/4), w));
+    }
+  } else if(f == 4) {
+    for(; i+4<=n; i+=4) {
+      v = _mm_loadu_si128(STATIC_CAST(const __m128i*, STATIC_CAST(const void*, src + 4*i)));
+      w = _mm_loadu_si128(STATIC_CAST(const __m128i*, STATIC_CAST(const void*, src + 4*i + 8)));
+      w = _mm_hadd_epi32(_mm_madd_epi16(v, ones), _mm_madd_epi16(w, ones));
+      _mm_storeu_si128(a + i/4, _mm_add_epi32(_mm_loadu_si128(a + i/4), w));
+    }
+  }
+
+  binAddC(acc + i, src + f*i, n - i, f);
+}
+
+__attribute__((target("ssse3"))) static void
+packSSSE3(pixel_t* dst, const int* acc, int n)
+{
+  const __m128i* a = STATIC_CAST(const __m128i*, STATIC_CAST(const void*, acc));
+  __m128i* d = STATIC_CAST(__m128i*, STATIC_CAST(void*, dst));
+  int i, blocks = n / 8;
+
+  for(i=0; i<blocks; i++)
+    _mm_storeu_si128(d+i, _mm_packs_epi32(_mm_loadu_si128(a + 2*i), 
+					  _mm_loadu_si128(a + 2*i + 1)));
+
+  packC(dst + 8*blocks, acc + 8*blocks, n - 8*blocks);
+}
+
+// 4 floats per step
+
+__attribute__((target("ssse3"))) static void
+subtractSSSE3(float* dst, const float* img, const float* ref, float a, float b, int n)
+{
+  const __m128 va = _mm_set1_ps(a);
+  const __m128 vb = _mm_set1_ps(b);
+  int i, blocks = n / 4;
+
+  for(i=0; i<blocks; i++)
+    _mm_storeu_ps(dst + 4*i, _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(img + 4*i),
+				       _mm_mul_ps(va, _mm_loadu_ps(ref + 4*i))), vb));
+
+  subtractC(dst + 4*blocks, img + 4*blocks, ref + 4*blocks, a, b, n - 4*blocks);
+}
+
+/*---------------------------------------------------------------------------*/
+/*                   AVX2 KERNELS, 16 PIXELS PER STEP                        */
+/*---------------------------------------------------------------------------*/
+
+// _mm256_shuffle_epi8 works within each 128 bit lane,
+// so mirroring also needs the two lanes exchanged
+
+__attribute__((target("avx2"))) static void
+swapAVX2(void* dst, const pixel_t* src, int n)
+{
+  const __m256i mask = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+					1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+  const __m256i* s = STATIC_CAST(const __m256i*, STATIC_CAST(const void*, src));
+  __m256i* d = STATIC_CAST(__m256i*, dst);
+  int i, blocks = n / 16;
+
+  for(i=0; i<blocks; i++)
+    _mm256_storeu_si256(d+i, _mm256_shuffle_epi8(_mm256_loadu_si256(s+i), mask));
+
+  _mm256_zeroupper();		// no AVX to SSE transition stall
+  swapSSSE3(STATIC_CAST(pixel_t*, dst) + 16*blocks, src + 16*blocks, n - 16*blocks);
+}
+
+__attribute__((target("avx2"))) static void
+mirrorAVX2(void* dst, const pixel_t* src, int n)
+{
+  const __m256i mask = _mm256_setr_epi8(14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1,
+					14,15,12,13,10,11,8,9,6,7,4,5,2,3,0,1);
+  pixel_t* d = STATIC_CAST(pixel_t*, dst);
+  int i, blocks = n / 16;
+
+  for(i=0; i<blocks; i++) {
+    __m256i v = _mm256_loadu_si256(STATIC_CAST(const __m256i*, STATIC_CAST(const void*, src + n - 16*(i+1))));
+    v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, mask), 0x4E);
+    _mm256_storeu_si256(STATIC_CAST(__m256i*, STATIC_CAST(void*, d + 16*i)), v);
+  }
+
+  for(i=16*blocks; i<n; i++)
+    d[i] = src[n-1-i];
+}
+
+__attribute__((target("avx2"))) static void
+swapMirrorAVX2(void* dst, const pixel_t* src, int n)
+{
+  const __m256i mask = _mm256_setr_epi8(15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0,
+					15,14,13,12,11,10,9,8,7,6,5,4,3,2,1,0);
+  pixel_t* d = STATIC_CAST(pixel_t*, dst);
+  int i, blocks = n / 16;
+
+  for(i=0; i<blocks; i++) {
+    __m256i v = _mm256_loadu_si256(STATIC_CAST(const __m256i*, STATIC_CAST(const void*, src + n - 16*(i+1))));
+    v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, mask), 0x4E);
+    _mm256_storeu_si256(STATIC_CAST(__m256i*, STATIC_CAST(void*, d + 16*i)), v);
+  }
+
+  for(i=16*blocks; i<n; i++)
+    d[i] = bswap16(src[n-1-i]);
+}
+
+__attribute__((target("avx2"))) static void
+binAddAVX2(int* acc, const pixel_t* src, int n, int f)
+{
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i* a = STATIC_CAST(__m256i*, STATIC_CAST(void*, acc));
+  __m256i v;
+  int i = 0;
+
+  if(f == 1) {
+    for(; i+8<=n; i+=8) {
+      v = _mm256_cvtepi16_epi32(_mm_loadu_si128(STATIC_CAST(const __m128i*, STATIC_CAST(const void*, src + i))));
+      _mm256_storeu_si256(a + i/8, _mm256_add_epi32(_mm256_loadu_si256(a + i/8), v));
+    }
+  } else if(f == 2) {
+    for(; i+8<=n; i+=8) {
+      v = _mm256_loadu_si256(STATIC_CAST(const __m256i*, STATIC_CAST(const void*, src + 2*i)));
+      v = _mm256_madd_epi16(v, ones);
+      _mm256_storeu_si256(a + i/8, _mm256_add_epi32(_mm256_loadu_si256(a + i/8), v));
+    }
+  }
+
+  _mm256_zeroupper();		// no AVX to SSE transition stall
+  binAddSSSE3(acc + i, src + f*i, n - i, f);
+}
+
+// _mm256_packs_epi32 packs within each 128 bit lane,
+// so the two middle quadwords must be exchanged afterwards
+
+__attribute__((target("avx2"))) static void
+packAVX2(pixel_t* dst, const int* acc, int n)
+{
+  const __m256i* a = STATIC_CAST(const __m256i*, STATIC_CAST(const void*, acc));
+  __m256i* d = STATIC_CAST(__m256i*, STATIC_CAST(void*, dst));
+  __m256i v;
+  int i, blocks = n / 16;
+
+  for(i=0; i<blocks; i++) {
+    v = _mm256_packs_epi32(_mm256_loadu_si256(a + 2*i), _mm256_loadu_si256(a + 2*i + 1));
+    _mm256_storeu_si256(d+i, _mm256_permute4x64_epi64(v, 0xD8));
+  }
+
+  _mm256_zeroupper();		// no AVX to SSE transition stall
+  packSSSE3(dst + 16*blocks, acc + 16*blocks, n - 16*blocks);
+}
+
+// 8 floats per step, unfused so that results match the other kernels
+
+__attribute__((target("avx2"))) static void
+subtractAVX2(float* dst, const float* img, const float* ref, float a, float b, int n)
+{
+  const __m256 va = _mm256_set1_ps(a);
+  const __m256 vb = _mm256_set1_ps(b);
+  int i, blocks = n / 8;
+
+  for(i=0; i<blocks; i++)
+    _mm256_storeu_ps(dst + 8*i, _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(img + 8*i),
+					      _mm256_mul_ps(va, _mm256_loadu_ps(ref + 8*i))), vb));
+
+  _mm256_zeroupper();		// no AVX to SSE transition stall
+  subtractSSSE3(dst + 8*blocks, img + 8*blocks, ref + 8*blocks, a, b, n - 8*blocks);
+}
+
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*                           RUNTIME DISPATCH                                */
+/*---------------------------------------------------------------------------*/
+
+RowKernel PixKern::swap       = swapC;
+RowKernel PixKern::mirror     = mirrorC;
+RowKernel PixKern::swapMirror = swapMirrorC;
+BinKernel PixKern::binAdd     = binAddC;
+PackKernel PixKern::pack      = packC;
+SubKernel PixKern::subtract   = subtractC;
+const char* PixKern::impl     = "C";
+
+/*---------------------------------------------------------------------------*/
+
+bool
+PixKern::select(const char* which)
+{
+  // the portable kernels unless better ones run on this CPU
+
+  swap       = swapC;
+  mirror     = mirrorC;
+  swapMirror = swapMirrorC;
+  binAdd     = binAddC;
+  pack       = packC;
+  subtract   = subtractC;
+  impl       = "C";
+  if(which && strcmp(which, impl) == 0)
+    return(true);
+
+#ifdef PIXKERN_X86
+
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2") && (which == 0 || strcmp(which, "AVX2") == 0)) {
+    swap       = swapAVX2;
+    mirror     = mirrorAVX2;
+    swapMirror = swapMirrorAVX2;
+    binAdd     = binAddAVX2;
+    pack       = packAVX2;
+    subtract   = subtractAVX2;
+    impl       = "AVX2";
+    return(true);
+  }
+  if(__builtin_cpu_supports("ssse3") && (which == 0 || strcmp(which, "SSSE3") == 0)) {
+    swap       = swapSSSE3;
+    mirror     = mirrorSSSE3;
+    swapMirror = swapMirrorSSSE3;
+    binAdd     = binAddSSSE3;
+    pack       = packSSSE3;
+    subtract   = subtractSSSE3;
+    impl       = "SSSE3";
+    return(true);
+  }
+
+#endif
+
+  return(which == 0);
+}
+
+/*---------------------------------------------------------------------------*/
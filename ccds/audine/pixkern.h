@@ -0,0 +1,73 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_PIXKERN_H
+#define AUDINE_PIXKERN_H
+
+/*
+ * Row kernels converting host order pixels to the FITS big endian
+ * layout, optionally mirrored left to right, in a single pass.
+ * The best implementation for the running CPU (AVX2, SSSE3 or
+ * portable C) is selected once at startup.
+ * 'dst' and 'src' must not overlap. 'n' is the row width in pixels.
+ * Also the row kernels of software binning, accumulating into 32 bits
+ * and saturating back to 16 bits, and of image differencing on
+ * decimal pixels, where NaN stays NaN.
+ */
+
+typedef void (*RowKernel)(void* dst, const pixel_t* src, int n);
+
+/* acc[i] += src[f*i] + ... + src[f*i + f-1], for 'n' sums */
+typedef void (*BinKernel)(int* acc, const pixel_t* src, int n, int f);
+
+/* dst[i] = acc[i] saturated to the pixel_t range, for 'n' pixels */
+typedef void (*PackKernel)(pixel_t* dst, const int* acc, int n);
+
+/* dst[i] = img[i] - a*ref[i] - b, for 'n' pixels */
+typedef void (*SubKernel)(float* dst, const float* img, const float* ref,
+			  float a, float b, int n);
+
+class PixKern {
+
+ public:
+
+  /* selects the kernels for this CPU, or those named ("AVX2", "SSSE3" */
+  /* or "C") to compare them. false if they do not run on this CPU. */
+  /* Call before any other thread starts */
+  static bool select(const char* which = 0);
+
+  /* name of the selected implementation, for logging */
+  static const char* name() { return(impl); }
+
+  static RowKernel swap;	/* endian swap only */
+  static RowKernel mirror;	/* horizontal mirror only */
+  static RowKernel swapMirror;	/* endian swap and horizontal mirror */
+  static BinKernel binAdd;	/* horizontal binning, vertical accumulation */
+  static PackKernel pack;	/* 32 to 16 bits with saturation */
+  static SubKernel subtract;	/* scaled reference subtraction */
+
+ private:
+
+  static const char* impl;
+};
+
+#endif
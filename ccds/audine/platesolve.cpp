@@ -0,0 +1,570 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "fitshead.h"
+#include "platesolve.h"
+
+#define DEG      (M_PI / 180)
+#define CODETOL  0.02		/* quad code tolerance */
+#define SKEWTOL  0.1		/* first fit squareness tolerance */
+#define MINMATCH 8		/* fewest stars matched by a solution */
+#define MAXUSED  200		/* brightest image stars checked */
+#define MAXQUAD  60		/* brightest image stars making quads */
+#define REFINE   3		/* least squares iterations */
+
+/*---------------------------------------------------------------------------*/
+
+static int
+byCode(const void* a, const void* b)
+{
+  float ca = (*static_cast<const IndexQuad* const*>(a))->code[0];
+  float cb = (*static_cast<const IndexQuad* const*>(b))->code[0];
+
+  return((ca < cb) ? -1 : (ca > cb) ? 1 : 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// least squares affine transform from 'n' points 'p' to 'q':
+// q.x = t0 p.x + t1 p.y + t2, q.y = t3 p.x + t4 p.y + t5
+
+template <class P> static bool
+affine(const P* p, const P* q, int n, double t[6])
+{
+  double m[3][3], bx[3], by[3], inv[3][3], det;
+
+  memset(m, 0, sizeof(m));
+  memset(bx, 0, sizeof(bx));
+  memset(by, 0, sizeof(by));
+  for(int i=0; i<n; i++) {
+    double v[3] = { p[i].x, p[i].y, 1 };
+    for(int j=0; j<3; j++) {
+      for(int k=0; k<3; k++)
+	m[j][k] += v[j] * v[k];
+      bx[j] += v[j] * q[i].x;
+      by[j] += v[j] * q[i].y;
+    }
+  }
+
+  det = m[0][0] * (m[1][1]*m[2][2] - m[1][2]*m[2][1])
+      - m[0][1] * (m[1][0]*m[2][2] - m[1][2]*m[2][0])
+      + m[0][2] * (m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+  if(fabs(det) < 1e-12 * m[0][0] * m[1][1] * m[2][2])
+    return(false);
+  for(int j=0; j<3; j++)
+    for(int k=0; k<3; k++) {
+      int j1 = (k+1) % 3, j2 = (k+2) % 3, k1 = (j+1) % 3, k2 = (j+2) % 3;
+      inv[j][k] = (m[j1][k1]*m[j2][k2] - m[j1][k2]*m[j2][k1]) / det;
+    }
+
+  for(int j=0; j<3; j++) {
+    t[j]   = inv[j][0]*bx[0] + inv[j][1]*bx[1] + inv[j][2]*bx[2];
+    t[3+j] = inv[j][0]*by[0] + inv[j][1]*by[1] + inv[j][2]*by[2];
+  }
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+PlateSolver::PlateSolver() : solved(false), imgX(0), imgY(0), nimg(0), nused(0),
+    width(0), height(0), pixScale(0), scaleTol(0), matchTol(0), cells(0), 
+    ncells(0), maxCells(0), cand(0), ncand(0), maxCand(0), checkLevel(0),
+    deepLevel(0), ref(0), tan(0),
+    pix(0), inField(0), nref(0), nfield(0), maxRef(0), match(0), from(0), to(0),
+    maxImg(0), quads(0), nquads(0), maxQuads(0)
+{
+  memset(&wcs, 0, sizeof(wcs));
+}
+
+/*---------------------------------------------------------------------------*/
+
+PlateSolver::~PlateSolver()
+{
+  delete [] cells;
+  delete [] cand;
+  delete [] ref;
+  delete [] tan;
+  delete [] pix;
+  delete [] inField;
+  delete [] match;
+  delete [] from;
+  delete [] to;
+  delete [] quads;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+PlateSolver::solve(const SolvePars* pars, const double* x, const double* y,
+		   int n, int w, int h)
+{
+  double half, area, expected[StarIndex::LEVELS];
+  int k, m, total;
+
+  solved = false;
+  memset(&wcs, 0, sizeof(wcs));
+  if(n < 4 || pars->scale <= 0 || !index.open(pars->index))
+    return(false);
+
+  imgX     = x;
+  imgY     = y;
+  nimg     = n;
+  nused    = (n < MAXUSED) ? n : MAXUSED;
+  width    = w;
+  height   = h;
+  pixScale = pars->scale / 3600 * DEG;
+  scaleTol = pars->scaleTol;
+  matchTol = pars->matchTol;
+
+  if(nused > maxImg) {
+    delete [] match;
+    delete [] from;
+    delete [] to;
+    maxImg = nused;
+    match  = new int[maxImg];
+    from   = new Point[maxImg];
+    to     = new Point[maxImg];
+  }
+
+  // the cells any part of the field may fall in
+
+  half = 0.5 * hypot(w, h) * pixScale / DEG;
+  for(;;) {
+    ncells = index.cone(pars->ra, pars->dec, pars->radius + half, cells, maxCells);
+    if(ncells < maxCells)
+      break;
+    delete [] cells;
+    maxCells = (maxCells) ? 2*maxCells : 1024;
+    cells = new int[maxCells];
+  }
+  if(ncells == 0)
+    return(false);
+
+  // index stars expected in the field at every level, the deepest
+  // level the image matches being used for the final fit
+
+  area = w * h * pixScale * pixScale / (DEG * DEG);
+  deepLevel = 0;
+  for(int l=0; l<index.levels(); l++) {
+    for(int c=total=0; c<ncells; c++) {
+      index.stars(cells[c], l, &k);
+      total += k;
+    }
+    expected[l] = STATIC_CAST(double, total) / ncells * area /
+      (StarIndex::CELL * StarIndex::CELL);
+    deepLevel = (expected[l] <= nused) ? l : deepLevel;
+  }
+
+  // from the shallowest level with enough stars in the field, as 
+  // long as the index is not much deeper than the image. The image
+  // stars taken are as many as the index is expected to have
+
+  for(int l=0; l<index.levels() && !solved; l++) {
+    if(expected[l] < 4)
+      continue;
+    if(expected[l] > 2*n)
+      break;
+    m = STATIC_CAST(int, expected[l] + 0.5);
+    m = (m < 6) ? 6 : m;
+    m = (m > n) ? n : m;
+    m = (m > MAXQUAD) ? MAXQUAD : m;
+    solved = tryLevel(l, m);
+  }
+  return(solved);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+PlateSolver::tryLevel(int l, int m)
+{
+  const Quad* q;
+  double ratio;
+  int lo, hi, mid, i;
+
+  imageQuads(m);
+  candidates(l);
+  checkLevel = (l+1 < index.levels()) ? l+1 : l; // denser, to tell a good fit
+  references(checkLevel);
+
+  // index quads of about the same code and the expected size
+
+  for(int j=0; j<nquads; j++) {
+    q = &quads[j];
+    for(lo=0, hi=ncand; lo<hi; ) {
+      mid = (lo + hi) / 2;
+      if(cand[mid]->code[0] < q->code[0] - CODETOL)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    for(int c=lo; c<ncand && cand[c]->code[0] <= q->code[0] + CODETOL; c++) {
+      for(i=1; i<5 && fabs(cand[c]->code[i] - q->code[i]) <= CODETOL; i++)
+	;
+      ratio = q->size * pixScale / cand[c]->size;
+      if(i == 5 && fabs(ratio - 1) <= scaleTol && verify(q, cand[c]))
+	return(true);
+    }
+  }
+  return(false);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+PlateSolver::imageQuads(int m)
+{
+  static const int PICK[4][3] = { {0,1,2}, {0,1,3}, {0,2,3}, {1,2,3} };
+  double best[4], d, x[4], y[4];
+  int near[4], order[4], star[4], found, t;
+
+  if(4*m > maxQuads) {
+    delete [] quads;
+    maxQuads = 4*m;
+    quads = new Quad[maxQuads];
+  }
+
+  // each star with its three nearest neighbours, as the index has
+  // them, and with any three of its four nearest in case the image
+  // has a star more than the index level
+
+  nquads = 0;
+  for(int i=0; i<m; i++) {
+    found = 0;
+    for(int j=0; j<m; j++) {
+      if(j == i)
+	continue;
+      d = hypot(imgX[j] - imgX[i], imgY[j] - imgY[i]);
+      if(found == 4 && d >= best[3])
+	continue;
+      t = (found < 4) ? found++ : 3;
+      for(; t>0 && d < best[t-1]; t--) {
+	best[t] = best[t-1];
+	near[t] = near[t-1];
+      }
+      best[t] = d;
+      near[t] = j;
+    }
+
+    for(int p=0; p<4 && found >= PICK[p][2]+1; p++) {
+      Quad* q = &quads[nquads];
+      star[0] = i;
+      for(int k=0; k<3; k++)
+	star[k+1] = near[PICK[p][k]];
+      for(int k=0; k<4; k++) {
+	x[k] = imgX[star[k]];
+	y[k] = imgY[star[k]];
+      }
+      q->size = StarIndex::code(x, y, order, q->code);
+      if(q->size < 2*matchTol)	// too small to tell anything
+	continue;
+      for(int k=0; k<4; k++)
+	q->star[k] = star[order[k]];
+      nquads++;
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+PlateSolver::candidates(int l)
+{
+  const IndexQuad* iq;
+  int n;
+
+  ncand = 0;
+  for(int c=0; c<ncells; c++) {
+    iq = index.quads(cells[c], l, &n);
+    if(ncand + n > maxCand) {
+      const IndexQuad** grown;
+      maxCand = 2 * (ncand + n);
+      grown = new const IndexQuad*[maxCand];
+      memcpy(grown, cand, ncand * sizeof(*cand));
+      delete [] cand;
+      cand = grown;
+    }
+    for(int i=0; i<n; i++)
+      cand[ncand++] = &iq[i];
+  }
+  qsort(cand, ncand, sizeof(*cand), byCode);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+PlateSolver::references(int l)
+{
+  const IndexStar* s;
+  int n;
+
+  nref = 0;
+  for(int c=0; c<ncells; c++) {
+    s = index.stars(cells[c], l, &n);
+    if(nref + n > maxRef) {
+      const IndexStar** grown;
+      maxRef = 2 * (nref + n);
+      grown = new const IndexStar*[maxRef];
+      memcpy(grown, ref, nref * sizeof(*ref));
+      delete [] ref;
+      delete [] tan;
+      delete [] pix;
+      delete [] inField;
+      ref = grown;
+      tan = new Point[maxRef];
+      pix = new Point[maxRef];
+      inField = new int[maxRef];
+    }
+    for(int i=0; i<n; i++)
+      ref[nref++] = &s[i];
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+PlateSolver::verify(const Quad* q, const IndexQuad* iq)
+{
+  const IndexStar* home = index.star(iq->star[0]);
+  double ra0 = home->ra, dec0 = home->dec;
+  double t[6], u[6], c1, c2, scale, cx, cy, ra, dec, det, sum = 0;
+  Point p[4], s[4];
+  int n, k;
+
+  // first fit from the four stars, about the home star of the quad,
+  // which must be close to a scaled rotation (mirrored or not)
+
+  for(int i=0; i<4; i++) {
+    const IndexStar* st = index.star(iq->star[i]);
+    p[i].x = imgX[q->star[i]];
+    p[i].y = imgY[q->star[i]];
+    StarIndex::project(ra0, dec0, st->ra, st->dec, &s[i].x, &s[i].y);
+  }
+  if(!affine(p, s, 4, t))
+    return(false);
+  c1 = hypot(t[0], t[3]);
+  c2 = hypot(t[1], t[4]);
+  scale = sqrt(fabs(t[0]*t[4] - t[1]*t[3]));
+  if(fabs(scale / pixScale - 1) > scaleTol || fabs(c1 / c2 - 1) > SKEWTOL ||
+     fabs(t[0]*t[1] + t[3]*t[4]) > SKEWTOL * c1 * c2)
+    return(false);
+
+  // then enough of the index stars in the field must be there,
+  // rather loosely as the fit is still rough
+
+  n = matchStars(ra0, dec0, t, 2*matchTol);
+  if(n < MINMATCH || n < ((nused < nfield) ? nused : nfield) / 4)
+    return(false);
+
+  // refined by least squares about the image centre, tangent
+  // point included, matching the stars again every time and
+  // as many as the image has
+
+  if(deepLevel > checkLevel) {
+    references(deepLevel);
+    matchStars(ra0, dec0, t, 2*matchTol);
+  }
+  cx = 0.5 * (width  - 1);
+  cy = 0.5 * (height - 1);
+  for(int it=0; it<REFINE; it++) {
+    StarIndex::deproject(ra0, dec0, t[0]*cx + t[1]*cy + t[2], 
+			 t[3]*cx + t[4]*cy + t[5], &ra, &dec);
+    k = pairs(ra, dec);
+    if(k < MINMATCH || !affine(from, to, k, u))
+      break;
+    ra0 = ra;
+    dec0 = dec;
+    memcpy(t, u, sizeof(t));
+    t[2] -= t[0]*cx + t[1]*cy;	// back to pixels from 0
+    t[5] -= t[3]*cx + t[4]*cy;
+    n = matchStars(ra0, dec0, t, matchTol);
+  }
+  k = pairs(ra0, dec0);
+  if(k < MINMATCH) {
+    references(checkLevel);	// for the next quads
+    return(false);
+  }
+
+  // the reference pixel is the tangent point
+
+  det = t[0]*t[4] - t[1]*t[3];
+  wcs.crpix1 = (-t[4]*t[2] + t[1]*t[5]) / det + 1;
+  wcs.crpix2 = ( t[3]*t[2] - t[0]*t[5]) / det + 1;
+  wcs.crval1 = ra0 / DEG;
+  wcs.crval2 = dec0 / DEG;
+  wcs.cd[0][0] = t[0] / DEG;
+  wcs.cd[0][1] = t[1] / DEG;
+  wcs.cd[1][0] = t[3] / DEG;
+  wcs.cd[1][1] = t[4] / DEG;
+  for(int i=0; i<k; i++)
+    sum += pow(t[0]*(from[i].x+cx) + t[1]*(from[i].y+cy) + t[2] - to[i].x, 2) +
+           pow(t[3]*(from[i].x+cx) + t[4]*(from[i].y+cy) + t[5] - to[i].y, 2);
+  wcs.matched = k;
+  wcs.rms     = sqrt(sum / k) / DEG * 3600;
+  wcs.scale   = sqrt(fabs(det)) / DEG * 3600;
+  wcs.rota    = atan2(-t[1], t[4]) / DEG;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+PlateSolver::matchStars(double ra0, double dec0, const double t[6], double tol)
+{
+  double det = t[0]*t[4] - t[1]*t[3];
+  double dx, dy, d, best;
+  int n = 0;
+
+  // index stars to pixels, those in the field only
+
+  nfield = 0;
+  for(int r=0; r<nref; r++) {
+    StarIndex::project(ra0, dec0, ref[r]->ra, ref[r]->dec, &tan[r].x, &tan[r].y);
+    dx = tan[r].x - t[2];
+    dy = tan[r].y - t[5];
+    pix[r].x = ( t[4]*dx - t[1]*dy) / det;
+    pix[r].y = (-t[3]*dx + t[0]*dy) / det;
+    if(pix[r].x >= -0.5 && pix[r].x < width - 0.5 && 
+       pix[r].y >= -0.5 && pix[r].y < height - 0.5)
+      inField[nfield++] = r;
+  }
+
+  // and the nearest one to every image star
+
+  for(int i=0; i<nused; i++) {
+    match[i] = -1;
+    best = tol * tol;
+    for(int f=0; f<nfield; f++) {
+      dx = pix[inField[f]].x - imgX[i];
+      dy = pix[inField[f]].y - imgY[i];
+      d  = dx*dx + dy*dy;
+      if(d <= best) {
+	best = d;
+	match[i] = inField[f];
+      }
+    }
+    n += (match[i] != -1);
+  }
+  return(n);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+PlateSolver::pairs(double ra0, double dec0)
+{
+  double cx = 0.5 * (width  - 1);
+  double cy = 0.5 * (height - 1);
+  const IndexStar* s;
+  int n = 0;
+
+  for(int i=0; i<nused; i++) {
+    if(match[i] == -1)
+      continue;
+    s = ref[match[i]];
+    from[n].x = imgX[i] - cx;
+    from[n].y = imgY[i] - cy;
+    StarIndex::project(ra0, dec0, s->ra, s->dec, &to[n].x, &to[n].y);
+    n++;
+  }
+  return(n);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+PlateSolver::stamp(FITSHeader* header) const
+{
+  header->set("PLTSOLVD", solved, "plate solved on the local star index");
+  if(!solved)
+    return;
+
+  header->erase("CDELT1");	// the seed scale & rotation
+  header->erase("CDELT2");
+  header->erase("CROTA2");
+  header->set("CTYPE1", "RA---TAN", "gnomonic projection");
+  header->set("CTYPE2", "DEC--TAN", "gnomonic projection");
+  header->set("CUNIT1", "deg", "world coordinates unit");
+  header->set("CUNIT2", "deg", "world coordinates unit");
+  header->set("CRPIX1", wcs.crpix1, "reference pixel");
+  header->set("CRPIX2", wcs.crpix2, "reference pixel");
+  header->set("CRVAL1", wcs.crval1, "[deg] RA of the reference pixel");
+  header->set("CRVAL2", wcs.crval2, "[deg] DEC of the reference pixel");
+  header->set("CD1_1", wcs.cd[0][0], "[deg/pixel] coordinate matrix");
+  header->set("CD1_2", wcs.cd[0][1], "[deg/pixel] coordinate matrix");
+  header->set("CD2_1", wcs.cd[1][0], "[deg/pixel] coordinate matrix");
+  header->set("CD2_2", wcs.cd[1][1], "[deg/pixel] coordinate matrix");
+  header->set("EQUINOX", 2000.0, "equinox of the coordinates");
+  header->set("RADESYS", "ICRS", "reference frame of the coordinates");
+  header->set("WCSMATCH", wcs.matched, "stars matched with the index");
+  header->set("WCSRMS", wcs.rms, "[arcsec] residual of the stars matched");
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+PlateSolver::pixel(double ra, double dec, double* x, double* y) const
+{
+  double xi, eta, det;
+
+  if(!solved)
+    return(false);
+  if(sin(wcs.crval2*DEG) * sin(dec*DEG) + cos(wcs.crval2*DEG) * cos(dec*DEG) *
+     cos((ra - wcs.crval1)*DEG) <= 0)
+    return(false);
+
+  StarIndex::project(wcs.crval1*DEG, wcs.crval2*DEG, ra*DEG, dec*DEG, &xi, &eta);
+  xi  /= DEG;
+  eta /= DEG;
+  det = wcs.cd[0][0] * wcs.cd[1][1] - wcs.cd[0][1] * wcs.cd[1][0];
+  *x  = ( wcs.cd[1][1] * xi - wcs.cd[0][1] * eta) / det + wcs.crpix1 - 1;
+  *y  = (-wcs.cd[1][0] * xi + wcs.cd[0][0] * eta) / det + wcs.crpix2 - 1;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+PlateSolver::world(double x, double y, double* ra, double* dec) const
+{
+  double xi, eta;
+
+  if(!solved)
+    return(false);
+
+  x  -= wcs.crpix1 - 1;
+  y  -= wcs.crpix2 - 1;
+  xi  = (wcs.cd[0][0] * x + wcs.cd[0][1] * y) * DEG;
+  eta = (wcs.cd[1][0] * x + wcs.cd[1][1] * y) * DEG;
+  StarIndex::deproject(wcs.crval1*DEG, wcs.crval2*DEG, xi, eta, ra, dec);
+  *ra  /= DEG;
+  *dec /= DEG;
+  return(true);
+}
@@ -0,0 +1,176 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_PLATESOLVE_H
+#define AUDINE_PLATESOLVE_H
+
+#include "starindex.h"
+
+/* plate solving parameters */
+
+struct SolvePars {
+  char index[256];		/* star index file, see StarIndex */
+  double ra;			/* field centre guess, J2000 [deg] */
+  double dec;
+  double scale;			/* image scale guess [arcsec/pixel] */
+  double radius;		/* field centre search radius [deg] */
+  double scaleTol;		/* scale tolerance, as a fraction */
+  double matchTol;		/* star match tolerance [pixels] */
+};
+
+/* a TAN world coordinate system, in FITS terms */
+
+struct WCSFit {
+  double crpix1;		/* reference pixel, 1 based */
+  double crpix2;
+  double crval1;		/* its RA & DEC [deg] */
+  double crval2;
+  double cd[2][2];		/* pixel to intermediate coordinates [deg] */
+  int matched;			/* stars matched */
+  double rms;			/* their residual [arcsec] */
+  double scale;			/* [arcsec/pixel] */
+  double rota;			/* north from +Y towards -X [deg] */
+};
+
+class FITSHeader;
+
+/*
+ * Plate solver on a local star index, no network involved.
+ * The brightest stars of the image make quads with their nearest
+ * neighbours, coded the way the index codes its own (see StarIndex).
+ * Index quads are only looked for in the cells around the telescope
+ * position, at the levels whose depth suits the image field, and must
+ * match both the code and the expected scale. Each match gives a first
+ * affine fit from its four stars, checked against the index stars of
+ * the field; the first one to explain enough of them is refined by
+ * least squares about the image centre, stars matched again each time.
+ */
+
+class PlateSolver {
+
+ public:
+
+  PlateSolver();
+ ~PlateSolver();
+
+  /* solves an image from its star positions in 0 based pixels, */
+  /* brightest first. false if not solved */
+  bool solve(const SolvePars* pars, const double* x, const double* y, int n,
+	     int width, int height);
+
+  /* last solution */
+  const WCSFit* fit() const { return(&wcs); }
+
+  /* adds the last solution, the seed WCS being left if not solved */
+  void stamp(FITSHeader* header) const;
+
+  /* 0 based pixel of (ra, dec) [deg] by the last solution. */
+  /* false if not solved or on the far side of the sky */
+  bool pixel(double ra, double dec, double* x, double* y) const;
+
+  /* and the reverse. false if not solved */
+  bool world(double x, double y, double* ra, double* dec) const;
+
+ private:
+
+  struct Point {		/* a star on the tangent plane or in pixels */
+    double x;
+    double y;
+  };
+
+  struct Quad {			/* an image quad, in canonical order */
+    int star[4];
+    float code[5];
+    double size;		/* largest distance [pixels] */
+  };
+
+  StarIndex index;		/* mapped while its file does not change */
+  WCSFit wcs;			/* last solution */
+  bool solved;
+
+  /* image stars */
+  const double* imgX;
+  const double* imgY;
+  int nimg;
+  int nused;			/* brightest ones checked against the index */
+  int width;
+  int height;
+  double pixScale;		/* expected scale [rad/pixel] */
+  double scaleTol;
+  double matchTol;
+
+  /* index cells around the telescope position */
+  int* cells;
+  int ncells;
+  int maxCells;			/* capacity of cells[] */
+
+  /* their quads of the level being tried, by first code */
+  const IndexQuad** cand;
+  int ncand;
+  int maxCand;			/* capacity of cand[] */
+
+  /* their stars of a denser level, to check fits with */
+  int checkLevel;		/* level of the first check */
+  int deepLevel;		/* level of the final fit, as deep as the image */
+  const IndexStar** ref;
+  Point* tan;			/* on the tangent plane of the fit */
+  Point* pix;			/* same in pixels */
+  int* inField;			/* those inside the image */
+  int nref;
+  int nfield;
+  int maxRef;			/* capacity of the four arrays above */
+
+  /* image stars matched & quads */
+  int* match;			/* reference star of each image star, -1 if none */
+  Point* from;			/* matched pairs, pixels */
+  Point* to;			/* and tangent plane */
+  int maxImg;			/* capacity of the three arrays above */
+  Quad* quads;
+  int nquads;
+  int maxQuads;			/* capacity of quads[] */
+
+  /* tries the quads of index level 'l' with the brightest 'm' stars */
+  bool tryLevel(int l, int m);
+
+  /* image quads of the brightest 'm' stars */
+  void imageQuads(int m);
+
+  /* index quads of level 'l' in the cells */
+  void candidates(int l);
+
+  /* index stars of level 'l' in the cells */
+  void references(int l);
+
+  /* checks and refines the fit given by a quad match. true if good */
+  bool verify(const Quad* q, const IndexQuad* iq);
+
+  /* projects the reference stars about (ra0, dec0) to pixels with */
+  /* the affine transform 't', xi = t0 x + t1 y + t2 and */
+  /* eta = t3 x + t4 y + t5, and matches them within 'tol' pixels. */
+  /* Returns the image stars matched */
+  int matchStars(double ra0, double dec0, const double t[6], double tol);
+
+  /* matched pairs, the reference stars projected about (ra0, dec0) */
+  int pairs(double ra0, double dec0);
+};
+
+#endif
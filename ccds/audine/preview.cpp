@@ -0,0 +1,324 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#include <math.h>
+#include <string.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "fitshead.h"
+#include "frame.h"
+#include "preview.h"
+
+#define OFFSET  32768		/* histogram index of a zero pixel */
+#define LEVELS  65536		/* histogram bins */
+#define BLACK   0.01		/* fraction of pixels rendered black */
+#define WHITE   0.999		/* fraction of pixels not rendered white */
+
+/*---------------------------------------------------------------------------*/
+
+Preview::Preview() : w(0), h(0), factor(0), pw(0), ph(0), flipUD(false),
+    colMap(0), colCount(0), sums(0), rowCount(0), rows(0),
+    complete(false), fresh(false), done(false), maxCols(0), maxPixels(0),
+    avg(0), image(0), imageSize(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  hist = new unsigned int[LEVELS];
+  lut  = new unsigned char[LEVELS];
+}
+
+/*---------------------------------------------------------------------------*/
+
+Preview::~Preview()
+{
+  pthread_mutex_destroy(&lock);
+  delete [] colMap;
+  delete [] colCount;
+  delete [] sums;
+  delete [] rowCount;
+  delete [] avg;
+  delete [] hist;
+  delete [] lut;
+  delete [] image;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Preview::reset(int width, int height, int side, bool flipLR, bool flipUD)
+{
+  int x, c;
+
+  pthread_mutex_lock(&lock);
+
+  w = width;
+  h = height;
+  this->flipUD = flipUD;
+  rows     = 0;
+  complete = false;
+  fresh    = false;
+  done     = false;
+  factor   = 0;
+
+  if(side <= 0) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+
+  if(side < MINSIDE)
+    side = MINSIDE;
+  if(side > MAXSIDE)
+    side = MAXSIDE;
+
+  factor = ((w > h ? w : h) + side - 1) / side;
+  pw = (w + factor - 1) / factor;
+  ph = (h + factor - 1) / factor;
+
+  // arrays only grow, as for the frame buffer
+
+  if(w > maxCols) {
+    delete [] colMap;
+    maxCols = w;
+    colMap = new int[maxCols];
+  }
+  if(pw*ph > maxPixels) {
+    delete [] colCount;
+    delete [] sums;
+    delete [] avg;
+    delete [] rowCount;
+    maxPixels = pw*ph;
+    colCount = new int[maxPixels];
+    sums     = new int[maxPixels];
+    avg      = new int[maxPixels];
+    rowCount = new int[maxPixels];
+  }
+
+  memset(colCount, 0, pw * sizeof(int));
+  for(x=0; x<w; x++) {
+    c = ((flipLR) ? w-1-x : x) / factor;
+    colMap[x] = c;
+    colCount[c]++;
+  }
+  memset(sums, 0, pw * ph * sizeof(int));
+  memset(rowCount, 0, ph * sizeof(int));
+
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Preview::add(const Frame* frame, int first, int n)
+{
+  const pixel_t* src;
+  int* dst;
+  int x, y, r;
+
+  if(factor == 0)
+    return;
+
+  pthread_mutex_lock(&lock);
+
+  for(y=first; y<first+n; y++) {
+    r   = ((flipUD) ? h-1-y : y) / factor;
+    src = frame->row(y);
+    dst = sums + r*pw;
+    for(x=0; x<w; x++)
+      dst[colMap[x]] += src[x];
+    rowCount[r]++;
+  }
+
+  rows += n;
+  if(rows >= h)			// no need to wait for the writer to close it
+    complete = true;
+  fresh = true;
+
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Preview::add(const float* row, int y)
+{
+  int* dst;
+  float v;
+  int r;
+
+  if(factor == 0)
+    return;
+
+  pthread_mutex_lock(&lock);
+
+  // within the range of the histogram, as raw pixels are
+
+  r   = ((flipUD) ? h-1-y : y) / factor;
+  dst = sums + r*pw;
+  for(int x=0; x<w; x++) {
+    v = (row[x] < -32768) ? -32768 : (row[x] > 32767) ? 32767 : row[x];
+    dst[colMap[x]] += STATIC_CAST(int, lrintf(v));
+  }
+  rowCount[r]++;
+
+  if(++rows >= h)
+    complete = true;
+  fresh = true;
+
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Preview::finish()
+{
+  pthread_mutex_lock(&lock);
+  fresh = fresh || (factor != 0 && !complete);
+  complete = true;
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Preview::changed(bool* complete)
+{
+  bool res;
+
+  pthread_mutex_lock(&lock);
+  res = fresh;
+  *complete = this->complete;
+  pthread_mutex_unlock(&lock);
+  return(res);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Preview::stretch(int n, int* black, int* white)
+{
+  unsigned int lo, hi, sum;
+  int v;
+
+  if(n == 0) {			// nothing read yet
+    *black = OFFSET;
+    *white = OFFSET + 1;
+    return;
+  }
+
+  lo = STATIC_CAST(unsigned int, BLACK * n);
+  hi = STATIC_CAST(unsigned int, WHITE * n);
+
+  for(sum = 0, v = 0; v < LEVELS-1; v++) {
+    sum += hist[v];
+    if(sum > lo)
+      break;
+  }
+  *black = v;
+
+  for(; v < LEVELS-1; v++) {
+    if(sum > hi)
+      break;
+    sum += hist[v+1];
+  }
+  *white = (v > *black) ? v : *black + 1;
+  if(*white > LEVELS-1) {	// a saturated preview
+    *white = LEVELS-1;
+    *black = LEVELS-2;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+Preview::render(const char** data)
+{
+  FITSHeader header;
+  unsigned char* dst;
+  int i, n, r, c, v, k, black, white, hdrSize, size, valid;
+
+  pthread_mutex_lock(&lock);
+
+  // a quick snapshot of binned averages, rows not yet read are flagged
+
+  for(r=0, i=0; r<ph; r++)
+    for(c=0; c<pw; c++, i++) {
+      n = rowCount[r] * colCount[c];
+      avg[i] = (n) ? sums[i] / n + OFFSET : -1;
+    }
+  done  = complete;
+  fresh = false;
+
+  pthread_mutex_unlock(&lock);
+
+  // the stretch table comes from the histogram of the rows read so far
+
+  memset(hist, 0, LEVELS * sizeof(unsigned int));
+  for(i=0, valid=0; i<pw*ph; i++)
+    if(avg[i] >= 0) {
+      hist[avg[i]]++;
+      valid++;
+    }
+
+  stretch(valid, &black, &white);
+  memset(lut, 0, black);
+  for(v=black; v<=white; v++)
+    lut[v] = STATIC_CAST(unsigned char, 
+			 255.0 * sqrt(STATIC_CAST(double, v-black) / (white-black)) + 0.5);
+  memset(lut + white, 255, LEVELS - white);
+
+  // a small 8 bit FITS image
+
+  header.set("BITPIX", 8, "Number of bits per data pixel");
+  header.set("NAXIS1", pw, "columns");
+  header.set("NAXIS2", ph, "rows");
+  header.set("XBINNING", factor, "image pixels binned per preview pixel");
+  header.set("YBINNING", factor, "image pixels binned per preview pixel");
+  header.set("PREVIEW", done, "final preview, else partial");
+  header.set("STRBLACK", black - OFFSET, "[ADU] rendered black");
+  header.set("STRWHITE", white - OFFSET, "[ADU] rendered white");
+
+  k = header.records();
+  hdrSize = k * FITSHeader::RECORDSZ;
+  size = hdrSize + ((pw*ph + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ)
+    * FITSHeader::RECORDSZ;
+
+  if(size > imageSize) {
+    delete [] image;
+    imageSize = size;
+    image = new char[imageSize];
+  }
+
+  header.render(image, k);
+  dst = STATIC_CAST(unsigned char*, STATIC_CAST(void*, image + hdrSize));
+  for(i=0; i<pw*ph; i++)
+    dst[i] = (avg[i] >= 0) ? lut[avg[i]] : 0;
+  memset(dst + pw*ph, 0, size - hdrSize - pw*ph);
+
+  *data = image;
+  return(size);
+}
+
+/*---------------------------------------------------------------------------*/
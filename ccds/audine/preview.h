@@ -0,0 +1,111 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#ifndef AUDINE_PREVIEW_H
+#define AUDINE_PREVIEW_H
+
+#include <pthread.h>
+
+class Frame;
+
+/*
+ * A downsampled, auto-stretched 8 bit preview of the image being read.
+ * Rows are binned by the writer thread as they are placed in the frame,
+ * in the same orientation as the saved file. The event loop renders
+ * the preview so far as a small 8 bit FITS image, ready for a BLOB.
+ * The stretch maps the 1% and 99.9% points of the preview histogram
+ * to black and white, with a square root curve in between.
+ */
+
+class Preview {
+
+ public:
+
+  static const int MINSIDE = 256; /* limits the binning factor to 128 */
+  static const int MAXSIDE = 2048;
+
+  Preview();
+ ~Preview();
+
+  /******************************/
+  /* writer thread side */
+  /******************************/
+
+  /* prepares an empty preview of an image no wider or higher than */
+  /* 'side' pixels. No preview at all if 'side' is 0 */
+  void reset(int width, int height, int side, bool flipLR, bool flipUD);
+
+  /* bins 'n' rows just placed in 'frame' from row 'first' on */
+  void add(const Frame* frame, int first, int n);
+
+  /* bins row 'y' of an image of decimal pixels */
+  void add(const float* row, int y);
+
+  /* marks the preview as final, even with rows lost */
+  void finish();
+
+  /******************************/
+  /* event loop side */
+  /******************************/
+
+  /* true if there is something new to render. 'complete' tells */
+  /* whether it would be the final preview */
+  bool changed(bool* complete);
+
+  /* true if the last rendered preview was the final one */
+  bool final() const { return(done); }
+
+  /* renders the preview as an 8 bit FITS image into an internal buffer */
+  /* returns its size in bytes. Valid until the next call */
+  int render(const char** data);
+
+ private:
+
+  pthread_mutex_t lock;		/* binned data is shared by both threads */
+
+  int w, h;			/* image dimensions */
+  int factor;			/* binning factor, 0 if disabled */
+  int pw, ph;			/* preview dimensions */
+  bool flipUD;
+  int* colMap;			/* preview column of each image column */
+  int* colCount;		/* image columns binned in each preview column */
+  int* sums;			/* binned pixel sums */
+  int* rowCount;		/* image rows binned in each preview row */
+  int rows;			/* image rows binned so far */
+  bool complete;		/* no more rows will come */
+  bool fresh;			/* rows binned since last render */
+  bool done;			/* last render was of the final preview */
+  int maxCols, maxPixels;	/* capacities of the arrays above */
+
+  /* render side */
+  int* avg;			/* preview pixels, snapshot of sums[] */
+  unsigned int* hist;		/* preview histogram */
+  unsigned char* lut;		/* stretch table, from black to white */
+  char* image;			/* FITS image */
+  int imageSize;		/* capacity of image[] */
+
+  /* computes black & white points from the histogram of 'n' pixels */
+  void stretch(int n, int* black, int* white);
+};
+
+#endif
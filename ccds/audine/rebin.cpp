@@ -0,0 +1,166 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "fitshead.h"
+#include "frame.h"
+#include "pixkern.h"
+#include "rebin.h"
+
+/*---------------------------------------------------------------------------*/
+
+Rebinner::Rebinner() : w(0), h(0), ow(0), oh(0), mask(0), acc(0), buf(0), 
+		       rows(0), cols(0), full(0)
+{
+  memset(&geom, 0, sizeof(geom));
+}
+
+/*---------------------------------------------------------------------------*/
+
+Rebinner::~Rebinner()
+{
+  delete [] mask;
+  delete [] acc;
+  delete [] buf;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Rebinner::reset(const RebinGeom* g, int width, int height)
+{
+  geom = *g;
+  w    = width;
+  h    = height;
+  ow   = geom.width / geom.binX;
+  oh   = geom.height / geom.binY;
+  full = STATIC_CAST(unsigned short, (1 << geom.binY) - 1);
+
+  if(oh > rows) {
+    delete [] mask;
+    rows = oh;
+    mask = new unsigned short[rows];
+  }
+  if(ow > cols) {
+    delete [] acc;
+    delete [] buf;
+    cols = ow;
+    acc  = new int[cols];
+    buf  = new pixel_t[cols];
+  }
+  memset(mask, 0, oh * sizeof(unsigned short));
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Rebinner::add(int first, int n, int* o1, int* o2)
+{
+  int y1, y2, oy, k;
+  unsigned short old;
+
+  y1 = (first > geom.y) ? first : geom.y;
+  y2 = (first+n < geom.y+oh*geom.binY) ? first+n : geom.y+oh*geom.binY;
+
+  // only the first and last output rows may have been complete already.
+  // Those the chunk completes are contiguous then
+
+  *o1 = *o2 = -1;
+  for(int y=y1; y<y2; y++) {
+    oy  = (y - geom.y) / geom.binY;
+    k   = (y - geom.y) % geom.binY;
+    old = mask[oy];
+    mask[oy] |= STATIC_CAST(unsigned short, 1 << k);
+    if(old != full && mask[oy] == full) {
+      if(*o1 == -1)
+	*o1 = oy;
+      *o2 = oy + 1;
+    }
+  }
+  return(*o1 != -1);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+Rebinner::incomplete(int oy) const
+{
+  for(; oy<oh; oy++)
+    if(mask[oy] != full && mask[oy] != 0)
+      return(oy);
+  return(-1);
+}
+
+/*---------------------------------------------------------------------------*/
+
+const pixel_t*
+Rebinner::row(const Frame* frame, int oy)
+{
+  int y = geom.y + oy*geom.binY;
+
+  memset(acc, 0, ow * sizeof(int));
+  for(int k=0; k<geom.binY; k++, y++)
+    if(frame->hasRow(y))	// lost rows add nothing
+      PixKern::binAdd(acc, frame->row(y) + geom.x, ow, geom.binX);
+  PixKern::pack(buf, acc, ow);
+  return(buf);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Rebinner::stamp(FITSHeader* header) const
+{
+  char buf[FITSHeader::STRINGSZ+1];
+
+  header->set("NAXIS1", ow, "columns");
+  header->set("NAXIS2", oh, "rows");
+
+  // section of the frame as read, IRAF style
+
+  if(geom.x != 0 || geom.y != 0 || geom.width != w || geom.height != h) {
+    snprintf(buf, sizeof(buf), "Trim data section is [%d:%d,%d:%d]",
+	     geom.x + 1, geom.x + geom.width, geom.y + 1, geom.y + geom.height);
+    header->set("TRIM", buf, (geom.trimmed) ? "overscan trimmed" : "cropped");
+  }
+  header->erase("BIASSEC");	// pixels no longer where they were
+  header->erase("TRIMSEC");
+
+  header->set("XORGSUBF", geom.orgX, "[pixels] area origin");
+  header->set("YORGSUBF", geom.orgY, "[pixels] area origin");
+
+  if(geom.binX == 1 && geom.binY == 1)
+    return;
+
+  snprintf(buf, sizeof(buf), "%dx%d", geom.binX, geom.binY);
+  header->set("SOFTBIN", buf, "software binning after readout");
+  header->set("CCDBIN1", geom.ccdBin1, "binned columns");
+  header->set("CCDBIN2", geom.ccdBin2, "binned rows");
+  header->set("PIXSZ1", geom.pixSize1, "[um] equivalent pixel size");
+  header->set("PIXSZ2", geom.pixSize2, "[um] equivalent pixel size");
+}
@@ -0,0 +1,109 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_REBIN_H
+#define AUDINE_REBIN_H
+
+/* 
+ * Output geometry of an image saved cropped and/or software binned,
+ * in pixels of the frame as read (already binned by the hardware).
+ */
+
+struct RebinGeom {
+  int x;			/* window kept */
+  int y;
+  int width;			/* multiples of binX & binY */
+  int height;
+  int binX;			/* software binning factors */
+  int binY;
+  bool trimmed;			/* window is the active area */
+
+  /* geometry keywords of the result */
+  int ccdBin1;			/* hardware x software binning */
+  int ccdBin2;
+  double pixSize1;		/* binned pixel size [microns] */
+  double pixSize2;
+  int orgX;			/* XORGSUBF & YORGSUBF */
+  int orgY;
+};
+
+class Frame;
+class FITSHeader;
+
+/*
+ * Streaming software binning and cropping of a frame being received.
+ * Frame rows arrive in any order, so every output row keeps a mask of 
+ * the frame rows it has got. It is binned from the frame as soon as it
+ * is complete: each frame row is binned horizontally and accumulated
+ * in 32 bits, and the sums saturate to 16 bits at the end.
+ * Output rows left incomplete by lost chunks are binned at the end
+ * from the rows received only.
+ */
+
+class Rebinner {
+
+ public:
+
+  static const int MAXBIN = 16;	/* largest binning factor */
+
+  Rebinner();
+ ~Rebinner();
+
+  /* prepares for a new frame of the given dimensions */
+  void reset(const RebinGeom* geom, int width, int height);
+
+  /* output image size */
+  int width() const { return(ow); }
+  int height() const { return(oh); }
+
+  /* accounts just placed frame rows [first, first+n). 
+     false if they complete no output row, else [*o1, *o2) are complete */
+  bool add(int first, int n, int* o1, int* o2);
+
+  /* first output row from 'oy' left incomplete, -1 if none */
+  int incomplete(int oy) const;
+
+  /* true if output row 'oy' has got all its frame rows */
+  bool complete(int oy) const { return(mask[oy] == full); }
+
+  /* bins output row 'oy' from the frame rows received */
+  const pixel_t* row(const Frame* frame, int oy);
+
+  /* sets the size and geometry keywords of the result */
+  void stamp(FITSHeader* header) const;
+
+ private:
+
+  RebinGeom geom;		/* current geometry */
+  int w;			/* frame size */
+  int h;
+  int ow;			/* output size */
+  int oh;
+  unsigned short* mask;		/* frame rows got, per output row */
+  int* acc;			/* row accumulator */
+  pixel_t* buf;			/* binned row */
+  int rows;			/* capacity of mask[] */
+  int cols;			/* capacity of acc[] & buf[] */
+  unsigned short full;		/* mask of a complete output row */
+};
+
+#endif
@@ -0,0 +1,141 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "rice.h"
+
+/*
+ * Coding parameters for 16 bit data, as in CFITSIO
+ */
+
+#define FSBITS  4		/* bits used to code the split position */
+#define FSMAX  14		/* highest split, else raw coding */
+#define BBITS  16		/* bits per raw pixel difference */
+
+/*---------------------------------------------------------------------------*/
+
+/* MSB first bit output */
+
+struct BitOutput {
+  unsigned char* p;		/* next output byte */
+  unsigned int bits;		/* pending bits, right justified */
+  int n;			/* number of pending bits, less than 8 */
+};
+
+/*---------------------------------------------------------------------------*/
+
+static inline void
+put(BitOutput& out, unsigned int value, int nbits)
+{
+  // nbits <= 16, so that pending bits never exceed 24
+
+  out.bits = (out.bits << nbits) | (value & ((1U << nbits) - 1));
+  out.n   += nbits;
+  while(out.n >= 8) {
+    out.n -= 8;
+    *out.p++ = STATIC_CAST(unsigned char, out.bits >> out.n);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+Rice::compress(const pixel_t* src, int n, unsigned char* dst)
+{
+  BitOutput out;
+  unsigned int diff[BLOCKSIZE];
+  unsigned int sum, psum, top;
+  short last, next, delta;
+  int i, j, fs, len;
+
+  out.p    = dst;
+  out.bits = 0;
+  out.n    = 0;
+
+  if(n <= 0)
+    return(0);
+
+  // first pixel goes uncoded
+
+  last = STATIC_CAST(short, src[0]);
+  put(out, STATIC_CAST(unsigned short, last), BBITS);
+
+  for(i=0; i<n; i+=BLOCKSIZE) {
+
+    len = (n - i < BLOCKSIZE) ? n - i : BLOCKSIZE;
+
+    // differences mapped to unsigned: 0,-1,1,-2,2 ... -> 0,1,2,3,4 ...
+
+    for(sum=0, j=0; j<len; j++) {
+      next  = STATIC_CAST(short, src[i+j]);
+      delta = STATIC_CAST(short, next - last);
+      diff[j] = STATIC_CAST(unsigned short, 
+			    (delta < 0) ? ~(delta << 1) : (delta << 1));
+      sum += diff[j];
+      last = next;
+    }
+
+    // split position from the mean difference in the block
+
+    psum = (sum > STATIC_CAST(unsigned int, len/2 + 1)) ? 
+      (sum - len/2 - 1) / len : 0;
+    psum = (psum & 0xFFFF) >> 1;
+    for(fs=0; psum>0; fs++)
+      psum >>= 1;
+
+    if(fs >= FSMAX) {		// high entropy, raw differences
+      put(out, FSMAX+1, FSBITS);
+      for(j=0; j<len; j++)
+	put(out, diff[j], BBITS);
+    } else if(fs == 0 && sum == 0) { // low entropy, all equal
+      put(out, 0, FSBITS);
+    } else {
+      put(out, fs+1, FSBITS);
+      for(j=0; j<len; j++) {
+
+	// top bits in unary, a run of zeros ended by a one
+
+	top = diff[j] >> fs;
+	while(top >= 16) {
+	  put(out, 0, 16);
+	  top -= 16;
+	}
+	put(out, 1, top+1);
+
+	// low bits verbatim
+
+	if(fs > 0)
+	  put(out, diff[j], fs);
+      }
+    }
+  }
+
+  if(out.n > 0)			// flushes the last partial byte
+    *out.p++ = STATIC_CAST(unsigned char, out.bits << (8 - out.n));
+
+  return(out.p - dst);
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,47 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_RICE_H
+#define AUDINE_RICE_H
+
+/*
+ * Lossless Rice coder for 16 bit pixels, bit compatible with
+ * the RICE_1 algorithm of CFITSIO (fits_rcomp_short) so that
+ * compressed tiles can be read by funpack and any CFITSIO reader.
+ * Pixels are taken in host order and coded as signed 16 bit values.
+ */
+
+class Rice {
+
+ public:
+
+  static const int BLOCKSIZE = 32; /* pixels per coding block */
+
+  /* worst case compressed size in bytes of 'n' pixels */
+  static int bound(int n) { return(2*n + n/BLOCKSIZE + 8); }
+
+  /* compresses 'n' pixels into 'dst'. Returns the compressed length */
+  /* 'dst' must hold at least bound(n) bytes */
+  static int compress(const pixel_t* src, int n, unsigned char* dst);
+};
+
+#endif
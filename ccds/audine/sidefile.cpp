@@ -0,0 +1,177 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "sidefile.h"
+
+/*---------------------------------------------------------------------------*/
+
+bool
+pwriteAll(int fd, const void* buf, size_t len, off_t offset)
+{
+  const char* p = STATIC_CAST(const char*, buf);
+  ssize_t res;
+
+  while(len > 0) {
+    res = pwrite(fd, p, len, offset);
+    if(res == -1) {
+      if(errno == EINTR)
+	continue;
+      return(false);
+    }
+    p      += res;
+    len    -= res;
+    offset += res;
+  }
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+double
+julianDay(const char* date)
+{
+  struct tm tm;
+  double sec;
+
+  memset(&tm, 0, sizeof(tm));
+  if(date == 0 || sscanf(date, "%d-%d-%dT%d:%d:%lf", &tm.tm_year, &tm.tm_mon,
+			 &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &sec) != 6)
+    return(0);
+  tm.tm_year -= 1900;
+  tm.tm_mon  -= 1;
+  return((timegm(&tm) + sec) / 86400 + 2440587.5);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+SavedGeom::toSaved(double fx, double fy, double* sx, double* sy) const
+{
+  // binned, cropped and flipped
+
+  *sx = (fx - x + 0.5) / binX - 0.5;
+  *sy = (fy - y + 0.5) / binY - 0.5;
+  if(*sx < -0.5 || *sx >= width - 0.5 || *sy < -0.5 || *sy >= height - 0.5)
+    return(false);
+  *sx = (flipLR) ? width-1 - *sx : *sx;
+  *sy = (flipUD) ? height-1 - *sy : *sy;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+SavedGeom::toFrame(double sx, double sy, double* fx, double* fy) const
+{
+  if(sx < -0.5 || sx >= width - 0.5 || sy < -0.5 || sy >= height - 0.5)
+    return(false);
+  sx = (flipLR) ? width-1 - sx : sx;
+  sy = (flipUD) ? height-1 - sy : sy;
+  *fx = (sx + 0.5) * binX - 0.5 + x;
+  *fy = (sy + 0.5) * binY - 0.5 + y;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+CSVLines::CSVLines() : buf(0), size(0), len(0), head(0)
+{
+}
+
+/*---------------------------------------------------------------------------*/
+
+CSVLines::~CSVLines()
+{
+  delete [] buf;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+CSVLines::begin(const char* columns)
+{
+  len = 0;
+  line("%s", columns);
+  head = len;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+CSVLines::line(const char* fmt, ...)
+{
+  va_list ap;
+  char* more;
+  int n;
+
+  // formatted into the room left, again into a larger buffer if short
+
+  for(;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+    if(n < size - len)
+      break;
+    more = new char[2*size + n + 1];
+    memcpy(more, buf, len);
+    delete [] buf;
+    buf  = more;
+    size = 2*size + n + 1;
+  }
+  len += n;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+CSVLines::append(const char* path) const
+{
+  struct stat st;
+  int fd, skip, err = 0;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1)
+    return(false);
+  skip = (fstat(fd, &st) == 0 && st.st_size == 0) ? 0 : head;
+  if(write(fd, buf + skip, len - skip) == -1)
+    err = errno;
+  if(close(fd) == -1 && !err)
+    err = errno;
+  errno = err;
+  return(err == 0);
+}
+
+/*---------------------------------------------------------------------------*/
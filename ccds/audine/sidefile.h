@@ -0,0 +1,141 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+
+#ifndef AUDINE_SIDEFILE_H
+#define AUDINE_SIDEFILE_H
+
+#include <sys/types.h>
+
+class FITSHeader;
+
+/* writes a whole buffer at 'offset' of file 'fd', going on after */
+/* partial writes. false on error (errno) */
+bool pwriteAll(int fd, const void* buf, size_t len, off_t offset);
+
+/* Julian day of a FITS date & time, 0 if not one */
+double julianDay(const char* date);
+
+/* where the pixels of a frame went in the image saved */
+
+struct SavedGeom {
+  int x;			/* origin of the area saved in the frame */
+  int y;
+  int binX;			/* frame pixels per pixel saved */
+  int binY;
+  int width;			/* image size in the file */
+  int height;
+  bool flipLR;			/* saved flipped Left to Right */
+  bool flipUD;			/* saved flipped upside down */
+
+  /* position of a frame pixel in the pixels of the file, 0 based. */
+  /* false if left out of it */
+  bool toSaved(double fx, double fy, double* sx, double* sy) const;
+
+  /* and the reverse */
+  bool toFrame(double sx, double sy, double* fx, double* fy) const;
+};
+
+/*
+ * The image just saved, as seen by the analysis modules that have
+ * something to save along with it. Implemented by the disk writer.
+ */
+
+class SavedImage {
+
+ public:
+
+  virtual ~SavedImage() {}
+
+  /* FITS file path */
+  virtual const char* path() const = 0;
+
+  /* IMAGE extension of a multi-extension file, 1 based. 0 if not one */
+  virtual int extension() const = 0;
+
+  /* where the pixels of the frame went */
+  virtual const SavedGeom* geometry() const = 0;
+
+  /* RA & DEC [deg] of pixel (x, y) of the image as saved, 0 based, */
+  /* by its plate solution. false if not solved */
+  virtual bool world(double x, double y, double* ra, double* dec) const = 0;
+
+  /* appends an HDU of header 'ext' and 'size' bytes of 'data', padded */
+  /* to whole records, after the last one written. The image 'header' */
+  /* is marked as having extensions */
+  virtual void append(FITSHeader* header, FITSHeader* ext, const void* data,
+		      off_t size) = 0;
+
+  /* notes a side file that could not be saved (errno 'err'). */
+  /* The image is saved anyway */
+  virtual void warn(int err, const char* path) = 0;
+};
+
+/*
+ * An analysis module saving what it found in a complete image, in
+ * files of its own or appended to the image, once the image is saved
+ * but before its final header is written. The disk writer calls the
+ * modules with something to save, one after the other.
+ */
+
+class SideOutput {
+
+ public:
+
+  virtual ~SideOutput() {}
+
+  /* saves what was found in 'image', keywords going to its 'header' */
+  virtual void output(SavedImage* image, FITSHeader* header) = 0;
+};
+
+/*
+ * The lines a CSV side file gets from an image, appended to it in a 
+ * single write, so that other readers never see part of them. 
+ * The column names go first, only into a new file.
+ */
+
+class CSVLines {
+
+ public:
+
+  CSVLines();
+ ~CSVLines();
+
+  /* starts the lines with the column names */
+  void begin(const char* columns);
+
+  /* adds a printf() formatted line, the buffer growing as needed */
+  void line(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+  /* appends the lines to 'path', the column names only if the file */
+  /* is new. false on error (errno) */
+  bool append(const char* path) const;
+
+ private:
+
+  char* buf;			/* the lines */
+  int size;			/* its capacity */
+  int len;			/* bytes used */
+  int head;			/* of which the column names */
+};
+
+#endif
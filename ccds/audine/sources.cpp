@@ -0,0 +1,996 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "calib.h"
+#include "checksum.h"
+#include "fitshead.h"
+#include "frame.h"
+#include "sources.h"
+#include "stats.h"
+#include "workpool.h"
+
+#define CLIP      3.0f		/* background clipping [sigma] */
+#define CLIPS     3		/* background clipping iterations */
+#define MADSIGMA  1.4826f	/* sigma of a normal distribution from its MAD */
+#define LOST      1		/* bad[]: row never received */
+#define SATURATED 2		/* bad[]: pixel at full scale */
+
+/*---------------------------------------------------------------------------*/
+
+static float
+median(float* v, int n)
+{
+  std::nth_element(v, v + n/2, v + n);
+  return(v[n/2]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+// centre of cell 'c' out of 'n' of 'm' pixels along 'len' pixels,
+// the last one taking the remainder
+
+static float
+centre(int c, int n, int m, int len)
+{
+  return((c < n-1) ? c*m + m/2.0f : (c*m + len) / 2.0f);
+}
+
+/*---------------------------------------------------------------------------*/
+
+SourceExtractor::SourceExtractor() : frame(0), calib(0), x0(0), y0(0), w(0),
+    h(0), bandRows(0), mw(0), mh(0), back(0), noise(0), meshSize(0),
+    level(0), sigma(0), sub(0), smooth(0), above(0), bad(0), size(0),
+    runs(0), nruns(0), maxRuns(0), dets(0), ndets(0), maxDets(0),
+    sources(0), nsources(0), maxSources(0), catalog(CATALOG_NONE)
+{
+  memset(&pars, 0, sizeof(pars));
+  memset(blend, 0, sizeof(blend));
+  memset(out, 0, sizeof(out));
+}
+
+/*---------------------------------------------------------------------------*/
+
+SourceExtractor::~SourceExtractor()
+{
+  delete [] back;
+  delete [] noise;
+  delete [] sub;
+  delete [] smooth;
+  delete [] above;
+  delete [] bad;
+  delete [] runs;
+  delete [] dets;
+  delete [] sources;
+  for(int i=0; i<BANDS; i++) {
+    delete [] blend[i].val;
+    delete [] blend[i].owner;
+    delete [] blend[i].mark;
+    delete [] blend[i].stack;
+    delete [] blend[i].start;
+    delete [] blend[i].flux;
+    delete [] blend[i].level;
+    delete [] blend[i].seed;
+    delete [] out[i].src;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+SourceExtractor::extract(const Frame* f, const Calibrator* c, int x, int y,
+			 int rw, int rh, const ExtractPars* p, WorkerPool* pool)
+{
+  int d, src, n;
+
+  frame = f;
+  calib = c;
+  pars  = *p;
+  pars.mesh = (pars.mesh < 8) ? 8 : pars.mesh;
+  x0 = (rw > 0) ? x : 0;
+  y0 = (rw > 0) ? y : 0;
+  w  = (rw > 0) ? rw : frame->width();
+  h  = (rw > 0) ? rh : frame->height();
+  bandRows  = (h + BANDS - 1) / BANDS;
+  nsources  = 0;
+  level = sigma = 0;
+
+  if(w * h > size) {
+    delete [] sub;
+    delete [] smooth;
+    delete [] above;
+    delete [] bad;
+    size   = w * h;
+    sub    = new float[size];
+    smooth = new float[size];
+    above  = new unsigned char[size];
+    bad    = new unsigned char[size];
+  }
+
+  run(pool, LOAD);
+
+  // rows never received take the nearest one received,
+  // they are not searched but they do not make edges either
+
+  for(y=0; y<h; y++) {
+    if(frame->hasRow(y0+y))
+      continue;
+    for(d=1, src=-1; src == -1 && (y-d >= 0 || y+d < h); d++)
+      if(y-d >= 0 && frame->hasRow(y0+y-d))
+	src = y-d;
+      else if(y+d < h && frame->hasRow(y0+y+d))
+	src = y+d;
+    if(src == -1)		// nothing received at all
+      return(0);
+    memcpy(sub + y*w, sub + src*w, w * sizeof(float));
+  }
+
+  // background mesh, whole cells only, the last ones taking the rest
+
+  mw = (w / pars.mesh > 0) ? w / pars.mesh : 1;
+  mh = (h / pars.mesh > 0) ? h / pars.mesh : 1;
+  if(mw * mh > meshSize) {
+    delete [] back;
+    delete [] noise;
+    meshSize = mw * mh;
+    back  = new float[meshSize];
+    noise = new float[meshSize];
+  }
+  run(pool, MESH);
+  filterMesh();
+
+  run(pool, SUBTRACT);
+  run(pool, DETECT);
+  label();
+  run(pool, MEASURE);
+
+  // brightest first
+
+  for(n=0, d=0; d<BANDS; d++)
+    n += out[d].n;
+  if(n > maxSources) {
+    delete [] sources;
+    maxSources = n;
+    sources = new Source[maxSources];
+  }
+  for(d=0; d<BANDS; d++) {
+    memcpy(sources + nsources, out[d].src, out[d].n * sizeof(Source));
+    nsources += out[d].n;
+  }
+  qsort(sources, nsources, sizeof(Source), SourceExtractor::byFlux);
+  return(nsources);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::stamp(FITSHeader* header) const
+{
+  header->set("NSOURCES", nsources, "sources extracted");
+  header->set("SKYLEVEL", level, "median sky background [ADU]");
+  header->set("SKYNOISE", sigma, "median sky noise [ADU]");
+}
+
+/*---------------------------------------------------------------------------*/
+
+// stores 'n' bytes of 'v' big endian
+
+static unsigned char*
+putBig(unsigned char* p, unsigned long long v, int n)
+{
+  for(int i=n-1; i>=0; i--, v >>= 8)
+    p[i] = v & 0xff;
+  return(p + n);
+}
+
+static unsigned char*
+putDouble(unsigned char* p, double v)
+{
+  unsigned long long u;
+
+  memcpy(&u, &v, sizeof(u));
+  return(putBig(p, u, sizeof(u)));
+}
+
+static unsigned char*
+putFloat(unsigned char* p, float v)
+{
+  unsigned int u;
+
+  memcpy(&u, &v, sizeof(u));
+  return(putBig(p, u, sizeof(u)));
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::output(SavedImage* image, FITSHeader* header)
+{
+  static const int ROWSZ = 34;	/* X, Y, FLUX, PEAK, FWHM, NPIX, FLAGS */
+  const SavedGeom* g = image->geometry();
+  int bx = g->binX;
+  int by = g->binY;
+  const Source* src;
+  unsigned char *buf, *p;
+  char catPath[256];
+  char* hdr;
+  const char* name;
+  const char* path = image->path();
+  off_t size;
+  FITSHeader ext;
+  DataSum sum;
+  double x, y;
+  int rows, nrec, catFd, n;
+
+  // in pixels of the image as saved, 1 based as FITS has them
+
+  size = STATIC_CAST(off_t, nsources) * ROWSZ;
+  size = ((size + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ)
+    * FITSHeader::RECORDSZ;
+  buf  = new unsigned char[size + 1];
+  memset(buf, 0, size);
+
+  for(int i=rows=0; i<nsources; i++) {
+    src = &sources[i];
+    if(!g->toSaved(src->x, src->y, &x, &y))
+      continue;
+    p = buf + rows++ * ROWSZ;
+    p = putDouble(p, x + 1);
+    p = putDouble(p, y + 1);
+    p = putFloat(p, src->flux);
+    p = putFloat(p, src->peak);
+    p = putFloat(p, src->fwhm / sqrt(STATIC_CAST(double, bx * by)));
+    p = putBig(p, (src->npix + bx*by/2) / (bx*by), 4);
+    p = putBig(p, src->flags, 2);
+  }
+  size = STATIC_CAST(off_t, rows) * ROWSZ;
+  size = ((size + FITSHeader::RECORDSZ - 1) / FITSHeader::RECORDSZ)
+    * FITSHeader::RECORDSZ;
+
+  ext.toTable(ROWSZ, rows, 7);
+  ext.setColumn(1, "X", "1D", "pixel");
+  ext.setColumn(2, "Y", "1D", "pixel");
+  ext.setColumn(3, "FLUX", "1E", "adu");
+  ext.setColumn(4, "PEAK", "1E", "adu");
+  ext.setColumn(5, "FWHM", "1E", "pixel");
+  ext.setColumn(6, "NPIX", "1J", "pixel");
+  ext.setColumn(7, "FLAGS", "1I");
+  ext.set("EXTNAME", "CATALOG", "sources extracted");
+  stamp(header);
+
+  if(catalog == CATALOG_EXTENSION) {
+    image->append(header, &ext, buf, size);
+    header->set("CATALOG", "CATALOG", "sources extension");
+    delete [] buf;
+    return;
+  }
+
+  // 'name.fit' or 'name.fit.fz' goes along with 'name_cat.fit'
+
+  n = strlen(path);
+  if(n > 3 && strcmp(path + n-3, ".fz") == 0)
+    n -= 3;
+  if(n > 4 && strncmp(path + n-4, ".fit", 4) == 0)
+    n -= 4;
+  snprintf(catPath, sizeof(catPath), "%.*s_cat.fit", n, path);
+  name = strrchr(catPath, '/');
+  header->set("CATALOG", (name) ? name+1 : catPath, "sources file");
+
+  catFd = open(catPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(catFd == -1) {
+    image->warn(errno, catPath); // the image is still saved
+    delete [] buf;
+    return;
+  }
+
+  FITSHeader primary;
+  char prim[FITSHeader::RECORDSZ];
+
+  sum.add(buf, size, 0);
+  nrec = ext.records();
+  hdr  = new char[nrec * FITSHeader::RECORDSZ];
+  ext.render(hdr, nrec, sum.value());
+
+  name = strrchr(path, '/');
+  primary.set("NAXIS", 0, "no primary data, see extensions");
+  primary.erase("NAXIS1");
+  primary.erase("NAXIS2");
+  primary.set("EXTEND", true, "FITS dataset may contain extensions");
+  primary.set("IMAGEFIL", (name) ? name+1 : path, "image the sources are from");
+  primary.render(prim, 1, 0);
+  if(!pwriteAll(catFd, prim, sizeof(prim), 0) ||
+     !pwriteAll(catFd, hdr, nrec * FITSHeader::RECORDSZ, sizeof(prim)) ||
+     !pwriteAll(catFd, buf, size, sizeof(prim) + nrec * FITSHeader::RECORDSZ))
+    image->warn(errno, catPath);
+  if(close(catFd) == -1)
+    image->warn(errno, catPath);
+  delete [] hdr;
+  delete [] buf;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::run(WorkerPool* pool, int which)
+{
+  int jobs = (which == MESH) ? mh : BANDS;
+
+  for(int j=0; j<jobs; j++)
+    pool->submit(SourceExtractor::passJob, this, which, j);
+  pool->wait();
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::passJob(void* ctx, int a, int b)
+{
+  STATIC_CAST(SourceExtractor*, ctx)->pass(a, b);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::pass(int which, int job)
+{
+  float* row = 0;
+  const pixel_t* src;
+  const float *up, *p, *down;
+  float* dst;
+  float t, k;
+  int y1, y2, xl, xr, i;
+
+  y1 = job * bandRows;
+  y2 = (y1 + bandRows < h) ? y1 + bandRows : h;
+
+  switch(which) {
+
+  case LOAD:
+    row = new float[frame->width()];
+    for(int y=y1; y<y2; y++) {
+      i = y * w;
+      if(!frame->hasRow(y0+y)) {
+	memset(bad + i, LOST, w);
+	continue;
+      }
+      src = frame->row(y0+y) + x0;
+      for(int x=0; x<w; x++)
+	bad[i+x] = (src[x] >= FrameStats::SATURATION) ? SATURATED : 0;
+      if(calib) {
+	calib->values(row, frame->row(y0+y), y0+y);
+	memcpy(sub + i, row + x0, w * sizeof(float));
+      } else
+	for(int x=0; x<w; x++)
+	  sub[i+x] = src[x];
+    }
+    break;
+
+  case MESH:
+    row = new float[2 * (pars.mesh + w % pars.mesh) * (pars.mesh + h % pars.mesh)];
+    for(int cx=0; cx<mw; cx++)
+      cell(cx, job, row);
+    break;
+
+  case SUBTRACT:
+    row = new float[w];
+    for(int y=y1; y<y2; y++) {
+      interpolate(back, y, row);
+      for(int x=0; x<w; x++)
+	sub[y*w + x] -= row[x];
+    }
+    break;
+
+  case DETECT:
+
+    // 3x3 gaussian filter, thresholded at sigmas of the unfiltered
+    // pixels, as SExtractor does
+
+    row = new float[w];
+    k   = pars.threshold;
+    for(int y=y1; y<y2; y++) {
+      i    = y * w;
+      up   = sub + ((y > 0) ? y-1 : 0) * w;
+      p    = sub + i;
+      down = sub + ((y < h-1) ? y+1 : h-1) * w;
+      dst  = smooth + i;
+      interpolate(noise, y, row);
+      for(int x=0; x<w; x++) {
+	xl = (x > 0) ? x-1 : 0;
+	xr = (x < w-1) ? x+1 : w-1;
+	t  = (up[xl] + 2*up[x] + up[xr] + 2*p[xl] + 4*p[x] + 2*p[xr] + 
+	      down[xl] + 2*down[x] + down[xr]) / 16;
+	dst[x] = t;
+	above[i+x] = t > k * ((row[x] > 0) ? row[x] : sigma) &&
+	  !(bad[i+x] & LOST);
+      }
+    }
+    break;
+
+  case MEASURE:
+
+    // detections are shared out in turn, bright and faint alike
+
+    out[job].n = 0;
+    for(int d=job; d<ndets; d+=BANDS)
+      measure(&dets[d], &blend[job], &out[job]);
+    break;
+  }
+
+  delete [] row;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::cell(int cx, int cy, float* buf)
+{
+  int xa = cx * pars.mesh;
+  int ya = cy * pars.mesh;
+  int xb = (cx < mw-1) ? xa + pars.mesh : w;
+  int yb = (cy < mh-1) ? ya + pars.mesh : h;
+  float med, s, v;	// buf holds twice the largest cell
+  double sum, sum2;
+  int n = 0, m;
+
+  for(int y=ya; y<yb; y++)
+    for(int x=xa; x<xb; x++)
+      if(!bad[y*w + x])
+	buf[n++] = sub[y*w + x];
+
+  // too few pixels left, filled from its neighbours later
+
+  if(n < (xb-xa) * (yb-ya) / 4) {
+    noise[cy*mw + cx] = -1;
+    return;
+  }
+
+  // median & MAD first, then clipped median & standard deviation,
+  // which does not suffer from integer pixels as the MAD does
+
+  med = median(buf, n);
+  for(int i=0; i<n; i++)
+    buf[n+i] = fabsf(buf[i] - med);
+  s = MADSIGMA * median(buf + n, n);
+
+  for(int it=0; it<CLIPS && n > 2; it++) {
+    sum = sum2 = 0;
+    for(int i=m=0; i<n; i++) {
+      v = buf[i];
+      if(s > 0 && fabsf(v - med) > CLIP * s)
+	continue;
+      buf[m++] = v;
+      sum  += v;
+      sum2 += v * v;
+    }
+    if(m < 2)
+      break;
+    n   = m;
+    med = median(buf, n);
+    s   = sqrt((sum2 - sum * sum / n) / (n - 1));
+  }
+
+  back[cy*mw + cx]  = med;
+  noise[cy*mw + cx] = s;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::filterMesh()
+{
+  float* tmp = new float[2 * mw * mh];
+  float* nb  = tmp + mw * mh;
+  float *mesh, v;
+  int i, n, valid, left;
+
+  // empty cells take the mean of their filled neighbours, round after round
+
+  for(i=valid=0; i<mw*mh; i++)
+    valid += noise[i] >= 0;
+  if(valid == 0)
+    for(i=0; i<mw*mh; i++)
+      back[i] = noise[i] = 0;
+
+  for(left = valid ? mw*mh - valid : 0; left > 0; ) {
+    memcpy(tmp, noise, mw * mh * sizeof(float));
+    for(int cy=0; cy<mh; cy++)
+      for(int cx=0; cx<mw; cx++) {
+	if(tmp[cy*mw + cx] >= 0)
+	  continue;
+	double b = 0, s = 0;
+	n = 0;
+	for(int y=cy-1; y<=cy+1; y++)
+	  for(int x=cx-1; x<=cx+1; x++)
+	    if(x >= 0 && x < mw && y >= 0 && y < mh && tmp[y*mw + x] >= 0) {
+	      b += back[y*mw + x];
+	      s += tmp[y*mw + x];
+	      n++;
+	    }
+	if(n) {
+	  back[cy*mw + cx]  = b / n;
+	  noise[cy*mw + cx] = s / n;
+	  left--;
+	}
+      }
+  }
+
+  // 3x3 median, a star on a cell boundary does not make a bump
+
+  for(int k=0; k<2; k++) {
+    mesh = k ? noise : back;
+    memcpy(tmp, mesh, mw * mh * sizeof(float));
+    for(int cy=0; cy<mh; cy++)
+      for(int cx=0; cx<mw; cx++) {
+	n = 0;
+	for(int y=cy-1; y<=cy+1; y++)
+	  for(int x=cx-1; x<=cx+1; x++)
+	    if(x >= 0 && x < mw && y >= 0 && y < mh)
+	      nb[n++] = tmp[y*mw + x];
+	mesh[cy*mw + cx] = median(nb, n);
+      }
+  }
+
+  memcpy(tmp, back, mw * mh * sizeof(float));
+  level = median(tmp, mw * mh);
+  memcpy(tmp, noise, mw * mh * sizeof(float));
+  sigma = median(tmp, mw * mh);
+
+  // a flat image would detect every pixel
+
+  v = (sigma > 0) ? 0 : 1;
+  for(i=0; i<mw*mh; i++)
+    if(noise[i] <= 0)
+      noise[i] = (sigma > 0) ? sigma : v;
+  delete [] tmp;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::interpolate(const float* mesh, int y, float* row) const
+{
+  float* col = new float[mw];
+  float yc, t, xa, xb;
+  int cy = 0, cx = 0;
+
+  // between the cell centres above and below, extrapolated beyond the
+  // outer ones
+
+  while(cy < mh-2 && centre(cy+1, mh, pars.mesh, h) <= y)
+    cy++;
+  if(mh > 1) {
+    yc = centre(cy, mh, pars.mesh, h);
+    t  = (y - yc) / (centre(cy+1, mh, pars.mesh, h) - yc);
+    for(int x=0; x<mw; x++)
+      col[x] = mesh[cy*mw + x] * (1-t) + mesh[(cy+1)*mw + x] * t;
+  } else
+    memcpy(col, mesh, mw * sizeof(float));
+
+  if(mw == 1) {
+    for(int x=0; x<w; x++)
+      row[x] = col[0];
+    delete [] col;
+    return;
+  }
+
+  xa = centre(0, mw, pars.mesh, w);
+  xb = centre(1, mw, pars.mesh, w);
+  for(int x=0; x<w; x++) {
+    if(x >= xb && cx < mw-2) {
+      cx++;
+      xa = xb;
+      xb = centre(cx+1, mw, pars.mesh, w);
+    }
+    t = (x - xa) / (xb - xa);
+    row[x] = col[cx] * (1-t) + col[cx+1] * t;
+  }
+  delete [] col;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::label()
+{
+  int prev = 0, cur = 0, r, p, k;
+  int* det;
+  Run* grown;
+  Detection* d;
+
+  nruns = ndets = 0;
+
+  for(int y=0; y<h; y++) {
+    const unsigned char* a = above + y*w;
+    cur = nruns;
+    for(int x=0; x<w; ) {
+      if(!a[x]) {
+	x++;
+	continue;
+      }
+      if(nruns == maxRuns) {
+	maxRuns = maxRuns ? 2*maxRuns : 4096;
+	grown = new Run[maxRuns];
+	memcpy(grown, runs, nruns * sizeof(Run));
+	delete [] runs;
+	runs = grown;
+      }
+      r = nruns++;
+      runs[r].y  = y;
+      runs[r].x1 = x;
+      while(x < w && a[x])
+	x++;
+      runs[r].x2 = x;
+      runs[r].parent = r;
+      runs[r].next = -1;
+
+      // joins the runs of the previous row touching it, diagonals included
+
+      for(p=prev; p<cur && runs[p].x1 <= runs[r].x2; p++)
+	if(runs[p].x2 >= runs[r].x1) {
+	  int ra = root(p), rb = root(r);
+	  if(ra != rb)
+	    runs[(ra > rb) ? ra : rb].parent = (ra > rb) ? rb : ra;
+	}
+      while(prev < cur && runs[prev].x2 < runs[r].x1)
+	prev++;
+    }
+    prev = cur;
+  }
+
+  // one detection per root, its runs chained in reverse order
+
+  det = new int[nruns > 0 ? nruns : 1];
+  for(r=0; r<nruns; r++) {
+    p = root(r);
+    if(p == r) {
+      if(ndets == maxDets) {
+	maxDets = maxDets ? 2*maxDets : 1024;
+	Detection* more = new Detection[maxDets];
+	memcpy(more, dets, ndets * sizeof(Detection));
+	delete [] dets;
+	dets = more;
+      }
+      det[r] = ndets;
+      d = &dets[ndets++];
+      d->first = -1;
+      d->npix  = 0;
+      d->x1 = runs[r].x1;
+      d->x2 = runs[r].x2;
+      d->y1 = runs[r].y;
+      d->y2 = runs[r].y + 1;
+    }
+    d = &dets[det[p]];
+    runs[r].next = d->first;
+    d->first = r;
+    d->npix += runs[r].x2 - runs[r].x1;
+    d->x1 = (runs[r].x1 < d->x1) ? runs[r].x1 : d->x1;
+    d->x2 = (runs[r].x2 > d->x2) ? runs[r].x2 : d->x2;
+    d->y2 = runs[r].y + 1;
+  }
+  delete [] det;
+
+  for(r=k=0; r<ndets; r++)
+    if(dets[r].npix >= pars.minArea)
+      dets[k++] = dets[r];
+  ndets = k;
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+SourceExtractor::root(int r)
+{
+  int t;
+
+  while(runs[r].parent != r) {
+    t = runs[r].parent;
+    runs[r].parent = runs[t].parent;
+    r = t;
+  }
+  return(r);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+SourceExtractor::deblend(const Detection* d, Blend* b)
+{
+  int bw = d->x2 - d->x1;
+  int bh = d->y2 - d->y1;
+  int n  = bw * bh;
+  int nreg, nb, nsig, p, i;
+  float t0 = FLT_MAX, peak = -FLT_MAX, v, t;
+  double total = 0;
+
+  if(n > b->size) {
+    delete [] b->val;
+    delete [] b->owner;
+    delete [] b->mark;
+    delete [] b->stack;
+    delete [] b->start;
+    delete [] b->flux;
+    delete [] b->level;
+    delete [] b->seed;
+    b->size  = n;
+    b->val   = new float[n];
+    b->owner = new int[n];
+    b->mark  = new int[n];
+    b->stack = new int[n];
+    b->start = new int[n];
+    b->flux  = new double[n];
+    b->level = new int[n];
+    b->seed  = new bool[n];
+    b->gen   = INT_MAX;
+  }
+  if(b->gen > INT_MAX/2) {
+    memset(b->mark, 0, b->size * sizeof(int));
+    b->gen = 0;
+  }
+
+  for(i=0; i<n; i++)
+    b->owner[i] = -1;
+  for(int r=d->first; r != -1; r=runs[r].next)
+    for(int x=runs[r].x1; x<runs[r].x2; x++) {
+      p = (runs[r].y - d->y1) * bw + x - d->x1;
+      v = smooth[runs[r].y * w + x];
+      b->val[p]   = v;
+      b->owner[p] = 0;
+      t0    = (v < t0) ? v : t0;
+      peak  = (v > peak) ? v : peak;
+      total += v;
+    }
+  b->seed[0]  = true;
+  b->level[0] = 0;
+  nreg = 1;
+  if(t0 <= 0 || peak <= t0)
+    return(nreg);
+
+  // regions are searched in the order found, each one from the level it
+  // was found at up: two significant branches or more split it, a single
+  // one goes on up, none makes it a seed
+
+  for(int r=0; r<nreg; r++)
+    for(int j=b->level[r]+1; j<pars.levels; j++) {
+      t = t0 * pow(peak / t0, (double) j / pars.levels);
+      b->gen++;
+      for(p=nb=nsig=0; p<n; p++)
+	if(b->owner[p] == r && b->val[p] > t && b->mark[p] != b->gen) {
+	  b->start[nb] = p;
+	  b->flux[nb]  = fill(b, bw, bh, p, r, t, -1);
+	  nsig += b->flux[nb] > pars.contrast * total;
+	  nb++;
+	}
+      if(nsig == 0)
+	break;
+      if(nsig == 1)
+	continue;
+      for(i=0; i<nb; i++)
+	if(b->flux[i] > pars.contrast * total) {
+	  b->gen++;
+	  b->level[nreg] = j;
+	  b->seed[nreg]  = true;
+	  fill(b, bw, bh, b->start[i], r, t, nreg);
+	  nreg++;
+	}
+      b->seed[r] = false;
+      break;
+    }
+  return(nreg);
+}
+
+/*---------------------------------------------------------------------------*/
+
+double
+SourceExtractor::fill(Blend* b, int bw, int bh, int p, int r, float t, int to)
+{
+  double sum = 0;
+  int sp = 0, q, x, y, nq;
+
+  b->mark[p] = b->gen;
+  b->stack[sp++] = p;
+  while(sp > 0) {
+    q = b->stack[--sp];
+    sum += b->val[q];
+    if(to != -1)
+      b->owner[q] = to;
+    x = q % bw;
+    y = q / bw;
+    for(int ny=y-1; ny<=y+1; ny++)
+      for(int nx=x-1; nx<=x+1; nx++) {
+	if(nx < 0 || nx >= bw || ny < 0 || ny >= bh)
+	  continue;
+	nq = ny * bw + nx;
+	if(b->owner[nq] == r && b->val[nq] > t && b->mark[nq] != b->gen) {
+	  b->mark[nq] = b->gen;
+	  b->stack[sp++] = nq;
+	}
+      }
+  }
+  return(sum);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::measure(const Detection* d, Blend* b, Output* o)
+{
+  int bw = d->x2 - d->x1;
+  int nreg = 1, nseeds, k, p, i, y;
+  int *seedOf, *npix, *flags, *half;
+  double *flux, mx, my, e, best;
+  float v;
+  Moments* m;
+  Source s;
+
+  if(bw * (d->y2 - d->y1) <= MAXBLEND && pars.levels > 1)
+    nreg = deblend(d, b);
+
+  seedOf = new int[nreg];
+  for(i=nseeds=0; i<nreg; i++)
+    seedOf[i] = (nreg == 1 || b->seed[i]) ? nseeds++ : -1;
+
+  // pixels left below the branches go to the seed most likely to hold
+  // them, seen as a gaussian of its own moments
+
+  if(nseeds > 1) {
+    m = new Moments[nseeds];
+    memset(m, 0, nseeds * sizeof(Moments));
+    for(p=0; p<bw * (d->y2 - d->y1); p++)
+      if(b->owner[p] >= 0 && (k = seedOf[b->owner[p]]) >= 0) {
+	v = b->val[p];
+	m[k].sum += v;
+	m[k].sx  += v * (p % bw);
+	m[k].sy  += v * (p / bw);
+	m[k].sxx += v * (p % bw) * (p % bw);
+	m[k].syy += v * (p / bw) * (p / bw);
+	m[k].peak = (v > m[k].peak) ? v : m[k].peak;
+      }
+    for(k=0; k<nseeds; k++) {
+      m[k].sx  /= m[k].sum;
+      m[k].sy  /= m[k].sum;
+      m[k].sxx = m[k].sxx / m[k].sum - m[k].sx * m[k].sx;
+      m[k].syy = m[k].syy / m[k].sum - m[k].sy * m[k].sy;
+      m[k].sxx = (m[k].sxx < 0.5) ? 0.5 : m[k].sxx;
+      m[k].syy = (m[k].syy < 0.5) ? 0.5 : m[k].syy;
+    }
+    for(p=0; p<bw * (d->y2 - d->y1); p++) {
+      if(b->owner[p] < 0)
+	continue;
+      if((k = seedOf[b->owner[p]]) < 0) {
+	best = -1;
+	for(i=0; i<nseeds; i++) {
+	  mx = p % bw - m[i].sx;
+	  my = p / bw - m[i].sy;
+	  e  = m[i].peak * exp(-0.5 * (mx*mx / m[i].sxx + my*my / m[i].syy));
+	  if(e > best) {
+	    best = e;
+	    k = i;
+	  }
+	}
+      }
+      b->owner[p] = k;
+    }
+    delete [] m;
+  }
+
+  // isophotal measurements on the unfiltered pixels, the centroid
+  // weighted by the positive ones only
+
+  m     = new Moments[nseeds];
+  flux  = new double[nseeds];
+  npix  = new int[3 * nseeds];
+  flags = npix + nseeds;
+  half  = flags + nseeds;
+  memset(m, 0, nseeds * sizeof(Moments));
+  memset(npix, 0, 3 * nseeds * sizeof(int));
+  for(k=0; k<nseeds; k++) {
+    flux[k]   = 0;
+    m[k].peak = -FLT_MAX;
+  }
+
+  for(int r=d->first; r != -1; r=runs[r].next) {
+    y = runs[r].y;
+    for(int x=runs[r].x1; x<runs[r].x2; x++) {
+      k = (nseeds > 1) ? b->owner[(y - d->y1) * bw + x - d->x1] : 0;
+      v = sub[y*w + x];
+      flux[k] += v;
+      if(v > 0) {
+	m[k].sum += v;
+	m[k].sx  += v * x;
+	m[k].sy  += v * y;
+      }
+      m[k].peak = (v > m[k].peak) ? v : m[k].peak;
+      npix[k]++;
+      if(bad[y*w + x] & SATURATED)
+	flags[k] |= SOURCE_SATURATED;
+      if(x == 0 || x == w-1 || y == 0 || y == h-1 ||
+	 (bad[(y-1)*w + x] & LOST) || (bad[(y+1)*w + x] & LOST))
+	flags[k] |= SOURCE_EDGE;
+    }
+  }
+  for(int r=d->first; r != -1; r=runs[r].next) {
+    y = runs[r].y;
+    for(int x=runs[r].x1; x<runs[r].x2; x++) {
+      k = (nseeds > 1) ? b->owner[(y - d->y1) * bw + x - d->x1] : 0;
+      half[k] += sub[y*w + x] >= m[k].peak / 2;
+    }
+  }
+
+  for(k=0; k<nseeds; k++) {
+    if(npix[k] == 0)
+      continue;
+    s.x     = x0 + ((m[k].sum > 0) ? m[k].sx / m[k].sum : (d->x1 + d->x2 - 1) / 2.0);
+    s.y     = y0 + ((m[k].sum > 0) ? m[k].sy / m[k].sum : (d->y1 + d->y2 - 1) / 2.0);
+    s.flux  = flux[k];
+    s.peak  = m[k].peak;
+    s.fwhm  = 2 * sqrt(half[k] / M_PI);
+    s.npix  = npix[k];
+    s.flags = flags[k] | ((nseeds > 1) ? SOURCE_BLENDED : 0);
+    add(o, &s);
+  }
+
+  delete [] m;
+  delete [] flux;
+  delete [] npix;
+  delete [] seedOf;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+SourceExtractor::add(Output* o, const Source* s)
+{
+  if(o->n == o->max) {
+    o->max = o->max ? 2 * o->max : 256;
+    Source* more = new Source[o->max];
+    memcpy(more, o->src, o->n * sizeof(Source));
+    delete [] o->src;
+    o->src = more;
+  }
+  o->src[o->n++] = *s;
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+SourceExtractor::byFlux(const void* a, const void* b)
+{
+  float fa = STATIC_CAST(const Source*, a)->flux;
+  float fb = STATIC_CAST(const Source*, b)->flux;
+
+  return((fa < fb) ? 1 : (fa > fb) ? -1 : 0);
+}
@@ -0,0 +1,245 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_SOURCES_H
+#define AUDINE_SOURCES_H
+
+#include "sidefile.h"
+
+/* source catalog of object images */
+
+#define CATALOG_NONE      0	/* no catalog */
+#define CATALOG_EXTENSION 1	/* CATALOG binary table appended to the image */
+#define CATALOG_FILE      2	/* same table in a *_cat.fit file of its own */
+
+/* source flags, as a mask */
+
+#define SOURCE_BLENDED   1	/* deblended from a larger detection */
+#define SOURCE_SATURATED 2	/* has pixels at full scale */
+#define SOURCE_EDGE      4	/* touches the region border or lost rows */
+
+/* extraction parameters */
+
+struct ExtractPars {
+  double threshold;		/* detection limit [background sigma] */
+  int minArea;			/* smallest detection [pixels] */
+  int levels;			/* deblending thresholds */
+  double contrast;		/* smallest deblended flux, fraction of the total */
+  int mesh;			/* background mesh cell size [pixels] */
+};
+
+/* a source found, in frame pixels */
+
+struct Source {
+  double x;			/* flux weighted centroid, 0 based */
+  double y;
+  float flux;			/* isophotal flux over the background [ADU] */
+  float peak;			/* highest pixel over the background [ADU] */
+  float fwhm;			/* diameter of the half maximum area [pixels] */
+  int npix;			/* isophotal area [pixels] */
+  int flags;			/* SOURCE_xxx mask */
+};
+
+class Calibrator;
+class FITSHeader;
+class Frame;
+class WorkerPool;
+
+/*
+ * Source extraction from a complete frame, or a region of it, in the
+ * manner of SExtractor. A background mesh gets the clipped median and
+ * noise of every cell, smoothed with its neighbours and interpolated
+ * bilinearly between cell centres. The background subtracted image,
+ * filtered by a 3x3 gaussian kernel, is thresholded at some sigmas 
+ * of the local noise and labelled into 8-connected detections, run by
+ * run. Every detection is deblended along exponentially spaced levels
+ * up to its peak: a branch holding enough of its flux makes a source 
+ * of its own, and pixels below the branches go to the most likely one.
+ * Cells, bands and detections are all shared out to the worker pool,
+ * only the labelling being sequential.
+ * The sources may be saved as a binary table, appended to the image
+ * or in a file of its own.
+ */
+
+class SourceExtractor : public SideOutput {
+
+ public:
+
+  static const int BANDS = 32;	/* parallel jobs per pass */
+  static const int MAXBLEND = 262144; /* largest box deblended [pixels] */
+
+  SourceExtractor();
+ ~SourceExtractor();
+
+  /* extracts the sources of a region of a complete frame, the whole */
+  /* frame if 'w' is 0. Calibrated pixels if 'calib' is not NULL */
+  /* Returns the sources found */
+  int extract(const Frame* frame, const Calibrator* calib, int x, int y, int w,
+	      int h, const ExtractPars* pars, WorkerPool* pool);
+
+  /* sources found, brightest first */
+  int count() const { return(nsources); }
+  const Source* source(int i) const { return(&sources[i]); }
+
+  /* adds the number of sources and the background level & noise */
+  void stamp(FITSHeader* header) const;
+
+  /* how output() saves the catalog, one of CATALOG_xxx */
+  void setCatalog(int mode) { catalog = mode; }
+
+  /* saves the sources in the pixels of the image saved from the */
+  /* frame as a CATALOG binary table, adding where to the header */
+  void output(SavedImage* image, FITSHeader* header);
+
+ private:
+
+  /* passes through the image */
+  enum { LOAD, MESH, SUBTRACT, DETECT, MEASURE };
+
+  struct Run {			/* pixels above threshold along a row */
+    int y;
+    int x1;			/* [x1, x2) */
+    int x2;
+    int parent;			/* union-find link, itself if a root */
+    int next;			/* next run of the same detection */
+  };
+
+  struct Detection {
+    int first;			/* its first run */
+    int npix;
+    int x1;			/* bounding box, [x1, x2) x [y1, y2) */
+    int y1;
+    int x2;
+    int y2;
+  };
+
+  struct Blend {			/* per job deblending work space */
+    float* val;			/* filtered pixels of the bounding box */
+    int* owner;			/* region of each pixel, -1 if not detected */
+    int* mark;			/* flood fill visits */
+    int* stack;			/* flood fill stack */
+    int* start;			/* a pixel of each branch found */
+    double* flux;		/* flux of each branch found */
+    int* level;			/* level each region was found at */
+    bool* seed;			/* region not split any further */
+    int size;			/* capacity of the arrays */
+    int gen;			/* current flood fill visit */
+  };
+
+  struct Moments {		/* per seed, to share out pixels */
+    double sum;
+    double sx;
+    double sy;
+    double sxx;
+    double syy;
+    float peak;
+  };
+
+  struct Output {		/* sources measured by a job */
+    Source* src;
+    int n;
+    int max;			/* capacity of src[] */
+  };
+
+  const Frame* frame;		/* frame being extracted */
+  const Calibrator* calib;	/* its calibration, NULL if none */
+  ExtractPars pars;		/* parameters in use */
+  int x0;			/* region in the frame */
+  int y0;
+  int w;
+  int h;
+  int bandRows;			/* rows per band */
+
+  /* background mesh */
+  int mw;			/* cells across and down */
+  int mh;
+  float* back;			/* cell background [ADU] */
+  float* noise;			/* cell noise [ADU] */
+  int meshSize;			/* capacity of back[] & noise[] */
+  double level;			/* median background of the region */
+  double sigma;			/* median noise of the region */
+
+  /* image planes, region sized */
+  float* sub;			/* background subtracted */
+  float* smooth;		/* same, filtered */
+  unsigned char* above;		/* filtered pixel above threshold */
+  unsigned char* bad;		/* row lost or pixel saturated */
+  int size;			/* capacity of the planes in pixels */
+
+  /* detections */
+  Run* runs;
+  int nruns;
+  int maxRuns;			/* capacity of runs[] */
+  Detection* dets;
+  int ndets;
+  int maxDets;			/* capacity of dets[] */
+
+  /* per job work space & results */
+  Blend blend[BANDS];
+  Output out[BANDS];
+  Source* sources;		/* all of them, brightest first */
+  int nsources;
+  int maxSources;		/* capacity of sources[] */
+  int catalog;			/* CATALOG_xxx output() saves */
+
+  /* runs a pass with the worker pool */
+  void run(WorkerPool* pool, int pass);
+
+  /* runs a pass over a band, a row of cells or a share of the */
+  /* detections. Runs in the worker pool */
+  static void passJob(void* ctx, int a, int b);
+  void pass(int which, int job);
+
+  /* clipped median and noise of a cell */
+  void cell(int cx, int cy, float* buf);
+
+  /* fills empty cells and smooths the mesh with a 3x3 median */
+  void filterMesh();
+
+  /* background or noise of row 'y' interpolated from the mesh */
+  void interpolate(const float* mesh, int y, float* row) const;
+
+  /* labels the pixels above threshold into detections */
+  void label();
+
+  /* root of the detection a run belongs to */
+  int root(int r);
+
+  /* splits a detection into regions along the levels to its peak */
+  /* Returns the regions, those not split any further being seeds */
+  int deblend(const Detection* d, Blend* b);
+
+  /* flood fills the pixels of region 'r' above 't' from pixel 'p' */
+  /* moving them to region 'to' if not -1. Returns their flux */
+  double fill(Blend* b, int bw, int bh, int p, int r, float t, int to);
+
+  /* deblends and measures a detection */
+  void measure(const Detection* d, Blend* b, Output* o);
+
+  /* appends a source to a job output */
+  static void add(Output* o, const Source* s);
+
+  /* qsort() order of sources */
+  static int byFlux(const void* a, const void* b);
+};
+
+#endif
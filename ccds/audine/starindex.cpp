@@ -0,0 +1,558 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "starindex.h"
+
+#define BANDS   (180 / StarIndex::CELL)
+#define ALIGN(n) (((n) + 7) & ~static_cast<size_t>(7))
+#define DEG     (M_PI / 180)
+
+/* a catalog star while building */
+
+struct Entry {
+  int cell;
+  IndexStar s;
+};
+
+/* a quad while building, keyed by its sorted stars */
+
+struct QuadEntry {
+  int cell;
+  int key[4];
+  IndexQuad q;
+};
+
+/*---------------------------------------------------------------------------*/
+
+static int
+byCellMag(const void* a, const void* b)
+{
+  const Entry* ea = static_cast<const Entry*>(a);
+  const Entry* eb = static_cast<const Entry*>(b);
+
+  if(ea->cell != eb->cell)
+    return(ea->cell - eb->cell);
+  return((ea->s.mag < eb->s.mag) ? -1 : (ea->s.mag > eb->s.mag) ? 1 : 0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static int
+byKey(const void* a, const void* b)
+{
+  const QuadEntry* qa = static_cast<const QuadEntry*>(a);
+  const QuadEntry* qb = static_cast<const QuadEntry*>(b);
+
+  for(int i=0; i<4; i++)
+    if(qa->key[i] != qb->key[i])
+      return(qa->key[i] - qb->key[i]);
+  return(0);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static int
+byCell(const void* a, const void* b)
+{
+  return(static_cast<const QuadEntry*>(a)->cell - 
+	 static_cast<const QuadEntry*>(b)->cell);
+}
+
+/*---------------------------------------------------------------------------*/
+
+StarIndex::StarIndex() : mtime(0), map(0), mapSize(0), head(0), bandTab(0),
+    cellTab(0), starTab(0), quadTab(0)
+{
+  path[0] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+StarIndex::~StarIndex()
+{
+  close();
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+StarIndex::bandCells(int b)
+{
+  double lo = -90.0 + b * CELL;
+  double hi = lo + CELL;
+  double d  = (lo < 0 && hi > 0) ? 0 : (fabs(lo) < fabs(hi)) ? fabs(lo) : fabs(hi);
+  int n = static_cast<int>(360.0 / CELL * cos(d * DEG));
+
+  return((n > 0) ? n : 1);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+StarIndex::cellOf(const int* band, double ra, double dec)
+{
+  int b = static_cast<int>(floor((dec / DEG + 90) / CELL));
+  int n, k;
+
+  b = (b < 0) ? 0 : (b >= BANDS) ? BANDS-1 : b;
+  n = band[b+1] - band[b];
+  ra = fmod(ra / DEG, 360.0);
+  k  = static_cast<int>(floor((ra < 0 ? ra + 360 : ra) * n / 360.0));
+  return(band[b] + ((k < 0) ? 0 : (k >= n) ? n-1 : k));
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+StarIndex::cone(const int* band, double ra, double dec, double radius,
+		int* out, int max)
+{
+  double lo = dec - radius, hi = dec + radius, edge, hw;
+  int b1, b2, n, k1, k2, count = 0;
+
+  b1 = static_cast<int>(floor((lo + 90) / CELL));
+  b2 = static_cast<int>(floor((hi + 90) / CELL));
+  b1 = (b1 < 0) ? 0 : b1;
+  b2 = (b2 >= BANDS) ? BANDS-1 : b2;
+  ra = fmod(ra, 360.0);
+  ra = (ra < 0) ? ra + 360 : ra;
+
+  // RA span at the band edge farthest from the equator,
+  // all of it if a pole is in reach
+
+  for(int b=b1; b<=b2; b++) {
+    n    = band[b+1] - band[b];
+    edge = fabs(-90.0 + b*CELL);
+    edge = (fabs(-90.0 + (b+1)*CELL) > edge) ? fabs(-90.0 + (b+1)*CELL) : edge;
+    hw   = (lo <= -90 || hi >= 90 || edge >= 90) ? 360 : radius / cos(edge * DEG);
+    if(hw >= 180) {
+      k1 = 0;
+      k2 = n-1;
+    } else {
+      k1 = static_cast<int>(floor((ra - hw) * n / 360.0));
+      k2 = static_cast<int>(floor((ra + hw) * n / 360.0));
+      if(k2 - k1 + 1 > n)
+	k2 = k1 + n-1;
+    }
+    for(int k=k1; k<=k2 && count < max; k++)
+      out[count++] = band[b] + ((k % n) + n) % n;
+  }
+  return(count);
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+StarIndex::cone(double ra, double dec, double radius, int* out, int max) const
+{
+  return(cone(bandTab, ra, dec, radius, out, max));
+}
+
+/*---------------------------------------------------------------------------*/
+
+const IndexStar*
+StarIndex::stars(int cell, int l, int* n) const
+{
+  int k = FIRST << l;
+
+  *n = (cellTab[cell].nstars < k) ? cellTab[cell].nstars : k;
+  return(starTab + cellTab[cell].star);
+}
+
+/*---------------------------------------------------------------------------*/
+
+const IndexQuad*
+StarIndex::quads(int cell, int l, int* n) const
+{
+  *n = cellTab[cell].nquads[l];
+  return(quadTab + cellTab[cell].quad[l]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+double
+StarIndex::code(const double* x, const double* y, int order[4], float code[5])
+{
+  double sum[4] = { 0, 0, 0, 0 };
+  double dist[6], d;
+  int i, j, k, t;
+
+  for(i=k=0; i<4; i++)
+    for(j=i+1; j<4; j++) {
+      d = hypot(x[i] - x[j], y[i] - y[j]);
+      dist[k++] = d;
+      sum[i] += d;
+      sum[j] += d;
+    }
+
+  for(i=0; i<4; i++)
+    order[i] = i;
+  for(i=1; i<4; i++)
+    for(j=i; j>0 && sum[order[j]] > sum[order[j-1]]; j--) {
+      t = order[j];
+      order[j] = order[j-1];
+      order[j-1] = t;
+    }
+  for(i=1; i<6; i++)
+    for(j=i; j>0 && dist[j] > dist[j-1]; j--) {
+      d = dist[j];
+      dist[j] = dist[j-1];
+      dist[j-1] = d;
+    }
+
+  for(i=0; i<5; i++)
+    code[i] = (dist[0] > 0) ? dist[i+1] / dist[0] : 0;
+  return(dist[0]);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+StarIndex::project(double ra0, double dec0, double ra, double dec,
+		   double* xi, double* eta)
+{
+  double c = sin(dec0) * sin(dec) + cos(dec0) * cos(dec) * cos(ra - ra0);
+
+  *xi  = cos(dec) * sin(ra - ra0) / c;
+  *eta = (cos(dec0) * sin(dec) - sin(dec0) * cos(dec) * cos(ra - ra0)) / c;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+StarIndex::deproject(double ra0, double dec0, double xi, double eta,
+		     double* ra, double* dec)
+{
+  double rho = hypot(xi, eta);
+  double c   = atan(rho);
+
+  if(rho == 0) {
+    *ra  = ra0;
+    *dec = dec0;
+    return;
+  }
+  *dec = asin(cos(c) * sin(dec0) + eta * sin(c) * cos(dec0) / rho);
+  *ra  = ra0 + atan2(xi * sin(c), rho * cos(dec0) * cos(c) - eta * sin(dec0) * sin(c));
+  *ra  = fmod(*ra, 2*M_PI);
+  *ra  = (*ra < 0) ? *ra + 2*M_PI : *ra;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+StarIndex::open(const char* file)
+{
+  const unsigned char* p;
+  struct stat st;
+  size_t need;
+  int fd;
+
+  // mapped again only when it changes
+
+  if(stat(file, &st) == -1) {
+    close();
+    return(false);
+  }
+  if(map && !strcmp(file, path) && st.st_mtime == mtime)
+    return(true);
+  close();
+
+  fd = ::open(file, O_RDONLY);
+  if(fd == -1)
+    return(false);
+  map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(map == MAP_FAILED) {
+    map = 0;
+    return(false);
+  }
+  mapSize = st.st_size;
+
+  p    = static_cast<const unsigned char*>(map);
+  head = reinterpret_cast<const Header*>(p);
+  need = ALIGN(sizeof(Header));
+  if(mapSize < need || memcmp(head->magic, "AUDSTAR1", 8) || head->bands != BANDS ||
+     head->levels < 1 || head->levels > LEVELS) {
+    close();
+    return(false);
+  }
+  bandTab = reinterpret_cast<const int*>(p + need);
+  need    = ALIGN(need + (head->bands + 1) * sizeof(int));
+  cellTab = reinterpret_cast<const Cell*>(p + need);
+  need    = ALIGN(need + head->cells * sizeof(Cell));
+  starTab = reinterpret_cast<const IndexStar*>(p + need);
+  need    = ALIGN(need + head->stars * sizeof(IndexStar));
+  quadTab = reinterpret_cast<const IndexQuad*>(p + need);
+  need    = need + head->quads * sizeof(IndexQuad);
+  if(mapSize < need) {
+    close();
+    return(false);
+  }
+
+  strncpy(path, file, sizeof(path) - 1);
+  path[sizeof(path) - 1] = 0;
+  mtime = st.st_mtime;
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+StarIndex::close()
+{
+  if(map)
+    munmap(map, mapSize);
+  map  = 0;
+  head = 0;
+  path[0] = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+int
+StarIndex::build(const char* catalog, const char* file, int* nstars,
+		 int* nquads, int* nlevels)
+{
+  char line[512], tmp[512];
+  int band[BANDS+1];
+  Entry* entries = 0;
+  Entry* more;
+  Cell* cells;
+  IndexStar* st;
+  QuadEntry* qe = 0;
+  double* unit;
+  double ra, dec, mag, x[4], y[4], best[3], dot, r;
+  int ncells, n, max = 0, kept, level, total, prevTotal, nq, maxq, res = 0;
+  int near[3], order[4], id[4], within[256], nwithin, t;
+  Header head;
+  FILE* f;
+
+  memset(&head, 0, sizeof(head));
+  for(int b=band[0]=0; b<BANDS; b++)
+    band[b+1] = band[b] + bandCells(b);
+  ncells = band[BANDS];
+
+  // stars, in cells and by brightness
+
+  f = fopen(catalog, "r");
+  if(f == 0)
+    return(errno);
+  for(n=0; fgets(line, sizeof(line), f); ) {
+    for(char* c=line; *c; c++)
+      if(*c == ',' || *c == ';')
+	*c = ' ';
+    if(line[0] == '#' || sscanf(line, "%lf %lf %lf", &ra, &dec, &mag) != 3 ||
+       dec < -90 || dec > 90)
+      continue;
+    if(n == max) {
+      max  = max ? 2*max : 65536;
+      more = new Entry[max];
+      memcpy(more, entries, n * sizeof(Entry));
+      delete [] entries;
+      entries = more;
+    }
+    entries[n].s.ra  = fmod(ra, 360.0) * DEG;
+    entries[n].s.ra += (entries[n].s.ra < 0) ? 2*M_PI : 0;
+    entries[n].s.dec = dec * DEG;
+    entries[n].s.mag = mag;
+    entries[n].s.pad = 0;
+    entries[n].cell  = cellOf(band, entries[n].s.ra, entries[n].s.dec);
+    n++;
+  }
+  fclose(f);
+  if(n < 4) {
+    delete [] entries;
+    return(EINVAL);
+  }
+  qsort(entries, n, sizeof(Entry), byCellMag);
+
+  // the brightest MAXSTARS of each cell
+
+  cells = new Cell[ncells];
+  memset(cells, 0, ncells * sizeof(Cell));
+  for(int i=kept=0; i<n; i++) {
+    Cell* c = &cells[entries[i].cell];
+    if(c->nstars == 0)
+      c->star = kept;
+    if(c->nstars == MAXSTARS)
+      continue;
+    c->nstars++;
+    entries[kept++] = entries[i];
+  }
+  st   = new IndexStar[kept];
+  unit = new double[3*kept];
+  for(int i=0; i<kept; i++) {
+    st[i] = entries[i].s;
+    unit[3*i]   = cos(st[i].dec) * cos(st[i].ra);
+    unit[3*i+1] = cos(st[i].dec) * sin(st[i].ra);
+    unit[3*i+2] = sin(st[i].dec);
+  }
+  delete [] entries;
+
+  // levels as long as they get deeper
+
+  for(level=prevTotal=0; level<LEVELS; level++) {
+    for(int c=total=0; c<ncells; c++)
+      total += (cells[c].nstars < (FIRST << level)) ? cells[c].nstars : FIRST << level;
+    if(level > 0 && total < prevTotal + prevTotal/4)
+      break;
+    prevTotal = total;
+  }
+  head.levels = level;
+
+  // every star of a level and its three nearest neighbours of the same
+  // level, found within a radius that shrinks as the level deepens
+
+  nq = maxq = 0;
+  for(int l=0; l<head.levels; l++) {
+    int first = nq, k = FIRST << l;
+
+    r = 2.0 * CELL / sqrt(static_cast<double>(1 << l));
+    for(int c=0; c<ncells; c++)
+      for(int i=cells[c].star; i<cells[c].star + cells[c].nstars && i-cells[c].star<k; i++) {
+	best[0] = best[1] = best[2] = -2;
+	nwithin = cone(band, st[i].ra / DEG, st[i].dec / DEG, r, within, 256);
+	for(int j=0; j<nwithin; j++) {
+	  const Cell* o = &cells[within[j]];
+	  for(int s=o->star; s<o->star + o->nstars && s-o->star<k; s++) {
+	    if(s == i)
+	      continue;
+	    dot = unit[3*i]*unit[3*s] + unit[3*i+1]*unit[3*s+1] + unit[3*i+2]*unit[3*s+2];
+	    if(dot <= best[2])
+	      continue;
+	    for(t=2; t>0 && dot > best[t-1]; t--) {
+	      best[t] = best[t-1];
+	      near[t] = near[t-1];
+	    }
+	    best[t] = dot;
+	    near[t] = s;
+	  }
+	}
+
+	// all the stars within the radius were seen, else the
+	// neighbours may not be the nearest ones
+
+	if(best[2] < cos(r * DEG))
+	  continue;
+
+	id[0] = i;
+	id[1] = near[0];
+	id[2] = near[1];
+	id[3] = near[2];
+	for(int j=0; j<4; j++)
+	  project(st[i].ra, st[i].dec, st[id[j]].ra, st[id[j]].dec, &x[j], &y[j]);
+
+	if(nq == maxq) {
+	  maxq = maxq ? 2*maxq : 65536;
+	  QuadEntry* grown = new QuadEntry[maxq];
+	  memcpy(grown, qe, nq * sizeof(QuadEntry));
+	  delete [] qe;
+	  qe = grown;
+	}
+	QuadEntry* q = &qe[nq++];
+	q->q.size = code(x, y, order, q->q.code);
+	for(int j=0; j<4; j++) {
+	  q->q.star[j] = id[order[j]];
+	  q->key[j] = id[j];
+	}
+	for(int a=1; a<4; a++)	// sorted stars, to find duplicates
+	  for(int b=a; b>0 && q->key[b] < q->key[b-1]; b--) {
+	    t = q->key[b];
+	    q->key[b] = q->key[b-1];
+	    q->key[b-1] = t;
+	  }
+	q->cell = cellOf(band, st[q->key[0]].ra, st[q->key[0]].dec);
+      }
+
+    // one of each, then by cell
+
+    qsort(qe + first, nq - first, sizeof(QuadEntry), byKey);
+    for(int i=n=first; i<nq; i++)
+      if(i == first || byKey(&qe[i], &qe[n-1]))
+	qe[n++] = qe[i];
+    nq = n;
+    qsort(qe + first, nq - first, sizeof(QuadEntry), byCell);
+    for(int c=0, i=first; c<ncells; c++) {
+      cells[c].quad[l] = i;
+      while(i < nq && qe[i].cell == c)
+	i++;
+      cells[c].nquads[l] = i - cells[c].quad[l];
+    }
+  }
+
+  // into a temporary file, renamed once complete
+
+  memcpy(head.magic, "AUDSTAR1", 8);
+  head.bands = BANDS;
+  head.cells = ncells;
+  head.stars = kept;
+  head.quads = nq;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  f = fopen(tmp, "wb");
+  if(f == 0)
+    res = errno;
+  else {
+    size_t off = 0;
+    const char zeros[8] = { 0 };
+    struct { const void* p; size_t len; } part[4] = {
+      { &head, sizeof(head) },
+      { band, sizeof(band) },
+      { cells, ncells * sizeof(Cell) },
+      { st, kept * sizeof(IndexStar) },
+    };
+    for(int i=0; i<4; i++) {
+      fwrite(part[i].p, part[i].len, 1, f);
+      off += part[i].len;
+      fwrite(zeros, ALIGN(off) - off, 1, f);
+      off = ALIGN(off);
+    }
+    for(int i=0; i<nq; i++)
+      fwrite(&qe[i].q, sizeof(IndexQuad), 1, f);
+    if(ferror(f))
+      res = EIO;
+    if(fclose(f) != 0 && res == 0)
+      res = errno;
+    if(res == 0 && rename(tmp, file) == -1)
+      res = errno;
+    if(res != 0)
+      unlink(tmp);
+  }
+
+  *nstars  = kept;
+  *nquads  = nq;
+  *nlevels = head.levels;
+  delete [] qe;
+  delete [] unit;
+  delete [] st;
+  delete [] cells;
+  return(res);
+}
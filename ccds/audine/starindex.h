@@ -0,0 +1,155 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_STARINDEX_H
+#define AUDINE_STARINDEX_H
+
+#include <sys/types.h>
+#include <time.h>
+
+/* a catalog star */
+
+struct IndexStar {
+  double ra;			/* J2000 [rad] */
+  double dec;
+  float mag;
+  int pad;
+};
+
+/* four nearby stars and their shape, in canonical order */
+
+struct IndexQuad {
+  int star[4];			/* stars of the index */
+  float code[5];		/* sorted distances over the largest one */
+  float size;			/* largest distance [rad] */
+};
+
+/*
+ * Star index for plate solving, built once from a local catalog file
+ * and memory mapped read only by the driver.
+ * The sky is cut into cells about CELL degrees wide, along declination
+ * bands, each keeping its brightest stars. Levels of increasing depth
+ * take the 8, 16, 32 ... brightest stars of every cell, and every star
+ * of a level makes a quad with its three nearest neighbours of the same
+ * level. A quad is coded by its six distances, sorted and divided by the
+ * largest one: the code does not change with position, scale, rotation
+ * or mirroring, so that the brightest stars of an image coded the same
+ * way find their quads whatever the camera orientation, once the level
+ * of a similar depth is chosen.
+ * The file holds host order binary data and is not portable across
+ * architectures.
+ */
+
+class StarIndex {
+
+ public:
+
+  static const int CELL = 1;	/* cell size [deg] */
+  static const int LEVELS = 8;	/* at most */
+  static const int FIRST  = 8;	/* stars per cell at level 0 */
+  static const int MAXSTARS = FIRST << (LEVELS-1); /* per cell */
+
+  StarIndex();
+ ~StarIndex();
+
+  /* builds an index from a text catalog, one 'ra dec mag' star per */
+  /* line in degrees. Returns 0 or an errno value, and the number of */
+  /* stars, quads and levels in the index */
+  static int build(const char* catalog, const char* path, int* stars,
+		   int* quads, int* levels);
+
+  /* maps an index file, unless already mapped and not changed since */
+  bool open(const char* path);
+
+  /* unmaps it */
+  void close();
+
+  /* cells within 'radius' of a position, all in degrees. Returns */
+  /* how many went to 'out', at most 'max' */
+  int cone(double ra, double dec, double radius, int* out, int max) const;
+
+  /* levels in the index */
+  int levels() const { return(head->levels); }
+
+  /* stars of level 'l' in a cell, brightest first */
+  const IndexStar* stars(int cell, int l, int* n) const;
+
+  /* quads of level 'l' homed in a cell */
+  const IndexQuad* quads(int cell, int l, int* n) const;
+
+  /* star by number */
+  const IndexStar* star(int i) const { return(&starTab[i]); }
+
+  /* codes the quad of four points and sorts 'order' canonically, */
+  /* by decreasing distance sum to the other three. Returns its size */
+  static double code(const double* x, const double* y, int order[4],
+		     float code[5]);
+
+  /* gnomonic projection about (ra0, dec0), in radians */
+  static void project(double ra0, double dec0, double ra, double dec,
+		      double* xi, double* eta);
+
+  /* and the reverse */
+  static void deproject(double ra0, double dec0, double xi, double eta,
+			double* ra, double* dec);
+
+ private:
+
+  struct Header {
+    char magic[8];		/* "AUDSTAR1" */
+    int bands;			/* declination bands */
+    int cells;
+    int stars;
+    int quads;
+    int levels;
+    int pad;
+  };
+
+  struct Cell {
+    int star;			/* its first star */
+    int nstars;
+    int quad[LEVELS];		/* its first quad of each level */
+    int nquads[LEVELS];
+  };
+
+  char path[256];		/* file mapped */
+  time_t mtime;			/* its modification time */
+  void* map;
+  size_t mapSize;
+  const Header* head;
+  const int* bandTab;		/* first cell of each band, then end */
+  const Cell* cellTab;
+  const IndexStar* starTab;
+  const IndexQuad* quadTab;
+
+  /* cells of declination band 'b' */
+  static int bandCells(int b);
+
+  /* cell of a position in radians */
+  static int cellOf(const int* band, double ra, double dec);
+
+  /* cells within 'radius' of a position, all in degrees */
+  static int cone(const int* band, double ra, double dec, double radius,
+		  int* out, int max);
+};
+
+#endif
@@ -309,6 +309,7 @@ AudineOk::exposure(Audine* ccd, SwitchPropertyVector* pv,
     ccd->imgseq.startFromWait();
     nextState(ccd, AudineWait::instance());
   } else {
+    ccd->storage.next();
     ccd->imgseq.startFromExp();
     nextState(ccd, AudineExp::instance());
   }  
@@ -316,6 +317,21 @@ AudineOk::exposure(Audine* ccd, SwitchPropertyVector* pv,
 
 /*---------------------------------------------------------------------------*/
 
+void
+AudineOk::tick(Audine* ccd)
+{
+  // only ticking while the storage writer has pending work
+
+  ccd->storage.poll();
+  ccd->storage.updateQueue();
+  if(!ccd->storage.busy()) {
+    ccd->storage.poll();	// last files closed
+    ccd->imgseq.stopTickTimer();
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
 void
 AudineOk::update(Audine* ccd, PropertyVector* pvorig, ITopic t)
 {
@@ -355,6 +371,34 @@ AudineOk::update(Audine* ccd, PropertyVector* pvorig, ITopic t)
     ccd->storage.updateFlip(name, swit);
   else if(pv->equals("STORAGE_SERIES"))
     ccd->storage.updateSeries(name, swit);
+  else if(pv->equals("FOCUS_MODE"))
+    ccd->storage.updateFocusMode(name, swit);
+  else if(pv->equals("STORAGE_SEQUENCE"))
+    ccd->storage.updateSequence(name, swit);
+  else if(pv->equals("FRAME_BLOB"))
+    ccd->storage.updateFrameBlob(name, swit);
+  else if(pv->equals("CALIBRATION"))
+    ccd->storage.updateCalibration(name, swit);
+  else if(pv->equals("CALIB_RAW"))
+    ccd->storage.updateCalibRaw(name, swit);
+  else if(pv->equals("DEFECTS"))
+    ccd->storage.updateDefects(name, swit);
+  else if(pv->equals("COSMIC"))
+    ccd->storage.updateCosmic(name, swit);
+  else if(pv->equals("CATALOG"))
+    ccd->storage.updateCatalog(name, swit);
+  else if(pv->equals("SOLVER"))
+    ccd->storage.updateSolver(name, swit);
+  else if(pv->equals("PHOTOMETRY"))
+    ccd->storage.updatePhotometry(name, swit);
+  else if(pv->equals("LIVE_STACK"))
+    ccd->storage.updateLiveStack(name, swit);
+  else if(pv->equals("DIFFERENCE"))
+    ccd->storage.updateDifference(name, swit);
+  else if(pv->equals("COMBINE"))
+    ccd->storage.updateCombine(name, swit);
+  else if(pv->equals("OVERSCAN"))
+    ccd->storage.updateOverscan(name, swit);
   else {
     forbidden(pv);
   }
@@ -382,6 +426,28 @@ AudineOk::update(Audine* ccd, NumberPropertyVector* pv,
     ccd->shutter.updateDelay(name, number, n);
   else if(pv->equals("FOCUS_BUFFER"))
     ccd->storage.update(name, number, n);
+  else if(pv->equals("FOCUS_PERSIST"))
+    ccd->storage.persist(name, number, n);
+  else if(pv->equals("PREVIEW_SETTINGS"))
+    ccd->storage.updatePreview(name, number, n);
+  else if(pv->equals("FOCUS_ROI"))
+    ccd->storage.updateFocusROI(name, number, n);
+  else if(pv->equals("COSMIC_PARS"))
+    ccd->storage.updateCosmicPars(name, number, n);
+  else if(pv->equals("CATALOG_PARS"))
+    ccd->storage.updateCatalogPars(name, number, n);
+  else if(pv->equals("SOLVER_PARS"))
+    ccd->storage.updateSolverPars(name, number, n);
+  else if(pv->equals("APER_PARS"))
+    ccd->storage.updatePhotPars(name, number, n);
+  else if(pv->equals("LIVE_STACK_PARS"))
+    ccd->storage.updateLiveStackPars(name, number, n);
+  else if(pv->equals("DIFF_PARS"))
+    ccd->storage.updateDiffPars(name, number, n);
+  else if(pv->equals("COMBINE_PARS"))
+    ccd->storage.updateCombinePars(name, number, n);
+  else if(pv->equals("SOFT_BINNING"))
+    ccd->storage.updateSoftBinning(name, number, n);
   else {
     forbidden(pv);
   }
@@ -397,6 +463,12 @@ AudineOk::update(Audine* ccd, TextPropertyVector* pv,
     ccd->updateFITSTextData(name, text, n);
   else if(pv->equals("STORAGE"))
     ccd->storage.update(name, text, n);
+  else if(pv->equals("CALIB_DIR"))
+    ccd->storage.updateCalibDir(name, text, n);
+  else if(pv->equals("SOLVER_INDEX"))
+    ccd->storage.updateSolverIndex(name, text, n);
+  else if(pv->equals("PHOT_TARGETS"))
+    ccd->storage.updatePhotTargets(name, text, n);
   else {
     forbidden(pv);
   }
@@ -462,6 +534,8 @@ AudineWait::tick(Audine* ccd)
 {
   log->verbose(IFUN,"\n");
   ccd->imgseq.decDelay();
+  ccd->storage.poll();
+  ccd->storage.updateQueue();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -469,7 +543,13 @@ AudineWait::tick(Audine* ccd)
 void
 AudineWait::timeout(Audine* ccd)
 {
+  if(ccd->storage.congested()) { // still waiting for the disk writer
+    ccd->imgseq.holdOff();
+    return;
+  }
+
   ccd->imgseq.stopTickTimer();
+  ccd->storage.next();
   ccd->imgseq.restartFromExp();
   nextState(ccd, AudineExp::instance());
 
@@ -535,6 +615,7 @@ AudineExp::tick(Audine* ccd)
 {
   log->verbose(IFUN,"\n");
   ccd->imgseq.decExptime();
+  ccd->storage.poll();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -613,14 +694,27 @@ AudineRead::handle(Audine* ccd, unsigned int event, const void* data, int len)
     ccd->device->formatMsg("Quedan %d imagenes",imageCount);
     ccd->device->indiMessage();
       
+    // the next image starts with its exposure, its header is taken
+    // then, after any delay, not now
+
     if(imageCount > 0 && waitNeeded) {  
 
-      ccd->storage.next();      
+      ccd->storage.end(false);      
       ccd->imgseq.restartFromWait();
       nextState(ccd, AudineWait::instance());
 
+    } else if(imageCount > 0 && ccd->storage.congested()) {
+
+      // the disk writer is lagging behind.
+      // delay next exposure instead of losing data
+
+      ccd->storage.end(false);      
+      ccd->imgseq.holdOff();
+      nextState(ccd, AudineWait::instance());
+
     } else if(imageCount > 0 && !waitNeeded) {
       
+      ccd->storage.end(false);      
       ccd->storage.next();      
       ccd->imgseq.restartFromExp();
       nextState(ccd, AudineExp::instance());
@@ -628,6 +722,8 @@ AudineRead::handle(Audine* ccd, unsigned int event, const void* data, int len)
     }  else {			// no more images
 
       ccd->storage.end();      
+      if(ccd->storage.busy())
+	ccd->imgseq.startPolling(); // until the writer finishes
       nextState(ccd, AudineOk::instance());
 
     } 
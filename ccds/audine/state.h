@@ -235,8 +235,9 @@ class AudineOk : public AudineState {
   /* timeout events */
   /******************/
 
+  virtual void tick(Audine* ccd);		/* storage writer polling */
+
 #if 0  
-  virtual void tick(Audine* ccd);		
   virtual void timeout(Audine* ccd);	
 #endif
 
@@ -0,0 +1,130 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <string.h>
+#include <math.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "stats.h"
+
+#define OFFSET 32768		/* pixel value of bin 0 */
+
+/* histogram bin of a pixel */
+#define BIN(p) (STATIC_CAST(unsigned short, p) ^ 0x8000)
+
+/*---------------------------------------------------------------------------*/
+
+FrameStats::FrameStats()
+{
+  even = new unsigned int[2*BINS];
+  odd  = even + BINS;
+  reset();
+}
+
+/*---------------------------------------------------------------------------*/
+
+FrameStats::~FrameStats()
+{
+  delete [] even;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameStats::reset()
+{
+  memset(even, 0, 2 * BINS * sizeof(unsigned int));
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameStats::add(const pixel_t* src, int n)
+{
+  int i;
+
+  for(i=0; i+1<n; i+=2) {
+    even[BIN(src[i])]++;
+    odd[BIN(src[i+1])]++;
+  }
+  if(i < n)
+    even[BIN(src[i])]++;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+FrameStats::finish(FrameStatistics* res)
+{
+  long long sum = 0, sum2 = 0;
+  unsigned int count, n = 0;
+  unsigned int half, acc;
+  double var;
+  int v, lo = -1, hi = -1;
+
+  memset(res, 0, sizeof(*res));
+
+  // merges both histograms and takes the moments
+
+  for(v=0; v<BINS; v++) {
+    count = even[v] + odd[v];
+    even[v] = count;
+    if(count == 0)
+      continue;
+    if(lo == -1)
+      lo = v;
+    hi    = v;
+    n    += count;
+    sum  += STATIC_CAST(long long, count) * (v - OFFSET);
+    sum2 += STATIC_CAST(long long, count) * (v - OFFSET) * (v - OFFSET);
+  }
+
+  if(n == 0)
+    return;
+
+  res->pixels    = n;
+  res->min       = lo - OFFSET;
+  res->max       = hi - OFFSET;
+  res->saturated = even[SATURATION + OFFSET];
+  res->mean      = STATIC_CAST(double, sum) / n;
+  var            = STATIC_CAST(double, sum2) / n - res->mean * res->mean;
+  res->sigma     = (var > 0) ? sqrt(var) : 0;
+
+  // median: the middle value, or the mean of both middle values
+
+  half = (n - 1) / 2;
+  for(v=lo, acc=0; acc + even[v] <= half; v++)
+    acc += even[v];
+  res->median = v - OFFSET;
+
+  if(n % 2 == 0) {
+    if(acc + even[v] == half + 1)	// next value is in another bin
+      for(v++; even[v] == 0; v++)
+	;
+    res->median = (res->median + v - OFFSET) / 2.0;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
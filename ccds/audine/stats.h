@@ -0,0 +1,74 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_STATS_H
+#define AUDINE_STATS_H
+
+/* statistics of a complete frame, in ADU */
+
+struct FrameStatistics {
+  int pixels;			/* pixels received */
+  int min;			/* minimun value */
+  int max;			/* maximun value */
+  double mean;			/* mean value */
+  double sigma;			/* standard deviation */
+  double median;		/* exact median */
+  int saturated;		/* pixels at full scale */
+};
+
+
+/*
+ * Accumulates a 65536 bin histogram as image chunks arrive,
+ * the signed pixel value offset by 32768 being the bin index.
+ * Everything else (min, max, moments, median) is derived exactly 
+ * from the histogram once per frame, so the per pixel cost is 
+ * a single counter increment. Even and odd pixels go to separate
+ * histograms so that runs of equal values, typical of the sky
+ * background, do not serialize on the same counter.
+ */
+
+class FrameStats {
+
+ public:
+
+  static const int BINS = 65536;
+  static const int SATURATION = 32767; /* ADC full scale */
+
+  FrameStats();
+ ~FrameStats();
+
+  /* clears the histogram for a new frame */
+  void reset();
+
+  /* accounts 'n' pixels */
+  void add(const pixel_t* src, int n);
+
+  /* computes the frame statistics */
+  void finish(FrameStatistics* res);
+
+ private:
+
+  unsigned int* even;		/* histogram of even pixels */
+  unsigned int* odd;		/* histogram of odd pixels */
+};
+
+#endif
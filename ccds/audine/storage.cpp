@@ -22,17 +22,21 @@
 
 #include <errno.h>
 #include <string.h> 
+#include <strings.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <math.h>
+#include <time.h>
 
 #ifndef AUDINE_H
 #include "audine.h"
 #endif
 
+#include "base64.h"
 #include "perscount.h"
+#include "pixkern.h"
 
 /*---------------------------------------------------------------------------*/
 
@@ -56,10 +60,30 @@ replaceSpaces(const char* src, char* dest, int len)
 
 /*---------------------------------------------------------------------------*/
 
-Storage::Storage(Audine* ccd) : log(0), fp(0), imageSize(0), byteCount(0), 
-    recvByteCount(0), audine(ccd), error(false), fileCount(0), series() 
+static double
+monotonic()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*---------------------------------------------------------------------------*/
+
+Storage::Storage(Audine* ccd) : log(0), imageSize(0), audine(ccd),
+    error(false), fileCount(0), mefSeq(false), frameIndex(0), previewSize(0), previewPeriod(0),
+    lastPreview(0), blobMode(BLOB_NONE), calibMode(CALIB_NONE), keepRaw(false),
+    repairDefects(false), cosmicMode(COSMIC_NONE), catalogMode(CATALOG_NONE),
+    plateSolve(false), photMode(PHOT_NONE), photCount(0), liveStack(false),
+    diffMode(DIFF_NONE),
+    combineMethod(COMBINE_NONE), stack(false), stackPending(false),
+    overscan(OVERSCAN_NONE), biasCount(0),
+    frameHead(0), sentDepth(-1), sentHigh(-1), sentDrops(-1), dropping(false),
+    series() 
 {
   log = LogFactory::instance()->forClass("Storage");
+  stackJob.nfiles = 0;
 }
 
 /*---------------------------------------------------------------------------*/
@@ -88,10 +112,144 @@ Storage::init()
   storageFlip  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("STORAGE_FLIP"));
   assert(storageFlip != NULL);
 
+  storageQueue  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("STORAGE_QUEUE"));
+  assert(storageQueue != NULL);
+  storageQueue->setValue("CAPACITY", DiskWriter::SLOTS);
+
+  frameStats  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("FRAME_STATS"));
+  assert(frameStats != NULL);
+
+  focusMode  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("FOCUS_MODE"));
+  assert(focusMode != NULL);
+
+  focusPersist  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("FOCUS_PERSIST"));
+  assert(focusPersist != NULL);
+
+  storageSequence  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("STORAGE_SEQUENCE"));
+  assert(storageSequence != NULL);
+
+  previewSettings  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("PREVIEW_SETTINGS"));
+  assert(previewSettings != NULL);
+
+  previewBlob  = DYNAMIC_CAST(BLOBPropertyVector*, audine->device->find("PREVIEW"));
+  assert(previewBlob != NULL);
+
+  frameBlobMode  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("FRAME_BLOB"));
+  assert(frameBlobMode != NULL);
+
+  frameBlob  = DYNAMIC_CAST(BLOBPropertyVector*, audine->device->find("FRAME"));
+  assert(frameBlob != NULL);
+
+  focusROI  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("FOCUS_ROI"));
+  assert(focusROI != NULL);
+
+  focusMetrics  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("FOCUS_METRICS"));
+  assert(focusMetrics != NULL);
+
+  calibration  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("CALIBRATION"));
+  assert(calibration != NULL);
+
+  calibRaw  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("CALIB_RAW"));
+  assert(calibRaw != NULL);
+
+  calibDir  = DYNAMIC_CAST(TextPropertyVector*, audine->device->find("CALIB_DIR"));
+  assert(calibDir != NULL);
+
+  defects  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("DEFECTS"));
+  assert(defects != NULL);
+
+  cosmic  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("COSMIC"));
+  assert(cosmic != NULL);
+
+  cosmicPars  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("COSMIC_PARS"));
+  assert(cosmicPars != NULL);
+
+  catalog  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("CATALOG"));
+  assert(catalog != NULL);
+
+  catalogPars  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("CATALOG_PARS"));
+  assert(catalogPars != NULL);
+
+  solver  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("SOLVER"));
+  assert(solver != NULL);
+
+  solverIndex  = DYNAMIC_CAST(TextPropertyVector*, audine->device->find("SOLVER_INDEX"));
+  assert(solverIndex != NULL);
+
+  solverPars  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("SOLVER_PARS"));
+  assert(solverPars != NULL);
+
+  solverResult  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("SOLVER_RESULT"));
+  assert(solverResult != NULL);
+
+  photometry  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("PHOTOMETRY"));
+  assert(photometry != NULL);
+
+  photTargets  = DYNAMIC_CAST(TextPropertyVector*, audine->device->find("PHOT_TARGETS"));
+  assert(photTargets != NULL);
+
+  photPars  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("APER_PARS"));
+  assert(photPars != NULL);
+
+  photResult  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("PHOT_RESULT"));
+  assert(photResult != NULL);
+
+  liveStackMode  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("LIVE_STACK"));
+  assert(liveStackMode != NULL);
+
+  liveStackPars  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("LIVE_STACK_PARS"));
+  assert(liveStackPars != NULL);
+
+  liveStackResult  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("LIVE_STACK_RESULT"));
+  assert(liveStackResult != NULL);
+
+  difference  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("DIFFERENCE"));
+  assert(difference != NULL);
+
+  diffPars  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("DIFF_PARS"));
+  assert(diffPars != NULL);
+
+  diffResult  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("DIFF_RESULT"));
+  assert(diffResult != NULL);
+
+  combineMode  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("COMBINE"));
+  assert(combineMode != NULL);
+
+  combinePars  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("COMBINE_PARS"));
+  assert(combinePars != NULL);
+
+  overscanMode  = DYNAMIC_CAST(SwitchPropertyVector*, audine->device->find("OVERSCAN"));
+  assert(overscanMode != NULL);
+
+  biasTelemetry  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("BIAS_TELEMETRY"));
+  assert(biasTelemetry != NULL);
+
+  softBinning  = DYNAMIC_CAST(NumberPropertyVector*, audine->device->find("SOFT_BINNING"));
+  assert(softBinning != NULL);
+
   prefix  = storage->getValue("PREFIX");
+  rice    = !strcasecmp(storage->getValue("COMPRESS"), "RICE");
   flipUD  = storageFlip->getValue("FLIP_UP_DOWN");
   flipLR  = storageFlip->getValue("FLIP_LEFT_RIGHT");
+  shmFocus = focusMode->getValue("SHARED_MEMORY");
+  mef     = storageSequence->getValue("EXTENSIONS");
   N       = STATIC_CAST(int,focusBuffer->getValue("SIZE"));
+  previewSize   = STATIC_CAST(int, previewSettings->getValue("SIZE"));
+  previewPeriod = previewSettings->getValue("PERIOD");
+  updateFrameBlob(0, ISS_OFF);	// just caches the mode
+  updateCalibration(0, ISS_OFF);
+  keepRaw = calibRaw->getValue("KEEP");
+  repairDefects = defects->getValue("REPAIR");
+  updateCosmic(0, ISS_OFF);
+  updateCatalog(0, ISS_OFF);
+  updateSolver(0, ISS_OFF);
+  updatePhotometry(0, ISS_OFF);
+  updateLiveStack(0, ISS_OFF);
+  updateDifference(0, ISS_OFF);
+  updateCombine(0, ISS_OFF);
+  updateOverscan(0, ISS_OFF);
+
+  snprintf(ringName, sizeof(ringName), "/%s_focus", audine->device->getName());
 
   createSubdir(getenv("HOME"),"ccd"); // the initial subdirectory created
   calcJD();			// Today's Julian Day
@@ -112,7 +270,17 @@ Storage::init()
   // another way to concat strings ...
   series.init(std::string(storage->getValue("DIR")).append(SERIES_FILE).c_str());
   
- 
+  PixKern::select();		// before the writer thread uses them
+  log->info(IFUN,"using %s pixel kernels\n", PixKern::name());
+  Base64::select();
+  log->info(IFUN,"using %s base64 encoder\n", Base64::name());
+
+  // full frames are too big for the event loop, the writer sends them
+  // through the driver's stdout, as the property layer does
+
+  writer.getBlob()->attach(stdout, audine->device->getName(), frameBlob->getName());
+  writer.start();
+  combiner.start();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -246,6 +414,395 @@ Storage::updateSeries(char* name, ISState swit)
 
 /*---------------------------------------------------------------------------*/
 
+void
+Storage::updateFocusMode(char* name, ISState swit)
+{
+  focusMode->setValue(name, swit);
+  focusMode->indiSetProperty();
+  shmFocus = focusMode->getValue("SHARED_MEMORY");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateSequence(char* name, ISState swit)
+{
+  storageSequence->setValue(name, swit);
+  storageSequence->indiSetProperty();
+  mef = storageSequence->getValue("EXTENSIONS");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateFrameBlob(char* name, ISState swit)
+{
+  if(name) {
+    frameBlobMode->setValue(name, swit);
+    frameBlobMode->indiSetProperty();
+  }
+  if(frameBlobMode->getValue("FITS"))
+    blobMode = BLOB_FITS;
+  else if(frameBlobMode->getValue("FITS_Z"))
+    blobMode = BLOB_FITSZ;
+  else
+    blobMode = BLOB_NONE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateFocusROI(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    focusROI->setValue(name[i], number[i]);
+  focusROI->indiSetProperty();	// taken into account from the next image on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCalibration(char* name, ISState swit)
+{
+  if(name) {
+    calibration->setValue(name, swit);
+    calibration->indiSetProperty();
+  }
+  if(calibration->getValue("FLOAT"))
+    calibMode = CALIB_FLOAT;
+  else if(calibration->getValue("INT16"))
+    calibMode = CALIB_INT16;
+  else
+    calibMode = CALIB_NONE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCalibRaw(char* name, ISState swit)
+{
+  calibRaw->setValue(name, swit);
+  calibRaw->indiSetProperty();
+  keepRaw = calibRaw->getValue("KEEP");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateDefects(char* name, ISState swit)
+{
+  defects->setValue(name, swit);
+  defects->indiSetProperty();
+  repairDefects = defects->getValue("REPAIR");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCosmic(char* name, ISState swit)
+{
+  if(name) {
+    cosmic->setValue(name, swit);
+    cosmic->indiSetProperty();
+  }
+  if(cosmic->getValue("CLEAN"))
+    cosmicMode = COSMIC_CLEAN;
+  else if(cosmic->getValue("MASK"))
+    cosmicMode = COSMIC_MASK;
+  else
+    cosmicMode = COSMIC_NONE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCosmicPars(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    cosmicPars->setValue(name[i], number[i]);
+  cosmicPars->indiSetProperty();	// taken into account from the next image on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCatalog(char* name, ISState swit)
+{
+  if(name) {
+    catalog->setValue(name, swit);
+    catalog->indiSetProperty();
+  }
+  if(catalog->getValue("EXTENSION"))
+    catalogMode = CATALOG_EXTENSION;
+  else if(catalog->getValue("FILE"))
+    catalogMode = CATALOG_FILE;
+  else
+    catalogMode = CATALOG_NONE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCatalogPars(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    catalogPars->setValue(name[i], number[i]);
+  catalogPars->indiSetProperty();	// taken into account from the next image on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateSolver(char* name, ISState swit)
+{
+  if(name) {
+    solver->setValue(name, swit);
+    solver->indiSetProperty();
+  }
+  plateSolve = solver->getValue("SOLVE");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateSolverIndex(char* name[], char* text[], int n)
+{
+  for(int i=0; i<n; i++)
+    if(strlen(text[i]) != 0)	// only deal with non empty new values
+      solverIndex->setValue(name[i], text[i]);
+  solverIndex->indiSetProperty(); // mapped again at the next image
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateSolverPars(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    solverPars->setValue(name[i], number[i]);
+  solverPars->indiSetProperty();	// taken into account from the next image on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updatePhotometry(char* name, ISState swit)
+{
+  if(name) {
+    photometry->setValue(name, swit);
+    photometry->indiSetProperty();
+  }
+  photMode  = (photometry->getValue("LIGHTCURVE")) ? PHOT_LIGHTCURVE : PHOT_NONE;
+  photCount = 0;		// a new rolling window
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updatePhotTargets(char* name[], char* text[], int n)
+{
+  for(int i=0; i<n; i++)
+    if(strlen(text[i]) != 0)	// only deal with non empty new values
+      photTargets->setValue(name[i], text[i]);
+  photTargets->indiSetProperty(); // read again at the next image
+  photCount = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updatePhotPars(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    photPars->setValue(name[i], number[i]);
+  photPars->indiSetProperty();	// taken into account from the next image on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateLiveStack(char* name, ISState swit)
+{
+  if(name) {
+    liveStackMode->setValue(name, swit);
+    liveStackMode->indiSetProperty();
+  }
+  liveStack = liveStackMode->getValue("STACK");
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateLiveStackPars(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    liveStackPars->setValue(name[i], number[i]);
+  liveStackPars->indiSetProperty(); // taken into account from the next sequence on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateDifference(char* name, ISState swit)
+{
+  if(name) {
+    difference->setValue(name, swit);
+    difference->indiSetProperty();
+  }
+  diffMode = (difference->getValue("EVENTS")) ? DIFF_EVENTS : DIFF_NONE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateDiffPars(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    diffPars->setValue(name[i], number[i]);
+  diffPars->indiSetProperty();	// taken into account from the next image on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCalibDir(char* name[], char* text[], int n)
+{
+  for(int i=0; i<n; i++)
+    if(strlen(text[i]) != 0)	// only deal with non empty new values
+      calibDir->setValue(name[i], text[i]);
+  calibDir->indiSetProperty();	// masters are looked for at the next image
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCombine(char* name, ISState swit)
+{
+  if(name) {
+    combineMode->setValue(name, swit);
+    combineMode->indiSetProperty();
+  }
+  if(combineMode->getValue("MEDIAN"))
+    combineMethod = COMBINE_MEDIAN;
+  else if(combineMode->getValue("SIGCLIP"))
+    combineMethod = COMBINE_SIGCLIP;
+  else
+    combineMethod = COMBINE_NONE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCombinePars(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    combinePars->setValue(name[i], number[i]);
+  combinePars->indiSetProperty();	// taken into account from the next sequence on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateOverscan(char* name, ISState swit)
+{
+  if(name) {
+    overscanMode->setValue(name, swit);
+    overscanMode->indiSetProperty();
+  }
+  if(overscanMode->getValue("SUBTRACT"))
+    overscan = OVERSCAN_SUBTRACT;
+  else if(overscanMode->getValue("TRIM"))
+    overscan = OVERSCAN_TRIM;
+  else
+    overscan = OVERSCAN_NONE;
+  biasCount = 0;		// a new telemetry window
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateSoftBinning(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    softBinning->setValue(name[i], number[i]);
+  softBinning->indiSetProperty();	// taken into account from the next image on
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::calibKey(WriterSpec* spec)
+{
+  CalibKey* key = &spec->calibKey;
+
+  // masters are matched in the writer thread, it knows nothing else
+
+  snprintf(spec->calibDir, sizeof(spec->calibDir), "%s", calibDir->getValue("DIR"));
+  memset(key, 0, sizeof(*key));
+  snprintf(key->model, sizeof(key->model), "%s", audine->chip.getModel());
+  key->bin = audine->chip.getBinning();
+  audine->chip.getOrigin(&key->x, &key->y);
+  key->width   = width;
+  key->height  = height;
+  key->exptime = audine->imgseq.getExposure();
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::persist(char* name[], double number[], int n)
+{
+  WriterSlot* slot;
+  WriterSpec* spec;
+  int i;
+
+  assert(n == 1);
+  i = STATIC_CAST(int, number[0]);
+  if(i < 0 || i >= N) {
+    focusPersist->formatMsg("Hueco %d fuera de rango [0,%d]", i, N-1);
+    focusPersist->forceChange();
+    focusPersist->indiSetProperty();
+    return;
+  }
+
+  focusPersist->setValue(name[0], i);
+  focusPersist->indiSetProperty();
+
+  // the writer thread saves the slot and we notify XEphem when done
+
+  spec = new WriterSpec();
+  snprintf(spec->path, sizeof(spec->path), "%s/%s_slot%02d.fit",
+	   dirname, prefix, i);
+  spec->slot = i;
+
+  slot = acquire();
+  if(slot == 0) {
+    delete spec;
+    return;
+  }
+  slot->op   = WR_PERSIST;
+  slot->spec = spec;
+  writer.commit();
+  audine->imgseq.startPolling();	// until the writer is done
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updatePreview(char* name[], double number[], int n)
+{
+  for(int i=0; i<n; i++)
+    previewSettings->setValue(name[i], number[i]);
+  previewSettings->indiSetProperty();
+
+  // taken into account from the next image on
+
+  previewSize   = STATIC_CAST(int, previewSettings->getValue("SIZE"));
+  previewPeriod = previewSettings->getValue("PERIOD");
+}
+
+/*---------------------------------------------------------------------------*/
+
 void
 Storage::update(char* name[], char* text[], int n)
 {
@@ -256,6 +813,10 @@ Storage::update(char* name[], char* text[], int n)
 
       if(!strcmp(name[i], "DIR")) {
 	createSubdir(text[i],"");
+      } else if(!strcmp(name[i], "COMPRESS") && 
+		strcasecmp(text[i], "NONE") && strcasecmp(text[i], "RICE")) {
+	storage->formatMsg("Compresion '%s' desconocida, use NONE o RICE",
+			   text[i]);
       } else {
 	storage->setValue(name[i],text[i]);
       }
@@ -264,6 +825,7 @@ Storage::update(char* name[], char* text[], int n)
 
   storage->indiSetProperty();
   prefix  = storage->getValue("PREFIX");
+  rice    = !strcasecmp(storage->getValue("COMPRESS"), "RICE");
 
 }
 
@@ -300,46 +862,283 @@ Storage::updatePrefix(const char* name)
 void
 Storage::cancel()
 {
-  int res;
+  WriterSlot* slot;
 
-  if(fp != NULL) {
-    fclose(fp);
-    res = unlink(curFile);		// borra el fichero
-    assert(res == 0);
+  // the writer closes and deletes the file being written, if any
+
+  slot = acquire();
+  if(slot != 0) {
+    slot->op = WR_CANCEL;
+    writer.commit();
   }
-  fp = NULL;
+
+  stack = false;		// an incomplete sequence is not combined
+
+  delete frameHead;
+  frameHead = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Storage::rebinGeom(WriterSpec* spec)
+{
+  RebinGeom* g = &spec->rebinGeom;
+  OverscanGeom ov;
+  bool hasOverscan;
+  int x1, y1, x2, y2, rx, ry, rw, rh, ox, oy;
+
+  // the window is the whole frame or its active area if trimmed,
+  // cropped to the region of interest, in pixels of the frame as read
+
+  hasOverscan = audine->chip.getOverscan(&ov);
+  g->trimmed  = overscan == OVERSCAN_TRIM && hasOverscan;
+  x1 = (g->trimmed) ? ov.x : 0;
+  y1 = (g->trimmed) ? ov.y : 0;
+  x2 = (g->trimmed) ? ov.x + ov.width  : width;
+  y2 = (g->trimmed) ? ov.y + ov.height : height;
+
+  rx = STATIC_CAST(int, softBinning->getValue("X"));
+  ry = STATIC_CAST(int, softBinning->getValue("Y"));
+  rw = STATIC_CAST(int, softBinning->getValue("WIDTH"));
+  rh = STATIC_CAST(int, softBinning->getValue("HEIGHT"));
+  if(rw > 0 && rh > 0) {
+    x1 = (rx > x1) ? rx : x1;
+    y1 = (ry > y1) ? ry : y1;
+    x2 = (rx+rw < x2) ? rx+rw : x2;
+    y2 = (ry+rh < y2) ? ry+rh : y2;
+  }
+
+  // whole binned pixels only, the last columns & rows may be left out
+
+  g->binX   = STATIC_CAST(int, softBinning->getValue("BINX"));
+  g->binY   = STATIC_CAST(int, softBinning->getValue("BINY"));
+  g->x      = x1;
+  g->y      = y1;
+  g->width  = (x2 > x1) ? (x2-x1) - (x2-x1) % g->binX : 0;
+  g->height = (y2 > y1) ? (y2-y1) - (y2-y1) % g->binY : 0;
+  if(g->width == 0 || g->height == 0) {
+    log->warn(IFUN,"Region of interest out of the image, saved as read\n");
+    return(false);
+  }
+  if(g->x == 0 && g->y == 0 && g->width == width && g->height == height &&
+     g->binX == 1 && g->binY == 1)
+    return(false);
+
+  // geometry keywords as if the camera had binned and read the window.
+  // A trimmed image has its origin at the active area
+
+  audine->chip.getOrigin(&ox, &oy);
+  if(g->trimmed) {
+    ox -= ov.x;
+    oy -= ov.y;
+  }
+  g->ccdBin1  = audine->chip.getBinning() * g->binX;
+  g->ccdBin2  = audine->chip.getBinning() * g->binY;
+  g->pixSize1 = audine->chip.getPixelSize() * g->binX;
+  g->pixSize2 = audine->chip.getPixelSize() * g->binY;
+  g->orgX     = (ox + g->x) / g->binX;
+  g->orgY     = (oy + g->y) / g->binY;
+  return(true);
 }
 
 /*---------------------------------------------------------------------------*/
 
 void
-Storage::nextFile()
+Storage::diffField(WriterSpec* spec)
 {
+  DiffField* f = &spec->diffField;
+
+  // as in the OBJECT, RA & DEC keywords
+
+  memset(f, 0, sizeof(*f));
+  if(audine->object)
+    snprintf(f->object, sizeof(f->object), "%s", audine->object->getValue("NAME"));
+  f->pointed = audine->eqCoords != 0;
+  if(f->pointed) {
+    f->ra  = audine->eqCoords->getValue("RA") * 15;
+    f->dec = audine->eqCoords->getValue("DEC");
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::analysisPars(WriterSpec* spec)
+{
+  spec->cosmicPars.iterations = STATIC_CAST(int, cosmicPars->getValue("ITERATIONS"));
+  spec->cosmicPars.sigclip    = cosmicPars->getValue("SIGCLIP");
+  spec->cosmicPars.sigfrac    = cosmicPars->getValue("SIGFRAC");
+  spec->cosmicPars.objlim     = cosmicPars->getValue("OBJLIM");
+  spec->cosmicPars.gain       = audine->chip.getGain();
+  spec->cosmicPars.rdnoise    = audine->chip.getReadNoise();
+
+  spec->extractPars.threshold = catalogPars->getValue("THRESHOLD");
+  spec->extractPars.minArea   = STATIC_CAST(int, catalogPars->getValue("MINAREA"));
+  spec->extractPars.levels    = STATIC_CAST(int, catalogPars->getValue("LEVELS"));
+  spec->extractPars.contrast  = catalogPars->getValue("CONTRAST");
+  spec->extractPars.mesh      = STATIC_CAST(int, catalogPars->getValue("MESH"));
+
+  snprintf(spec->photTargets, sizeof(spec->photTargets), "%s",
+	   photTargets->getValue("PATH"));
+  spec->photPars.radius = photPars->getValue("RADIUS");
+  spec->photPars.inner  = photPars->getValue("SKY_INNER");
+  spec->photPars.outer  = photPars->getValue("SKY_OUTER");
+  spec->photPars.search = photPars->getValue("SEARCH");
+  spec->photPars.gain   = audine->chip.getGain();
+
+  spec->stackPars.kappa     = liveStackPars->getValue("KAPPA");
+  spec->stackPars.matchTol  = liveStackPars->getValue("MATCHTOL");
+  spec->stackPars.saveEvery = STATIC_CAST(int, liveStackPars->getValue("SAVE_EVERY"));
+
+  spec->diffPars.kappa     = diffPars->getValue("KAPPA");
+  spec->diffPars.minPix    = STATIC_CAST(int, diffPars->getValue("MINPIX"));
+  spec->diffPars.refFrames = STATIC_CAST(int, diffPars->getValue("REF_FRAMES"));
+  spec->diffPars.radius    = diffPars->getValue("RADIUS");
+  spec->diffPars.matchTol  = diffPars->getValue("MATCHTOL");
+  spec->diffPars.gain      = audine->chip.getGain();
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool
+Storage::solvePars(WriterSpec* spec)
+{
+  SolvePars* p = &spec->solvePars;
+  int bx = (spec->rebin) ? spec->rebinGeom.binX : 1;
+  int by = (spec->rebin) ? spec->rebinGeom.binY : 1;
+
+  // the telescope position and the seed scale, both needed.
+  // Square pixels only, as the solver expects them
+
+  if(audine->eqCoords == 0 || audine->wcsSeed->getValue("SCALE") == 0 || bx != by)
+    return(false);
+
+  snprintf(p->index, sizeof(p->index), "%s", solverIndex->getValue("PATH"));
+  p->ra       = audine->eqCoords->getValue("RA") * 15;
+  p->dec      = audine->eqCoords->getValue("DEC");
+  p->scale    = audine->wcsSeed->getValue("SCALE") * audine->chip.getBinning() * bx;
+  p->radius   = solverPars->getValue("RADIUS");
+  p->scaleTol = solverPars->getValue("SCALETOL");
+  p->matchTol = solverPars->getValue("MATCHTOL");
+  return(true);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::next()
+{
+  WriterSlot* slot;
+  WriterSpec* spec;
+  int ringSlots, calib, cosmics;
+
   if(error) {
     log->warn(IFUN,"Ignoring CCD data\n");
     return;
   }
 
-  byteCount = 0;		// resets per-file running counts
-  recvByteCount = 0;
+  // focus frames in shared memory need no file name
 
-  generatePath();		// generates 'curFile' path according to context
+  // and the next images of a multi-extension file keep its name
 
-  fp = fopen(curFile, "w");
-  if(fp == NULL) {
-    error = true;
-    audine->device->formatMsg("Almacenamiento: %s",strerror(errno));
-    audine->device->indiMessage();
-  }  
+  dropping = false;		// overruns are reported once per image
+
+  ringSlots = (shmFocus && audine->getImageType() == Audine::FOCUS) ? N : 0;
+  if(ringSlots > 0)
+    strcpy(curFile, ringName);
+  else if(!mefSeq || frameIndex == 0) {
+    generatePath();		// generates 'curFile' path according to context
+    if(stack && stackJob.nfiles < COMBINE_FILES)
+      strcpy(stackJob.files[stackJob.nfiles++], curFile);
+  }
+  frameIndex++;
 
-  /* writes a temporary header, complete except for exposure dates & times */
+  /* the writer saves a temporary header, */
+  /* complete except for exposure dates & times */
 
   audine->fits.set("DATE", timestamp(), "file creation time");
-  audine->fits.save(fp);
 
-  if(flipUD) {
-    fseek(fp, imageSize, SEEK_CUR); // file pointer to the end of image
+  // master frames & defect maps are made in the orientation 
+  // of the readout, whatever the files they come from
+
+  audine->fits.set("FLIPLR", flipLR, "columns saved right to left");
+  audine->fits.set("FLIPUD", flipUD, "rows saved bottom to top");
+
+  // the image keeps the header as it is when its exposure starts.
+  // Later changes to the camera header (telescope, temperatures ...) 
+  // go to the next image. Copies share their cards until changed, 
+  // so they are cheap
+
+  delete frameHead;
+  frameHead = new FITSHeader(audine->fits);
+
+  spec = new WriterSpec();
+  strcpy(spec->path, curFile);
+  spec->width     = width;
+  spec->height    = height;
+  spec->imageSize = imageSize;
+  spec->flipLR    = flipLR;
+  spec->flipUD    = flipUD;
+  calib = (audine->getImageType() == Audine::OBJECT && !mefSeq && ringSlots == 0) ?
+    calibMode : CALIB_NONE;
+  cosmics = (audine->getImageType() == Audine::OBJECT && !mefSeq && ringSlots == 0) ?
+    cosmicMode : COSMIC_NONE;
+  spec->rice      = rice && !mefSeq && !stack && 
+    audine->getImageType() != Audine::FOCUS && calib == CALIB_NONE && 
+    cosmics == COSMIC_NONE;
+  spec->ringSlots = ringSlots;
+  spec->mef       = mefSeq;
+  spec->frames    = audine->imgseq.getSequenceSize();
+  spec->preview   = previewSize;
+  spec->blob      = blobMode;
+  spec->focus     = audine->getImageType() == Audine::FOCUS;
+  spec->roiX      = STATIC_CAST(int, focusROI->getValue("X"));
+  spec->roiY      = STATIC_CAST(int, focusROI->getValue("Y"));
+  spec->roiWidth  = STATIC_CAST(int, focusROI->getValue("WIDTH"));
+  spec->roiHeight = STATIC_CAST(int, focusROI->getValue("HEIGHT"));
+  spec->calib     = calib;
+  spec->calibRaw  = keepRaw;
+
+  // bias & dark frames are kept as read, they are what maps come from
+
+  spec->defects   = repairDefects && audine->getImageType() != Audine::BIAS &&
+    audine->getImageType() != Audine::DARK;
+  if(calib != CALIB_NONE || spec->defects)
+    calibKey(spec);
+  spec->overscan  = (overscan != OVERSCAN_NONE && 
+		     audine->chip.getOverscan(&spec->overscanGeom)) ?
+    overscan : OVERSCAN_NONE;
+  spec->rebin     = rebinGeom(spec);
+
+  // object images only, what each analysis is done for
+
+  spec->cosmic    = cosmics;
+  spec->catalog   = (audine->getImageType() == Audine::OBJECT && !mefSeq &&
+		     ringSlots == 0) ? catalogMode : CATALOG_NONE;
+  spec->solve     = audine->getImageType() == Audine::OBJECT && !mefSeq &&
+    ringSlots == 0 && plateSolve && solvePars(spec);
+  spec->photometry = (audine->getImageType() == Audine::OBJECT && ringSlots == 0) ?
+    photMode : PHOT_NONE;
+  spec->liveStack  = audine->getImageType() == Audine::OBJECT && ringSlots == 0 &&
+    liveStack;
+  spec->stackStart = frameIndex == 1;
+  spec->difference = (audine->getImageType() == Audine::OBJECT && ringSlots == 0) ?
+    diffMode : DIFF_NONE;
+  diffField(spec);
+  analysisPars(spec);
+
+  slot = acquire();
+  if(slot == 0) {		// its data is going to be dropped anyway
+    delete spec;
+    return;
   }
+  slot->op     = WR_OPEN;
+  slot->header = new FITSHeader(*frameHead);
+  slot->spec   = spec;
+  writer.commit();
+
+  lastPreview = monotonic();	// first partial preview after a period
 }
 
 /*---------------------------------------------------------------------------*/
@@ -354,240 +1153,522 @@ Storage::start(int x, int y)
   }
    
   fileCount = 1;		// initializes running counts
-  byteCount = 0;
-  recvByteCount = 0;
+  frameIndex = 0;
   imageSize = sizeof(pixel_t) * x * y;
   width = x;
+  height = y;
+
+  // a single image gains nothing from a multi-extension file
+
+  mefSeq = mef && audine->getImageType() != Audine::FOCUS &&
+    audine->imgseq.getSequenceSize() > 1;
+
+  // bias, dark & flat sequences may end up in a master frame
+
+  if(stackPending)
+    log->warn(IFUN,"combiner busy, sequence not combined\n");
+  stack = combineMethod != COMBINE_NONE &&
+    audine->imgseq.getSequenceSize() >= COMBINE_MIN &&
+    (audine->getImageType() == Audine::BIAS || 
+     audine->getImageType() == Audine::DARK ||
+     audine->getImageType() == Audine::FLAT);
+  stackPending = false;
+  stackJob.nfiles = 0;
+  stackJob.type   = (audine->getImageType() == Audine::BIAS) ? MASTER_BIAS :
+    (audine->getImageType() == Audine::DARK) ? MASTER_DARK : MASTER_FLAT;
+  stackJob.method = combineMethod;
+  stackJob.kappa  = combinePars->getValue("KAPPA");
+  snprintf(stackJob.dir, sizeof(stackJob.dir), "%s", calibDir->getValue("DIR"));
+
+  writer.resetStats();
+  updateQueue();
 
   openFIFO();
-  updateSeriesCounter();			// always before nextFile()
-  nextFile();
+  updateSeriesCounter();			// always before next()
 }
 
 /*---------------------------------------------------------------------------*/
 
 void
-Storage::saveNoFlip(const void* data, int byteLen)
+Storage::handle(const void* data, int byteLen)
 {
-  Incoming_Message* msg = STATIC_CAST(Incoming_Message*, data);
- 
-  int nwritten;
-  int pixelCount = (byteLen - IMG_HEAD)/2;
-  
-  // FITS needs a byte swap for x86
-  // swap performed in-place
+  WriterSlot* slot;
 
-  u_char* px;
-  u_char temp;
-  int i;
+  if(error) {
+    log->warn(IFUN,"Ignoring CCD data\n");
+    return;
+  }
+
+  // just a copy to a pooled buffer. 
+  // All disk I/O is done by the writer thread
 
-  for(i=0, px = msg->body.imgData.data; i< pixelCount; i++) {
-    temp    = *px;
-    *px     = *(px+1);
-    *(px+1) = temp;
-    px += sizeof(pixel_t);
+  if(byteLen < 0 || byteLen > STATIC_CAST(int, sizeof(slot->data))) {
+    log->warn(IFUN,"Dropping a %d bytes long CCD data packet\n", byteLen);
+    return;
   }
 
-  /* writes chunk of data */
+  slot = acquire(true);
+  if(slot == 0)
+    return;
+  slot->op  = WR_DATA;
+  slot->len = byteLen;
+  memcpy(slot->data, data, byteLen);
+  writer.commit();
 
-  recvByteCount += 2*pixelCount;
-  nwritten = fwrite(msg->body.imgData.data, sizeof(pixel_t), pixelCount, fp);
-  byteCount += 2*nwritten;
+  poll();
 }
 
 /*---------------------------------------------------------------------------*/
 
 void
-Storage::saveFlipLR(const void* data, int byteLen)
+Storage::notifyXEphem(const char* path)
 {
-  Incoming_Message* msg = STATIC_CAST(Incoming_Message*, data);
+  int res;
 
-  int nwritten;
-  int pixelCount = (byteLen - IMG_HEAD)/2;
-  int nrows      = pixelCount / width;
-  int N          = width*2;	// row size in bytes
- 
-  // performs row flipping and FITS byte swap 
-  // at the same time for a given chunk of data
-  
-  u_char* first;
-  u_char* last;
-  u_char temp;
+  if(fifo != -1) {
+    res = write(fifo, path, strlen(path));
+    if(res == -1 && errno == EPIPE) {
+      log->warn(IFUN,"FIFO closed by XEphem\n");
+      audine->device->formatMsg("Aviso: XEphem ha cerrado la FIFO");
+      audine->device->indiMessage();
+      close(fifo);
+      fifo = -1;
+      openFIFO();
+    } else if(res == -1) {
+      log->error(IFUN,"XEphem FIFO error %s\n",strerror(errno));
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::end(bool last)
+{ 
+  WriterSlot* slot;
+
+  if(error || frameHead == 0)
+    return;
 
-  int i,j;
+  // the writer re-writtes header with correct date and time
+  // taken from the image snapshot, which is handed over to it,
+  // and the event loop notifies XEphem when the file is closed
 
-  for(i=0; i<nrows; i++) {
+  slot = acquire();
+  if(slot == 0) {
+    delete frameHead;
+    frameHead = 0;
+    return;
+  }
+  slot->op = WR_CLOSE;
+  slot->header = frameHead;
+  slot->last = last;
+  frameHead = 0;
+  writer.commit();
+
+  if(last && stack) {		// once the writer has closed all its files
+    stackPending = true;
+    stack = false;
+  }
+
+  updateQueue();
+  updatePreview();		// right now if the writer is up to date
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::poll()
+{
+  WriterReport rep;
+  FocusMetrics focus;
+  CombineReport master;
+  int err;
+
+  err = writer.lastError();
+  if(err) {
+    error = true;
+    log->error(IFUN,"%s\n", strerror(err));
+    audine->device->formatMsg("Almacenamiento: %s",strerror(err));
+    audine->device->indiMessage();
+  }
 
-    first = msg->body.imgData.data + i*N;
-    last  = msg->body.imgData.data + (i+1)*N - 1;
+  // notifies XEphem on new images to display
+  // and warns about incomplete images
 
-    for(j=0; j<width; j++, first++, last--) {
-      temp    = *first;
-      *first  = *last;
-      *last   = temp;
+  while(writer.popDone(&rep)) {
+    if(rep.lost || rep.dups || rep.invalid) {
+      log->warn(IFUN,"%s: %d rows lost, %d dup. chunks, %d bad chunks\n",
+		rep.path, rep.lost, rep.dups, rep.invalid);
+      audine->device->formatMsg("Aviso: %s, %d filas perdidas",
+				rep.path, rep.lost);
+      audine->device->indiMessage();
+    }
+    if(rep.hasStats)
+      updateStats(&rep.stats);
+    if(rep.hasBias)
+      updateBias(&rep.bias);
+    if(rep.hasWCS)
+      updateSolver(&rep.wcs);
+    if(rep.unsolved) {
+      log->warn(IFUN,"%s: not plate solved\n", rep.path);
+      audine->device->formatMsg("Aviso: %s sin reducir, no hay solucion astrometrica",
+				rep.path);
+      audine->device->indiMessage();
+    }
+    if(rep.hasPhot)
+      updatePhotometry(&rep.phot);
+    if(rep.unmeasured) {
+      log->warn(IFUN,"%s: no photometry target list\n", rep.path);
+      audine->device->formatMsg("Aviso: %s sin fotometria, no hay lista de estrellas",
+				rep.path);
+      audine->device->indiMessage();
+    }
+    if(rep.hasStack)
+      updateLiveStack(&rep.stack);
+    if(rep.hasDiff)
+      updateDifference(&rep.diff, &rep.event);
+    if(rep.hasDiff && rep.diff.events > 0) {
+      log->info(IFUN,"%s: %d candidate events, strongest %.1f sigma at (%.1f, %.1f)\n",
+		rep.path, rep.diff.events, rep.event.snr, rep.event.x + 1, rep.event.y + 1);
+      audine->device->formatMsg("Transitorio: %s, %d candidatos, el mayor en (%.1f, %.1f)",
+				rep.path, rep.diff.events, rep.event.x + 1, rep.event.y + 1);
+      audine->device->indiMessage();
+    }
+    if(rep.stackLate) {
+      log->warn(IFUN,"%s: live stacking took %.0f ms, slower than the exposures\n",
+		rep.path, rep.stack.elapsed);
+      audine->device->formatMsg("Aviso: %s, el apilado no sigue el ritmo de la secuencia",
+				rep.path);
+      audine->device->indiMessage();
+    }
+    if(rep.uncalibrated) {
+      log->warn(IFUN,"%s: no master frame found, saved raw\n", rep.path);
+      audine->device->formatMsg("Aviso: %s sin calibrar, no hay imagenes maestras",
+				rep.path);
+      audine->device->indiMessage();
+    }
+    if(rep.calibSkipped) {
+      log->warn(IFUN,"%s: binned, cropped or overscan corrected by software, saved raw\n",
+		rep.path);
+      audine->device->formatMsg("Aviso: %s sin calibrar, binada, recortada o con overscan por software",
+				rep.path);
+      audine->device->indiMessage();
     }
+    if(rep.warning) {		// not fatal, the image itself is saved
+      log->warn(IFUN,"%s: %s not saved, %s\n", rep.path, rep.warnPath,
+		strerror(rep.warning));
+      audine->device->formatMsg("Aviso: %s, no se ha podido guardar %s: %s",
+				rep.path, rep.warnPath, strerror(rep.warning));
+      audine->device->indiMessage();
+    }
+    if(rep.file)
+      notifyXEphem(rep.path);
   }
 
+  if(writer.popFocus(&focus))
+    updateFocus(&focus);
 
-  /* writes chunk of data */
+  // all files of a sequence are closed once the writer is done
 
-  recvByteCount += 2*pixelCount;
-  nwritten = fwrite(msg->body.imgData.data, sizeof(pixel_t), pixelCount, fp);
-  byteCount += 2*nwritten;
+  if(stackPending && !writer.busy() && !combiner.busy())
+    startCombine();
+  if(combiner.popDone(&master))
+    updateCombine(&master);
+
+  updatePreview();
 }
 
 /*---------------------------------------------------------------------------*/
 
 void
-Storage::saveFlipUD(const void* data, int byteLen)
+Storage::updateStats(const FrameStatistics* stats)
 {
-  Incoming_Message* msg = STATIC_CAST(Incoming_Message*, data);
- 
-  int nwritten;
-  int pixelCount = (byteLen - IMG_HEAD)/2;
-  int nrows      = pixelCount / width;
-  int N          = width*2;	// row size in bytes
+  frameStats->setValue("MIN", stats->min);
+  frameStats->setValue("MAX", stats->max);
+  frameStats->setValue("MEAN", stats->mean);
+  frameStats->setValue("SIGMA", stats->sigma);
+  frameStats->setValue("MEDIAN", stats->median);
+  frameStats->setValue("SATURATED", stats->saturated);
+  frameStats->setValue("PIXELS", stats->pixels);
+  frameStats->indiSetProperty();
+}
 
-  // rewinds file this amount from the given last position
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateFocus(const FocusMetrics* metrics)
+{
+  focusMetrics->setValue("STARS", metrics->stars);
+  focusMetrics->setValue("HFD", metrics->hfd);
+  focusMetrics->setValue("FWHM", metrics->fwhm);
+  focusMetrics->setValue("BACKGROUND", metrics->background);
+  focusMetrics->setValue("NOISE", metrics->noise);
+  focusMetrics->setValue("X", metrics->x);
+  focusMetrics->setValue("Y", metrics->y);
+  focusMetrics->setValue("PEAK", metrics->peak);
+  focusMetrics->setValue("TIME", metrics->elapsed);
+  if(metrics->stars)
+    focusMetrics->okStatus();
+  else
+    focusMetrics->alertStatus();	// nothing to focus on
+  focusMetrics->indiSetProperty();
+}
 
-   fseek(fp, -(byteLen-IMG_HEAD), SEEK_CUR); 
+/*---------------------------------------------------------------------------*/
 
-  u_char* px;
-  u_char temp;
-  int i, j;
+void
+Storage::updateBias(const BiasLevel* bias)
+{
+  double sum = 0, sum2 = 0, mean;
+  int n;
 
-  // saves last row in chunk in first place
-  // FITS needs a byte swap for x86
-  // swap performed in-place
+  // the spread of the last frames levels tells a drifting bias
+  // from a noisy one
 
-  for(i=nrows-1; i>-1; i--) {
-    px = msg->body.imgData.data + i*N;
-    for(j=0; j< width; j++) {
-      temp    = *px;
-      *px     = *(px+1);
-      *(px+1) = temp;
-      px += sizeof(pixel_t);
-    }
-    recvByteCount += N;
-    nwritten = fwrite(msg->body.imgData.data+i*N, sizeof(pixel_t), width, fp);
-    byteCount += 2*nwritten;
+  n = (biasCount < BIAS_FRAMES) ? biasCount + 1 : BIAS_FRAMES;
+  biasTelemetry->setValue("DELTA", (biasCount) ? 
+			  bias->level - biasLevels[(biasCount-1) % BIAS_FRAMES] : 0);
+  biasLevels[biasCount++ % BIAS_FRAMES] = bias->level;
+  for(int i=0; i<n; i++) {
+    sum  += biasLevels[i];
+    sum2 += biasLevels[i] * biasLevels[i];
   }
+  mean = sum / n;
+
+  biasTelemetry->setValue("LEVEL", bias->level);
+  biasTelemetry->setValue("DRIFT", bias->drift);
+  biasTelemetry->setValue("NOISE", bias->noise);
+  biasTelemetry->setValue("SPREAD", sqrt(fmax(sum2 / n - mean * mean, 0)));
+  biasTelemetry->setValue("FRAMES", n);
+  biasTelemetry->indiSetProperty();
+}
+
+/*---------------------------------------------------------------------------*/
 
-  fseek(fp, -(byteLen-IMG_HEAD), SEEK_CUR); 
+void
+Storage::updateSolver(const WCSFit* wcs)
+{
+  solverResult->setValue("RA", wcs->crval1 / 15);
+  solverResult->setValue("DEC", wcs->crval2);
+  solverResult->setValue("SCALE", wcs->scale);
+  solverResult->setValue("ROTA", wcs->rota);
+  solverResult->setValue("MATCHED", wcs->matched);
+  solverResult->setValue("RMS", wcs->rms);
+  solverResult->indiSetProperty();
 }
 
 /*---------------------------------------------------------------------------*/
 
 void
-Storage::saveFlipLRUD(const void* data, int byteLen)
+Storage::updatePhotometry(const PhotMeasure* phot)
 {
-  Incoming_Message* msg = STATIC_CAST(Incoming_Message*, data);
- 
-  int nwritten;
-  int pixelCount = (byteLen - IMG_HEAD)/2;
-  int nrows      = pixelCount / width;
-  int N          = width*2;	// row size in bytes
+  static const int BAD = PHOT_EDGE | PHOT_SATURATED | PHOT_NOSKY | PHOT_LOST |
+    PHOT_NOREF;
+  double sum = 0, sum2 = 0, mean;
+  int n;
+
+  photResult->setValue("DMAG", phot->dmag);
+  photResult->setValue("DMAG_ERR", phot->dmagErr);
+  photResult->setValue("MAG", phot->mag);
+  photResult->setValue("SKY", phot->sky);
+  photResult->setValue("FLAGS", phot->flags);
+
+  // a badly measured frame is shown but left out of the window
+
+  if(phot->flags & BAD) {
+    photResult->alertStatus();
+    photResult->indiSetProperty();
+    return;
+  }
 
-  // rewinds file this amount from the given last position
+  n = (photCount < PHOT_FRAMES) ? photCount + 1 : PHOT_FRAMES;
+  photLevels[photCount++ % PHOT_FRAMES] = phot->dmag;
+  for(int i=0; i<n; i++) {
+    sum  += photLevels[i];
+    sum2 += photLevels[i] * photLevels[i];
+  }
+  mean = sum / n;
 
-  fseek(fp, -(byteLen-IMG_HEAD), SEEK_CUR); 
+  photResult->setValue("ROLLING", mean);
+  photResult->setValue("SCATTER", sqrt(fmax(sum2 / n - mean * mean, 0)));
+  photResult->setValue("FRAMES", n);
+  photResult->okStatus();
+  photResult->indiSetProperty();
+}
 
-  u_char* first;
-  u_char* last;
-  u_char temp;
+/*---------------------------------------------------------------------------*/
 
-  int i, j;
+void
+Storage::updateLiveStack(const StackResult* stack)
+{
+  liveStackResult->setValue("FRAMES", stack->frames);
+  liveStackResult->setValue("SKIPPED", stack->skipped);
+  liveStackResult->setValue("MATCHED", stack->matched);
+  liveStackResult->setValue("DX", stack->dx);
+  liveStackResult->setValue("DY", stack->dy);
+  liveStackResult->setValue("ROTA", stack->rota);
+  liveStackResult->setValue("REJECTED", stack->rejected);
+  liveStackResult->setValue("LATENCY", stack->elapsed);
+  liveStackResult->indiSetProperty();
+}
 
-  // saves last row in chunk in first place
-  // LR flip and FITS byte swapping performed in-place
+/*---------------------------------------------------------------------------*/
 
-  for(i=nrows-1; i>-1; i--) {
+void
+Storage::updateDifference(const DiffResult* diff, const DiffEvent* event)
+{
+  diffResult->setValue("REF_FRAMES", diff->refFrames);
+  diffResult->setValue("EVENTS", diff->events);
+  diffResult->setValue("X", (diff->events > 0) ? event->x + 1 : 0);
+  diffResult->setValue("Y", (diff->events > 0) ? event->y + 1 : 0);
+  diffResult->setValue("SNR", event->snr);
+  diffResult->setValue("FLUX", event->flux);
+  diffResult->setValue("SCALE", diff->scale);
+  diffResult->setValue("NOISE", diff->noise);
+  diffResult->setValue("LATENCY", diff->elapsed);
+
+  // busy while the reference is being made, alert on events
+
+  if(!diff->ready)
+    diffResult->busyStatus();
+  else if(diff->events > 0)
+    diffResult->alertStatus();
+  else
+    diffResult->okStatus();
+  diffResult->indiSetProperty();
+}
 
-    first = msg->body.imgData.data + i*N;
-    last  = msg->body.imgData.data + (i+1)*N - 1;
+/*---------------------------------------------------------------------------*/
 
-    for(j=0; j<width; j++, first++, last--) {
-      temp    = *first;
-      *first  = *last;
-      *last   = temp;
-    }
+void
+Storage::updatePreview()
+{
+  Preview* preview = writer.getPreview();
+  const char* data;
+  bool complete;
+  double now;
+  int len;
 
-    recvByteCount += N;
-    nwritten = fwrite(msg->body.imgData.data+i*N, sizeof(pixel_t), width, fp);
-    byteCount += 2*nwritten;
-  }
+  if(!preview->changed(&complete))
+    return;
 
-  // decreases the seek pointer by this amount
+  // partial previews are throttled for slow links, the final one is not
 
-  fseek(fp, -(byteLen-IMG_HEAD), SEEK_CUR); 
+  now = monotonic();
+  if(!complete && (previewPeriod <= 0 || now - lastPreview < previewPeriod))
+    return;
+
+  len = preview->render(&data);
+  previewBlob->setValue("IMAGE", data, len, ".fits");
+  if(preview->final())
+    previewBlob->okStatus();
+  else
+    previewBlob->busyStatus();
+  previewBlob->indiSetProperty();
+  lastPreview = now;
 }
 
 /*---------------------------------------------------------------------------*/
 
 void
-Storage::handle(const void* data, int byteLen)
+Storage::startCombine()
 {
-  
-  if(error) {
-    log->warn(IFUN,"Ignoring CCD data\n");
-    return;
-  }
+  stackPending = false;
+  combiner.submit(&stackJob);
+
+  combineMode->busyStatus();
+  combineMode->indiSetProperty();
+  log->info(IFUN,"combining %d files\n", stackJob.nfiles);
+}
 
-  if(!flipLR && !flipUD) {
-    saveNoFlip(data, byteLen);
-  } else if(flipLR && !flipUD) {
-    saveFlipLR(data, byteLen);
-  } else if(!flipLR && flipUD) {
-    saveFlipUD(data, byteLen);
+/*---------------------------------------------------------------------------*/
+
+void
+Storage::updateCombine(const CombineReport* report)
+{
+  if(report->error) {
+    log->error(IFUN,"master frame not written: %s\n", strerror(report->error));
+    combineMode->formatMsg("Imagen maestra no generada: %s", strerror(report->error));
+    combineMode->alertStatus();
   } else {
-    saveFlipLRUD(data, byteLen);
+    log->info(IFUN,"%s: %d frames combined in %.1f s\n", 
+	      report->path, report->frames, report->elapsed);
+    if(report->defects >= 0) {
+      log->info(IFUN,"defect map updated: %d runs\n", report->defects);
+      combineMode->formatMsg("Imagen maestra %s (%d imagenes), mapa de defectos: %d", 
+			     report->path, report->frames, report->defects);
+    } else
+      combineMode->formatMsg("Imagen maestra %s (%d imagenes)", 
+			     report->path, report->frames);
+    combineMode->okStatus();
   }
+  combineMode->indiSetProperty();
 }
 
 /*---------------------------------------------------------------------------*/
 
-void
-Storage::notifyXEphem()
+bool
+Storage::congested()
 {
-  int res;
+  int rows, packets, room;
 
-  if(fifo != -1) {
-    res = write(fifo, curFile, strlen(curFile));
-    if(res == -1 && errno == EPIPE) {
-      log->warn(IFUN,"FIFO closed by XEphem\n");
-      audine->device->formatMsg("Aviso: XEphem ha cerrado la FIFO");
-      audine->device->indiMessage();
-      close(fifo);
-      fifo = -1;
-      openFIFO();
-    } else if(res == -1) {
-      log->error(IFUN,"XEphem FIFO error %s\n",strerror(errno));
-    }
-  }
+  // we want room enough in the ring for a whole image
+  // else the next exposure should be delayed until the writer catches up.
+  // Packets are counted as the COR splits the image, in whole rows
+
+  rows = MAX_IMG_LEN / (sizeof(pixel_t) * width);
+  if(rows == 0)
+    rows = 1;
+  packets = (height + rows - 1) / rows + 2;	// plus open & close
+  room = DiskWriter::SLOTS - DiskWriter::RESERVE;
+  if(packets > room)
+    return(writer.depth() > 0);
+
+  return(room - writer.depth() < packets);
 }
 
 /*---------------------------------------------------------------------------*/
 
-void
-Storage::end()
-{ 
-  int rembytes = imageSize % FITSHeader::RECORDSZ;
+WriterSlot*
+Storage::acquire(bool data)
+{
+  WriterSlot* slot;
 
-  assert(imageSize == byteCount);
-  assert(imageSize == recvByteCount);
+  // the event loop never waits for the writer. When the ring is full
+  // the image loses rows, which the writer reports as lost when closed
 
-  if (rembytes) {
-    while (rembytes++ <  FITSHeader::RECORDSZ)
-      putc (0, fp);
+  slot = writer.acquire(data);
+  if(slot == 0 && !dropping) {
+    dropping = true;
+    log->error(IFUN,"writer queue full, CCD data dropped\n");
+    audine->device->formatMsg("Error Almacenamiento: cola de escritura llena, se pierden datos");
+    audine->device->indiMessage();
   }
+  return(slot);
+}
 
-  fseek(fp, 0L, SEEK_SET);	// re-writtes header with correct date and time
-  audine->fits.save(fp);
-  fclose(fp);
+/*---------------------------------------------------------------------------*/
 
-  // notifies XEphem on new image to display
-  notifyXEphem();
+void
+Storage::updateQueue()
+{
+  int depth  = writer.depth();
+  int high   = writer.highWater();
+  int drops  = writer.drops();
+
+  // called on every tick, but only changes are sent to the clients
 
+  if(depth == sentDepth && high == sentHigh && drops == sentDrops)
+    return;
+  sentDepth  = depth;
+  sentHigh   = high;
+  sentDrops  = drops;
+
+  storageQueue->setValue("DEPTH", depth);
+  storageQueue->setValue("HIGH_WATER", high);
+  storageQueue->setValue("STALLS", drops);
+  storageQueue->indiSetProperty();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -596,6 +1677,7 @@ void
 Storage::generatePath()
 
 {
+  const char* ext;
 
   // generates  next file name.
   //
@@ -607,6 +1689,15 @@ Storage::generatePath()
   // value as part of the file path
   // If its value is 'Always', we do always insert it.
   // Value 'two or more' do it whenerver 2 or more images are being taken.
+  //
+  // Rice compressed images get the usual fpack suffix. Focus images
+  // are never compressed, as XEphem must be able to display them, 
+  // nor are multi-extension files, sequences to be combined or
+  // object images calibrated or cleaned of cosmic rays.
+
+  ext = (rice && !mefSeq && !stack && 
+	 !(audine->getImageType() == Audine::OBJECT && 
+	   (calibMode != CALIB_NONE || cosmicMode != COSMIC_NONE))) ? ".fit.fz" : ".fit";
 
   if(audine->getImageType() == Audine::FOCUS) {
     snprintf(curFile, sizeof(curFile), "%s/%s_%02d.fit",
@@ -614,17 +1705,17 @@ Storage::generatePath()
   } else {			// other image types
 
     if(storageSeries->getValue("ALWAYS")) {
-      snprintf(curFile, sizeof(curFile), "%s/%s_%02X_%03d.fit",
-	       dirname, prefix, series.value(), fileCount++);
+      snprintf(curFile, sizeof(curFile), "%s/%s_%02X_%03d%s",
+	       dirname, prefix, series.value(), fileCount++, ext);
      } else if(storageSeries->getValue("NEVER")) {
-       snprintf(curFile, sizeof(curFile), "%s/%s.fit",
-	       dirname, prefix);
+       snprintf(curFile, sizeof(curFile), "%s/%s%s",
+	       dirname, prefix, ext);
      } else if(audine->imgseq.getSequenceSize() > 1) { // two or more ...
-       snprintf(curFile, sizeof(curFile), "%s/%s_%02X_%03d.fit",
-		dirname, prefix, series.value(), fileCount++);
+       snprintf(curFile, sizeof(curFile), "%s/%s_%02X_%03d%s",
+		dirname, prefix, series.value(), fileCount++, ext);
      } else {
-       snprintf(curFile, sizeof(curFile), "%s/%s.fit",
-	       dirname, prefix);
+       snprintf(curFile, sizeof(curFile), "%s/%s%s",
+	       dirname, prefix, ext);
      }
   }
   
@@ -24,6 +24,8 @@
 #define AUDINE_STORAGE_H
 
 #include "perscount.h"
+#include "combiner.h"
+#include "diskwriter.h"
 
 
 class Audine;			/* forward reference */
@@ -36,10 +38,13 @@ class Storage  {
 
   typedef PersistentCounter<unsigned char> Counter8bit;
 
+  static const int BIAS_FRAMES = 16; /* frames in the bias telemetry window */
+  static const int PHOT_FRAMES = 16; /* frames in the rolling magnitude window */
+
  public:
 
   Storage(Audine* ccd);
- ~Storage() { delete log; }
+ ~Storage() { writer.stop(); combiner.stop(); delete log; }
 
   /* ****************** */
   /* THE INDI INTERFACE */
@@ -53,6 +58,63 @@ class Storage  {
 
   void updateSeries(char* name, ISState swit);
 
+  void updateFocusMode(char* name, ISState swit);
+
+  void updateSequence(char* name, ISState swit);
+
+  /* saves a focus ring slot as a FITS file */
+  void persist(char* name[], double number[], int n);
+
+  void updatePreview(char* name[], double number[], int n);
+
+  void updateFrameBlob(char* name, ISState swit);
+
+  void updateFocusROI(char* name[], double number[], int n);
+
+  void updateCalibration(char* name, ISState swit);
+
+  void updateCalibRaw(char* name, ISState swit);
+
+  void updateCalibDir(char* name[], char* text[], int n);
+
+  void updateDefects(char* name, ISState swit);
+
+  void updateCosmic(char* name, ISState swit);
+
+  void updateCosmicPars(char* name[], double number[], int n);
+
+  void updateCatalog(char* name, ISState swit);
+
+  void updateCatalogPars(char* name[], double number[], int n);
+
+  void updateSolver(char* name, ISState swit);
+
+  void updateSolverIndex(char* name[], char* text[], int n);
+
+  void updateSolverPars(char* name[], double number[], int n);
+
+  void updatePhotometry(char* name, ISState swit);
+
+  void updatePhotTargets(char* name[], char* text[], int n);
+
+  void updatePhotPars(char* name[], double number[], int n);
+
+  void updateLiveStack(char* name, ISState swit);
+
+  void updateLiveStackPars(char* name[], double number[], int n);
+
+  void updateDifference(char* name, ISState swit);
+
+  void updateDiffPars(char* name[], double number[], int n);
+
+  void updateCombine(char* name, ISState swit);
+
+  void updateCombinePars(char* name[], double number[], int n);
+
+  void updateOverscan(char* name, ISState swit);
+
+  void updateSoftBinning(char* name[], double number[], int n);
+
   /*********************************************/
   /* the private interface for image sequencer */
   /*********************************************/
@@ -62,24 +124,41 @@ class Storage  {
   /* prepares the sequence of files */
   void start(int width, int height);
 
+  /* starts the next image as its exposure starts. Its header and */
+  /* pointing are those of the camera at that moment */
+  void next();
+
   /* saves a chunk of the pixel array in FITS format */
   void handle(const void* data, int byteLength);
 
-  /* closes current image and prepares next if any */
-  void next() { end(); nextFile(); }
-
-  /* closes current image */
-  void end();
+  /* closes current image, the last one of the sequence by default */
+  void end(bool last = true);
 
   /* cancels writting of current image */
   void cancel();
 
+  /* header snapshot of the image being read, taken when its exposure */
+  /* started. Keywords known only at readout go here. NULL if no image */
+  FITSHeader* frameHeader() { return(frameHead); }
+
   /* suggest a new prefix to user when image type is changed */
   void updatePrefix(const char* name);
 
   /* tries to open writer side of XEphem FIFO */
   void openFIFO();
 
+  /* collects results from the writer thread. Called from the event loop */
+  void poll();
+
+  /* true if the writer cannot absorb another whole image right now */
+  bool congested();
+
+  /* true if the writer or the combiner have still work to do */
+  bool busy() { return(writer.busy() || stackPending || combiner.busy()); }
+
+  /* updates STORAGE_QUEUE property from writer statistics */
+  void updateQueue();
+
  private:
 
   NumberPropertyVector* focusBuffer;
@@ -87,51 +166,166 @@ class Storage  {
   TextPropertyVector* eventFIFO;
   SwitchPropertyVector* storageFlip;
   SwitchPropertyVector* storageSeries;
+  NumberPropertyVector* storageQueue;
+  NumberPropertyVector* frameStats;
+  SwitchPropertyVector* focusMode;
+  SwitchPropertyVector* storageSequence;
+  NumberPropertyVector* focusPersist;
+  NumberPropertyVector* previewSettings;
+  BLOBPropertyVector* previewBlob;
+  SwitchPropertyVector* frameBlobMode;
+  BLOBPropertyVector* frameBlob;	/* sent by the writer, see FrameBlob */
+  NumberPropertyVector* focusROI;
+  NumberPropertyVector* focusMetrics;
+  SwitchPropertyVector* calibration;
+  SwitchPropertyVector* calibRaw;
+  TextPropertyVector* calibDir;
+  SwitchPropertyVector* defects;
+  SwitchPropertyVector* cosmic;
+  NumberPropertyVector* cosmicPars;
+  SwitchPropertyVector* catalog;
+  NumberPropertyVector* catalogPars;
+  SwitchPropertyVector* solver;
+  TextPropertyVector* solverIndex;
+  NumberPropertyVector* solverPars;
+  NumberPropertyVector* solverResult;
+  SwitchPropertyVector* photometry;
+  TextPropertyVector* photTargets;
+  NumberPropertyVector* photPars;
+  NumberPropertyVector* photResult;
+  SwitchPropertyVector* liveStackMode;
+  NumberPropertyVector* liveStackPars;
+  NumberPropertyVector* liveStackResult;
+  SwitchPropertyVector* difference;
+  NumberPropertyVector* diffPars;
+  NumberPropertyVector* diffResult;
+  SwitchPropertyVector* combineMode;
+  NumberPropertyVector* combinePars;
+  SwitchPropertyVector* overscanMode;
+  NumberPropertyVector* biasTelemetry;
+  NumberPropertyVector* softBinning;
 
   Log* log;
-  FILE* fp;
   int imageSize;		/* predicted image size in bytes */
-  int byteCount;		/* running count of written bytes */
-  int recvByteCount;		/* running count of recived bytes */
   Audine* audine;
 
+  DiskWriter writer;		/* background FITS file writer */
+  Combiner combiner;		/* background master frame combiner */
+
   bool error;
   int fileCount;		/* serves as a suffix for the file name */
   int width;			/* current image width for a sequence of images */
+  int height;			/* current image height for a sequence of images */
 
   bool flipLR;			/* flag: save image flipped Left to Right */
   bool flipUD;			/* flag: save image flipped upside down */
+  bool rice;			/* flag: save Rice compressed images */
+  bool shmFocus;		/* flag: focus frames go to shared memory */
+  bool mef;			/* flag: sequences in multi-extension files */
+  bool mefSeq;			/* current sequence goes to a single file */
+  int frameIndex;		/* images already started in the sequence */
+  int previewSize;		/* largest preview side in pixels, 0=none */
+  double previewPeriod;		/* seconds between partial previews */
+  double lastPreview;		/* time of last partial preview */
+  int blobMode;			/* full frame BLOB, one of BLOB_xxx */
+  int calibMode;		/* object images output, one of CALIB_xxx */
+  bool keepRaw;			/* flag: raw image saved with the calibrated one */
+  bool repairDefects;		/* flag: known chip defects repaired */
+  int cosmicMode;		/* object images hits, one of COSMIC_xxx */
+  int catalogMode;		/* object images sources, one of CATALOG_xxx */
+  bool plateSolve;		/* flag: object images plate solved */
+  int photMode;			/* object images photometry, one of PHOT_xxx */
+  double photLevels[PHOT_FRAMES]; /* differential magnitudes of the last frames */
+  int photCount;		/* frames measured so far */
+  bool liveStack;		/* flag: object sequences stacked live */
+  int diffMode;			/* object images differencing, one of DIFF_xxx */
+  int combineMethod;		/* bias, dark & flat sequences, one of COMBINE_xxx */
+  bool stack;			/* flag: current sequence to be combined */
+  bool stackPending;		/* flag: combined once its files are closed */
+  CombineJob stackJob;		/* its files */
+  int overscan;			/* full frames with overscan, one of OVERSCAN_xxx */
+  double biasLevels[BIAS_FRAMES]; /* overscan levels of the last frames */
+  int biasCount;		/* frames measured so far */
+  FITSHeader* frameHead;	/* header snapshot of current image */
 
   const char* dirname;		/* caches directory entry */
   const char* prefix;		/* caches file prefix */
 
   char fifoname[256];		/* XEphem's watch FIFO name */
   char curFile[256];		/* current FITS file path */
+  char ringName[64];		/* focus ring shared memory object name */
   int fifo;			/* XEphem FIFO file descriptor */
 
   char jdStr[16];		/* Julian day (integer) as a string */
 
   int N;			/* cache of focus buffer 'size' property */
 
+  int sentDepth;		/* STORAGE_QUEUE values last sent */
+  int sentHigh;
+  int sentDrops;
+  bool dropping;		/* ring overrun already reported for this image */
+
   Counter8bit series;	/* the series counter for image sequencing */
 
   /******************/
   /* HELPER METHODS */
   /******************/
 
-  void nextFile();
-  void notifyXEphem();
+  void notifyXEphem(const char* path);
+
+  /* updates FRAME_STATS property */
+  void updateStats(const FrameStatistics* stats);
+
+  /* sends the image preview if final or if due */
+  void updatePreview();
+
+  /* fills what master frames must match for the current image */
+  void calibKey(WriterSpec* spec);
+
+  /* fills how the current image is cropped & binned. false if saved as read */
+  bool rebinGeom(WriterSpec* spec);
+
+  /* fills where the current image is expected in the sky. false if unknown */
+  bool solvePars(WriterSpec* spec);
+
+  /* fills the field of the current image, by OBJECT & telescope position */
+  void diffField(WriterSpec* spec);
+
+  /* fills how the analysis modules work, from their parameter properties */
+  void analysisPars(WriterSpec* spec);
+
+  /* updates SOLVER_RESULT property */
+  void updateSolver(const WCSFit* wcs);
+
+  /* updates PHOT_RESULT property with a new frame */
+  void updatePhotometry(const PhotMeasure* phot);
+
+  /* updates LIVE_STACK_RESULT property */
+  void updateLiveStack(const StackResult* stack);
+
+  /* updates DIFF_RESULT property */
+  void updateDifference(const DiffResult* diff, const DiffEvent* event);
+
+  /* updates FOCUS_METRICS property */
+  void updateFocus(const FocusMetrics* metrics);
+
+  /* gets a writer slot or reports the full ring once per image. NULL if full */
+  WriterSlot* acquire(bool data = false);
+
+  /* updates BIAS_TELEMETRY property with a new frame */
+  void updateBias(const BiasLevel* bias);
+
+  /* hands the sequence just ended to the combiner */
+  void startCombine();
+
+  /* reports a master frame written or failed */
+  void updateCombine(const CombineReport* report);
 
   void initFIFO();
 
   void createSubdir(const char* basedir, const char* subdir);
   void calcJD();		/* today's date as JD string */
 
-  void saveNoFlip(const void* data, int byteLen); /* save as received */
-  void saveFlipLR(const void* data, int byteLen); /* save flipped L/R */
-  void saveFlipUD(const void* data, int byteLen); /* save flipped U/D */
-  void saveFlipLRUD(const void* data, int byteLen); /* save flipped on both axis */
-
   /* generates a file path according to various rules */
   void generatePath();
 
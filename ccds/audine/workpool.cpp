@@ -0,0 +1,184 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#include <unistd.h>
+
+#ifndef AUDINE_H
+#include "audine.h"
+#endif
+
+#include "workpool.h"
+
+/*---------------------------------------------------------------------------*/
+
+WorkerPool::WorkerPool() : head(0), tail(0), pending(0), active(0),
+    quit(false), tids(0), nthreads(0)
+{
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&notEmpty, NULL);
+  pthread_cond_init(&notFull, NULL);
+  pthread_cond_init(&idle, NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+
+WorkerPool::~WorkerPool()
+{
+  stop();
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&notEmpty);
+  pthread_cond_destroy(&notFull);
+  pthread_cond_destroy(&idle);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+WorkerPool::start(int n)
+{
+  int res;
+
+  if(nthreads > 0)
+    return;
+
+  if(n <= 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  if(n <= 0)
+    n = 1;
+
+  quit = false;
+  tids = new pthread_t[n];
+  for(nthreads = 0; nthreads < n; nthreads++) {
+    res = pthread_create(&tids[nthreads], NULL, WorkerPool::run, this);
+    assert(res == 0);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+WorkerPool::stop()
+{
+  if(nthreads == 0)
+    return;
+
+  wait();
+
+  pthread_mutex_lock(&lock);
+  quit = true;
+  pthread_cond_broadcast(&notEmpty);
+  pthread_mutex_unlock(&lock);
+
+  for(int i=0; i<nthreads; i++)
+    pthread_join(tids[i], NULL);
+
+  delete [] tids;
+  tids = 0;
+  nthreads = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+WorkerPool::submit(WorkFn fn, void* ctx, int a, int b)
+{
+  Job* job;
+
+  // without threads the caller does the job itself
+
+  if(nthreads == 0) {
+    fn(ctx, a, b);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  while(pending == QUEUE)
+    pthread_cond_wait(&notFull, &lock);
+
+  job = &queue[head];
+  job->fn  = fn;
+  job->ctx = ctx;
+  job->a   = a;
+  job->b   = b;
+  head = (head + 1) % QUEUE;
+  pending++;
+
+  pthread_cond_signal(&notEmpty);
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+WorkerPool::wait()
+{
+  pthread_mutex_lock(&lock);
+  while(pending > 0 || active > 0)
+    pthread_cond_wait(&idle, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void*
+WorkerPool::run(void* arg)
+{
+  STATIC_CAST(WorkerPool*, arg)->loop();
+  return(NULL);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void
+WorkerPool::loop()
+{
+  Job job;
+
+  pthread_mutex_lock(&lock);
+
+  for(;;) {
+
+    while(pending == 0 && !quit)
+      pthread_cond_wait(&notEmpty, &lock);
+
+    if(pending == 0)		// quit and nothing left to do
+      break;
+
+    job  = queue[tail];
+    tail = (tail + 1) % QUEUE;
+    pending--;
+    active++;
+    pthread_cond_signal(&notFull);
+
+    pthread_mutex_unlock(&lock);
+    job.fn(job.ctx, job.a, job.b);
+    pthread_mutex_lock(&lock);
+
+    active--;
+    if(pending == 0 && active == 0)
+      pthread_cond_broadcast(&idle);
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,93 @@
+/* $Id: $ */
+/*
+
+  Copyright (C) 2005 Rafael Gonzalez (astrorafael@yahoo.es)
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+*/
+
+
+#ifndef AUDINE_WORKPOOL_H
+#define AUDINE_WORKPOOL_H
+
+#include <pthread.h>
+
+/*
+ * A job is a plain function taking an opaque context 
+ * and two integer arguments, typically a range of rows.
+ */
+
+typedef void (*WorkFn)(void* ctx, int a, int b);
+
+/*
+ * A fixed set of threads executing queued jobs in no particular order.
+ * Used to take CPU bound work (compression ...) away from the threads
+ * that must keep up with the incoming image data.
+ */
+
+class WorkerPool {
+
+ public:
+
+  static const int QUEUE = 256;	/* max. pending jobs */
+
+  WorkerPool();
+ ~WorkerPool();
+
+  /* spawns 'n' threads, one per online CPU if 0 */
+  void start(int n = 0);
+
+  /* waits for pending jobs and joins all threads */
+  void stop();
+
+  /* number of threads in the pool */
+  int threads() const { return(nthreads); }
+
+  /* queues a job. Blocks only when the queue is full */
+  void submit(WorkFn fn, void* ctx, int a, int b);
+
+  /* blocks until all submitted jobs have finished */
+  void wait();
+
+ private:
+
+  struct Job {
+    WorkFn fn;
+    void* ctx;
+    int a;
+    int b;
+  };
+
+  Job queue[QUEUE];		/* circular job queue */
+  int head;			/* next job to queue */
+  int tail;			/* next job to run */
+  int pending;			/* queued jobs not yet taken */
+  int active;			/* jobs being run */
+  bool quit;
+
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;	/* signals new jobs or quit */
+  pthread_cond_t notFull;	/* signals a free queue entry */
+  pthread_cond_t idle;		/* signals no pending nor active jobs */
+
+  pthread_t* tids;
+  int nthreads;
+
+  static void* run(void* arg);	/* thread entry point */
+  void loop();			/* thread main loop */
+};
+
+#endif